@@ -0,0 +1,288 @@
+/**
+ * @file admin.c
+ * @brief Implementation of the admin control socket.
+ */
+
+#define _GNU_SOURCE
+#include "admin.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATE_COUNT (CALL_DISCONNECTING + 1)
+
+static const char help_text[] =
+    "calls                   Count the calls by state\n"
+    "calls list              List the calls\n"
+    "call <index|call-id>    Show one call\n"
+    "registrations           List the registered bindings\n"
+    "drop <index|call-id>    Tear down a call\n"
+    "log <all|off|filter>    Change the messages logged, as SIP_TRACE\n"
+    "costs                   Show the cycles spent per transition (built with COSTS=1)\n"
+    "help                    Show this help\n";
+
+int admin_socket_open(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Admin socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Admin socket creation failed");
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("Failed to set non-blocking admin socket");
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        perror("Admin socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void admin_socket_close(int fd, const char *path) {
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Waits until the client's socket is ready for events, or the deadline passes.
+ * @return true if it is ready.
+ */
+static bool wait_for(int client, short events, uint64_t deadline_ms) {
+    uint64_t now_ms = monotonic_ms();
+    if (now_ms >= deadline_ms) {
+        return false;
+    }
+    struct pollfd pfd = { .fd = client, .events = events };
+    return poll(&pfd, 1, (int)(deadline_ms - now_ms)) > 0;
+}
+
+/**
+ * @brief Reads one command line from a client before the deadline.
+ * @return true if a command was read into command, without its line end.
+ */
+static bool read_command(int client, char *command, size_t size, uint64_t deadline_ms) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = recv(client, command + len, size - 1 - len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+            wait_for(client, POLLIN, deadline_ms)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+        if (memchr(command, '\n', len) != NULL) {
+            break;
+        }
+    }
+    command[len] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+    return len > 0;
+}
+
+/**
+ * @brief Sends a reply, giving up on a client that doesn't take it before the deadline.
+ */
+static void send_reply(int client, const char *reply, size_t len, uint64_t deadline_ms) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(client, reply + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+                   wait_for(client, POLLOUT, deadline_ms)) {
+            continue;
+        } else {
+            return;
+        }
+    }
+}
+
+void admin_socket_serve(sip_server_t *server, int fd) {
+    int client;
+    // The connection is non-blocking too: a client gets ADMIN_IO_TIMEOUT_MS of the receive loop
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        uint64_t deadline_ms = monotonic_ms() + ADMIN_IO_TIMEOUT_MS;
+        char command[ADMIN_COMMAND_SIZE];
+        if (!read_command(client, command, sizeof(command), deadline_ms)) {
+            close(client);
+            continue;
+        }
+        // The reply is put together in memory, cut short if it doesn't fit
+        char reply[ADMIN_REPLY_SIZE];
+        FILE *out = fmemopen(reply, sizeof(reply), "w");
+        if (out == NULL) {
+            close(client);
+            continue;
+        }
+        admin_execute(server, command, out);
+        fflush(out);
+        long len = ftell(out);
+        fclose(out);
+        if (len < 0) {
+            len = 0;
+        } else if (len > (long)sizeof(reply) - 1) {
+            len = (long)sizeof(reply) - 1;
+        }
+        send_reply(client, reply, (size_t)len, deadline_ms);
+        close(client);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Admin socket accept failed");
+    }
+}
+
+/**
+ * @brief Finds a call by its index in the call table or its A-leg Call-ID.
+ * @return The call's index, or -1 if no call is up with it.
+ */
+static int resolve_call(sip_server_t *server, const char *argument, call_summary_t *summary) {
+    char *end;
+    long index = strtol(argument, &end, 10);
+    if (end != argument && *end == '\0') {
+        if (index < 0 || index >= MAX_CALLS) {
+            return -1;
+        }
+        return sip_server_call_summary(server, (int)index, summary) ? (int)index : -1;
+    }
+    for (int i = 0; i < MAX_CALLS; i++) {
+        if (sip_server_call_summary(server, i, summary) && strcmp(summary->call_id, argument) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void count_calls(sip_server_t *server, FILE *out) {
+    int counts[STATE_COUNT] = {0};
+    int total = 0;
+    call_summary_t summary;
+    for (int i = 0; i < MAX_CALLS; i++) {
+        if (sip_server_call_summary(server, i, &summary) && (size_t)summary.state < STATE_COUNT) {
+            counts[summary.state]++;
+            total++;
+        }
+    }
+    for (size_t state = CALL_STATE_ROUTING; state < STATE_COUNT; state++) {
+        fprintf(out, "%-14s %d\n", call_state_name((call_state_t)state), counts[state]);
+    }
+    fprintf(out, "%-14s %d\n", "total", total);
+}
+
+static void list_calls(sip_server_t *server, FILE *out) {
+    uint64_t now_ms = sip_server_now_ms(server);
+    call_summary_t summary;
+    for (int i = 0; i < MAX_CALLS; i++) {
+        if (sip_server_call_summary(server, i, &summary)) {
+            fprintf(out, "%d %s %s %s -> %s %llus\n", i, call_state_name(summary.state), summary.call_id,
+                    summary.caller, summary.callee, (unsigned long long)((now_ms - summary.started_ms) / 1000));
+        }
+    }
+}
+
+static void show_call(sip_server_t *server, int index, const call_summary_t *summary, FILE *out) {
+    uint64_t now_ms = sip_server_now_ms(server);
+    fprintf(out, "index:    %d\n", index);
+    fprintf(out, "state:    %s for %llu ms\n", call_state_name(summary->state),
+            (unsigned long long)(now_ms - summary->state_ms));
+    fprintf(out, "call-id:  %s\n", summary->call_id);
+    fprintf(out, "caller:   %s at %s:%d\n", summary->caller, summary->a_leg_ip_str, summary->a_leg_port);
+    fprintf(out, "callee:   %s at %s:%d\n", summary->callee, summary->b_leg_ip_str, summary->b_leg_port);
+    fprintf(out, "duration: %llu ms\n", (unsigned long long)(now_ms - summary->started_ms));
+}
+
+static void list_registrations(sip_server_t *server, FILE *out) {
+    location_entry_t entries[MAX_LOCATIONS];
+    int count = sip_server_registrations(server, entries, MAX_LOCATIONS);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s %s:%d%s\n", entries[i].username, entries[i].ip_str, entries[i].port,
+                entries[i].nated ? " nated" : "");
+    }
+    fprintf(out, "%d registered\n", count);
+}
+
+int admin_execute(sip_server_t *server, const char *command, FILE *out) {
+    char verb[ADMIN_COMMAND_SIZE];
+    const char *argument = command + strcspn(command, " ");
+    size_t verb_len = (size_t)(argument - command);
+    if (verb_len >= sizeof(verb)) {
+        fprintf(out, "error: command too long\n");
+        return -1;
+    }
+    memcpy(verb, command, verb_len);
+    verb[verb_len] = '\0';
+    argument += strspn(argument, " ");
+
+    call_summary_t summary;
+    if (strcmp(verb, "calls") == 0 && argument[0] == '\0') {
+        count_calls(server, out);
+    } else if (strcmp(verb, "calls") == 0 && strcmp(argument, "list") == 0) {
+        list_calls(server, out);
+    } else if (strcmp(verb, "call") == 0 && argument[0] != '\0') {
+        int index = resolve_call(server, argument, &summary);
+        if (index < 0) {
+            fprintf(out, "error: no call %s\n", argument);
+            return -1;
+        }
+        show_call(server, index, &summary, out);
+    } else if (strcmp(verb, "registrations") == 0 && argument[0] == '\0') {
+        list_registrations(server, out);
+    } else if (strcmp(verb, "drop") == 0 && argument[0] != '\0') {
+        int index = resolve_call(server, argument, &summary);
+        if (index < 0 || !sip_server_drop_call(server, index, summary.call_id)) {
+            fprintf(out, "error: no call %s\n", argument);
+            return -1;
+        }
+        fprintf(out, "ok\n");
+    } else if (strcmp(verb, "log") == 0 && argument[0] != '\0') {
+        sip_trace_filter_t filter;
+        sip_trace_filter_init(&filter);
+        if (sip_trace_configure(&filter, argument) < 0) {
+            fprintf(out, "error: invalid filter %s\n", argument);
+            return -1;
+        }
+        sip_server_set_trace(server, &filter);
+        fprintf(out, "ok\n");
+    } else if (strcmp(verb, "costs") == 0 && argument[0] == '\0') {
+#ifdef COST_COUNTERS
+        cost_counters_dump(&server->store->costs, out);
+#else
+        fprintf(out, "error: cost counters not built in, build with make COSTS=1\n");
+        return -1;
+#endif
+    } else if (strcmp(verb, "help") == 0) {
+        fputs(help_text, out);
+    } else {
+        fprintf(out, "error: unknown command, try help\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file admin.h
+ * @brief Admin control socket: inspecting and steering a running server.
+ *
+ * The server listens on a Unix-domain stream socket. A client connects, writes one command
+ * line and reads the reply until the server closes the connection, e.g.
+ *
+ *     echo "calls list" | socat - UNIX-CONNECT:/tmp/mini_sip_admin.sock
+ *
+ * Commands are served by the receive loop, which a client holds for ADMIN_IO_TIMEOUT_MS at most:
+ * the connection is non-blocking and the reply is put together in memory before it is sent. They
+ * read the calls from the summaries the workers publish under a seqlock and the registrations
+ * from a copy of the location store, so inspecting the server never stalls the workers.
+ */
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdio.h>
+#include "sip_server.h"
+
+#ifndef ADMIN_SOCKET_PATH
+#define ADMIN_SOCKET_PATH "/tmp/mini_sip_admin.sock"    // Overridden with SIP_ADMIN_SOCKET
+#endif
+
+#define ADMIN_COMMAND_SIZE 256          // Longest command line
+#define ADMIN_REPLY_SIZE 16384          // Longest reply, a longer one is cut short
+#define ADMIN_IO_TIMEOUT_MS 50          // A client that doesn't send its command and take the reply by then is dropped
+
+/**
+ * @brief Creates the admin socket, replacing a stale one left at path.
+ * @return The listening socket, non-blocking, or -1 on failure.
+ */
+int admin_socket_open(const char *path);
+
+/**
+ * @brief Closes the admin socket and removes it from the file system.
+ */
+void admin_socket_close(int fd, const char *path);
+
+/**
+ * @brief Serves the clients waiting on the admin socket, one command each.
+ * @param fd The socket returned by admin_socket_open().
+ */
+void admin_socket_serve(sip_server_t *server, int fd);
+
+/**
+ * @brief Executes one command and writes its reply.
+ * @param command The command line, without its line end.
+ * @param out Where the reply is written.
+ * @return 0 on success, -1 if the command is unknown or failed (the reply says why).
+ */
+int admin_execute(sip_server_t *server, const char *command, FILE *out);
+
+#endif // ADMIN_H
@@ -0,0 +1,267 @@
+/**
+ * @file call_limits.c
+ * @brief Implementation of the per-AOR and per-peer call limits.
+ */
+
+#define _GNU_SOURCE
+#include "call_limits.h"
+#include "sip_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert((CALL_LIMIT_SLOTS & (CALL_LIMIT_SLOTS - 1)) == 0, "CALL_LIMIT_SLOTS must be a power of two");
+_Static_assert(CALL_LIMIT_SLOTS <= INT16_MAX, "tickets hold slot indexes in 16 bits");
+
+static const char *const kind_names[CALL_LIMIT_KINDS] = {
+    [CALL_LIMIT_AOR] = "aor",
+    [CALL_LIMIT_PEER] = "peer",
+};
+
+void call_limits_init(call_limits_t *limits) {
+    for (int kind = 0; kind < CALL_LIMIT_KINDS; kind++) {
+        for (int i = 0; i < CALL_LIMIT_SLOTS; i++) {
+            atomic_init(&limits->slots[kind][i].owner, 0);
+            atomic_init(&limits->slots[kind][i].window, 0);
+        }
+        atomic_init(&limits->rejected[kind], 0);
+    }
+    atomic_init(&limits->max_calls[CALL_LIMIT_AOR], CALL_LIMIT_AOR_CALLS);
+    atomic_init(&limits->max_cps[CALL_LIMIT_AOR], CALL_LIMIT_AOR_CPS);
+    atomic_init(&limits->max_calls[CALL_LIMIT_PEER], CALL_LIMIT_PEER_CALLS);
+    atomic_init(&limits->max_cps[CALL_LIMIT_PEER], CALL_LIMIT_PEER_CPS);
+    atomic_init(&limits->untracked, 0);
+}
+
+int call_limits_configure(call_limits_t *limits, const char *spec) {
+    unsigned int values[CALL_LIMIT_KINDS][2];
+    bool set[CALL_LIMIT_KINDS][2] = {{false}};
+    char copy[256];
+
+    if (spec == NULL || strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    // Parse everything first, so an invalid specification changes nothing
+    char *save;
+    for (char *setting = strtok_r(copy, ",", &save); setting != NULL; setting = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(setting, '=');
+        char *dash = strchr(setting, '-');
+        if (value == NULL || dash == NULL || dash > value) {
+            return -1;
+        }
+        *value++ = '\0';
+        *dash++ = '\0';
+        int kind = -1;
+        for (int i = 0; i < CALL_LIMIT_KINDS; i++) {
+            if (strcmp(setting, kind_names[i]) == 0) {
+                kind = i;
+            }
+        }
+        int limit = strcmp(dash, "calls") == 0 ? 0 : strcmp(dash, "cps") == 0 ? 1 : -1;
+        char *end;
+        unsigned long parsed = strtoul(value, &end, 10);
+        if (kind < 0 || limit < 0 || end == value || *end != '\0' || value[0] == '-' || parsed > INT32_MAX) {
+            return -1;
+        }
+        values[kind][limit] = (unsigned int)parsed;
+        set[kind][limit] = true;
+    }
+    for (int kind = 0; kind < CALL_LIMIT_KINDS; kind++) {
+        if (set[kind][0]) {
+            atomic_store(&limits->max_calls[kind], values[kind][0]);
+        }
+        if (set[kind][1]) {
+            atomic_store(&limits->max_cps[kind], values[kind][1]);
+        }
+    }
+    return 0;
+}
+
+void call_limit_ticket_clear(call_limit_ticket_t *ticket) {
+    for (int kind = 0; kind < CALL_LIMIT_KINDS; kind++) {
+        ticket->slots[kind] = -1;
+    }
+}
+
+static uint64_t hash_key(const void *data, size_t len) {
+    uint64_t hash = sip_hash(data, len, 0) >> CALL_LIMIT_ACTIVE_BITS;
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Tells whether a slot can be taken by another key: it holds no call and started none
+ * this second, so its counters mean nothing to the key it has.
+ */
+static bool slot_idle(call_limit_slot_t *slot, uint_fast64_t owner, uint64_t second) {
+    return (owner & CALL_LIMIT_ACTIVE_MASK) == 0 &&
+           (atomic_load_explicit(&slot->window, memory_order_relaxed) >> 32) != second;
+}
+
+/**
+ * @brief Finds the slot of a key and counts one more call held in it, taking a free or idle slot
+ * if the key has none yet.
+ *
+ * The key and the calls held share one word, so a slot is taken over only while it holds no
+ * call, and a call is counted only in a slot that still has its key.
+ * @param active Set to the calls the key holds, this one included.
+ * @return The slot index, or -1 if the probed slots are all busy with other keys.
+ */
+static int hold_slot(call_limit_slot_t *slots, uint64_t key, uint64_t now_ms, int *active) {
+    uint64_t second = (now_ms / 1000) & 0xffffffffULL;
+    for (int attempt = 0; attempt < CALL_LIMIT_PROBES; attempt++) {
+        int candidate = -1;
+        uint_fast64_t candidate_owner = 0;
+        for (int probe = 0; probe < CALL_LIMIT_PROBES; probe++) {
+            int index = (int)((key + (uint64_t)probe) & (CALL_LIMIT_SLOTS - 1));
+            uint_fast64_t owner = atomic_load_explicit(&slots[index].owner, memory_order_acquire);
+            while ((owner >> CALL_LIMIT_ACTIVE_BITS) == key &&
+                   (owner & CALL_LIMIT_ACTIVE_MASK) != CALL_LIMIT_ACTIVE_MASK) {
+                if (atomic_compare_exchange_weak_explicit(&slots[index].owner, &owner, owner + 1,
+                                                          memory_order_acq_rel, memory_order_acquire)) {
+                    *active = (int)((owner + 1) & CALL_LIMIT_ACTIVE_MASK);
+                    return index;
+                }
+            }
+            if ((owner >> CALL_LIMIT_ACTIVE_BITS) == key) {
+                return -1;
+            }
+            if (candidate < 0 && (owner == 0 || slot_idle(&slots[index], owner, second))) {
+                candidate = index;
+                candidate_owner = owner;
+            }
+            // Keys are replaced but never cleared, so the key isn't past an unused slot
+            if (owner == 0) {
+                break;
+            }
+        }
+        if (candidate < 0) {
+            return -1;
+        }
+        // Taken with this call held in it, so no other key can take it over before the call is counted
+        if (atomic_compare_exchange_strong_explicit(&slots[candidate].owner, &candidate_owner,
+                                                    (key << CALL_LIMIT_ACTIVE_BITS) | 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            *active = 1;
+            return candidate;
+        }
+        // Another key took the slot first, or a call was counted in it, look again
+    }
+    return -1;
+}
+
+/**
+ * @brief Uncounts a call held in a slot by hold_slot().
+ */
+static void unhold_slot(call_limit_slot_t *slot) {
+    atomic_fetch_sub_explicit(&slot->owner, 1, memory_order_release);
+}
+
+/**
+ * @brief Counts a call started this second, unless max_cps have been already.
+ */
+static bool count_start(call_limit_slot_t *slot, unsigned int max_cps, uint64_t now_ms) {
+    uint64_t second = (now_ms / 1000) & 0xffffffffULL;
+    uint_fast64_t window = atomic_load_explicit(&slot->window, memory_order_relaxed);
+    uint_fast64_t next;
+    do {
+        uint64_t started = (window >> 32) == second ? (window & 0xffffffffULL) : 0;
+        if (max_cps != 0 && started >= max_cps) {
+            return false;
+        }
+        next = (second << 32) | (started + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&slot->window, &window, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+/**
+ * @brief Takes back a start counted by count_start(), if its second hasn't passed.
+ */
+static void uncount_start(call_limit_slot_t *slot, uint64_t now_ms) {
+    uint64_t second = (now_ms / 1000) & 0xffffffffULL;
+    uint_fast64_t window = atomic_load_explicit(&slot->window, memory_order_relaxed);
+    while ((window >> 32) == second && (window & 0xffffffffULL) > 0 &&
+           !atomic_compare_exchange_weak_explicit(&slot->window, &window, window - 1,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Checks a call held in one slot against the limits, the concurrent limit first, then the rate.
+ * @param active The calls held in the slot, this one included.
+ * @return CALL_LIMIT_OK, or busy_verdict or rate_verdict if the call is refused (nothing is counted then).
+ */
+static call_limit_verdict_t count_call(call_limits_t *limits, call_limit_kind_t kind, int index, int active,
+                                       uint64_t now_ms, call_limit_verdict_t busy_verdict,
+                                       call_limit_verdict_t rate_verdict) {
+    call_limit_slot_t *slot = &limits->slots[kind][index];
+    unsigned int max_calls = atomic_load_explicit(&limits->max_calls[kind], memory_order_relaxed);
+    unsigned int max_cps = atomic_load_explicit(&limits->max_cps[kind], memory_order_relaxed);
+
+    if (max_calls != 0 && active > (int)max_calls) {
+        // Concurrent calls may both be refused near the limit, never both admitted past it
+        unhold_slot(slot);
+        return busy_verdict;
+    }
+    if (!count_start(slot, max_cps, now_ms)) {
+        unhold_slot(slot);
+        return rate_verdict;
+    }
+    return CALL_LIMIT_OK;
+}
+
+call_limit_verdict_t call_limits_acquire(call_limits_t *limits, const char *aor, const struct in_addr *peer,
+                                         uint64_t now_ms, call_limit_ticket_t *ticket) {
+    call_limit_ticket_clear(ticket);
+    int aor_slot = -1;
+    int aor_active = 0;
+    if (aor != NULL && aor[0] != '\0') {
+        aor_slot = hold_slot(limits->slots[CALL_LIMIT_AOR], hash_key(aor, strlen(aor)), now_ms, &aor_active);
+        if (aor_slot < 0) {
+            atomic_fetch_add_explicit(&limits->untracked, 1, memory_order_relaxed);
+        }
+    }
+    int peer_active = 0;
+    int peer_slot = hold_slot(limits->slots[CALL_LIMIT_PEER], hash_key(&peer->s_addr, sizeof(peer->s_addr)),
+                              now_ms, &peer_active);
+    if (peer_slot < 0) {
+        atomic_fetch_add_explicit(&limits->untracked, 1, memory_order_relaxed);
+    }
+
+    if (aor_slot >= 0) {
+        call_limit_verdict_t verdict = count_call(limits, CALL_LIMIT_AOR, aor_slot, aor_active, now_ms,
+                                                  CALL_LIMIT_AOR_BUSY, CALL_LIMIT_AOR_RATE);
+        if (verdict != CALL_LIMIT_OK) {
+            if (peer_slot >= 0) {
+                unhold_slot(&limits->slots[CALL_LIMIT_PEER][peer_slot]);
+            }
+            atomic_fetch_add_explicit(&limits->rejected[CALL_LIMIT_AOR], 1, memory_order_relaxed);
+            return verdict;
+        }
+    }
+    if (peer_slot >= 0) {
+        call_limit_verdict_t verdict = count_call(limits, CALL_LIMIT_PEER, peer_slot, peer_active, now_ms,
+                                                  CALL_LIMIT_PEER_BUSY, CALL_LIMIT_PEER_RATE);
+        if (verdict != CALL_LIMIT_OK) {
+            if (aor_slot >= 0) {
+                uncount_start(&limits->slots[CALL_LIMIT_AOR][aor_slot], now_ms);
+                unhold_slot(&limits->slots[CALL_LIMIT_AOR][aor_slot]);
+            }
+            atomic_fetch_add_explicit(&limits->rejected[CALL_LIMIT_PEER], 1, memory_order_relaxed);
+            return verdict;
+        }
+    }
+    ticket->slots[CALL_LIMIT_AOR] = (int16_t)aor_slot;
+    ticket->slots[CALL_LIMIT_PEER] = (int16_t)peer_slot;
+    return CALL_LIMIT_OK;
+}
+
+void call_limits_release(call_limits_t *limits, call_limit_ticket_t *ticket) {
+    for (int kind = 0; kind < CALL_LIMIT_KINDS; kind++) {
+        if (ticket->slots[kind] >= 0) {
+            unhold_slot(&limits->slots[kind][ticket->slots[kind]]);
+        }
+    }
+    call_limit_ticket_clear(ticket);
+}
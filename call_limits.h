@@ -0,0 +1,134 @@
+/**
+ * @file call_limits.h
+ * @brief Concurrent-call and calls-per-second limits per AOR and per peer.
+ *
+ * One subscriber or gateway must not be able to take the whole call table. Each new call is
+ * counted against the AOR of its caller (the user part of From) and against the peer it came
+ * from (its source address), each with a limit on the calls it holds at once and on the calls
+ * it starts per second. A call over a limit is refused before it takes a call table entry.
+ *
+ * The counters are sharded by key hash into fixed slots updated with atomics only, so the INVITE
+ * path takes no lock for them and different AORs and peers don't contend. A key is probed for in
+ * a few slots. One whose key holds no call and started none this second is idle and is taken
+ * over by a new key, so the table follows the keys in use rather than the first ones seen. A
+ * slot's key and the calls it holds share one atomic word, so a call is never counted in a slot
+ * another key has just taken over. When the probed slots are all busy with other keys the call
+ * is not limited (fail open), which is counted. The table holds no pointers, so it lives in the
+ * store and is shared by the worker processes of the prefork mode.
+ */
+
+#ifndef CALL_LIMITS_H
+#define CALL_LIMITS_H
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Default limits, 0 for none. Overridden at run time with call_limits_configure().
+#ifndef CALL_LIMIT_AOR_CALLS
+#define CALL_LIMIT_AOR_CALLS 0          // Calls one AOR may hold at once
+#endif
+#ifndef CALL_LIMIT_AOR_CPS
+#define CALL_LIMIT_AOR_CPS 0            // Calls one AOR may start per second
+#endif
+#ifndef CALL_LIMIT_PEER_CALLS
+#define CALL_LIMIT_PEER_CALLS 0         // Calls one peer address may hold at once
+#endif
+#ifndef CALL_LIMIT_PEER_CPS
+#define CALL_LIMIT_PEER_CPS 0           // Calls one peer address may start per second
+#endif
+
+#ifndef CALL_LIMIT_SLOTS
+#define CALL_LIMIT_SLOTS 512            // Counter slots per kind, a power of two
+#endif
+#define CALL_LIMIT_PROBES 8             // Slots a key is looked for in
+#define CALL_LIMIT_ACTIVE_BITS 16       // Low bits of a slot's owner counting the calls held
+#define CALL_LIMIT_ACTIVE_MASK ((1ULL << CALL_LIMIT_ACTIVE_BITS) - 1)
+
+/**
+ * @enum call_limit_kind_t
+ * @brief What a call is counted against.
+ */
+typedef enum {
+    CALL_LIMIT_AOR,
+    CALL_LIMIT_PEER,
+    CALL_LIMIT_KINDS
+} call_limit_kind_t;
+
+/**
+ * @enum call_limit_verdict_t
+ * @brief Result of admitting a new call.
+ */
+typedef enum {
+    CALL_LIMIT_OK,
+    CALL_LIMIT_AOR_BUSY,        // The caller holds its maximum of calls, answered with 486
+    CALL_LIMIT_AOR_RATE,        // The caller started its maximum of calls this second, answered with 503
+    CALL_LIMIT_PEER_BUSY,       // The peer holds its maximum of calls, answered with 503
+    CALL_LIMIT_PEER_RATE,       // The peer started its maximum of calls this second, answered with 503
+} call_limit_verdict_t;
+
+/**
+ * @struct call_limit_slot_t
+ * @brief Counters of one AOR or peer.
+ */
+typedef struct {
+    atomic_uint_fast64_t owner;     // Hash of the AOR or peer address (high bits) and calls held (low bits), 0 if never used
+    atomic_uint_fast64_t window;    // Second (high 32 bits) and calls started in it (low 32 bits)
+} call_limit_slot_t;
+
+/**
+ * @struct call_limit_ticket_t
+ * @brief The slots a call is counted in, kept by the call until it ends.
+ */
+typedef struct {
+    int16_t slots[CALL_LIMIT_KINDS];    // -1 if the call is not counted for that kind
+} call_limit_ticket_t;
+
+/**
+ * @struct call_limits_t
+ * @brief Limits and counters of all AORs and peers.
+ */
+typedef struct {
+    call_limit_slot_t slots[CALL_LIMIT_KINDS][CALL_LIMIT_SLOTS];
+    atomic_uint max_calls[CALL_LIMIT_KINDS];    // 0 for none
+    atomic_uint max_cps[CALL_LIMIT_KINDS];      // 0 for none
+    atomic_ulong rejected[CALL_LIMIT_KINDS];    // Calls refused by a limit of that kind
+    atomic_ulong untracked;                     // Calls not limited because their key found no idle slot
+} call_limits_t;
+
+/**
+ * @brief Initializes empty counters with the default limits.
+ */
+void call_limits_init(call_limits_t *limits);
+
+/**
+ * @brief Sets limits from a specification like "aor-calls=4,aor-cps=2,peer-calls=30,peer-cps=10".
+ *
+ * Limits not named are kept, 0 removes one.
+ * @return 0 on success, -1 if the specification is invalid (no limit is changed then).
+ */
+int call_limits_configure(call_limits_t *limits, const char *spec);
+
+/**
+ * @brief Marks a ticket as counting nothing.
+ */
+void call_limit_ticket_clear(call_limit_ticket_t *ticket);
+
+/**
+ * @brief Counts a new call against its caller's AOR and its peer, unless that takes one over a limit.
+ * @param aor The user part of From, NULL or "" to count the call against its peer only.
+ * @param peer The source address of the INVITE.
+ * @param now_ms Current server time in milliseconds.
+ * @param ticket Set to the slots counted in if the call is admitted, to be given to call_limits_release().
+ * @return CALL_LIMIT_OK if the call is admitted, otherwise the limit that refused it (nothing is counted then).
+ */
+call_limit_verdict_t call_limits_acquire(call_limits_t *limits, const char *aor, const struct in_addr *peer,
+                                         uint64_t now_ms, call_limit_ticket_t *ticket);
+
+/**
+ * @brief Uncounts a call that ended, and clears its ticket so it can't be released twice.
+ */
+void call_limits_release(call_limits_t *limits, call_limit_ticket_t *ticket);
+
+#endif // CALL_LIMITS_H
@@ -0,0 +1,145 @@
+/**
+ * @file cost_counters.c
+ * @brief Implementation of the per-transition cost counters.
+ */
+
+#define _GNU_SOURCE
+#include "cost_counters.h"
+#include "sip_server.h"
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(CALL_DISCONNECTING + 1 == COST_STATES, "COST_STATES must count the call states");
+_Static_assert(B_LEG < COST_LEGS, "COST_LEGS must cover the leg types");
+
+static const char *const event_names[COST_EVENTS] = {
+    [COST_EVENT_INVITE] = "INVITE",
+    [COST_EVENT_ACK] = "ACK",
+    [COST_EVENT_BYE] = "BYE",
+    [COST_EVENT_CANCEL] = "CANCEL",
+    [COST_EVENT_OTHER_REQUEST] = "other",
+    [COST_EVENT_1XX] = "1xx",
+    [COST_EVENT_2XX] = "2xx",
+    [COST_EVENT_FAILURE] = "3xx-6xx",
+};
+
+static const char *const leg_names[COST_LEGS] = { "-", "A", "B" };
+
+static const char *const outcome_names[COST_REGISTER_OUTCOMES] = {
+    [COST_REGISTER_CACHED] = "cached",
+    [COST_REGISTER_BOUND] = "bound",
+    [COST_REGISTER_REMOVED] = "removed",
+    [COST_REGISTER_UNKNOWN_USER] = "unknown-user",
+    [COST_REGISTER_TOO_BRIEF] = "too-brief",
+    [COST_REGISTER_REFUSED] = "refused",
+    [COST_REGISTER_INVALID] = "invalid",
+};
+
+void cost_counters_init(cost_counters_t *costs) {
+    cost_counter_t *counters = &costs->transitions[0][0][0][0];
+    size_t total = sizeof(costs->transitions) / sizeof(cost_counter_t);
+    for (size_t i = 0; i < total; i++) {
+        atomic_init(&counters[i].count, 0);
+        atomic_init(&counters[i].cycles, 0);
+    }
+    for (int i = 0; i < COST_REGISTER_OUTCOMES; i++) {
+        atomic_init(&costs->registers[i].count, 0);
+        atomic_init(&costs->registers[i].cycles, 0);
+    }
+}
+
+cost_event_t cost_event_classify(bool response, const char *method_or_code) {
+    if (response) {
+        int code = atoi(method_or_code);
+        return code < 200 ? COST_EVENT_1XX : code < 300 ? COST_EVENT_2XX : COST_EVENT_FAILURE;
+    }
+    if (strcmp(method_or_code, "INVITE") == 0) {
+        return COST_EVENT_INVITE;
+    }
+    if (strcmp(method_or_code, "ACK") == 0) {
+        return COST_EVENT_ACK;
+    }
+    if (strcmp(method_or_code, "BYE") == 0) {
+        return COST_EVENT_BYE;
+    }
+    if (strcmp(method_or_code, "CANCEL") == 0) {
+        return COST_EVENT_CANCEL;
+    }
+    return COST_EVENT_OTHER_REQUEST;
+}
+
+static void count(cost_counter_t *counter, uint64_t cycles) {
+    atomic_fetch_add_explicit(&counter->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->cycles, cycles, memory_order_relaxed);
+}
+
+void cost_count_transition(cost_counters_t *costs, int state, cost_event_t event, int leg, bool has_sdp,
+                           uint64_t cycles) {
+    if (state < 0 || state >= COST_STATES || leg < 0 || leg >= COST_LEGS) {
+        return;
+    }
+    count(&costs->transitions[state][event][leg][has_sdp ? 1 : 0], cycles);
+}
+
+void cost_count_register(cost_counters_t *costs, cost_register_outcome_t outcome, uint64_t cycles) {
+    count(&costs->registers[outcome], cycles);
+}
+
+/**
+ * @struct cost_row_t
+ * @brief A line of the table, copied out of the counters to be sorted.
+ */
+typedef struct {
+    char label[48];
+    unsigned long count;
+    unsigned long cycles;
+} cost_row_t;
+
+static int by_cycles(const void *a, const void *b) {
+    unsigned long x = ((const cost_row_t *)a)->cycles, y = ((const cost_row_t *)b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void cost_counters_dump(cost_counters_t *costs, FILE *out) {
+    cost_row_t rows[COST_STATES * COST_EVENTS * COST_LEGS * 2 + COST_REGISTER_OUTCOMES];
+    int count = 0;
+    unsigned long total = 0;
+
+    for (int state = 0; state < COST_STATES; state++) {
+        for (int event = 0; event < COST_EVENTS; event++) {
+            for (int leg = 0; leg < COST_LEGS; leg++) {
+                for (int sdp = 0; sdp < 2; sdp++) {
+                    cost_counter_t *counter = &costs->transitions[state][event][leg][sdp];
+                    unsigned long runs = atomic_load_explicit(&counter->count, memory_order_relaxed);
+                    if (runs == 0) {
+                        continue;
+                    }
+                    cost_row_t *row = &rows[count++];
+                    snprintf(row->label, sizeof(row->label), "%-13s %-7s %-3s %-3s", call_state_name(state),
+                             event_names[event], leg_names[leg], sdp ? "sdp" : "");
+                    row->count = runs;
+                    row->cycles = atomic_load_explicit(&counter->cycles, memory_order_relaxed);
+                    total += row->cycles;
+                }
+            }
+        }
+    }
+    for (int outcome = 0; outcome < COST_REGISTER_OUTCOMES; outcome++) {
+        unsigned long runs = atomic_load_explicit(&costs->registers[outcome].count, memory_order_relaxed);
+        if (runs == 0) {
+            continue;
+        }
+        cost_row_t *row = &rows[count++];
+        snprintf(row->label, sizeof(row->label), "%-13s %-15s", "REGISTER", outcome_names[outcome]);
+        row->count = runs;
+        row->cycles = atomic_load_explicit(&costs->registers[outcome].cycles, memory_order_relaxed);
+        total += row->cycles;
+    }
+
+    qsort(rows, (size_t)count, sizeof(rows[0]), by_cycles);
+    fprintf(out, "%-29s %10s %14s %10s %6s\n", "state         event   leg sdp", "runs", "cycles", "avg", "share");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%-29s %10lu %14lu %10lu %5.1f%%\n", rows[i].label, rows[i].count, rows[i].cycles,
+                rows[i].cycles / rows[i].count, total > 0 ? 100.0 * (double)rows[i].cycles / (double)total : 0.0);
+    }
+}
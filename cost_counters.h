@@ -0,0 +1,124 @@
+/**
+ * @file cost_counters.h
+ * @brief Invocations and CPU cycles per state-machine transition and per REGISTER outcome.
+ *
+ * Built with COST_COUNTERS defined (make COSTS=1), each run of handle_state_machine() is timed
+ * with the time-stamp counter and counted under the call's state before the message, the message
+ * (request method or response class), the leg it came from and whether it carried SDP. Each
+ * REGISTER is counted under its outcome. The table, most expensive first, shows where the
+ * traffic mix spends its cycles (admin socket command "costs").
+ *
+ * The counters are atomics in the store, so the worker processes of the prefork mode add to the
+ * same table. Without COST_COUNTERS nothing is counted and the hot path doesn't read the clock.
+ * Cycles include the logging of traced messages, trace only what is needed while measuring.
+ */
+
+#ifndef COST_COUNTERS_H
+#define COST_COUNTERS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define COST_STATES 6       // call_state_t values
+#define COST_LEGS 3         // No call yet, A_LEG, B_LEG
+
+/**
+ * @enum cost_event_t
+ * @brief The message a transition is run for.
+ */
+typedef enum {
+    COST_EVENT_INVITE,
+    COST_EVENT_ACK,
+    COST_EVENT_BYE,
+    COST_EVENT_CANCEL,
+    COST_EVENT_OTHER_REQUEST,
+    COST_EVENT_1XX,
+    COST_EVENT_2XX,
+    COST_EVENT_FAILURE,         // 3xx to 6xx
+    COST_EVENTS
+} cost_event_t;
+
+/**
+ * @enum cost_register_outcome_t
+ * @brief How handle_register() answered.
+ */
+typedef enum {
+    COST_REGISTER_CACHED,       // Unchanged refresh answered from the registration cache
+    COST_REGISTER_BOUND,        // 200, binding added or refreshed
+    COST_REGISTER_REMOVED,      // 200, binding removed with expires 0
+    COST_REGISTER_UNKNOWN_USER, // 404
+    COST_REGISTER_TOO_BRIEF,    // 423
+    COST_REGISTER_REFUSED,      // 503, registrar memory ceiling reached
+    COST_REGISTER_INVALID,      // Not answered, malformed
+    COST_REGISTER_OUTCOMES
+} cost_register_outcome_t;
+
+/**
+ * @struct cost_counter_t
+ * @brief Runs of one transition and the cycles they took.
+ */
+typedef struct {
+    atomic_ulong count;
+    atomic_ulong cycles;
+} cost_counter_t;
+
+/**
+ * @struct cost_counters_t
+ * @brief All the counters.
+ */
+typedef struct {
+    cost_counter_t transitions[COST_STATES][COST_EVENTS][COST_LEGS][2];    // [state][event][leg][has SDP]
+    cost_counter_t registers[COST_REGISTER_OUTCOMES];
+} cost_counters_t;
+
+/**
+ * @brief Reads the time-stamp counter, or a nanosecond clock where there is none.
+ */
+static inline uint64_t cost_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Initializes (or resets) all counters to zero.
+ */
+void cost_counters_init(cost_counters_t *costs);
+
+/**
+ * @brief Classifies a message for cost_count_transition().
+ * @param response true for a response, false for a request.
+ * @param method_or_code The request method or the response code.
+ */
+cost_event_t cost_event_classify(bool response, const char *method_or_code);
+
+/**
+ * @brief Counts one run of the state machine.
+ * @param state The call's state before the message, CALL_STATE_IDLE if there was no call.
+ * @param leg The leg the message came from, 0 if there was no call.
+ * @param cycles The cycles the run took.
+ */
+void cost_count_transition(cost_counters_t *costs, int state, cost_event_t event, int leg, bool has_sdp,
+                           uint64_t cycles);
+
+/**
+ * @brief Counts one REGISTER.
+ */
+void cost_count_register(cost_counters_t *costs, cost_register_outcome_t outcome, uint64_t cycles);
+
+/**
+ * @brief Writes the transitions and REGISTER outcomes seen, the most cycles first.
+ */
+void cost_counters_dump(cost_counters_t *costs, FILE *out);
+
+#endif // COST_COUNTERS_H
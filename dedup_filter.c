@@ -0,0 +1,81 @@
+/**
+ * @file dedup_filter.c
+ * @brief Implementation of the receive-thread duplicate datagram filter.
+ */
+
+#include "dedup_filter.h"
+#include "shared_mem.h"
+#include "sip_hash.h"
+#include <string.h>
+
+void dedup_filter_init(dedup_filter_t *filter, bool process_shared) {
+    memset(filter->slots, 0, sizeof(filter->slots));
+    filter->duplicates = 0;
+    filter->in_flight = 0;
+    shm_mutex_init(&filter->mutex, process_shared);
+}
+
+/**
+ * @brief Destroys a filter.
+ * @param filter Pointer to the filter to destroy.
+ */
+void dedup_filter_destroy(dedup_filter_t *filter) {
+    pthread_mutex_destroy(&filter->mutex);
+}
+
+uint64_t dedup_filter_hash(const char *data, size_t len, const struct sockaddr_in *addr) {
+    // The payload, seeded with the source address and port
+    uint64_t seed = addr != NULL ? ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port : 0;
+    uint64_t hash = sip_hash(data, len, seed);
+    // 0 is reserved for "not tracked"
+    return hash != 0 ? hash : 1;
+}
+
+bool dedup_filter_check(dedup_filter_t *filter, uint64_t hash, uint64_t now_ms) {
+    bool duplicate = false;
+    dedup_slot_t *slot = &filter->slots[hash & (DEDUP_FILTER_SLOTS - 1)];
+
+    shm_mutex_lock(&filter->mutex);
+    if (slot->hash == hash && slot->in_flight && now_ms < slot->expires_ms) {
+        filter->duplicates++;
+        duplicate = true;
+    } else {
+        // New datagram, or the slot holds a stale/other entry: take it over
+        if (!slot->in_flight) {
+            filter->in_flight++;
+        }
+        slot->hash = hash;
+        slot->expires_ms = now_ms + DEDUP_WINDOW_MS;
+        slot->in_flight = true;
+    }
+    pthread_mutex_unlock(&filter->mutex);
+    return duplicate;
+}
+
+void dedup_filter_release(dedup_filter_t *filter, uint64_t hash) {
+    if (hash == 0) {
+        return;
+    }
+    dedup_slot_t *slot = &filter->slots[hash & (DEDUP_FILTER_SLOTS - 1)];
+
+    shm_mutex_lock(&filter->mutex);
+    if (slot->hash == hash && slot->in_flight) {
+        slot->in_flight = false;
+        filter->in_flight--;
+    }
+    pthread_mutex_unlock(&filter->mutex);
+}
+
+unsigned long dedup_filter_duplicates(dedup_filter_t *filter) {
+    shm_mutex_lock(&filter->mutex);
+    unsigned long duplicates = filter->duplicates;
+    pthread_mutex_unlock(&filter->mutex);
+    return duplicates;
+}
+
+size_t dedup_filter_in_flight(dedup_filter_t *filter) {
+    shm_mutex_lock(&filter->mutex);
+    size_t in_flight = filter->in_flight;
+    pthread_mutex_unlock(&filter->mutex);
+    return in_flight;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file dedup_filter.h
+ * @brief Time-windowed duplicate datagram filter used by the receive thread.
+ *
+ * UAs retransmit requests (INVITE, BYE, REGISTER, ...) until they hear back. While the
+ * first copy is still queued or being processed, every further copy is pure waste, so the
+ * receive thread hashes each datagram together with its source address and drops exact
+ * copies of messages that are still in flight.
+ */
+
+#ifndef DEDUP_FILTER_H
+#define DEDUP_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#ifndef DEDUP_FILTER_SLOTS
+#define DEDUP_FILTER_SLOTS 256      // Number of tracked datagrams, must be a power of two
+#endif
+
+#ifndef DEDUP_WINDOW_MS
+#define DEDUP_WINDOW_MS 2000        // Max time a datagram is considered in flight
+#endif
+
+/**
+ * @struct dedup_slot_t
+ * @brief One tracked datagram.
+ */
+typedef struct {
+    uint64_t hash;          // Hash of datagram bytes and source address
+    uint64_t expires_ms;    // Monotonic time after which the entry is stale
+    bool in_flight;         // Set on receive, cleared once a worker has processed the message
+} dedup_slot_t;
+
+/**
+ * @struct dedup_filter_t
+ * @brief Direct-mapped table of in-flight datagram hashes.
+ */
+typedef struct {
+    dedup_slot_t slots[DEDUP_FILTER_SLOTS];
+    unsigned long duplicates;   // Number of datagrams dropped as duplicates
+    size_t in_flight;           // Number of slots holding a datagram in flight
+    pthread_mutex_t mutex;
+} dedup_filter_t;
+
+/**
+ * @brief Initializes an empty filter.
+ * @param filter Pointer to the filter to initialize.
+ * @param process_shared true if the filter lives in a shared segment used by several processes.
+ */
+void dedup_filter_init(dedup_filter_t *filter, bool process_shared);
+void dedup_filter_destroy(dedup_filter_t *filter);
+
+/**
+ * @brief Computes the filter key of a datagram.
+ * @param data The datagram bytes.
+ * @param len The datagram length.
+ * @param addr The source address of the datagram.
+ * @return A non-zero 64-bit hash.
+ */
+uint64_t dedup_filter_hash(const char *data, size_t len, const struct sockaddr_in *addr);
+
+/**
+ * @brief Checks a received datagram against the filter and records it if it is new.
+ * @param filter The filter.
+ * @param hash The key computed by dedup_filter_hash().
+ * @param now_ms Current monotonic time in milliseconds.
+ * @return true if an identical datagram is still in flight (the caller should drop it), false otherwise.
+ */
+bool dedup_filter_check(dedup_filter_t *filter, uint64_t hash, uint64_t now_ms);
+
+/**
+ * @brief Marks a datagram as processed so later retransmissions are let through again.
+ * @param filter The filter.
+ * @param hash The key recorded by dedup_filter_check(). 0 is ignored.
+ */
+void dedup_filter_release(dedup_filter_t *filter, uint64_t hash);
+
+/**
+ * @brief Returns the number of duplicates dropped so far.
+ */
+unsigned long dedup_filter_duplicates(dedup_filter_t *filter);
+
+/**
+ * @brief Returns the number of datagrams tracked as in flight.
+ */
+size_t dedup_filter_in_flight(dedup_filter_t *filter);
+
+#endif // DEDUP_FILTER_H
@@ -0,0 +1,537 @@
+/**
+ * @file fault_injection.c
+ * @brief Implementation of the fault injector and of the process-wide injector of the socket layer.
+ */
+
+#define _GNU_SOURCE
+#include "fault_injection.h"
+#include "shared_mem.h"
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/**
+ * @struct fault_datagram
+ * @brief A copy of a held datagram.
+ */
+struct fault_datagram {
+    uint64_t due_ms;
+    uint64_t sequence;          // Keeps datagrams due at the same time in arrival order
+    fault_direction_t direction;
+    int fd;
+    struct sockaddr_in peer;
+    size_t len;
+    char data[];
+};
+
+static int direction_index(fault_direction_t direction) {
+    return direction == FAULT_IN ? 0 : 1;
+}
+
+/**
+ * @brief Parses a percentage into a probability.
+ */
+static bool parse_percent(const char *value, double *probability) {
+    char *end;
+    double percent = strtod(value, &end);
+    if (end == value || *end != '\0' || percent < 0.0 || percent > 100.0) {
+        return false;
+    }
+    *probability = percent / 100.0;
+    return true;
+}
+
+static bool parse_ms(const char *value, uint32_t *ms) {
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || parsed > UINT32_MAX) {
+        return false;
+    }
+    *ms = (uint32_t)parsed;
+    return true;
+}
+
+static bool parse_delay(const char *value, fault_rule_t *rule) {
+    char copy[64];
+    if (strlen(value) >= sizeof(copy)) {
+        return false;
+    }
+    strcpy(copy, value);
+
+    if (strncmp(copy, "exp:", 4) == 0) {
+        rule->delay = FAULT_DELAY_EXPONENTIAL;
+        return parse_ms(copy + 4, &rule->delay_min_ms);
+    }
+    char *dash = strchr(copy, '-');
+    if (dash == NULL) {
+        rule->delay = FAULT_DELAY_FIXED;
+        return parse_ms(copy, &rule->delay_min_ms);
+    }
+    *dash = '\0';
+    rule->delay = FAULT_DELAY_UNIFORM;
+    return parse_ms(copy, &rule->delay_min_ms) && parse_ms(dash + 1, &rule->delay_max_ms) &&
+           rule->delay_min_ms <= rule->delay_max_ms;
+}
+
+static bool parse_peer(const char *value, fault_rule_t *rule) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(value, ':');
+    size_t ip_len = colon != NULL ? (size_t)(colon - value) : strlen(value);
+    if (ip_len >= sizeof(ip)) {
+        return false;
+    }
+    memcpy(ip, value, ip_len);
+    ip[ip_len] = '\0';
+    if (inet_pton(AF_INET, ip, &rule->peer_ip) != 1) {
+        return false;
+    }
+    rule->any_peer = false;
+    rule->peer_port = 0;
+    if (colon != NULL) {
+        uint32_t port;
+        if (!parse_ms(colon + 1, &port) || port == 0 || port > 65535) {
+            return false;
+        }
+        rule->peer_port = (uint16_t)port;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses one "key=value" setting of a rule.
+ */
+static bool parse_setting(fault_injector_t *injector, fault_rule_t *rule, char *setting) {
+    char *value = strchr(setting, '=');
+    if (value == NULL) {
+        return false;
+    }
+    *value++ = '\0';
+
+    if (strcmp(setting, "peer") == 0) {
+        return parse_peer(value, rule);
+    } else if (strcmp(setting, "dir") == 0) {
+        if (strcmp(value, "in") == 0) {
+            rule->directions = FAULT_IN;
+        } else if (strcmp(value, "out") == 0) {
+            rule->directions = FAULT_OUT;
+        } else if (strcmp(value, "both") == 0) {
+            rule->directions = FAULT_IN | FAULT_OUT;
+        } else {
+            return false;
+        }
+        return true;
+    } else if (strcmp(setting, "drop") == 0) {
+        return parse_percent(value, &rule->drop);
+    } else if (strcmp(setting, "dup") == 0) {
+        return parse_percent(value, &rule->duplicate);
+    } else if (strcmp(setting, "reorder") == 0) {
+        return parse_percent(value, &rule->reorder);
+    } else if (strcmp(setting, "reorder_ms") == 0) {
+        return parse_ms(value, &rule->reorder_ms);
+    } else if (strcmp(setting, "delay") == 0) {
+        return parse_delay(value, rule);
+    } else if (strcmp(setting, "seed") == 0) {
+        char *end;
+        injector->random_state = strtoull(value, &end, 0);
+        return end != value && *end == '\0';
+    }
+    return false;
+}
+
+static bool parse_spec(fault_injector_t *injector, const char *spec) {
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    char *rule_save;
+    for (char *text = strtok_r(copy, ";", &rule_save); text != NULL && ok; text = strtok_r(NULL, ";", &rule_save)) {
+        if (injector->rule_count == FAULT_MAX_RULES) {
+            fprintf(stderr, "Fault injection: more than %d rules\n", FAULT_MAX_RULES);
+            ok = false;
+            break;
+        }
+        fault_rule_t *rule = &injector->rules[injector->rule_count++];
+        *rule = (fault_rule_t){ .any_peer = true, .directions = FAULT_IN | FAULT_OUT,
+                                .delay = FAULT_DELAY_NONE, .reorder_ms = FAULT_REORDER_MS };
+
+        char *setting_save;
+        for (char *setting = strtok_r(text, ",", &setting_save); setting != NULL;
+             setting = strtok_r(NULL, ",", &setting_save)) {
+            char text_copy[128];
+            snprintf(text_copy, sizeof(text_copy), "%s", setting);
+            if (!parse_setting(injector, rule, setting)) {
+                fprintf(stderr, "Fault injection: invalid setting '%s'\n", text_copy);
+                ok = false;
+                break;
+            }
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+int fault_injector_init(fault_injector_t *injector, const char *spec) {
+    memset(injector, 0, sizeof(*injector));
+    injector->random_state = 1;
+    injector->held = malloc(FAULT_MAX_HELD * sizeof(*injector->held));
+    if (injector->held == NULL) {
+        return -1;
+    }
+    if (spec != NULL && !parse_spec(injector, spec)) {
+        free(injector->held);
+        injector->held = NULL;
+        return -1;
+    }
+
+    shm_mutex_init(&injector->mutex, false);
+    // Waits for due datagrams are measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&injector->held_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+void fault_injector_destroy(fault_injector_t *injector) {
+    for (size_t i = 0; i < injector->held_count; i++) {
+        free(injector->held[i]);
+    }
+    free(injector->held);
+    injector->held = NULL;
+    injector->held_count = 0;
+    pthread_cond_destroy(&injector->held_changed);
+    pthread_mutex_destroy(&injector->mutex);
+}
+
+/**
+ * @brief splitmix64, small and good enough for fault decisions.
+ */
+static uint64_t fault_random(fault_injector_t *injector) {
+    uint64_t z = (injector->random_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double fault_uniform(fault_injector_t *injector) {
+    return (double)(fault_random(injector) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool fault_roll(fault_injector_t *injector, double probability) {
+    return probability > 0.0 && fault_uniform(injector) < probability;
+}
+
+static uint64_t sample_delay(fault_injector_t *injector, const fault_rule_t *rule) {
+    switch (rule->delay) {
+    case FAULT_DELAY_FIXED:
+        return rule->delay_min_ms;
+    case FAULT_DELAY_UNIFORM:
+        return rule->delay_min_ms + fault_random(injector) % ((uint64_t)rule->delay_max_ms - rule->delay_min_ms + 1);
+    case FAULT_DELAY_EXPONENTIAL:
+        return (uint64_t)(-(double)rule->delay_min_ms * log(1.0 - fault_uniform(injector)));
+    case FAULT_DELAY_NONE:
+        break;
+    }
+    return 0;
+}
+
+static const fault_rule_t *match_rule(const fault_injector_t *injector, fault_direction_t direction,
+                                      const struct sockaddr_in *peer) {
+    for (int i = 0; i < injector->rule_count; i++) {
+        const fault_rule_t *rule = &injector->rules[i];
+        if ((rule->directions & direction) == 0) {
+            continue;
+        }
+        if (!rule->any_peer && (rule->peer_ip.s_addr != peer->sin_addr.s_addr ||
+                                (rule->peer_port != 0 && rule->peer_port != ntohs(peer->sin_port)))) {
+            continue;
+        }
+        return rule;
+    }
+    return NULL;
+}
+
+static bool held_before(const fault_datagram_t *a, const fault_datagram_t *b) {
+    return a->due_ms < b->due_ms || (a->due_ms == b->due_ms && a->sequence < b->sequence);
+}
+
+/**
+ * @brief Copies a datagram into the queue. Called with the mutex held.
+ */
+static void hold(fault_injector_t *injector, fault_direction_t direction, int fd, const char *data, size_t len,
+                 const struct sockaddr_in *peer, uint64_t due_ms) {
+    fault_stats_t *stats = &injector->stats[direction_index(direction)];
+    fault_datagram_t *datagram = NULL;
+    if (injector->held_count < FAULT_MAX_HELD) {
+        datagram = malloc(sizeof(*datagram) + len);
+    }
+    if (datagram == NULL) {
+        stats->overflowed++;
+        return;
+    }
+    datagram->due_ms = due_ms;
+    datagram->sequence = injector->sequence++;
+    datagram->direction = direction;
+    datagram->fd = fd;
+    datagram->peer = *peer;
+    datagram->len = len;
+    memcpy(datagram->data, data, len);
+    stats->delayed++;
+
+    // Sift up
+    size_t i = injector->held_count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!held_before(datagram, injector->held[parent])) {
+            break;
+        }
+        injector->held[i] = injector->held[parent];
+        i = parent;
+    }
+    injector->held[i] = datagram;
+    if (i == 0) {
+        // A new earliest datagram, the delivery thread has to wake up sooner
+        pthread_cond_signal(&injector->held_changed);
+    }
+}
+
+/**
+ * @brief Removes the earliest datagram from the queue. Called with the mutex held.
+ */
+static fault_datagram_t *pop_held(fault_injector_t *injector) {
+    fault_datagram_t *first = injector->held[0];
+    fault_datagram_t *last = injector->held[--injector->held_count];
+    size_t i = 0;
+    // Sift down
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= injector->held_count) {
+            break;
+        }
+        if (child + 1 < injector->held_count && held_before(injector->held[child + 1], injector->held[child])) {
+            child++;
+        }
+        if (!held_before(injector->held[child], last)) {
+            break;
+        }
+        injector->held[i] = injector->held[child];
+        i = child;
+    }
+    if (injector->held_count > 0) {
+        injector->held[i] = last;
+    }
+    return first;
+}
+
+bool fault_injector_filter(fault_injector_t *injector, fault_direction_t direction, int fd,
+                           const char *data, size_t len, const struct sockaddr_in *peer, uint64_t now_ms) {
+    shm_mutex_lock(&injector->mutex);
+    fault_stats_t *stats = &injector->stats[direction_index(direction)];
+    const fault_rule_t *rule = match_rule(injector, direction, peer);
+    if (rule == NULL) {
+        stats->passed++;
+        pthread_mutex_unlock(&injector->mutex);
+        return true;
+    }
+
+    if (fault_roll(injector, rule->drop)) {
+        stats->dropped++;
+        pthread_mutex_unlock(&injector->mutex);
+        return false;
+    }
+
+    uint64_t delay = sample_delay(injector, rule);
+    if (fault_roll(injector, rule->reorder)) {
+        // Held back so that datagrams sent after it overtake it
+        delay += rule->reorder_ms;
+        stats->reordered++;
+    }
+    bool now = delay == 0;
+    if (now) {
+        stats->passed++;
+    } else {
+        hold(injector, direction, fd, data, len, peer, now_ms + delay);
+    }
+
+    if (fault_roll(injector, rule->duplicate)) {
+        // The copy takes its own way through the network
+        stats->duplicated++;
+        hold(injector, direction, fd, data, len, peer, now_ms + sample_delay(injector, rule));
+    }
+    pthread_mutex_unlock(&injector->mutex);
+    return now;
+}
+
+size_t fault_injector_release(fault_injector_t *injector, uint64_t now_ms, fault_deliver_fn deliver, void *user_data) {
+    size_t delivered = 0;
+    for (;;) {
+        shm_mutex_lock(&injector->mutex);
+        if (injector->held_count == 0 || injector->held[0]->due_ms > now_ms) {
+            pthread_mutex_unlock(&injector->mutex);
+            return delivered;
+        }
+        fault_datagram_t *datagram = pop_held(injector);
+        pthread_mutex_unlock(&injector->mutex);
+
+        // Delivered outside the lock, delivery may feed datagrams back into the injector
+        deliver(user_data, datagram->direction, datagram->fd, datagram->data, datagram->len, &datagram->peer);
+        free(datagram);
+        delivered++;
+    }
+}
+
+int64_t fault_injector_next_due(fault_injector_t *injector, uint64_t now_ms) {
+    int64_t due = -1;
+    shm_mutex_lock(&injector->mutex);
+    if (injector->held_count > 0) {
+        uint64_t first = injector->held[0]->due_ms;
+        due = first > now_ms ? (int64_t)(first - now_ms) : 0;
+    }
+    pthread_mutex_unlock(&injector->mutex);
+    return due;
+}
+
+void fault_injector_stats(fault_injector_t *injector, fault_direction_t direction, fault_stats_t *stats) {
+    shm_mutex_lock(&injector->mutex);
+    *stats = injector->stats[direction_index(direction)];
+    pthread_mutex_unlock(&injector->mutex);
+}
+
+// The process-wide injector of the socket layer
+static fault_injector_t process_injector;
+static bool process_enabled = false;
+static fault_deliver_fn process_receive = NULL;
+static void *process_receive_data = NULL;
+// The delivery thread is started on first use, in each process that holds datagrams
+static pthread_mutex_t delivery_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool delivery_running = false;
+
+static uint64_t fault_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void process_deliver(void *user_data, fault_direction_t direction, int fd,
+                            const char *data, size_t len, const struct sockaddr_in *peer) {
+    (void)user_data;
+    if (direction == FAULT_OUT) {
+        if (sendto(fd, data, len, 0, (const struct sockaddr *)peer, sizeof(*peer)) < 0) {
+            perror("Send failed");
+        }
+    } else if (process_receive != NULL) {
+        process_receive(process_receive_data, direction, fd, data, len, peer);
+    }
+}
+
+static void *delivery_thread(void *arg) {
+    fault_injector_t *injector = arg;
+    for (;;) {
+        shm_mutex_lock(&injector->mutex);
+        while (injector->held_count == 0) {
+            pthread_cond_wait(&injector->held_changed, &injector->mutex);
+        }
+        uint64_t due = injector->held[0]->due_ms;
+        if (due > fault_now_ms()) {
+            struct timespec deadline = { .tv_sec = (time_t)(due / 1000), .tv_nsec = (long)(due % 1000) * 1000000 };
+            pthread_cond_timedwait(&injector->held_changed, &injector->mutex, &deadline);
+        }
+        pthread_mutex_unlock(&injector->mutex);
+        fault_injector_release(injector, fault_now_ms(), process_deliver, NULL);
+    }
+    return NULL;
+}
+
+static void start_delivery(void) {
+    pthread_mutex_lock(&delivery_mutex);
+    if (!delivery_running) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, delivery_thread, &process_injector) == 0) {
+            pthread_detach(thread);
+            delivery_running = true;
+        } else {
+            perror("Failed to create fault injection thread");
+        }
+    }
+    pthread_mutex_unlock(&delivery_mutex);
+}
+
+// A worker process forked from the receive process starts with an empty queue and no delivery thread
+static void fork_prepare(void) {
+    pthread_mutex_lock(&delivery_mutex);
+    shm_mutex_lock(&process_injector.mutex);
+}
+
+static void fork_parent(void) {
+    pthread_mutex_unlock(&process_injector.mutex);
+    pthread_mutex_unlock(&delivery_mutex);
+}
+
+static void fork_child(void) {
+    for (size_t i = 0; i < process_injector.held_count; i++) {
+        free(process_injector.held[i]);
+    }
+    process_injector.held_count = 0;
+    delivery_running = false;
+    // The parent's delivery thread may have been waiting on it
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&process_injector.held_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_unlock(&process_injector.mutex);
+    pthread_mutex_unlock(&delivery_mutex);
+}
+
+int fault_injection_setup(const char *spec, fault_deliver_fn receive, void *user_data) {
+    if (spec == NULL || spec[0] == '\0' || process_enabled) {
+        return 0;
+    }
+    if (fault_injector_init(&process_injector, spec) < 0) {
+        return -1;
+    }
+    process_receive = receive;
+    process_receive_data = user_data;
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    process_enabled = true;
+    return 0;
+}
+
+bool fault_injection_enabled(void) {
+    return process_enabled;
+}
+
+static bool process_filter(fault_direction_t direction, int fd, const char *data, size_t len,
+                           const struct sockaddr_in *peer) {
+    if (!process_enabled) {
+        return true;
+    }
+    bool now = fault_injector_filter(&process_injector, direction, fd, data, len, peer, fault_now_ms());
+    if (fault_injector_next_due(&process_injector, 0) >= 0) {
+        start_delivery();
+    }
+    return now;
+}
+
+bool fault_injection_outgoing(int fd, const char *data, size_t len, const struct sockaddr_in *dest) {
+    return process_filter(FAULT_OUT, fd, data, len, dest);
+}
+
+bool fault_injection_incoming(int fd, const char *data, size_t len, const struct sockaddr_in *source) {
+    return process_filter(FAULT_IN, fd, data, len, source);
+}
+
+void fault_injection_stats(fault_direction_t direction, fault_stats_t *stats) {
+    if (!process_enabled) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    fault_injector_stats(&process_injector, direction, stats);
+}
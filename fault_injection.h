@@ -0,0 +1,192 @@
+/**
+ * @file fault_injection.h
+ * @brief Loss, delay, duplication and reordering of datagrams between the socket and the SIP core.
+ *
+ * A fault injector applies a list of rules to every datagram that passes through it. The first
+ * rule matching the datagram's peer address and direction decides its fate: it is dropped,
+ * delayed (fixed, uniform or exponential delay), duplicated, or held back long enough for later
+ * datagrams to overtake it. Delayed copies are kept in a queue ordered by due time and handed to
+ * a delivery callback once they are due. All random choices come from a seeded generator, so an
+ * injector fed the same datagrams at the same times makes the same choices.
+ *
+ * The server uses one process-wide injector beneath send_sip_message() and its receive path. It
+ * is compiled in with `make FAULTS=1` (which defines FAULT_INJECTION) and configured at run time
+ * with the SIP_FAULTS environment variable. Rules are separated by ';', their settings by ',':
+ *
+ *   peer=IP[:PORT]     only datagrams from or to this address (default: any peer)
+ *   dir=in|out|both    only received or sent datagrams (default: both)
+ *   drop=PCT           percentage of datagrams lost
+ *   dup=PCT            percentage of datagrams delivered twice
+ *   reorder=PCT        percentage of datagrams held back an extra reorder_ms
+ *   reorder_ms=MS      how long reordered datagrams are held back (default FAULT_REORDER_MS)
+ *   delay=MS | delay=MIN-MAX | delay=exp:MEAN
+ *                      fixed, uniform or exponentially distributed delay
+ *   seed=N             seed of the random choices (any rule, default 1)
+ *
+ * e.g. SIP_FAULTS="peer=10.0.0.7,drop=30;drop=2,dup=1,delay=10-80,reorder=5"
+ */
+
+#ifndef FAULT_INJECTION_H
+#define FAULT_INJECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#ifndef FAULT_MAX_RULES
+#define FAULT_MAX_RULES 16          // Rules of one injector
+#endif
+
+#ifndef FAULT_MAX_HELD
+#define FAULT_MAX_HELD 4096         // Datagrams held back at once, further delayed ones are dropped
+#endif
+
+#ifndef FAULT_REORDER_MS
+#define FAULT_REORDER_MS 50         // Default extra delay of reordered datagrams
+#endif
+
+/**
+ * @enum fault_direction_t
+ * @brief Direction of a datagram, as seen from the server.
+ */
+typedef enum {
+    FAULT_IN = 1,       // Received by the server
+    FAULT_OUT = 2,      // Sent by the server
+} fault_direction_t;
+
+typedef enum {
+    FAULT_DELAY_NONE,
+    FAULT_DELAY_FIXED,          // delay_min_ms
+    FAULT_DELAY_UNIFORM,        // delay_min_ms to delay_max_ms
+    FAULT_DELAY_EXPONENTIAL,    // Mean of delay_min_ms
+} fault_delay_t;
+
+/**
+ * @struct fault_rule_t
+ * @brief What happens to the datagrams of one peer (or of all peers) in one or both directions.
+ */
+typedef struct {
+    bool any_peer;
+    struct in_addr peer_ip;
+    uint16_t peer_port;         // Host order, 0 for any port
+    int directions;             // FAULT_IN and/or FAULT_OUT
+    double drop;                // Probabilities, 0 to 1
+    double duplicate;
+    double reorder;
+    fault_delay_t delay;
+    uint32_t delay_min_ms;
+    uint32_t delay_max_ms;
+    uint32_t reorder_ms;
+} fault_rule_t;
+
+/**
+ * @struct fault_stats_t
+ * @brief What an injector did to the datagrams of one direction.
+ */
+typedef struct {
+    unsigned long passed;       // Handled at once, untouched
+    unsigned long dropped;
+    unsigned long duplicated;
+    unsigned long delayed;      // Held back, including duplicates and reordered datagrams
+    unsigned long reordered;
+    unsigned long overflowed;   // Dropped because FAULT_MAX_HELD datagrams were already held
+} fault_stats_t;
+
+typedef struct fault_datagram fault_datagram_t;
+
+/**
+ * @struct fault_injector_t
+ * @brief Rules, random generator and queue of held datagrams.
+ */
+typedef struct {
+    fault_rule_t rules[FAULT_MAX_RULES];
+    int rule_count;
+    uint64_t random_state;
+    fault_datagram_t **held;    // Binary heap ordered by due time, then by arrival
+    size_t held_count;
+    uint64_t sequence;
+    fault_stats_t stats[2];     // FAULT_IN, FAULT_OUT
+    pthread_mutex_t mutex;
+    pthread_cond_t held_changed;
+} fault_injector_t;
+
+/**
+ * @brief Delivers a datagram whose delay has elapsed.
+ */
+typedef void (*fault_deliver_fn)(void *user_data, fault_direction_t direction, int fd,
+                                 const char *data, size_t len, const struct sockaddr_in *peer);
+
+/**
+ * @brief Initializes an injector from a rule specification (see the file comment).
+ * @param spec The rules, NULL or "" for an injector that lets everything through.
+ * @return 0 on success, -1 if the specification is invalid or memory couldn't be allocated.
+ */
+int fault_injector_init(fault_injector_t *injector, const char *spec);
+void fault_injector_destroy(fault_injector_t *injector);
+
+/**
+ * @brief Applies the rules to a datagram.
+ *
+ * Delayed copies (and the extra copy of a duplicated datagram) are copied into the queue and
+ * come out of fault_injector_release() once due.
+ * @param direction Whether the datagram is received or sent.
+ * @param fd The socket the datagram arrived on or is sent from, handed back on delivery.
+ * @param peer The source of a received datagram, the destination of a sent one.
+ * @param now_ms Current time in milliseconds.
+ * @return true if the caller should handle the datagram now, false if it was dropped or held back.
+ */
+bool fault_injector_filter(fault_injector_t *injector, fault_direction_t direction, int fd,
+                           const char *data, size_t len, const struct sockaddr_in *peer, uint64_t now_ms);
+
+/**
+ * @brief Delivers the held datagrams that are due, in order of due time.
+ * @return The number of datagrams delivered.
+ */
+size_t fault_injector_release(fault_injector_t *injector, uint64_t now_ms, fault_deliver_fn deliver, void *user_data);
+
+/**
+ * @brief Returns how long until the next held datagram is due, 0 if one is due, -1 if none is held.
+ */
+int64_t fault_injector_next_due(fault_injector_t *injector, uint64_t now_ms);
+
+/**
+ * @brief Copies the statistics of one direction.
+ */
+void fault_injector_stats(fault_injector_t *injector, fault_direction_t direction, fault_stats_t *stats);
+
+/**
+ * @brief Enables the process-wide injector used by the server's socket layer.
+ *
+ * Held datagrams are delivered by a thread of the process that held them: sent ones with
+ * sendto(), received ones through receive, which takes them on from where the receive path
+ * handed them to fault_injection_incoming().
+ * @param spec The rules, NULL or "" to leave fault injection disabled.
+ * @return 0 on success (enabled or not), -1 if the specification is invalid.
+ */
+int fault_injection_setup(const char *spec, fault_deliver_fn receive, void *user_data);
+
+/**
+ * @brief Whether fault_injection_setup() enabled the process-wide injector.
+ */
+bool fault_injection_enabled(void);
+
+/**
+ * @brief Applies the process-wide injector to a datagram about to be sent.
+ * @return true if the caller should send it now.
+ */
+bool fault_injection_outgoing(int fd, const char *data, size_t len, const struct sockaddr_in *dest);
+
+/**
+ * @brief Applies the process-wide injector to a datagram just received.
+ * @return true if the caller should handle it now.
+ */
+bool fault_injection_incoming(int fd, const char *data, size_t len, const struct sockaddr_in *source);
+
+/**
+ * @brief Copies the statistics of the process-wide injector, zeroes if it is disabled.
+ */
+void fault_injection_stats(fault_direction_t direction, fault_stats_t *stats);
+
+#endif // FAULT_INJECTION_H
@@ -0,0 +1,521 @@
+/**
+ * @file im_relay.c
+ * @brief Instant messages: stateless MESSAGE relay, mailboxes of offline users and paced delivery.
+ */
+
+#define _GNU_SOURCE
+#include "im_relay.h"
+#include "sip_server.h"
+#include "shared_mem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+_Static_assert(MAX_LOCATIONS <= IM_MAX_AORS, "instant message store too small for the location store");
+_Static_assert(IM_FIELD_SIZE == HEADER_SIZE, "stored From and To must hold a header");
+_Static_assert(IM_CALL_ID_SIZE == MAX_UUID_LENGTH, "stored Call-ID must hold a Call-ID");
+
+// Branch of the server's Via on relayed and delivered MESSAGEs, tells their responses apart
+#define IM_BRANCH_PREFIX "z9hG4bK-im-"
+
+void sip_im_store_init(sip_im_store_t *store, bool process_shared) {
+    memset(store->mailboxes, 0, sizeof(store->mailboxes));
+    store->next_mailbox = 0;
+    store->delivery_pending = false;
+    memset(&store->stats, 0, sizeof(store->stats));
+    shm_mutex_init(&store->mutex, process_shared);
+}
+
+void sip_im_store_destroy(sip_im_store_t *store) {
+    pthread_mutex_destroy(&store->mutex);
+}
+
+void sip_im_stats(sip_im_store_t *store, sip_im_stats_t *stats) {
+    shm_mutex_lock(&store->mutex);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->mutex);
+}
+
+/**
+ * @brief Reads where a user is registered.
+ * @return true if the user is registered.
+ */
+static bool read_binding(sip_server_t *server, int aor, char *ip_str, int *port) {
+    sip_store_t *store = server->store;
+    location_entry_t *user = &store->location_entries[aor];
+    shm_mutex_lock(&store->location_mutex);
+    bool registered = user->registered;
+    memcpy(ip_str, user->ip_str, INET_ADDRSTRLEN);
+    *port = user->port;
+    pthread_mutex_unlock(&store->location_mutex);
+    return registered;
+}
+
+/**
+ * @brief Marks a mailbox ready and arms the delivery timer if it isn't already.
+ * The instant message lock must be held.
+ */
+static void mark_ready(sip_server_t *server, int aor) {
+    sip_im_store_t *store = &server->store->instant_messages;
+    if (store->mailboxes[aor].count == 0) {
+        return;
+    }
+    store->mailboxes[aor].ready = true;
+    if (!store->delivery_pending) {
+        store->delivery_pending = true;
+        sip_timer_arm(&server->store->timers, IM_DELIVERY_TIMER_ID, sip_server_now_ms(server) + IM_DELIVERY_INTERVAL_MS);
+    }
+}
+
+/**
+ * @brief Appends text to a message being put together.
+ * @return false if it doesn't fit.
+ */
+static bool append(sip_message_t *out, size_t *len, const char *text, size_t text_len) {
+    if (*len + text_len > BUFFER_SIZE) {
+        return false;
+    }
+    memcpy(out->buffer + *len, text, text_len);
+    *len += text_len;
+    return true;
+}
+
+/**
+ * @brief Derives the branch of the server's Via on a relayed MESSAGE from the sender's Via line
+ * below it. The hash key is secret, so a response whose Vias don't match wasn't to our MESSAGE.
+ */
+static uint64_t relay_branch(const char *sender_via, size_t len) {
+    return sip_hash(sender_via, len, 0);
+}
+
+/**
+ * @brief Puts the sender's Via line as relayed into sender. Any received and rport parameters
+ * the sender put in are dropped, since responses are relayed to them: the address the MESSAGE
+ * came from is put in their place, rport only if the sender asked for it.
+ * @return The length of the line, or -1 if it doesn't fit.
+ */
+static int render_sender_via(const char *via, const char *source_ip, int source_port, char *sender, size_t size) {
+    size_t first = strcspn(via, ";");
+    int n = snprintf(sender, size, "Via: %.*s", (int)first, via);
+    size_t len = (size_t)n;
+    bool rport_seen = false;
+    for (const char *param = via + first; *param == ';' && len < size; param += 1 + strcspn(param + 1, ";")) {
+        size_t param_len = 1 + strcspn(param + 1, ";");
+        size_t name_len = strcspn(param + 1, "=;");
+        if (name_len == strlen("rport") && strncasecmp(param + 1, "rport", name_len) == 0) {
+            if (!rport_seen) {
+                n = snprintf(sender + len, size - len, ";rport=%d;received=%s", source_port, source_ip);
+                len += (size_t)n;
+            }
+            rport_seen = true;
+        } else if (!(name_len == strlen("received") && strncasecmp(param + 1, "received", name_len) == 0)) {
+            n = snprintf(sender + len, size - len, "%.*s", (int)param_len, param);
+            len += (size_t)n;
+        }
+    }
+    if (!rport_seen && len < size) {
+        n = snprintf(sender + len, size - len, ";received=%s", source_ip);
+        len += (size_t)n;
+    }
+    return len < size ? (int)len : -1;
+}
+
+/**
+ * @brief Puts together the MESSAGE relayed to a registered user.
+ *
+ * The Request-URI is the user's binding. The server's Via goes on top, its branch derived from
+ * the sender's Via line as relayed, so that a retransmission is relayed with the same one and a
+ * response can be checked against it. The sender's Via is given the address the MESSAGE came
+ * from, and Max-Forwards is decremented. The other header lines and the body are copied.
+ * @return false if the MESSAGE doesn't fit in a datagram.
+ */
+static bool render_relayed(const sip_message_t *message, const char *via, const char *username,
+                           const char *ip_str, int port, const char *source_ip, int source_port,
+                           sip_message_t *out) {
+    char line[HEADER_SIZE + 96];
+    size_t len = 0;
+    memset(out, 0, sizeof(*out));
+
+    int n = snprintf(line, sizeof(line), "MESSAGE sip:%s@%s:%d SIP/2.0\r\n", username, ip_str, port);
+    if (!append(out, &len, line, (size_t)n)) {
+        return false;
+    }
+    bool via_seen = false;
+    const char *cursor = strstr(message->buffer, "\r\n") + 2;
+    while (strncmp(cursor, "\r\n", 2) != 0) {
+        const char *end = strstr(cursor, "\r\n");
+        if (end == NULL) {
+            return false;
+        }
+        size_t line_len = (size_t)(end - cursor) + 2;
+        if (!via_seen && strncmp(cursor, "Via:", strlen("Via:")) == 0) {
+            via_seen = true;
+            char sender[HEADER_SIZE + 64];
+            int sender_len = render_sender_via(via, source_ip, source_port, sender, sizeof(sender));
+            if (sender_len < 0) {
+                return false;
+            }
+            n = snprintf(line, sizeof(line), "Via: SIP/2.0/UDP %s:%d;branch=" IM_BRANCH_PREFIX "%016llx\r\n",
+                         SIP_SERVER_IP_ADDRESS, SIP_PORT, (unsigned long long)relay_branch(sender, (size_t)sender_len));
+            if (!append(out, &len, line, (size_t)n)) {
+                return false;
+            }
+            n = snprintf(line, sizeof(line), "%s\r\n", sender);
+        } else if (strncmp(cursor, "Max-Forwards:", strlen("Max-Forwards:")) == 0) {
+            n = snprintf(line, sizeof(line), "Max-Forwards: %d\r\n", atoi(cursor + strlen("Max-Forwards:")) - 1);
+        } else {
+            if (!append(out, &len, cursor, line_len)) {
+                return false;
+            }
+            cursor = end + 2;
+            continue;
+        }
+        if (n >= (int)sizeof(line) || !append(out, &len, line, (size_t)n)) {
+            return false;
+        }
+        cursor = end + 2;
+    }
+    return append(out, &len, cursor, strlen(cursor));
+}
+
+/**
+ * @brief Handles SIP MESSAGE requests.
+ *
+ * A MESSAGE for a registered user is relayed to the user's binding. One for a user who isn't
+ * registered, or still has stored messages, is stored and answered with 202 Accepted, or with
+ * 480 Temporarily Unavailable if the user's mailbox is full. Unknown users get 404 Not Found,
+ * an exhausted Max-Forwards 483 Too Many Hops, and a body too long to store or a MESSAGE too
+ * long to relay 513 Message Too Large.
+ * @param server The server handling the message
+ * @param message The MESSAGE
+ * @return 0 for success, -1 if message is invalid
+ */
+int handle_message(sip_server_t *server, sip_message_t *message) {
+    char via[HEADER_SIZE], from[HEADER_SIZE], to[HEADER_SIZE], cseq[HEADER_SIZE];
+    char call_id[MAX_UUID_LENGTH];
+    const char *body = strstr(message->buffer, "\r\n\r\n");
+    if (body == NULL ||
+        !sip_header_value(message->buffer, "Via", via, sizeof(via)) ||
+        !sip_header_value(message->buffer, "From", from, sizeof(from)) ||
+        !sip_header_value(message->buffer, "To", to, sizeof(to)) ||
+        !sip_header_value(message->buffer, "Call-ID", call_id, sizeof(call_id)) ||
+        !sip_header_value(message->buffer, "CSeq", cseq, sizeof(cseq))) {
+        return -1;
+    }
+    body += strlen("\r\n\r\n");
+
+    // Our responses carry a To tag, made from the Call-ID so that retransmissions get the same
+    char tagged_to[HEADER_SIZE];
+    if (strstr(to, "tag=") != NULL) {
+        memcpy(tagged_to, to, sizeof(tagged_to));
+    } else {
+        snprintf(tagged_to, sizeof(tagged_to), "%.200s;tag=im%08x", to,
+                 (unsigned int)sip_hash(call_id, strlen(call_id), 0));
+    }
+
+    char request_uri[HEADER_SIZE];
+    snprintf(request_uri, sizeof(request_uri), "%.*s", (int)strcspn(message->buffer, "\r\n"), message->buffer);
+    char username[MAX_USERNAME_LENGTH];
+    location_entry_t *user = NULL;
+    if (sip_header_username(request_uri, username, sizeof(username))) {
+        user = find_location_entry_by_userid(server, username);
+    }
+    if (user == NULL) {
+        SIP_TRACE("Recipient of MESSAGE not found. Sending 404 Not Found.\n");
+        sip_server_send_reply(server, message, "404 Not Found", via, from, tagged_to, call_id, cseq, "");
+        return 0;
+    }
+    int aor = (int)(user - server->store->location_entries);
+
+    char max_forwards[16];
+    if (sip_header_value(message->buffer, "Max-Forwards", max_forwards, sizeof(max_forwards)) &&
+        atoi(max_forwards) <= 0) {
+        SIP_TRACE("MESSAGE out of hops. Sending 483 Too Many Hops.\n");
+        sip_server_send_reply(server, message, "483 Too Many Hops", via, from, tagged_to, call_id, cseq, "");
+        return 0;
+    }
+
+    char source_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &message->client_addr.sin_addr, source_ip, sizeof(source_ip));
+    int source_port = ntohs(message->client_addr.sin_port);
+    char ip_str[INET_ADDRSTRLEN];
+    int port;
+    bool registered = read_binding(server, aor, ip_str, &port);
+
+    sip_im_store_t *store = &server->store->instant_messages;
+    sip_im_mailbox_t *mailbox = &store->mailboxes[aor];
+    shm_mutex_lock(&store->mutex);
+    if (registered && mailbox->count == 0) {
+        pthread_mutex_unlock(&store->mutex);
+        sip_message_t relayed;
+        if (!render_relayed(message, via, username, ip_str, port, source_ip, source_port, &relayed)) {
+            SIP_TRACE("Relayed MESSAGE too long. Sending 513 Message Too Large.\n");
+            sip_server_send_reply(server, message, "513 Message Too Large", via, from, tagged_to, call_id, cseq, "");
+            return 0;
+        }
+        shm_mutex_lock(&store->mutex);
+        store->stats.relayed++;
+        pthread_mutex_unlock(&store->mutex);
+        SIP_TRACE("Tx SIP message MESSAGE (relayed to %s at %s:%d):\r\n%s\r\n", username, ip_str, port, relayed.buffer);
+        sip_server_send(server, &relayed, ip_str, port);
+        return 0;
+    }
+
+    size_t body_len = strlen(body);
+    const char *status = "202 Accepted";
+    if (body_len >= IM_BODY_SIZE) {
+        status = "513 Message Too Large";
+    } else if (mailbox->count == IM_QUEUE_DEPTH) {
+        store->stats.rejected++;
+        status = "480 Temporarily Unavailable";
+    } else {
+        sip_im_stored_t *stored = &mailbox->messages[(mailbox->head + mailbox->count) % IM_QUEUE_DEPTH];
+        memcpy(stored->from, from, sizeof(stored->from));
+        memcpy(stored->to, to, sizeof(stored->to));
+        memcpy(stored->call_id, call_id, sizeof(stored->call_id));
+        if (!sip_header_value(message->buffer, "Content-Type", stored->content_type, sizeof(stored->content_type))) {
+            stored->content_type[0] = '\0';
+        }
+        memcpy(stored->body, body, body_len);
+        stored->body_len = body_len;
+        mailbox->count++;
+        store->stats.stored++;
+        store->stats.waiting++;
+        // Registered, but older messages are still being delivered: this one follows them
+        if (registered) {
+            mark_ready(server, aor);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    SIP_TRACE("MESSAGE for %s, who is %s: %s\n", username, registered ? "registered" : "offline", status);
+    sip_server_send_reply(server, message, status, via, from, tagged_to, call_id, cseq, "");
+    return 0;
+}
+
+/**
+ * @brief Relays a response to a MESSAGE back to its sender.
+ *
+ * The server's Via is taken off the top, and the response is sent to the address the next Via
+ * names, received and rport if present. Without a next Via the response is to a stored message
+ * the server delivered itself, and is discarded. One whose branch wasn't derived from the next
+ * Via is dropped, so the server can't be made to reflect datagrams to arbitrary addresses.
+ * @param server The server handling the message
+ * @param message The response
+ * @return 0 for success, -1 if the response isn't for a MESSAGE the server sent
+ */
+int handle_message_response(sip_server_t *server, sip_message_t *message) {
+    char *top = strstr(message->buffer, "\r\nVia:");
+    if (top == NULL) {
+        return -1;
+    }
+    top += strlen("\r\n");
+    char *top_end = strstr(top, "\r\n");
+    if (top_end == NULL || memmem(top, (size_t)(top_end - top), IM_BRANCH_PREFIX, strlen(IM_BRANCH_PREFIX)) == NULL) {
+        return -1;
+    }
+
+    char via[HEADER_SIZE];
+    if (strncmp(top_end, "\r\nVia:", strlen("\r\nVia:")) != 0 ||
+        !sip_header_value(top_end, "Via", via, sizeof(via))) {
+        SIP_TRACE("Response to a delivered MESSAGE, discarded.\n");
+        return 0;
+    }
+
+    // Only a response whose branch matches the Via below it is to a MESSAGE we relayed
+    const char *sender_via = top_end + strlen("\r\n");
+    const char *sender_end = strstr(sender_via, "\r\n");
+    const char *branch = memmem(top, (size_t)(top_end - top), IM_BRANCH_PREFIX, strlen(IM_BRANCH_PREFIX));
+    char expected[17];
+    snprintf(expected, sizeof(expected), "%016llx",
+             (unsigned long long)relay_branch(sender_via, sender_end == NULL ? 0 : (size_t)(sender_end - sender_via)));
+    branch += strlen(IM_BRANCH_PREFIX);
+    if (sender_end == NULL || top_end - branch < 16 || strncmp(branch, expected, 16) != 0 ||
+        strchr(";, \r", branch[16]) == NULL) {
+        SIP_TRACE("Response to a MESSAGE the server didn't relay, discarded.\n");
+        return -1;
+    }
+
+    // sent-by of the sender's Via, overridden by received and rport
+    char destination[INET_ADDRSTRLEN] = "";
+    int port = SIP_PORT;
+    const char *sent_by = strchr(via, ' ');
+    if (sent_by != NULL) {
+        sent_by++;
+        snprintf(destination, sizeof(destination), "%.*s", (int)strcspn(sent_by, ":; "), sent_by);
+        const char *colon = sent_by + strcspn(sent_by, ":; ");
+        if (*colon == ':') {
+            port = atoi(colon + 1);
+        }
+    }
+    const char *received = strstr(via, ";received=");
+    if (received != NULL) {
+        received += strlen(";received=");
+        snprintf(destination, sizeof(destination), "%.*s", (int)strcspn(received, ";, "), received);
+    }
+    const char *rport = strstr(via, ";rport=");
+    if (rport != NULL) {
+        port = atoi(rport + strlen(";rport="));
+    }
+    if (destination[0] == '\0' || port <= 0) {
+        return -1;
+    }
+
+    // Both parts of the buffer are copied, top_end + 2 starts the sender's Via line
+    sip_message_t relayed;
+    memset(&relayed, 0, sizeof(relayed));
+    size_t head_len = (size_t)(top - message->buffer);
+    memcpy(relayed.buffer, message->buffer, head_len);
+    memcpy(relayed.buffer + head_len, top_end + 2, strlen(top_end + 2));
+
+    sip_im_store_t *store = &server->store->instant_messages;
+    shm_mutex_lock(&store->mutex);
+    store->stats.responses++;
+    pthread_mutex_unlock(&store->mutex);
+    SIP_TRACE("Tx SIP message (response to MESSAGE relayed to %s:%d):\r\n%s\r\n", destination, port, relayed.buffer);
+    sip_server_send(server, &relayed, destination, port);
+    return 0;
+}
+
+void sip_im_user_registered(sip_server_t *server, int aor) {
+    sip_im_store_t *store = &server->store->instant_messages;
+    shm_mutex_lock(&store->mutex);
+    mark_ready(server, aor);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+/**
+ * @brief Puts together the MESSAGE delivering a stored message to its recipient's binding.
+ */
+static void render_delivery(sip_server_t *server, int aor, const sip_im_stored_t *stored,
+                            const char *ip_str, int port, sip_message_t *out) {
+    char content_type[IM_CONTENT_TYPE_SIZE + 32] = "";
+    if (stored->content_type[0] != '\0') {
+        snprintf(content_type, sizeof(content_type), "Content-Type: %s\r\n", stored->content_type);
+    }
+    int cseq = next_cseq_number(server);
+    memset(out, 0, sizeof(*out));
+    int len = snprintf(out->buffer, BUFFER_SIZE,
+        "MESSAGE sip:%s@%s:%d SIP/2.0\r\n"
+        "Via: SIP/2.0/UDP %s:%d;branch=" IM_BRANCH_PREFIX "%d-%d\r\n"
+        "Max-Forwards: 70\r\n"
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %d MESSAGE\r\n"
+        "User-Agent: TinySIP\r\n"
+        "%s"
+        "Content-Length: %zu\r\n\r\n"
+        "%.*s",
+        server->store->location_entries[aor].username, ip_str, port,
+        SIP_SERVER_IP_ADDRESS, SIP_PORT, aor, cseq,
+        stored->from,
+        stored->to,
+        stored->call_id,
+        cseq,
+        content_type,
+        stored->body_len, (int)stored->body_len, stored->body);
+    if (len >= BUFFER_SIZE) {
+        SIP_TRACE("Stored MESSAGE for user %d truncated to %d bytes\n", aor, BUFFER_SIZE - 1);
+    }
+}
+
+/**
+ * @struct rendered_deliveries_t
+ * @brief Stored messages rendered under the instant message lock, to be sent once it is released.
+ */
+typedef struct {
+    sip_message_t messages[IM_DELIVERY_BATCH];
+    char destinations[IM_DELIVERY_BATCH][INET_ADDRSTRLEN];
+    int ports[IM_DELIVERY_BATCH];
+    size_t count;
+} rendered_deliveries_t;
+
+/**
+ * @brief Renders the next batch of stored messages, one from each ready mailbox in turn.
+ * The instant message lock must be held.
+ * @return The messages to send, to be freed, NULL if there are none.
+ */
+static rendered_deliveries_t *render_stored(sip_server_t *server, uint64_t now_ms) {
+    sip_im_store_t *store = &server->store->instant_messages;
+    rendered_deliveries_t *rendered = malloc(sizeof(rendered_deliveries_t));
+    if (rendered == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    rendered->count = 0;
+    bool progress = true;
+
+    while (rendered->count < IM_DELIVERY_BATCH && progress) {
+        progress = false;
+        int start = store->next_mailbox;
+        for (int n = 0; n < IM_MAX_AORS && rendered->count < IM_DELIVERY_BATCH; n++) {
+            int aor = (start + n) % IM_MAX_AORS;
+            sip_im_mailbox_t *mailbox = &store->mailboxes[aor];
+            if (!mailbox->ready) {
+                continue;
+            }
+            size_t i = rendered->count;
+            if (mailbox->count == 0 || !read_binding(server, aor, rendered->destinations[i], &rendered->ports[i])) {
+                mailbox->ready = false;     // Delivered, or offline again until the next registration
+                continue;
+            }
+            render_delivery(server, aor, &mailbox->messages[mailbox->head], rendered->destinations[i],
+                            rendered->ports[i], &rendered->messages[i]);
+            rendered->count++;
+            mailbox->head = (mailbox->head + 1) % IM_QUEUE_DEPTH;
+            mailbox->count--;
+            store->stats.waiting--;
+            store->stats.delivered++;
+            store->next_mailbox = (aor + 1) % IM_MAX_AORS;
+            progress = true;
+        }
+    }
+
+    for (int aor = 0; aor < IM_MAX_AORS; aor++) {
+        if (store->mailboxes[aor].ready && store->mailboxes[aor].count > 0) {
+            store->delivery_pending = true;
+            sip_timer_arm(&server->store->timers, IM_DELIVERY_TIMER_ID, now_ms + IM_DELIVERY_INTERVAL_MS);
+            break;
+        }
+    }
+    if (rendered->count == 0) {
+        free(rendered);
+        return NULL;
+    }
+    store->stats.batches++;
+    return rendered;
+}
+
+/**
+ * @brief Hands rendered stored messages to the transport in one batch.
+ * Called without the instant message lock.
+ */
+static void send_rendered(sip_server_t *server, const rendered_deliveries_t *rendered) {
+    sip_outgoing_t batch[IM_DELIVERY_BATCH];
+    for (size_t i = 0; i < rendered->count; i++) {
+        batch[i].message = &rendered->messages[i];
+        batch[i].destination = rendered->destinations[i];
+        batch[i].port = rendered->ports[i];
+    }
+    SIP_TRACE("Delivering %zu stored MESSAGEs\r\n", rendered->count);
+    sip_server_send_batch(server, batch, rendered->count);
+}
+
+void sip_im_handle_timer(sip_server_t *server, int id, uint64_t now_ms) {
+    sip_im_store_t *store = &server->store->instant_messages;
+    rendered_deliveries_t *rendered = NULL;
+    shm_mutex_lock(&store->mutex);
+    if (sip_timer_claim(&server->store->timers, id, now_ms)) {
+        store->delivery_pending = false;
+        rendered = render_stored(server, now_ms);
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    if (rendered != NULL) {
+        send_rendered(server, rendered);
+        free(rendered);
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * @file im_relay.h
+ * @brief Instant messages between users (SIP MESSAGE, RFC 3428), stored for users who are offline.
+ *
+ * A MESSAGE for a registered user is relayed statelessly: the server puts its Via on top, with a
+ * branch derived from the sender's, and sends it to the user's binding. The user's responses come
+ * back through that Via, which the server takes off to send them on to the sender. Nothing about
+ * the transaction is kept.
+ *
+ * A MESSAGE for a user who isn't registered is answered with 202 Accepted and appended to the
+ * user's mailbox, a queue of IM_QUEUE_DEPTH messages. A full mailbox answers 480 Temporarily
+ * Unavailable. When handle_register() binds the user, the mailbox is marked ready and the delivery
+ * timer armed. Each time the timer fires, it takes one message from each ready mailbox in turn, at
+ * most IM_DELIVERY_BATCH in all, and hands them to the transport as one batch (one sendmmsg() on
+ * UDP), then fires again IM_DELIVERY_INTERVAL_MS later while messages are left. A registration
+ * storm thus releases stored messages at a steady rate instead of all at once. Stored messages are
+ * sent once, the responses to them are discarded.
+ *
+ * Messages for a user that still has stored ones are stored too, so the user gets them in order.
+ * The store holds no pointers and lives in sip_store_t, shared by the worker processes of the
+ * prefork mode. The SIP side (handle_message() and the registration hook) is declared in sip_server.h.
+ */
+
+#ifndef IM_RELAY_H
+#define IM_RELAY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef IM_MAX_AORS
+#define IM_MAX_AORS 64                      // Users with a mailbox, at least MAX_LOCATIONS
+#endif
+
+#ifndef IM_QUEUE_DEPTH
+#define IM_QUEUE_DEPTH 4                    // Messages stored per offline user
+#endif
+
+#ifndef IM_BODY_SIZE
+#define IM_BODY_SIZE 512                    // Longest body stored, longer ones get 513 Message Too Large
+#endif
+
+#ifndef IM_DELIVERY_BATCH
+#define IM_DELIVERY_BATCH 16                // Stored messages sent per delivery, over all users
+#endif
+
+#ifndef IM_DELIVERY_INTERVAL_MS
+#define IM_DELIVERY_INTERVAL_MS 100         // Time between deliveries, and from a registration to the first
+#endif
+
+#define IM_FIELD_SIZE 256                   // Size of From and To, HEADER_SIZE
+#define IM_CALL_ID_SIZE 128                 // Size of the Call-ID, MAX_UUID_LENGTH
+#define IM_CONTENT_TYPE_SIZE 64
+
+/**
+ * @struct sip_im_stored_t
+ * @brief A MESSAGE waiting for its recipient to register.
+ */
+typedef struct {
+    char from[IM_FIELD_SIZE];               // From of the MESSAGE, with the sender's tag
+    char to[IM_FIELD_SIZE];                 // To of the MESSAGE
+    char call_id[IM_CALL_ID_SIZE];
+    char content_type[IM_CONTENT_TYPE_SIZE];
+    char body[IM_BODY_SIZE];
+    size_t body_len;
+} sip_im_stored_t;
+
+/**
+ * @struct sip_im_mailbox_t
+ * @brief The messages stored for one user, oldest first.
+ */
+typedef struct {
+    sip_im_stored_t messages[IM_QUEUE_DEPTH];
+    int head;                               // Oldest message
+    int count;
+    bool ready;                             // The user registered, the messages are being delivered
+} sip_im_mailbox_t;
+
+/**
+ * @struct sip_im_stats_t
+ * @brief Instant message counters.
+ */
+typedef struct {
+    size_t waiting;                 // Messages stored now
+    unsigned long relayed;          // MESSAGEs relayed to registered users
+    unsigned long responses;        // Responses relayed back to senders
+    unsigned long stored;           // MESSAGEs stored for offline users
+    unsigned long rejected;         // MESSAGEs refused with a full mailbox
+    unsigned long delivered;        // Stored messages sent
+    unsigned long batches;          // Deliveries they were sent in
+} sip_im_stats_t;
+
+/**
+ * @struct sip_im_store_t
+ * @brief The mailboxes and the delivery schedule.
+ */
+typedef struct {
+    sip_im_mailbox_t mailboxes[IM_MAX_AORS];
+    int next_mailbox;                       // Mailbox the next delivery starts with
+    bool delivery_pending;                  // The delivery timer is armed
+    sip_im_stats_t stats;
+    pthread_mutex_t mutex;
+} sip_im_store_t;
+
+/**
+ * @brief Initializes empty mailboxes.
+ * @param process_shared true if the store is shared by several worker processes.
+ */
+void sip_im_store_init(sip_im_store_t *store, bool process_shared);
+void sip_im_store_destroy(sip_im_store_t *store);
+
+/**
+ * @brief Copies the instant message counters.
+ */
+void sip_im_stats(sip_im_store_t *store, sip_im_stats_t *stats);
+
+#endif // IM_RELAY_H
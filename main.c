@@ -5,6 +5,10 @@
 
 #include "sip_server.h"
 #include "network_utils.h"
+#include "prefork.h"
+#include "fault_injection.h"
+#include "admin.h"
+#include "mirror.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,42 +19,295 @@
 #include <errno.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <time.h>
+#include <signal.h>
 
 
 worker_thread_t worker_threads[MAX_THREADS];
 
 void setup_server_socket(int *server_socket, struct sockaddr_in *server_addr);
 void handle_new_message(int server_socket);
+static void dispatch_message(sip_message_t *message, size_t len);
 
 int server_socket;
 
-int main() {
+// The SIP core, sending through server_socket
+static sip_server_t server;
+
+// Shared segment of the multi-process worker mode, NULL when the workers are threads
+static prefork_segment_t *prefork_segment = NULL;
+static volatile sig_atomic_t worker_exited = 0;
+
+// Admin control socket, served by the receive loop, -1 if it couldn't be opened
+static int admin_socket = -1;
+
+// Sampled copy of the received traffic for a shadow server, off unless SIP_MIRROR is set
+static mirror_t mirror;
+
+static void handle_sigchld(int sig) {
+    (void)sig;
+    worker_exited = 1;
+}
+
+/**
+ * @brief Reports the memory accounts that changed since the last report.
+ */
+static void report_memory(void) {
+    static sip_memory_stats_t reported[SIP_MEMORY_SUBSYSTEMS];
+    for (int i = 0; i < SIP_MEMORY_SUBSYSTEMS; i++) {
+        sip_memory_stats_t stats;
+        sip_server_memory_stats(&server, (sip_memory_subsystem_t)i, &stats);
+        if (memcmp(&stats, &reported[i], sizeof(stats)) != 0) {
+            printf("Memory (%s): %zu objects, %zu bytes, peak %zu, ceiling %zu, reserved %zu, %lu shed\n",
+                   sip_memory_subsystem_name((sip_memory_subsystem_t)i), stats.objects, stats.bytes,
+                   stats.peak_bytes, stats.ceiling_bytes, stats.reserved_bytes, stats.shed);
+            reported[i] = stats;
+        }
+    }
+}
+
+/**
+ * @brief Reports the subscription counters if they changed since the last report.
+ */
+static void report_subscriptions(void) {
+    static sip_subscription_stats_t reported;
+    sip_subscription_stats_t stats;
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    if (memcmp(&stats, &reported, sizeof(stats)) != 0) {
+        printf("Subscriptions: %zu active, %lu NOTIFYs sent (%lu batches), %lu changes coalesced, %lu NOTIFYs suppressed\n",
+               stats.active, stats.notifies, stats.batches, stats.coalesced, stats.suppressed);
+        reported = stats;
+    }
+}
+
+/**
+ * @brief Reports the instant message counters if they changed since the last report.
+ */
+static void report_instant_messages(void) {
+    static sip_im_stats_t reported;
+    sip_im_stats_t stats;
+    sip_im_stats(&server.store->instant_messages, &stats);
+    if (memcmp(&stats, &reported, sizeof(stats)) != 0) {
+        printf("Instant messages: %lu relayed (%lu responses), %lu stored, %lu refused, %lu delivered (%lu batches), %zu waiting\n",
+               stats.relayed, stats.responses, stats.stored, stats.rejected, stats.delivered, stats.batches, stats.waiting);
+        reported = stats;
+    }
+}
+
+/**
+ * @brief Reports the requests for unknown users rejected early, if they changed since the last report.
+ */
+static void report_unknown_users(void) {
+    static unsigned long reported_bloom = 0, reported_negative = 0;
+    unsigned long bloom_rejects, negative_hits;
+    user_filter_stats(&server.store->user_filter, &bloom_rejects, &negative_hits);
+    if (bloom_rejects != reported_bloom || negative_hits != reported_negative) {
+        printf("Unknown users: %lu requests rejected by the Bloom filter, %lu by the negative cache\n",
+               bloom_rejects, negative_hits);
+        reported_bloom = bloom_rejects;
+        reported_negative = negative_hits;
+    }
+}
+
+/**
+ * @brief Prints how many calls the per-AOR and per-peer limits refused, when that changed.
+ */
+static void report_call_limits(void) {
+    static unsigned long reported_aor = 0, reported_peer = 0;
+    unsigned long aor = atomic_load(&server.store->call_limits.rejected[CALL_LIMIT_AOR]);
+    unsigned long peer = atomic_load(&server.store->call_limits.rejected[CALL_LIMIT_PEER]);
+    if (aor != reported_aor || peer != reported_peer) {
+        printf("Call limits: %lu INVITEs refused for their caller, %lu for their peer\n", aor, peer);
+        reported_aor = aor;
+        reported_peer = peer;
+    }
+}
+
+/**
+ * @brief Reports the datagrams mirrored since the last report.
+ */
+static void report_mirror(void) {
+    static unsigned long reported_mirrored = 0, reported_discarded = 0;
+    if (mirror.mirrored != reported_mirrored || mirror.discarded != reported_discarded) {
+        printf("Mirror: %lu datagrams copied to the shadow, %lu from it discarded\n",
+               mirror.mirrored, mirror.discarded);
+        reported_mirrored = mirror.mirrored;
+        reported_discarded = mirror.discarded;
+    }
+}
+
+#ifdef FAULT_INJECTION
+/**
+ * @brief Takes on a received datagram the fault injector held back.
+ */
+static void receive_delayed(void *user_data, fault_direction_t direction, int fd,
+                            const char *data, size_t len, const struct sockaddr_in *peer) {
+    (void)user_data;
+    (void)direction;
+    (void)fd;
+    sip_message_t *message = malloc(sizeof(sip_message_t));
+    if (message == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+    memcpy(message->buffer, data, len);
+    message->buffer[len] = '\0';
+    message->client_addr = *peer;
+    message->client_addr_len = sizeof(message->client_addr);
+    dispatch_message(message, len);
+}
+
+/**
+ * @brief Reports what the fault injector did since the last report.
+ */
+static void report_faults(void) {
+    static fault_stats_t reported[2];
+    const fault_direction_t directions[2] = { FAULT_IN, FAULT_OUT };
+    for (int i = 0; i < 2; i++) {
+        fault_stats_t stats;
+        fault_injection_stats(directions[i], &stats);
+        if (memcmp(&stats, &reported[i], sizeof(stats)) != 0) {
+            printf("Fault injection (%s): %lu passed, %lu dropped, %lu duplicated, %lu delayed, %lu reordered, %lu overflowed\n",
+                   directions[i] == FAULT_IN ? "in" : "out", stats.passed, stats.dropped, stats.duplicated,
+                   stats.delayed, stats.reordered, stats.overflowed);
+            reported[i] = stats;
+        }
+    }
+}
+#endif
+
+int main(int argc, char *argv[]) {
     
     struct sockaddr_in server_addr;
+    bool prefork = (argc > 1 && strcmp(argv[1], "--prefork") == 0);
 
     // Setup server socket
     setup_server_socket(&server_socket, &server_addr);
 
-    // Initialize worker threads and their queues
-    for (int i = 0; i < MAX_THREADS; i++) {
-        initialize_message_queue(&worker_threads[i].queue, QUEUE_CAPACITY);
-        if (pthread_create(&worker_threads[i].thread, NULL, process_sip_messages, &worker_threads[i].queue) != 0) {
-            perror("Failed to create worker thread");
+    const sip_transport_t transport = { .send = udp_transport_send, .send_batch = udp_transport_send_batch, .user_data = &server_socket };
+    sip_server_init(&server, &transport);
+    printf("Table hashing: %s, keyed per run\n", sip_hash_implementation());
+
+    // Messages logged, checked before the workers start and set in the store they use
+    sip_trace_filter_t trace_filter;
+    sip_trace_filter_init(&trace_filter);
+    const char *trace = getenv("SIP_TRACE");
+    if (trace != NULL && sip_trace_configure(&trace_filter, trace) < 0) {
+        fprintf(stderr, "Invalid SIP_TRACE: %s\n", trace);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Numbers whose INVITEs bypass overload shedding, matched by the receive thread
+    const char *emergency_numbers = getenv("SIP_EMERGENCY_NUMBERS");
+    if (emergency_numbers != NULL && sip_server_set_emergency_numbers(&server, emergency_numbers) < 0) {
+        fprintf(stderr, "Invalid SIP_EMERGENCY_NUMBERS: %s\n", emergency_numbers);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef FAULT_INJECTION
+    // Set up before the workers start, so worker processes inherit the rules
+    const char *faults = getenv("SIP_FAULTS");
+    if (fault_injection_setup(faults, receive_delayed, NULL) < 0) {
+        fprintf(stderr, "Invalid SIP_FAULTS: %s\n", faults);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    if (fault_injection_enabled()) {
+        printf("Fault injection: %s\n", faults);
+    }
+#endif
+
+    if (prefork) {
+        // Worker processes sharing the call table and location store through shared memory
+        signal(SIGCHLD, handle_sigchld);
+        prefork_segment = prefork_start(&server, MAX_THREADS);
+        if (prefork_segment == NULL) {
+            fprintf(stderr, "Failed to start worker processes\n");
             close(server_socket);
             exit(EXIT_FAILURE);
         }
+        printf("Prefork mode: %d worker processes\n", prefork_segment->worker_count);
+    } else {
+        // Initialize worker threads and their queues
+        for (int i = 0; i < MAX_THREADS; i++) {
+            initialize_message_queue(&worker_threads[i].queue, QUEUE_CAPACITY);
+            worker_threads[i].server = &server;
+            if (pthread_create(&worker_threads[i].thread, NULL, process_sip_messages, &worker_threads[i]) != 0) {
+                perror("Failed to create worker thread");
+                close(server_socket);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    sip_server_set_trace(&server, &trace_filter);
+
+    // Memory ceilings, in the store the workers use
+    const char *memory_limits = getenv("SIP_MEMORY_LIMITS");
+    if (memory_limits != NULL && sip_memory_configure(&server.store->memory, memory_limits) < 0) {
+        fprintf(stderr, "Invalid SIP_MEMORY_LIMITS: %s\n", memory_limits);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Call limits per AOR and peer, in the store the workers use
+    const char *call_limits = getenv("SIP_CALL_LIMITS");
+    if (call_limits != NULL && call_limits_configure(&server.store->call_limits, call_limits) < 0) {
+        fprintf(stderr, "Invalid SIP_CALL_LIMITS: %s\n", call_limits);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Traffic mirrored to a shadow server
+    mirror_init(&mirror);
+    const char *mirror_spec = getenv("SIP_MIRROR");
+    if (mirror_spec != NULL) {
+        if (mirror_configure(&mirror, mirror_spec) < 0) {
+            fprintf(stderr, "Invalid SIP_MIRROR: %s\n", mirror_spec);
+            close(server_socket);
+            exit(EXIT_FAILURE);
+        }
+        printf("Mirroring 1 in %u dialogs to %s:%d\n", mirror.sample, mirror.shadow_ip, mirror.shadow_port);
+    }
+
+    // Admin control socket, opened after the workers start so they don't inherit it
+    const char *admin_path = getenv("SIP_ADMIN_SOCKET");
+    if (admin_path == NULL) {
+        admin_path = ADMIN_SOCKET_PATH;
+    }
+    admin_socket = admin_socket_open(admin_path);
+    if (admin_socket < 0) {
+        fprintf(stderr, "Admin socket %s unavailable, continuing without it\n", admin_path);
+    } else {
+        printf("Admin socket: %s\n", admin_path);
     }
 
     // Main server loop
     while (1) {
         handle_new_message(server_socket);
+        mirror_poll(&mirror, sip_server_now_ms(&server));
+        // Call and registration timers, for the threads and the worker processes alike
+        sip_server_run_timers(&server);
+        if (worker_exited) {
+            worker_exited = 0;
+            prefork_reap(prefork_segment);
+        }
     }
 
     // Cleanup (not reached in current setup)
-    for (int i = 0; i < MAX_THREADS; i++) {
-        pthread_join(worker_threads[i].thread, NULL);
-        destroy_message_queue(&worker_threads[i].queue);
+    if (prefork_segment != NULL) {
+        prefork_stop(prefork_segment);
+    } else {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            pthread_join(worker_threads[i].thread, NULL);
+            destroy_message_queue(&worker_threads[i].queue);
+        }
     }
+    admin_socket_close(admin_socket, admin_path);
+    mirror_close(&mirror);
+    sip_server_destroy(&server);
     close(server_socket);
 
     return 0;
@@ -88,14 +345,46 @@ void handle_new_message(int server_socket) {
     fd_set read_fds;
     FD_ZERO(&read_fds);
     FD_SET(server_socket, &read_fds);
+    if (admin_socket >= 0) {
+        FD_SET(admin_socket, &read_fds);
+    }
 
-    struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
+    // Wake up often enough to run the timers in time
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+    static unsigned long reported_duplicates = 0;
 
-    if (select(server_socket + 1, &read_fds, NULL, NULL, &tv) < 0) {
-        perror("Select error");
+    int max_fd = admin_socket > server_socket ? admin_socket : server_socket;
+    int ready = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
+    if (ready < 0) {
+        if (errno != EINTR) {
+            perror("Select error");
+        }
         return;
     }
 
+    if (ready == 0) {
+        // Idle: report retransmissions dropped since the last report
+        unsigned long duplicates = dedup_filter_duplicates(&server.store->dedup_filter);
+        if (duplicates != reported_duplicates) {
+            printf("Duplicate filter: %lu retransmitted datagrams dropped in total\n", duplicates);
+            reported_duplicates = duplicates;
+        }
+        report_memory();
+        report_subscriptions();
+        report_instant_messages();
+        report_unknown_users();
+        report_call_limits();
+        report_mirror();
+#ifdef FAULT_INJECTION
+        report_faults();
+#endif
+        return;
+    }
+
+    if (admin_socket >= 0 && FD_ISSET(admin_socket, &read_fds)) {
+        admin_socket_serve(&server, admin_socket);
+    }
+
     if (FD_ISSET(server_socket, &read_fds)) {
         sip_message_t *message = malloc(sizeof(sip_message_t));
         if (message == NULL) {
@@ -109,14 +398,14 @@ void handle_new_message(int server_socket) {
 
         if (bytes_received > 0) {
             message->buffer[bytes_received] = '\0';
-
-            // TODO: update on how the thread should be selected based on your
-            // routing logic
-            int selected_thread = 0;
-            if (!enqueue_message(&worker_threads[selected_thread].queue, message)) {
-                fprintf(stderr, "Failed to enqueue message\n");
+#ifdef FAULT_INJECTION
+            // Lost, or handed back to receive_delayed() later
+            if (!fault_injection_incoming(server_socket, message->buffer, (size_t)bytes_received, &message->client_addr)) {
                 free(message);
+                return;
             }
+#endif
+            dispatch_message(message, (size_t)bytes_received);
         } else {
             if (bytes_received < 0 && errno != EWOULDBLOCK) {
                 perror("Error receiving data");
@@ -125,3 +414,48 @@ void handle_new_message(int server_socket) {
         }
     }
 }
+
+/**
+ * @brief Drops retransmissions still in flight and hands the message to its worker.
+ * @param message The received message, owned by the callee.
+ * @param len The length of the datagram in message->buffer.
+ */
+static void dispatch_message(sip_message_t *message, size_t len) {
+    // Hashed by the first to need it, then carried to the worker
+    message->call_hash = 0;
+
+    // Mirrored as received, retransmissions and shed datagrams included
+    mirror_datagram(&mirror, message, sip_server_now_ms(&server));
+
+    // Drop exact copies of a datagram whose first copy is still queued or being processed
+    message->pool_bytes = 0;
+    message->dedup_hash = dedup_filter_hash(message->buffer, len, &message->client_addr);
+    if (dedup_filter_check(&server.store->dedup_filter, message->dedup_hash, sip_server_now_ms(&server))) {
+        free(message);
+        return;
+    }
+
+    // Over the message pool's ceiling, shed the datagram before it is queued, the UA retransmits it
+    if (!sip_server_admit_message(&server, message)) {
+        release_message(&server, message);
+        return;
+    }
+
+    if (prefork_segment != NULL) {
+        // The message is copied into the worker's ring, which releases its filter entry
+        if (!prefork_dispatch(prefork_segment, message)) {
+            fprintf(stderr, "Failed to enqueue message\n");
+            release_message(&server, message);
+        } else {
+            free(message);
+        }
+        return;
+    }
+
+    // Both legs of a call go to the same worker, so a call's messages are handled in order
+    int selected_thread = message_worker_index(message, MAX_THREADS);
+    if (!enqueue_message(&worker_threads[selected_thread].queue, message)) {
+        fprintf(stderr, "Failed to enqueue message\n");
+        release_message(&server, message);
+    }
+}
@@ -0,0 +1,125 @@
+/**
+ * @file mirror.c
+ * @brief Implementation of the traffic mirror.
+ */
+
+#define _GNU_SOURCE
+#include "mirror.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void mirror_init(mirror_t *mirror) {
+    memset(mirror, 0, sizeof(*mirror));
+    mirror->socket = -1;
+    mirror->sample = MIRROR_SAMPLE;
+}
+
+int mirror_configure(mirror_t *mirror, const char *spec) {
+    char copy[64];
+    if (spec == NULL || strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    // Address and port, then the sample
+    unsigned int sample = MIRROR_SAMPLE;
+    char *options = strchr(copy, ',');
+    if (options != NULL) {
+        *options++ = '\0';
+        if (strncmp(options, "sample=", strlen("sample=")) != 0) {
+            return -1;
+        }
+        const char *value = options + strlen("sample=");
+        char *end;
+        unsigned long parsed = strtoul(value, &end, 10);
+        if (end == value || *end != '\0' || value[0] == '-' || parsed == 0 || parsed > UINT32_MAX) {
+            return -1;
+        }
+        sample = (unsigned int)parsed;
+    }
+    char *colon = strrchr(copy, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+    *colon++ = '\0';
+    char *end;
+    long port = strtol(colon, &end, 10);
+    struct in_addr addr;
+    if (end == colon || *end != '\0' || port <= 0 || port > 65535 || inet_pton(AF_INET, copy, &addr) != 1) {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Mirror socket creation failed");
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("Failed to set non-blocking mirror socket");
+        close(fd);
+        return -1;
+    }
+
+    mirror_close(mirror);
+    mirror->socket = fd;
+    strcpy(mirror->shadow_ip, copy);
+    mirror->shadow_port = (int)port;
+    mirror->sample = sample;
+    return 0;
+}
+
+bool mirror_datagram(mirror_t *mirror, sip_message_t *message, uint64_t now_ms) {
+    // The high half of the hash, the low half picks the worker and would skew the sample
+    if (mirror->socket < 0 || (message_call_hash(message) >> 32) % mirror->sample != 0) {
+        return false;
+    }
+    if (mirror->queued == 0) {
+        mirror->oldest_ms = now_ms;
+    }
+    size_t len = strnlen(message->buffer, BUFFER_SIZE);
+    sip_message_t *copy = &mirror->copies[mirror->queued];
+    memcpy(copy->buffer, message->buffer, len);
+    copy->buffer[len] = '\0';
+    mirror->batch[mirror->queued] = (sip_outgoing_t){ .message = copy, .destination = mirror->shadow_ip,
+                                                      .port = mirror->shadow_port };
+    if (++mirror->queued == MIRROR_BATCH_SIZE) {
+        mirror_flush(mirror);
+    }
+    return true;
+}
+
+void mirror_flush(mirror_t *mirror) {
+    if (mirror->queued == 0) {
+        return;
+    }
+    send_sip_batch(mirror->socket, mirror->batch, mirror->queued);
+    mirror->mirrored += mirror->queued;
+    mirror->queued = 0;
+}
+
+void mirror_poll(mirror_t *mirror, uint64_t now_ms) {
+    if (mirror->socket < 0) {
+        return;
+    }
+    if (mirror->queued > 0 && now_ms - mirror->oldest_ms >= MIRROR_FLUSH_MS) {
+        mirror_flush(mirror);
+    }
+    char discard[BUFFER_SIZE];
+    while (recv(mirror->socket, discard, sizeof(discard), 0) >= 0) {
+        mirror->discarded++;
+    }
+}
+
+void mirror_close(mirror_t *mirror) {
+    if (mirror->socket >= 0) {
+        mirror_flush(mirror);
+        close(mirror->socket);
+        mirror->socket = -1;
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * @file mirror.h
+ * @brief Copies a sample of the received traffic to a shadow server.
+ *
+ * A new build can be run against real traffic by giving it a copy of what the live server
+ * receives. Dialogs are sampled by Call-ID hash, the same for both legs of a call, so the shadow
+ * sees every message of the dialogs it gets. The copies are queued by the receive loop and sent
+ * in batches, at most MIRROR_FLUSH_MS later, so mirroring costs it a copy per datagram and a
+ * system call per batch. They are sent from a socket of their own: whatever the shadow answers
+ * comes back to it and is discarded, never to the live server's socket.
+ *
+ * The shadow runs its own routing, so it must be provisioned not to reach the live UAs.
+ */
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include "sip_server.h"
+#include "network_utils.h"
+
+#ifndef MIRROR_SAMPLE
+#define MIRROR_SAMPLE 10                // Default sample: 1 in MIRROR_SAMPLE dialogs is mirrored
+#endif
+#ifndef MIRROR_FLUSH_MS
+#define MIRROR_FLUSH_MS 20              // Longest a copy waits for its batch to fill
+#endif
+#define MIRROR_BATCH_SIZE SIP_SEND_BATCH_MAX
+
+/**
+ * @struct mirror_t
+ * @brief Where the traffic is mirrored and the copies waiting to be sent.
+ */
+typedef struct {
+    int socket;                                 // Socket the copies are sent from, -1 if mirroring is off
+    char shadow_ip[INET_ADDRSTRLEN];
+    int shadow_port;
+    unsigned int sample;                        // Mirror 1 in sample dialogs
+    sip_message_t copies[MIRROR_BATCH_SIZE];    // Only the buffer is used
+    sip_outgoing_t batch[MIRROR_BATCH_SIZE];
+    size_t queued;
+    uint64_t oldest_ms;                         // When the first queued copy was taken
+    unsigned long mirrored;                     // Datagrams sent to the shadow
+    unsigned long discarded;                    // Datagrams received from the shadow
+} mirror_t;
+
+/**
+ * @brief Initializes a mirror that is off.
+ */
+void mirror_init(mirror_t *mirror);
+
+/**
+ * @brief Starts mirroring as specified, e.g. "10.0.0.9:5060,sample=100".
+ * @param spec The shadow's address and port, optionally followed by the sample (MIRROR_SAMPLE by default).
+ * @return 0 on success, -1 if the specification is invalid or the socket can't be created (mirroring stays off then).
+ */
+int mirror_configure(mirror_t *mirror, const char *spec);
+
+/**
+ * @brief Queues a copy of a received datagram if its dialog is sampled, sending the batch once full.
+ * @param message The received message.
+ * @param now_ms Current server time in milliseconds.
+ * @return true if the datagram was mirrored.
+ */
+bool mirror_datagram(mirror_t *mirror, sip_message_t *message, uint64_t now_ms);
+
+/**
+ * @brief Sends the queued copies if the oldest waited MIRROR_FLUSH_MS, and discards what the shadow sent.
+ * @param now_ms Current server time in milliseconds.
+ */
+void mirror_poll(mirror_t *mirror, uint64_t now_ms);
+
+/**
+ * @brief Sends the queued copies.
+ */
+void mirror_flush(mirror_t *mirror);
+
+/**
+ * @brief Sends the queued copies and stops mirroring.
+ */
+void mirror_close(mirror_t *mirror);
+
+#endif // MIRROR_H
@@ -3,35 +3,26 @@
  * @brief Implementation of network utility functions for the SIP server.
  */
 
+#define _GNU_SOURCE
 #include "network_utils.h"
+#include "sip_encoder.h"
+#include "fault_injection.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <unistd.h>
-
-extern int server_socket;
 
 /**
  * @brief Sends a SIP message to the specified destination and port.
  * 
+ * @param socket_fd The UDP socket to send from.
  * @param message The SIP message to be sent.
  * @param destination The IP address of the destination.
  * @param port The port number on the destination.
  */
-void send_sip_message(const sip_message_t *message, const char *destination, int port) {
-    int sockfd;
+void send_sip_message(int socket_fd, const sip_message_t *message, const char *destination, int port) {
     struct sockaddr_in dest_addr;
-    struct sockaddr_in local_addr;
-    socklen_t local_addr_len = sizeof(local_addr);
-    char source_ip_str[INET_ADDRSTRLEN] = {0};
-
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        return;
-    }
 
     memset(&dest_addr, 0, sizeof(dest_addr));
     dest_addr.sin_family = AF_INET;
@@ -39,26 +30,99 @@ void send_sip_message(const sip_message_t *message, const char *destination, int
 
     if (inet_pton(AF_INET, destination, &dest_addr.sin_addr) <= 0) {
         perror("Invalid address/ Address not supported");
-        close(sockfd);
         return;
     }
 
-    // Get local address from the socket
-    getsockname(sockfd, (struct sockaddr *)&local_addr, &local_addr_len);
+    // Compact the message if needed to stay under the MTU budget
+    char compact[BUFFER_SIZE + 1];
+    const char *payload;
+    size_t payload_len = sip_encoder_prepare(message->buffer, strlen(message->buffer), compact, sizeof(compact), &payload);
 
-    // Convert source IP address to string format
-    inet_ntop(AF_INET, &(local_addr.sin_addr), source_ip_str, INET_ADDRSTRLEN);
+#ifdef FAULT_INJECTION
+    // Lost, or sent later by the injector's delivery thread
+    if (!fault_injection_outgoing(socket_fd, payload, payload_len, &dest_addr)) {
+        return;
+    }
+#endif
 
-    // Send the message
-    if (sendto(server_socket, message->buffer, strlen(message->buffer), 0,
+    // Send the message, one sendto() per message on the listening socket
+    if (sendto(socket_fd, payload, payload_len, 0,
                (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
         perror("Send failed");
     } else {
         //printf("\r\n===========================================================\r\n");
-        //printf("Message sent to %s:%d, Source: %s:%d\r\n", destination, port, source_ip_str, ntohs(local_addr.sin_port));
+        //printf("Message sent to %s:%d\r\n", destination, port);
         // printf("Raw SIP message :\r\n%s\r\n", message->buffer);
         // printf("==============================================================\r\n");
     }
+}
+
+void udp_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port) {
+    send_sip_message(*(const int *)user_data, message, destination, port);
+}
+
+/**
+ * @brief Sends several SIP messages with as few system calls as possible (sendmmsg()).
+ *
+ * Each message is compacted and passed through the fault injector like a message sent with
+ * send_sip_message(). Messages with an invalid destination are skipped.
+ * @param socket_fd The UDP socket to send from.
+ * @param batch The messages and their destinations.
+ * @param count Number of messages in batch.
+ */
+void send_sip_batch(int socket_fd, const sip_outgoing_t *batch, size_t count) {
+    char compact[SIP_SEND_BATCH_MAX][BUFFER_SIZE + 1];
+    struct sockaddr_in addrs[SIP_SEND_BATCH_MAX];
+    struct iovec iovs[SIP_SEND_BATCH_MAX];
+    struct mmsghdr headers[SIP_SEND_BATCH_MAX];
+
+    while (count > 0) {
+        size_t chunk = count < SIP_SEND_BATCH_MAX ? count : SIP_SEND_BATCH_MAX;
+        unsigned int queued = 0;
+        for (size_t i = 0; i < chunk; i++) {
+            struct sockaddr_in *dest_addr = &addrs[queued];
+            memset(dest_addr, 0, sizeof(*dest_addr));
+            dest_addr->sin_family = AF_INET;
+            dest_addr->sin_port = htons(batch[i].port);
+            if (inet_pton(AF_INET, batch[i].destination, &dest_addr->sin_addr) <= 0) {
+                perror("Invalid address/ Address not supported");
+                continue;
+            }
+            const char *payload;
+            const sip_message_t *message = batch[i].message;
+            size_t payload_len = sip_encoder_prepare(message->buffer, strlen(message->buffer), compact[queued],
+                                                     sizeof(compact[queued]), &payload);
+#ifdef FAULT_INJECTION
+            if (!fault_injection_outgoing(socket_fd, payload, payload_len, dest_addr)) {
+                continue;
+            }
+#endif
+            iovs[queued].iov_base = (void *)payload;
+            iovs[queued].iov_len = payload_len;
+            memset(&headers[queued], 0, sizeof(headers[queued]));
+            headers[queued].msg_hdr.msg_name = dest_addr;
+            headers[queued].msg_hdr.msg_namelen = sizeof(*dest_addr);
+            headers[queued].msg_hdr.msg_iov = &iovs[queued];
+            headers[queued].msg_hdr.msg_iovlen = 1;
+            queued++;
+        }
+
+        // sendmmsg() may stop early, carry on after what it sent and skip a message it failed on
+        unsigned int sent = 0;
+        while (sent < queued) {
+            int n = sendmmsg(socket_fd, headers + sent, queued - sent, 0);
+            if (n < 0) {
+                perror("Send failed");
+                sent++;
+            } else {
+                sent += (unsigned int)n;
+            }
+        }
+        batch += chunk;
+        count -= chunk;
+    }
+}
 
-    close(sockfd);
-}
\ No newline at end of file
+void udp_transport_send_batch(void *user_data, const sip_outgoing_t *batch, size_t count) {
+    send_sip_batch(*(const int *)user_data, batch, count);
+}
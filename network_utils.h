@@ -8,13 +8,39 @@
 
 #include "sip_server.h"
 
+#ifndef SIP_SEND_BATCH_MAX
+#define SIP_SEND_BATCH_MAX 32       // Messages passed to one sendmmsg() call
+#endif
+
 /**
  * @brief Sends a SIP message to a specified destination and port.
  * 
+ * @param socket_fd The UDP socket to send from.
  * @param message The SIP message to be sent.
  * @param destination The IP address of the destination.
  * @param port The port number on the destination.
  */
-void send_sip_message(const sip_message_t *message, const char *destination, int port);
+void send_sip_message(int socket_fd, const sip_message_t *message, const char *destination, int port);
+
+/**
+ * @brief UDP transport callback (sip_transport_t.send) for send_sip_message().
+ * @param user_data Pointer to the int socket descriptor to send from.
+ */
+void udp_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port);
+
+/**
+ * @brief Sends several SIP messages, SIP_SEND_BATCH_MAX per system call.
+ *
+ * @param socket_fd The UDP socket to send from.
+ * @param batch The messages and their destinations.
+ * @param count Number of messages in batch.
+ */
+void send_sip_batch(int socket_fd, const sip_outgoing_t *batch, size_t count);
+
+/**
+ * @brief UDP transport callback (sip_transport_t.send_batch) for send_sip_batch().
+ * @param user_data Pointer to the int socket descriptor to send from.
+ */
+void udp_transport_send_batch(void *user_data, const sip_outgoing_t *batch, size_t count);
 
 #endif // NETWORK_UTILS_H
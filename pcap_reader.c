@@ -0,0 +1,331 @@
+/**
+ * @file pcap_reader.c
+ * @brief Implementation of the pcap/pcapng datagram reader.
+ */
+
+#include "pcap_reader.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PCAP_MAGIC_USEC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC      0xa1b23c4d
+#define PCAPNG_SHB           0x0a0d0d0a
+#define PCAPNG_IDB           0x00000001
+#define PCAPNG_SPB           0x00000003
+#define PCAPNG_EPB           0x00000006
+#define PCAPNG_BYTE_ORDER    0x1a2b3c4d
+
+#define LINKTYPE_NULL        0
+#define LINKTYPE_ETHERNET    1
+#define LINKTYPE_RAW         101
+#define LINKTYPE_LINUX_SLL   113
+#define LINKTYPE_IPV4        228
+#define LINKTYPE_LINUX_SLL2  276
+
+static uint32_t swap32(uint32_t v) {
+    return ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+static uint32_t file32(const pcap_reader_t *reader, const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return reader->swapped ? swap32(v) : v;
+}
+
+static uint16_t file16(const pcap_reader_t *reader, const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return reader->swapped ? (uint16_t)((v << 8) | (v >> 8)) : v;
+}
+
+static uint16_t net16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+int pcap_reader_open(pcap_reader_t *reader, const char *path) {
+    uint8_t header[24];
+
+    memset(reader, 0, offsetof(pcap_reader_t, buffer));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        perror("Failed to open capture");
+        return -1;
+    }
+    if (fread(header, 1, 4, reader->file) != 4) {
+        goto invalid;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic == PCAPNG_SHB) {
+        // The section header is parsed by pcap_reader_next() like any other block
+        reader->pcapng = true;
+        rewind(reader->file);
+        return 0;
+    }
+
+    if (fread(header + 4, 1, 20, reader->file) != 20) {
+        goto invalid;
+    }
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        reader->swapped = false;
+    } else if (swap32(magic) == PCAP_MAGIC_USEC || swap32(magic) == PCAP_MAGIC_NSEC) {
+        reader->swapped = true;
+        magic = swap32(magic);
+    } else {
+        goto invalid;
+    }
+    reader->ts_unit_ns = (magic == PCAP_MAGIC_NSEC) ? 1 : 1000;
+    reader->linktype = file32(reader, header + 20) & 0xffff;
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s is not a pcap or pcapng capture\n", path);
+    fclose(reader->file);
+    reader->file = NULL;
+    return -1;
+}
+
+void pcap_reader_close(pcap_reader_t *reader) {
+    if (reader->file != NULL) {
+        fclose(reader->file);
+        reader->file = NULL;
+    }
+}
+
+/**
+ * @brief Extracts the UDP datagram of a captured packet.
+ * @return true if the packet is an unfragmented IPv4 UDP datagram.
+ */
+static bool decode_packet(uint32_t linktype, const uint8_t *p, size_t len, pcap_datagram_t *datagram) {
+    uint16_t ethertype = 0x0800;
+
+    switch (linktype) {
+        case LINKTYPE_ETHERNET:
+            if (len < 14) {
+                return false;
+            }
+            ethertype = net16(p + 12);
+            p += 14;
+            len -= 14;
+            if (ethertype == 0x8100 && len >= 4) {
+                ethertype = net16(p + 2);
+                p += 4;
+                len -= 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if (len < 16) {
+                return false;
+            }
+            ethertype = net16(p + 14);
+            p += 16;
+            len -= 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if (len < 20) {
+                return false;
+            }
+            ethertype = net16(p);
+            p += 20;
+            len -= 20;
+            break;
+        case LINKTYPE_NULL:
+            // Address family in host byte order of the capturing machine, AF_INET is 2 everywhere
+            if (len < 4 || (p[0] != 2 && p[3] != 2)) {
+                return false;
+            }
+            p += 4;
+            len -= 4;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            break;
+        default:
+            return false;
+    }
+
+    if (ethertype != 0x0800 || len < 20 || (p[0] >> 4) != 4) {
+        return false;
+    }
+    size_t ihl = (size_t)(p[0] & 0x0f) * 4;
+    size_t total = net16(p + 2);
+    uint16_t fragment = net16(p + 6);
+    if (ihl < 20 || total < ihl + 8 || total > len || p[9] != 17 || (fragment & 0x3fff) != 0) {
+        return false;
+    }
+
+    const uint8_t *udp = p + ihl;
+    size_t udp_len = net16(udp + 4);
+    if (udp_len < 8 || udp_len > total - ihl) {
+        return false;
+    }
+
+    memset(&datagram->src, 0, sizeof(datagram->src));
+    memset(&datagram->dst, 0, sizeof(datagram->dst));
+    datagram->src.sin_family = AF_INET;
+    datagram->dst.sin_family = AF_INET;
+    memcpy(&datagram->src.sin_addr, p + 12, 4);
+    memcpy(&datagram->dst.sin_addr, p + 16, 4);
+    memcpy(&datagram->src.sin_port, udp, 2);
+    memcpy(&datagram->dst.sin_port, udp + 2, 2);
+    datagram->payload = (const char *)(udp + 8);
+    datagram->len = udp_len - 8;
+    return true;
+}
+
+/**
+ * @brief Reads the next classic pcap record.
+ * @return 1 on success, 0 at the end of the file, -1 on error.
+ */
+static int read_pcap_record(pcap_reader_t *reader, uint64_t *ts_ns, size_t *len) {
+    uint8_t header[16];
+    size_t n = fread(header, 1, sizeof(header), reader->file);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != sizeof(header)) {
+        return -1;
+    }
+    uint32_t caplen = file32(reader, header + 8);
+    if (caplen > PCAP_MAX_PACKET || fread(reader->buffer, 1, caplen, reader->file) != caplen) {
+        return -1;
+    }
+    *ts_ns = (uint64_t)file32(reader, header) * 1000000000ULL + (uint64_t)file32(reader, header + 4) * reader->ts_unit_ns;
+    *len = caplen;
+    return 1;
+}
+
+/**
+ * @brief Returns the timestamp units per second given by an if_tsresol option value.
+ */
+static uint64_t tsresol_per_sec(uint8_t tsresol) {
+    uint64_t per_sec = 1;
+    uint8_t exponent = tsresol & 0x7f;
+    for (uint8_t i = 0; i < exponent && per_sec < (1ULL << 62); i++) {
+        per_sec *= (tsresol & 0x80) ? 2 : 10;
+    }
+    return per_sec;
+}
+
+/**
+ * @brief Reads pcapng blocks until the next packet block.
+ * @return 1 on success, 0 at the end of the file, -1 on error.
+ */
+static int read_pcapng_packet(pcap_reader_t *reader, uint64_t *ts_ns, size_t *len, uint32_t *linktype) {
+    uint8_t header[8];
+
+    while (1) {
+        size_t n = fread(header, 1, sizeof(header), reader->file);
+        if (n == 0) {
+            return 0;
+        }
+        if (n != sizeof(header)) {
+            return -1;
+        }
+
+        uint32_t type;
+        memcpy(&type, header, sizeof(type));
+        if (type == PCAPNG_SHB) {
+            // A new section, possibly in another byte order, resets the interfaces
+            uint32_t order;
+            if (fread(&order, 1, sizeof(order), reader->file) != sizeof(order)) {
+                return -1;
+            }
+            if (order == PCAPNG_BYTE_ORDER) {
+                reader->swapped = false;
+            } else if (swap32(order) == PCAPNG_BYTE_ORDER) {
+                reader->swapped = true;
+            } else {
+                return -1;
+            }
+            reader->interface_count = 0;
+            uint32_t total = file32(reader, header + 4);
+            if (total < 16 || fseek(reader->file, (long)total - 12, SEEK_CUR) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        type = file32(reader, header);
+        uint32_t total = file32(reader, header + 4);
+        if (total < 12 || total % 4 != 0 || total - 12 > PCAP_MAX_PACKET) {
+            return -1;
+        }
+        size_t body_len = total - 12;
+        if (fread(reader->buffer, 1, body_len + 4, reader->file) != body_len + 4) {
+            return -1;
+        }
+        const uint8_t *body = reader->buffer;
+
+        if (type == PCAPNG_IDB && body_len >= 8) {
+            if (reader->interface_count == PCAP_MAX_INTERFACES) {
+                continue;
+            }
+            int index = reader->interface_count++;
+            reader->if_linktype[index] = file16(reader, body);
+            reader->if_ts_per_sec[index] = 1000000;
+            // Options: look for if_tsresol (code 9)
+            size_t offset = 8;
+            while (offset + 4 <= body_len) {
+                uint16_t code = file16(reader, body + offset);
+                uint16_t option_len = file16(reader, body + offset + 2);
+                if (code == 0 || offset + 4 + option_len > body_len) {
+                    break;
+                }
+                if (code == 9 && option_len >= 1) {
+                    reader->if_ts_per_sec[index] = tsresol_per_sec(body[offset + 4]);
+                }
+                offset += 4 + ((option_len + 3u) & ~3u);
+            }
+        } else if (type == PCAPNG_EPB && body_len >= 20) {
+            uint32_t interface = file32(reader, body);
+            uint32_t caplen = file32(reader, body + 12);
+            if (interface >= (uint32_t)reader->interface_count || caplen > body_len - 20) {
+                return -1;
+            }
+            uint64_t ts = ((uint64_t)file32(reader, body + 4) << 32) | file32(reader, body + 8);
+            uint64_t per_sec = reader->if_ts_per_sec[interface];
+            *ts_ns = (ts / per_sec) * 1000000000ULL + (ts % per_sec) * 1000000000ULL / per_sec;
+            memmove(reader->buffer, body + 20, caplen);
+            *len = caplen;
+            *linktype = reader->if_linktype[interface];
+            return 1;
+        } else if (type == PCAPNG_SPB && body_len >= 4) {
+            if (reader->interface_count == 0) {
+                return -1;
+            }
+            // Simple packet blocks carry no timestamp or captured length
+            uint32_t origlen = file32(reader, body);
+            size_t caplen = origlen < body_len - 4 ? origlen : body_len - 4;
+            *ts_ns = 0;
+            memmove(reader->buffer, body + 4, caplen);
+            *len = caplen;
+            *linktype = reader->if_linktype[0];
+            return 1;
+        }
+        // Other blocks (statistics, name resolution, ...) are skipped
+    }
+}
+
+int pcap_reader_next(pcap_reader_t *reader, pcap_datagram_t *datagram) {
+    uint64_t ts_ns = 0;
+    size_t len = 0;
+    uint32_t linktype = reader->linktype;
+
+    if (reader->file == NULL) {
+        return -1;
+    }
+    while (1) {
+        int ret = reader->pcapng ? read_pcapng_packet(reader, &ts_ns, &len, &linktype)
+                                 : read_pcap_record(reader, &ts_ns, &len);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (decode_packet(linktype, reader->buffer, len, datagram)) {
+            datagram->ts_ns = ts_ns;
+            return 1;
+        }
+        reader->skipped++;
+    }
+}
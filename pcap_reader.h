@@ -0,0 +1,67 @@
+/**
+ * @file pcap_reader.h
+ * @brief Reader for the IPv4/UDP datagrams of pcap and pcapng captures.
+ *
+ * Used by the replay tool (sip_replay.c) to feed captured SIP traffic back into the server.
+ * Both classic pcap (micro- and nanosecond, either byte order) and pcapng (section header,
+ * interface description, enhanced and simple packet blocks) are read. Ethernet (with one
+ * optional VLAN tag), Linux cooked (SLL and SLL2), BSD loopback and raw IPv4 link types are
+ * supported. Everything that is not an unfragmented IPv4 UDP datagram is skipped.
+ */
+
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#define PCAP_MAX_PACKET 65536       // Largest captured packet accepted
+#define PCAP_MAX_INTERFACES 16      // pcapng interfaces tracked per section
+
+/**
+ * @struct pcap_reader_t
+ * @brief State of an open capture file.
+ */
+typedef struct {
+    FILE *file;
+    bool pcapng;
+    bool swapped;                   // File byte order differs from the host's
+    uint32_t linktype;              // Classic pcap link type
+    uint64_t ts_unit_ns;            // Classic pcap timestamp unit (1000 or 1)
+    int interface_count;            // pcapng interfaces of the current section
+    uint32_t if_linktype[PCAP_MAX_INTERFACES];
+    uint64_t if_ts_per_sec[PCAP_MAX_INTERFACES];
+    unsigned long skipped;          // Packets that were not IPv4 UDP datagrams
+    uint8_t buffer[PCAP_MAX_PACKET];
+} pcap_reader_t;
+
+/**
+ * @struct pcap_datagram_t
+ * @brief One UDP datagram of a capture, payload points into the reader's buffer.
+ */
+typedef struct {
+    uint64_t ts_ns;                 // Capture timestamp in nanoseconds
+    struct sockaddr_in src;
+    struct sockaddr_in dst;
+    const char *payload;
+    size_t len;
+} pcap_datagram_t;
+
+/**
+ * @brief Opens a pcap or pcapng file.
+ * @return 0 on success, -1 if the file can't be read or isn't a capture.
+ */
+int pcap_reader_open(pcap_reader_t *reader, const char *path);
+
+/**
+ * @brief Reads the next UDP datagram, skipping other packets.
+ * @return 1 if a datagram was read, 0 at the end of the file, -1 on a malformed file.
+ */
+int pcap_reader_next(pcap_reader_t *reader, pcap_datagram_t *datagram);
+
+void pcap_reader_close(pcap_reader_t *reader);
+
+#endif // PCAP_READER_H
@@ -0,0 +1,190 @@
+/**
+ * @file prefork.c
+ * @brief Implementation of the multi-process worker mode.
+ */
+
+#define _GNU_SOURCE
+#include "prefork.h"
+#include "shared_mem.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void shm_ring_init(shm_ring_t *ring) {
+    ring->size = 0;
+    ring->front = 0;
+    ring->rear = -1;
+    ring->urgent_size = 0;
+    ring->urgent_front = 0;
+    shm_mutex_init(&ring->mutex, true);
+    shm_cond_init(&ring->cond, true);
+}
+
+int shm_ring_push(shm_ring_t *ring, const sip_message_t *message) {
+    shm_mutex_lock(&ring->mutex);
+    if (message->priority && ring->urgent_size < EMERGENCY_QUEUE_CAPACITY) {
+        int slot = (ring->urgent_front + ring->urgent_size) % EMERGENCY_QUEUE_CAPACITY;
+        memcpy(&ring->urgent[slot], message, sizeof(sip_message_t));
+        ring->urgent_size++;
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->mutex);
+        return 1;
+    }
+    if (ring->size == PREFORK_RING_CAPACITY) {
+        pthread_mutex_unlock(&ring->mutex);
+        return 0;
+    }
+
+    ring->rear = (ring->rear + 1) % PREFORK_RING_CAPACITY;
+    memcpy(&ring->slots[ring->rear], message, sizeof(sip_message_t));
+    ring->size++;
+
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+    return 1;
+}
+
+int shm_ring_pop(shm_ring_t *ring, sip_message_t *message) {
+    if (shm_mutex_lock(&ring->mutex) != 0) {
+        return 0;
+    }
+
+    while (ring->size == 0 && ring->urgent_size == 0) {
+        if (shm_cond_wait(&ring->cond, &ring->mutex) != 0) {
+            pthread_mutex_unlock(&ring->mutex);
+            return 0;
+        }
+    }
+
+    if (ring->urgent_size > 0) {
+        memcpy(message, &ring->urgent[ring->urgent_front], sizeof(sip_message_t));
+        ring->urgent_front = (ring->urgent_front + 1) % EMERGENCY_QUEUE_CAPACITY;
+        ring->urgent_size--;
+        pthread_mutex_unlock(&ring->mutex);
+        return 1;
+    }
+
+    memcpy(message, &ring->slots[ring->front], sizeof(sip_message_t));
+    ring->front = (ring->front + 1) % PREFORK_RING_CAPACITY;
+    ring->size--;
+
+    pthread_mutex_unlock(&ring->mutex);
+    return 1;
+}
+
+/**
+ * @brief Main loop of a worker process, never returns.
+ * @param server The server to process the messages with.
+ * @param ring The ring the worker takes its messages from.
+ */
+static void worker_process_main(sip_server_t *server, shm_ring_t *ring) {
+    sip_message_t message;
+
+    signal(SIGCHLD, SIG_DFL);
+    while (1) {
+        if (shm_ring_pop(ring, &message)) {
+            process_sip_message(server, &message);
+            complete_message(server, &message);
+            fflush(stdout);
+        }
+    }
+}
+
+/**
+ * @brief Forks the worker process for one ring.
+ * @return The pid of the worker, or -1 on failure.
+ */
+static pid_t spawn_worker(prefork_segment_t *segment, int index) {
+    // Don't let the child inherit and print our pending output a second time
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork worker process");
+        return -1;
+    }
+    if (pid == 0) {
+        worker_process_main(segment->server, &segment->rings[index]);
+        _exit(EXIT_FAILURE);
+    }
+    segment->workers[index] = pid;
+    printf("Worker process %d started with pid %d\n", index, (int)pid);
+    return pid;
+}
+
+prefork_segment_t *prefork_start(sip_server_t *server, int workers) {
+    if (workers < 1 || workers > MAX_THREADS) {
+        workers = MAX_THREADS;
+    }
+
+    prefork_segment_t *segment = shm_segment_create(sizeof(prefork_segment_t));
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    sip_store_init(&segment->store, true);
+    segment->server = server;
+    server->store = &segment->store;
+    segment->worker_count = workers;
+    for (int i = 0; i < workers; i++) {
+        shm_ring_init(&segment->rings[i]);
+    }
+    for (int i = 0; i < workers; i++) {
+        if (spawn_worker(segment, i) < 0) {
+            prefork_stop(segment);
+            return NULL;
+        }
+    }
+    return segment;
+}
+
+int prefork_dispatch(prefork_segment_t *segment, sip_message_t *message) {
+    int index = message_worker_index(message, segment->worker_count);
+    return shm_ring_push(&segment->rings[index], message);
+}
+
+int prefork_reap(prefork_segment_t *segment) {
+    int respawned = 0;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < segment->worker_count; i++) {
+            if (segment->workers[i] != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Worker process %d (pid %d) killed by signal %d, respawning\n", i, (int)pid, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "Worker process %d (pid %d) exited with status %d, respawning\n", i, (int)pid, WEXITSTATUS(status));
+            }
+            segment->workers[i] = 0;
+            if (spawn_worker(segment, i) > 0) {
+                respawned++;
+            }
+        }
+    }
+    return respawned;
+}
+
+void prefork_stop(prefork_segment_t *segment) {
+    if (segment == NULL) {
+        return;
+    }
+    for (int i = 0; i < segment->worker_count; i++) {
+        if (segment->workers[i] > 0) {
+            kill(segment->workers[i], SIGTERM);
+            waitpid(segment->workers[i], NULL, 0);
+            segment->workers[i] = 0;
+        }
+    }
+    if (segment->server != NULL && segment->server->store == &segment->store) {
+        segment->server->store = &segment->server->local_store;
+    }
+    shm_segment_destroy(segment, sizeof(prefork_segment_t));
+}
@@ -0,0 +1,89 @@
+/**
+ * @file prefork.h
+ * @brief Optional multi-process worker mode.
+ *
+ * In prefork mode the workers are processes instead of threads, so a crash in one handler
+ * only loses the message it was processing. The call table, location store and duplicate
+ * filter (sip_store_t) live in an anonymous shared memory segment mapped before forking,
+ * and the receive process hands datagrams to the workers through rings of fixed-size
+ * message slots in the same segment. A dead worker is respawned on its ring.
+ */
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <sys/types.h>
+#include "sip_server.h"
+
+#ifndef PREFORK_RING_CAPACITY
+#define PREFORK_RING_CAPACITY 64    // Message slots per worker ring
+#endif
+
+/**
+ * @struct shm_ring_t
+ * @brief Process-shared message ring, messages are copied in and out.
+ */
+typedef struct {
+    sip_message_t slots[PREFORK_RING_CAPACITY];
+    int size;
+    int front;
+    int rear;
+    sip_message_t urgent[EMERGENCY_QUEUE_CAPACITY];    // Priority messages, popped before the others
+    int urgent_size;
+    int urgent_front;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} shm_ring_t;
+
+/**
+ * @struct prefork_segment_t
+ * @brief Layout of the shared memory segment.
+ */
+typedef struct {
+    sip_store_t store;
+    shm_ring_t rings[MAX_THREADS];
+    pid_t workers[MAX_THREADS];
+    int worker_count;
+    sip_server_t *server;           // Server the workers process messages with
+} prefork_segment_t;
+
+void shm_ring_init(shm_ring_t *ring);
+
+/**
+ * @brief Copies a message into a ring, a priority message into its urgent slots if one is free.
+ * @return 1 on success, 0 if the ring is full.
+ */
+int shm_ring_push(shm_ring_t *ring, const sip_message_t *message);
+
+/**
+ * @brief Copies the oldest priority message, or else the oldest message, out of a ring, waiting until one is available.
+ * @return 1 on success, 0 on error.
+ */
+int shm_ring_pop(shm_ring_t *ring, sip_message_t *message);
+
+/**
+ * @brief Creates the shared segment, selects its store for the server and forks the worker processes.
+ * @param server The server, its store is switched to the segment's until prefork_stop().
+ * @param workers The number of worker processes, at most MAX_THREADS.
+ * @return The segment, or NULL on failure.
+ */
+prefork_segment_t *prefork_start(sip_server_t *server, int workers);
+
+/**
+ * @brief Hands a received message to its worker process.
+ * @return 1 on success, 0 if the worker's ring is full.
+ */
+int prefork_dispatch(prefork_segment_t *segment, sip_message_t *message);
+
+/**
+ * @brief Reaps dead worker processes and respawns them on their rings.
+ * @return The number of respawned workers.
+ */
+int prefork_reap(prefork_segment_t *segment);
+
+/**
+ * @brief Terminates the worker processes, restores the server's local store and unmaps the segment.
+ */
+void prefork_stop(prefork_segment_t *segment);
+
+#endif // PREFORK_H
@@ -0,0 +1,101 @@
+/**
+ * @file shared_mem.c
+ * @brief Implementation of the shared memory segment and process-shared lock helpers.
+ */
+
+#define _GNU_SOURCE
+#include "shared_mem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void *shm_segment_create(size_t size) {
+    void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        perror("Shared memory mmap failed");
+        return NULL;
+    }
+    memset(segment, 0, size);
+    return segment;
+}
+
+void shm_segment_destroy(void *segment, size_t size) {
+    if (segment != NULL) {
+        munmap(segment, size);
+    }
+}
+
+void shm_mutex_init(pthread_mutex_t *mutex, bool process_shared) {
+    if (!process_shared) {
+        pthread_mutex_init(mutex, NULL);
+        return;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void shm_cond_init(pthread_cond_t *cond, bool process_shared) {
+    if (!process_shared) {
+        pthread_cond_init(cond, NULL);
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int shm_mutex_lock(pthread_mutex_t *mutex) {
+    int ret = pthread_mutex_lock(mutex);
+    if (ret == EOWNERDEAD) {
+        // The previous owner crashed, the protected data is left as it was
+        fprintf(stderr, "Recovered mutex held by a dead worker process\n");
+        pthread_mutex_consistent(mutex);
+        ret = 0;
+    }
+    return ret;
+}
+
+int shm_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret == EOWNERDEAD) {
+        fprintf(stderr, "Recovered mutex held by a dead worker process\n");
+        pthread_mutex_consistent(mutex);
+        ret = 0;
+    }
+    return ret;
+}
+
+void shm_seqlock_init(shm_seqlock_t *lock) {
+    atomic_init(&lock->sequence, 0);
+}
+
+void shm_seqlock_write(shm_seqlock_t *lock, void *data, const void *value, size_t size) {
+    atomic_fetch_add_explicit(&lock->sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(data, value, size);
+    atomic_fetch_add_explicit(&lock->sequence, 1, memory_order_release);
+}
+
+void shm_seqlock_read(shm_seqlock_t *lock, void *value, const void *data, size_t size) {
+    unsigned int start;
+    do {
+        start = shm_seqlock_read_begin(lock);
+        memcpy(value, data, size);
+    } while (shm_seqlock_read_retry(lock, start));
+}
+
+unsigned int shm_seqlock_read_begin(shm_seqlock_t *lock) {
+    return atomic_load_explicit(&lock->sequence, memory_order_acquire);
+}
+
+bool shm_seqlock_read_retry(shm_seqlock_t *lock, unsigned int start) {
+    atomic_thread_fence(memory_order_acquire);
+    return (start & 1) != 0 || atomic_load_explicit(&lock->sequence, memory_order_relaxed) != start;
+}
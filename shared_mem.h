@@ -0,0 +1,98 @@
+/**
+ * @file shared_mem.h
+ * @brief Shared memory segment and process-shared lock helpers.
+ *
+ * State that lives in a shared segment is accessed by several worker processes, so its
+ * mutexes must be process-shared, and robust: a worker that crashes while holding a lock
+ * must not stall the surviving workers.
+ */
+
+#ifndef SHARED_MEM_H
+#define SHARED_MEM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @struct shm_seqlock_t
+ * @brief Sequence lock guarding data that is read often and without stalling its writer.
+ *
+ * The writer makes the sequence odd while it updates the data. A reader copies the data and
+ * copies again if the sequence was odd or moved meanwhile, so readers never block the writer,
+ * and an admin inspecting the state never stalls the workers. Writers must be serialised by
+ * the caller, e.g. by a mutex they hold anyway. The sequence is a lock-free atomic, so a seqlock
+ * works in a shared segment too.
+ */
+typedef struct {
+    atomic_uint sequence;
+} shm_seqlock_t;
+
+/**
+ * @brief Maps an anonymous shared memory segment that is inherited by forked children.
+ * @param size The size of the segment in bytes.
+ * @return The zeroed segment, or NULL on failure.
+ */
+void *shm_segment_create(size_t size);
+
+/**
+ * @brief Unmaps a segment created by shm_segment_create().
+ */
+void shm_segment_destroy(void *segment, size_t size);
+
+/**
+ * @brief Initializes a mutex, process-shared and robust if requested.
+ * @param mutex The mutex to initialize.
+ * @param process_shared true if the mutex lives in a shared segment.
+ */
+void shm_mutex_init(pthread_mutex_t *mutex, bool process_shared);
+
+/**
+ * @brief Initializes a condition variable, process-shared if requested.
+ */
+void shm_cond_init(pthread_cond_t *cond, bool process_shared);
+
+/**
+ * @brief Locks a mutex, recovering it if the previous owner died while holding it.
+ * @return 0 on success, an error number otherwise.
+ */
+int shm_mutex_lock(pthread_mutex_t *mutex);
+
+/**
+ * @brief Waits on a condition variable, recovering the mutex if its owner died.
+ * @return 0 on success, an error number otherwise.
+ */
+int shm_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+/**
+ * @brief Initializes a seqlock.
+ */
+void shm_seqlock_init(shm_seqlock_t *lock);
+
+/**
+ * @brief Copies size bytes from value into the data a seqlock guards.
+ * @param data The guarded data.
+ */
+void shm_seqlock_write(shm_seqlock_t *lock, void *data, const void *value, size_t size);
+
+/**
+ * @brief Copies size bytes of the data a seqlock guards into value, as left by one write.
+ * @param data The guarded data.
+ */
+void shm_seqlock_read(shm_seqlock_t *lock, void *value, const void *data, size_t size);
+
+/**
+ * @brief Starts reading a few fields of the data a seqlock guards in place, when copying it all
+ * would cost more than the read.
+ * @return The sequence to give to shm_seqlock_read_retry().
+ */
+unsigned int shm_seqlock_read_begin(shm_seqlock_t *lock);
+
+/**
+ * @brief Ends a read started by shm_seqlock_read_begin().
+ * @return true if a write overlapped the read, which must be done again.
+ */
+bool shm_seqlock_read_retry(shm_seqlock_t *lock, unsigned int start);
+
+#endif // SHARED_MEM_H
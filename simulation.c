@@ -0,0 +1,694 @@
+/**
+ * @file simulation.c
+ * @brief Implementation of the deterministic call and registration simulation.
+ */
+
+#include "simulation.h"
+#include "sip_server.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_WINDOW 8192                 // Calls (and registrations) tracked at once, must be a power of two
+#define SIM_T1_MS 500                   // UA retransmission interval, doubled up to SIM_T2_MS
+#define SIM_T2_MS 4000
+#define SIM_MAX_SENDS 7                 // Transmissions of a request (or 200 OK) before a UA gives up
+#define SIM_RING_MS 50                  // Time from INVITE to the callee's 180 (or 486)
+#define SIM_CANCEL_MS 500               // Time from 180 to the caller's CANCEL
+#define SIM_DRAIN_MS (CALL_RINGING_TIMEOUT_MS + 2 * CALL_TRANSACTION_TIMEOUT_MS)
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+// Event types
+enum { EV_CALL_ARRIVAL, EV_REGISTER_ARRIVAL, EV_TO_SERVER, EV_TO_UA, EV_UA_TIMER };
+
+// Simulated UAs
+enum { UA_CALLER, UA_CALLEE, UA_REGISTRANT };
+
+// Messages
+enum { MSG_NONE, MSG_INVITE, MSG_ACK, MSG_BYE, MSG_CANCEL, MSG_REGISTER, MSG_RESPONSE };
+
+// UA timers
+enum { TIMER_INVITE, TIMER_CANCEL_START, TIMER_CANCEL, TIMER_HANGUP, TIMER_BYE, TIMER_RING, TIMER_ANSWER, TIMER_OK, TIMER_REGISTER };
+
+// Callee behaviours
+enum { SCENARIO_ANSWER, SCENARIO_BUSY, SCENARIO_NO_ANSWER, SCENARIO_CANCEL };
+
+static const char *method_names[] = { "", "INVITE", "ACK", "BYE", "CANCEL", "REGISTER", "" };
+
+typedef struct {
+    uint64_t at;            // Virtual time the event happens
+    uint64_t seq;           // Tie breaker, events at the same time happen in scheduling order
+    unsigned long id;       // Call or registration number
+    uint32_t cseq;          // CSeq number of the message
+    uint16_t code;          // Status code of a response
+    uint8_t type;
+    uint8_t ua;
+    uint8_t msg;            // Message, or UA timer
+    uint8_t method;         // CSeq method of a response, or attempt number of a UA timer
+} sim_event_t;
+
+typedef struct {
+    unsigned long id;
+    bool in_use;
+    uint8_t scenario;
+    // Caller
+    bool provisional;       // Got a 1xx for the INVITE
+    bool final;             // Got a final response for the INVITE
+    bool cancel_started;
+    bool cancel_done;
+    bool hangup_started;
+    bool bye_done;
+    // Callee
+    bool invited;
+    bool acked;
+    uint16_t callee_final;  // Final response sent by the callee, 0 if none yet
+    uint32_t invite_cseq;   // CSeq number of the server's INVITE
+} sim_call_t;
+
+typedef struct {
+    unsigned long id;
+    bool in_use;
+    bool done;
+} sim_registration_t;
+
+typedef struct {
+    sim_config_t config;
+    sim_result_t *result;
+    sip_server_t server;
+    sip_message_t message;          // Rendering buffer for datagrams to the server
+    uint64_t now;
+    uint64_t rng;
+    uint64_t next_seq;
+    sim_event_t *heap;
+    size_t heap_size;
+    size_t heap_capacity;
+    bool out_of_memory;
+    sim_call_t calls[SIM_WINDOW];
+    sim_registration_t registrations[SIM_WINDOW];
+} sim_t;
+
+void sim_config_defaults(sim_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->seed = 1;
+    config->calls = 1000;
+    config->registrations = 100;
+    config->call_interval_ms = 500;
+    config->register_interval_ms = 1000;
+    config->answer_ms = 1000;
+    config->hold_ms = 2000;
+    config->delay_min_ms = 5;
+    config->delay_max_ms = 50;
+    config->loss = 0.01;
+    config->busy = 0.05;
+    config->no_answer = 0.01;
+    config->cancel = 0.05;
+}
+
+/**
+ * @brief splitmix64, small and good enough for traffic decisions.
+ */
+static uint64_t sim_random(sim_t *sim) {
+    uint64_t z = (sim->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double sim_uniform(sim_t *sim) {
+    return (double)(sim_random(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sim_clock_ms(void *user_data) {
+    return ((sim_t *)user_data)->now;
+}
+
+static bool event_before(const sim_event_t *a, const sim_event_t *b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void schedule(sim_t *sim, sim_event_t event, uint64_t at) {
+    if (sim->heap_size == sim->heap_capacity) {
+        size_t capacity = sim->heap_capacity ? sim->heap_capacity * 2 : 1024;
+        sim_event_t *heap = realloc(sim->heap, capacity * sizeof(sim_event_t));
+        if (heap == NULL) {
+            sim->out_of_memory = true;
+            return;
+        }
+        sim->heap = heap;
+        sim->heap_capacity = capacity;
+    }
+    event.at = at;
+    event.seq = sim->next_seq++;
+    size_t i = sim->heap_size++;
+    while (i > 0 && event_before(&event, &sim->heap[(i - 1) / 2])) {
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->heap[i] = event;
+}
+
+static sim_event_t pop_event(sim_t *sim) {
+    sim_event_t top = sim->heap[0];
+    sim_event_t last = sim->heap[--sim->heap_size];
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= sim->heap_size) {
+            break;
+        }
+        if (child + 1 < sim->heap_size && event_before(&sim->heap[child + 1], &sim->heap[child])) {
+            child++;
+        }
+        if (!event_before(&sim->heap[child], &last)) {
+            break;
+        }
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+    if (sim->heap_size > 0) {
+        sim->heap[i] = last;
+    }
+    return top;
+}
+
+/**
+ * @brief Puts a datagram on the simulated network: lost, or delivered after a random delay.
+ */
+static void transmit(sim_t *sim, sim_event_t event) {
+    sim->result->datagrams++;
+    if (sim_uniform(sim) < sim->config.loss) {
+        sim->result->datagrams_lost++;
+        return;
+    }
+    uint32_t spread = sim->config.delay_max_ms - sim->config.delay_min_ms;
+    uint64_t delay = sim->config.delay_min_ms + (spread ? sim_random(sim) % (spread + 1) : 0);
+    schedule(sim, event, sim->now + delay);
+}
+
+static void ua_send(sim_t *sim, uint8_t ua, unsigned long id, uint8_t msg, uint16_t code, uint8_t method, uint32_t cseq) {
+    sim_event_t event = { .type = EV_TO_SERVER, .ua = ua, .id = id, .msg = msg, .code = code, .method = method, .cseq = cseq };
+    transmit(sim, event);
+}
+
+static void ua_timer(sim_t *sim, uint8_t ua, unsigned long id, uint8_t timer, uint8_t attempt, uint64_t delay) {
+    sim_event_t event = { .type = EV_UA_TIMER, .ua = ua, .id = id, .msg = timer, .method = attempt };
+    schedule(sim, event, sim->now + delay);
+}
+
+static uint64_t retransmit_interval(uint8_t attempt) {
+    uint64_t interval = (uint64_t)SIM_T1_MS << (attempt > 3 ? 3 : attempt);
+    return interval < SIM_T2_MS ? interval : SIM_T2_MS;
+}
+
+static sim_call_t *call_for(sim_t *sim, unsigned long id) {
+    sim_call_t *call = &sim->calls[id & (SIM_WINDOW - 1)];
+    return (call->in_use && call->id == id) ? call : NULL;
+}
+
+static sim_registration_t *registration_for(sim_t *sim, unsigned long id) {
+    sim_registration_t *registration = &sim->registrations[id & (SIM_WINDOW - 1)];
+    return (registration->in_use && registration->id == id) ? registration : NULL;
+}
+
+static void retire_call(sim_t *sim, sim_call_t *call) {
+    if (call->in_use && !call->final) {
+        sim->result->calls_unresolved++;
+    }
+    call->in_use = false;
+}
+
+static void retire_registration(sim_t *sim, sim_registration_t *registration) {
+    if (registration->in_use && !registration->done) {
+        sim->result->registrations_failed++;
+    }
+    registration->in_use = false;
+}
+
+/**
+ * @brief The simulated transport: parses what the server sent and puts it on the network.
+ */
+static void sim_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port) {
+    (void)destination;
+    (void)port;
+    sim_t *sim = user_data;
+    const char *buffer = message->buffer;
+    sim_event_t event = { .type = EV_TO_UA };
+
+    if (strncmp(buffer, "SIP/2.0 ", 8) == 0) {
+        event.msg = MSG_RESPONSE;
+        event.code = (uint16_t)atoi(buffer + 8);
+    } else {
+        for (uint8_t m = MSG_INVITE; m <= MSG_REGISTER; m++) {
+            size_t len = strlen(method_names[m]);
+            if (strncmp(buffer, method_names[m], len) == 0 && buffer[len] == ' ') {
+                event.msg = m;
+            }
+        }
+    }
+
+    // The Call-ID tells which UA the datagram is for
+    const char *call_id = strstr(buffer, "Call-ID: ");
+    const char *cseq = strstr(buffer, "CSeq: ");
+    if (event.msg == MSG_NONE || call_id == NULL || cseq == NULL) {
+        return;
+    }
+    call_id += strlen("Call-ID: ");
+    if (strncmp(call_id, "simc-", 5) == 0) {
+        event.ua = UA_CALLER;
+    } else if (strncmp(call_id, "b-leg", 5) == 0) {
+        event.ua = UA_CALLEE;
+    } else if (strncmp(call_id, "simr-", 5) == 0) {
+        event.ua = UA_REGISTRANT;
+    } else {
+        return;
+    }
+    event.id = strtoul(call_id + 5, NULL, 10);
+
+    char *end;
+    event.cseq = (uint32_t)strtoul(cseq + strlen("CSeq: "), &end, 10);
+    while (*end == ' ') {
+        end++;
+    }
+    for (uint8_t m = MSG_INVITE; m <= MSG_REGISTER; m++) {
+        size_t len = strlen(method_names[m]);
+        if (strncmp(end, method_names[m], len) == 0) {
+            event.method = m;
+        }
+    }
+    transmit(sim, event);
+}
+
+static const char *reason_phrase(uint16_t code) {
+    switch (code) {
+        case 180: return "Ringing";
+        case 200: return "OK";
+        case 486: return "Busy Here";
+        case 487: return "Request Terminated";
+        default: return "Unknown";
+    }
+}
+
+static const char *sdp_body =
+    "v=0\r\n"
+    "o=- 0 0 IN IP4 10.1.0.1\r\n"
+    "s=-\r\n"
+    "c=IN IP4 10.1.0.1\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n";
+
+/**
+ * @brief Renders a datagram from a simulated UA into sim->message.
+ */
+static void render(sim_t *sim, const sim_event_t *event) {
+    sip_message_t *message = &sim->message;
+    char ip[INET_ADDRSTRLEN];
+    unsigned long id = event->id;
+    // Every caller and registrant gets its own address, the callees share one
+    int port = 5060;
+    if (event->ua == UA_CALLEE) {
+        snprintf(ip, sizeof(ip), "10.2.0.1");
+        port = 5070;
+    } else {
+        snprintf(ip, sizeof(ip), "10.%d.%lu.%lu", event->ua == UA_CALLER ? 1 : 3, (id >> 8) & 0xff, id & 0xff);
+    }
+
+    memset(&message->client_addr, 0, sizeof(message->client_addr));
+    message->client_addr.sin_family = AF_INET;
+    message->client_addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &message->client_addr.sin_addr);
+    message->client_addr_len = sizeof(message->client_addr);
+    message->dedup_hash = 0;
+    message->call_hash = 0;
+
+    if (event->ua == UA_CALLER) {
+        bool sdp = event->msg == MSG_INVITE;
+        snprintf(message->buffer, BUFFER_SIZE,
+                 "%s sip:1002@sim.invalid SIP/2.0\r\n"
+                 "Via: SIP/2.0/UDP %s:%d;rport;branch=z9hG4bKsim%lu-%u\r\n"
+                 "Max-Forwards: 70\r\n"
+                 "From: <sip:1001@sim.invalid>;tag=a%lu\r\n"
+                 "To: <sip:1002@sim.invalid>\r\n"
+                 "Call-ID: simc-%lu@sim.invalid\r\n"
+                 "CSeq: %u %s\r\n"
+                 "Contact: <sip:1001@%s:%d>\r\n"
+                 "%s"
+                 "Content-Length: %zu\r\n\r\n%s",
+                 method_names[event->msg], ip, port, id, event->cseq, id, id, event->cseq, method_names[event->msg],
+                 ip, port, sdp ? "Content-Type: application/sdp\r\n" : "",
+                 sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    } else if (event->ua == UA_CALLEE) {
+        bool sdp = event->code == 200 && event->method == MSG_INVITE;
+        snprintf(message->buffer, BUFFER_SIZE,
+                 "SIP/2.0 %u %s\r\n"
+                 "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bKsim\r\n"
+                 "From: <sip:1001@sim.invalid>;tag=a%lu\r\n"
+                 "To: <sip:1002@sim.invalid>;tag=b%lu\r\n"
+                 "Call-ID: b-leg%lu@sim.invalid\r\n"
+                 "CSeq: %u %s\r\n"
+                 "Contact: <sip:1002@%s:%d>\r\n"
+                 "%s"
+                 "Content-Length: %zu\r\n\r\n%s",
+                 event->code, reason_phrase(event->code), ip, port, id, id, id, event->cseq, method_names[event->method],
+                 ip, port, sdp ? "Content-Type: application/sdp\r\n" : "",
+                 sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    } else {
+        unsigned long user = 1001 + id % 8;
+        snprintf(message->buffer, BUFFER_SIZE,
+                 "REGISTER sip:sim.invalid SIP/2.0\r\n"
+                 "Via: SIP/2.0/UDP %s:%d;rport;branch=z9hG4bKsimr%lu\r\n"
+                 "Max-Forwards: 70\r\n"
+                 "From: <sip:%lu@sim.invalid>;tag=r%lu\r\n"
+                 "To: <sip:%lu@sim.invalid>\r\n"
+                 "Call-ID: simr-%lu@sim.invalid\r\n"
+                 "CSeq: %u REGISTER\r\n"
+                 "Contact: <sip:%lu@%s:%d>\r\n"
+                 "Content-Length: 0\r\n\r\n",
+                 ip, port, id, user, id, user, id, event->cseq, user, ip, port);
+    }
+}
+
+static void start_call(sim_t *sim, unsigned long id) {
+    sim_call_t *call = &sim->calls[id & (SIM_WINDOW - 1)];
+    retire_call(sim, call);
+    memset(call, 0, sizeof(*call));
+    call->id = id;
+    call->in_use = true;
+
+    double u = sim_uniform(sim);
+    if (u < sim->config.busy) {
+        call->scenario = SCENARIO_BUSY;
+    } else if (u < sim->config.busy + sim->config.no_answer) {
+        call->scenario = SCENARIO_NO_ANSWER;
+    } else if (u < sim->config.busy + sim->config.no_answer + sim->config.cancel) {
+        call->scenario = SCENARIO_CANCEL;
+    } else {
+        call->scenario = SCENARIO_ANSWER;
+    }
+    ua_send(sim, UA_CALLER, id, MSG_INVITE, 0, 0, 1);
+    ua_timer(sim, UA_CALLER, id, TIMER_INVITE, 1, retransmit_interval(0));
+}
+
+static void start_registration(sim_t *sim, unsigned long id) {
+    sim_registration_t *registration = &sim->registrations[id & (SIM_WINDOW - 1)];
+    retire_registration(sim, registration);
+    registration->id = id;
+    registration->in_use = true;
+    registration->done = false;
+    ua_send(sim, UA_REGISTRANT, id, MSG_REGISTER, 0, 0, 1);
+    ua_timer(sim, UA_REGISTRANT, id, TIMER_REGISTER, 1, retransmit_interval(0));
+}
+
+static void caller_receive(sim_t *sim, sim_call_t *call, const sim_event_t *event) {
+    if (event->msg != MSG_RESPONSE) {
+        // The server only sends the caller requests when the callee hangs up, which it never does here
+        return;
+    }
+    if (event->method == MSG_CANCEL) {
+        call->cancel_done = true;
+    } else if (event->method == MSG_BYE) {
+        call->bye_done = true;
+    } else if (event->method == MSG_INVITE) {
+        if (event->code < 200) {
+            call->provisional = true;
+            if (call->scenario == SCENARIO_CANCEL && event->code == 180 && !call->cancel_started) {
+                call->cancel_started = true;
+                ua_timer(sim, UA_CALLER, call->id, TIMER_CANCEL_START, 0, SIM_CANCEL_MS);
+            }
+            return;
+        }
+        if (!call->final) {
+            call->final = true;
+            switch (event->code) {
+                case 200: sim->result->calls_answered++; break;
+                case 486: sim->result->calls_busy++; break;
+                case 487: sim->result->calls_cancelled++; break;
+                case 408: sim->result->calls_timed_out++; break;
+                default: sim->result->calls_failed++; break;
+            }
+        }
+        if (event->code == 200) {
+            // Every 200 OK, retransmissions included, is acknowledged
+            ua_send(sim, UA_CALLER, call->id, MSG_ACK, 0, 0, 1);
+            if (!call->hangup_started) {
+                call->hangup_started = true;
+                ua_timer(sim, UA_CALLER, call->id, TIMER_HANGUP, 0, sim->config.hold_ms);
+            }
+        }
+    }
+}
+
+static void callee_receive(sim_t *sim, sim_call_t *call, const sim_event_t *event) {
+    switch (event->msg) {
+        case MSG_INVITE:
+            if (!call->invited) {
+                call->invited = true;
+                call->invite_cseq = event->cseq;
+                ua_timer(sim, UA_CALLEE, call->id, TIMER_RING, 0, SIM_RING_MS);
+                if (call->scenario == SCENARIO_ANSWER) {
+                    ua_timer(sim, UA_CALLEE, call->id, TIMER_ANSWER, 0, sim->config.answer_ms);
+                }
+            }
+            break;
+        case MSG_ACK:
+            call->acked = true;
+            break;
+        case MSG_CANCEL:
+            ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 200, MSG_CANCEL, event->cseq);
+            if (call->callee_final == 0) {
+                call->callee_final = 487;
+                ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 487, MSG_INVITE, call->invite_cseq);
+            }
+            break;
+        case MSG_BYE:
+            ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 200, MSG_BYE, event->cseq);
+            break;
+        default:
+            break;
+    }
+}
+
+static void caller_timer(sim_t *sim, sim_call_t *call, uint8_t timer, uint8_t attempt) {
+    uint8_t msg = MSG_NONE;
+    uint32_t cseq = 1;
+    bool done = true;
+    switch (timer) {
+        case TIMER_INVITE:
+            msg = MSG_INVITE;
+            done = call->provisional || call->final;
+            break;
+        case TIMER_CANCEL_START:
+        case TIMER_CANCEL:
+            msg = MSG_CANCEL;
+            done = call->cancel_done || (timer == TIMER_CANCEL_START && call->final);
+            break;
+        case TIMER_HANGUP:
+        case TIMER_BYE:
+            msg = MSG_BYE;
+            cseq = 2;
+            done = call->bye_done;
+            break;
+        default:
+            return;
+    }
+    if (done || attempt >= SIM_MAX_SENDS) {
+        return;
+    }
+    if (timer == TIMER_INVITE || timer == TIMER_CANCEL || timer == TIMER_BYE) {
+        sim->result->retransmissions++;
+    }
+    ua_send(sim, UA_CALLER, call->id, msg, 0, 0, cseq);
+    uint8_t next = timer == TIMER_CANCEL_START ? TIMER_CANCEL : timer == TIMER_HANGUP ? TIMER_BYE : timer;
+    ua_timer(sim, UA_CALLER, call->id, next, attempt + 1, retransmit_interval(attempt));
+}
+
+static void callee_timer(sim_t *sim, sim_call_t *call, uint8_t timer, uint8_t attempt) {
+    switch (timer) {
+        case TIMER_RING:
+            if (call->scenario == SCENARIO_BUSY) {
+                call->callee_final = 486;
+                ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 486, MSG_INVITE, call->invite_cseq);
+            } else if (call->callee_final == 0) {
+                ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 180, MSG_INVITE, call->invite_cseq);
+            }
+            break;
+        case TIMER_ANSWER:
+        case TIMER_OK:
+            if (timer == TIMER_ANSWER) {
+                if (call->callee_final != 0) {
+                    return;
+                }
+                call->callee_final = 200;
+            } else if (call->acked || attempt >= SIM_MAX_SENDS) {
+                return;
+            } else {
+                sim->result->retransmissions++;
+            }
+            // The 200 OK is resent until the ACK arrives
+            ua_send(sim, UA_CALLEE, call->id, MSG_RESPONSE, 200, MSG_INVITE, call->invite_cseq);
+            ua_timer(sim, UA_CALLEE, call->id, TIMER_OK, attempt + 1, retransmit_interval(attempt));
+            break;
+        default:
+            break;
+    }
+}
+
+static void handle_event(sim_t *sim, const sim_event_t *event) {
+    switch (event->type) {
+        case EV_CALL_ARRIVAL:
+            start_call(sim, event->id);
+            if (event->id + 1 < sim->config.calls) {
+                sim_event_t next = { .type = EV_CALL_ARRIVAL, .id = event->id + 1 };
+                schedule(sim, next, sim->now + sim->config.call_interval_ms);
+            }
+            break;
+        case EV_REGISTER_ARRIVAL:
+            start_registration(sim, event->id);
+            if (event->id + 1 < sim->config.registrations) {
+                sim_event_t next = { .type = EV_REGISTER_ARRIVAL, .id = event->id + 1 };
+                schedule(sim, next, sim->now + sim->config.register_interval_ms);
+            }
+            break;
+        case EV_TO_SERVER:
+            render(sim, event);
+            process_sip_message(&sim->server, &sim->message);
+            break;
+        case EV_TO_UA:
+        case EV_UA_TIMER:
+            if (event->ua == UA_REGISTRANT) {
+                sim_registration_t *registration = registration_for(sim, event->id);
+                if (registration == NULL || registration->done) {
+                    break;
+                }
+                if (event->type == EV_TO_UA && event->msg == MSG_RESPONSE && event->code >= 200) {
+                    registration->done = true;
+                    if (event->code == 200) {
+                        sim->result->registrations_ok++;
+                    } else {
+                        sim->result->registrations_failed++;
+                    }
+                } else if (event->type == EV_UA_TIMER && event->method < SIM_MAX_SENDS) {
+                    sim->result->retransmissions++;
+                    ua_send(sim, UA_REGISTRANT, event->id, MSG_REGISTER, 0, 0, 1);
+                    ua_timer(sim, UA_REGISTRANT, event->id, TIMER_REGISTER, event->method + 1, retransmit_interval(event->method));
+                }
+                break;
+            }
+            sim_call_t *call = call_for(sim, event->id);
+            if (call == NULL) {
+                break;
+            }
+            if (event->type == EV_TO_UA) {
+                if (event->ua == UA_CALLER) {
+                    caller_receive(sim, call, event);
+                } else {
+                    callee_receive(sim, call, event);
+                }
+            } else if (event->ua == UA_CALLER) {
+                caller_timer(sim, call, event->msg, event->method);
+            } else {
+                callee_timer(sim, call, event->msg, event->method);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static uint64_t digest_add(uint64_t digest, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        digest ^= (value >> (i * 8)) & 0xff;
+        digest *= FNV_PRIME;
+    }
+    return digest;
+}
+
+int sim_run(const sim_config_t *config, sim_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    sim_t *sim = calloc(1, sizeof(sim_t));
+    if (sim == NULL) {
+        return -1;
+    }
+    sim->config = *config;
+    if (sim->config.delay_max_ms < sim->config.delay_min_ms) {
+        sim->config.delay_max_ms = sim->config.delay_min_ms;
+    }
+    sim->result = result;
+    result->digest = FNV_OFFSET_BASIS;
+
+    // Hash the same on every run of this seed, the tables' layout is part of the run
+    sim->rng = config->seed;
+    uint8_t hash_key[SIP_HASH_KEY_SIZE];
+    for (size_t i = 0; i < sizeof(hash_key); i += sizeof(uint64_t)) {
+        uint64_t word = sim_random(sim);
+        memcpy(hash_key + i, &word, sizeof(word));
+    }
+    sip_hash_set_key(hash_key);
+    sim->rng = config->seed;
+
+    const sip_transport_t transport = { .send = sim_transport_send, .user_data = sim };
+    sip_server_init(&sim->server, &transport);
+    sim->server.clock = (sip_clock_t){ .now_ms = sim_clock_ms, .user_data = sim };
+    sip_timer_wheel_t *timers = &sim->server.store->timers;
+
+    if (config->calls > 0) {
+        schedule(sim, (sim_event_t){ .type = EV_CALL_ARRIVAL, .id = 0 }, 0);
+    }
+    if (config->registrations > 0) {
+        schedule(sim, (sim_event_t){ .type = EV_REGISTER_ARRIVAL, .id = 0 }, 0);
+    }
+    uint64_t last_arrival = 0;
+    if (config->calls > 0) {
+        last_arrival = (uint64_t)(config->calls - 1) * config->call_interval_ms;
+    }
+    if (config->registrations > 0 && (uint64_t)(config->registrations - 1) * config->register_interval_ms > last_arrival) {
+        last_arrival = (uint64_t)(config->registrations - 1) * config->register_interval_ms;
+    }
+    // After the last arrival, give the server's timers time to clean up what the network lost
+    uint64_t deadline = last_arrival + SIM_DRAIN_MS;
+
+    while (!sim->out_of_memory) {
+        if (sim->heap_size > 0 && sim->heap[0].at <= sim->now) {
+            sim_event_t event = pop_event(sim);
+            result->digest = digest_add(result->digest, event.at);
+            result->digest = digest_add(result->digest, ((uint64_t)event.type << 56) | ((uint64_t)event.ua << 48) |
+                                                        ((uint64_t)event.msg << 40) | ((uint64_t)event.code << 24) | event.method);
+            result->digest = digest_add(result->digest, event.id);
+            handle_event(sim, &event);
+            continue;
+        }
+        if (sim->heap_size == 0 && sim->now >= last_arrival && sim->server.store->call_map.size == 0) {
+            break;
+        }
+        // Advance to the next event, stopping at every tick of the server's timer wheel while timers run
+        uint64_t next = sim->heap_size > 0 ? sim->heap[0].at : UINT64_MAX;
+        if (sip_timer_armed(timers) > 0) {
+            uint64_t tick = (sim->now / SIP_TIMER_TICK_MS + 1) * SIP_TIMER_TICK_MS;
+            if (tick < next) {
+                next = tick;
+            }
+        }
+        if (next == UINT64_MAX || next > deadline) {
+            break;
+        }
+        sim->now = next;
+        sip_server_run_timers(&sim->server);
+    }
+
+    for (int i = 0; i < SIM_WINDOW; i++) {
+        retire_call(sim, &sim->calls[i]);
+        retire_registration(sim, &sim->registrations[i]);
+    }
+    result->timers_fired = timers->fired;
+    result->calls_left = sim->server.store->call_map.size;
+    result->virtual_ms = sim->now;
+
+    bool out_of_memory = sim->out_of_memory;
+    sip_server_destroy(&sim->server);
+    free(sim->heap);
+    free(sim);
+    return out_of_memory ? -1 : 0;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file simulation.h
+ * @brief Deterministic simulation of calls and registrations against an in-process server.
+ *
+ * The server runs on a virtual clock and a virtual transport: every datagram, in either
+ * direction, is subject to seeded random loss and delay and is delivered from an event queue
+ * ordered by virtual time. Simulated UAs place calls, answer, reject, cancel, hang up and
+ * register, retransmitting their requests (and the callee its 200 OK) like real UAs do.
+ * The server's call and registration timers fire as the virtual clock passes them, so long
+ * timeouts cost no wall-clock time.
+ *
+ * A run depends on nothing but its configuration: the same seed produces the same sequence of
+ * events, which is summarized by the digest in the result.
+ */
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <stdint.h>
+
+/**
+ * @struct sim_config_t
+ * @brief Traffic and network model of a simulation run.
+ */
+typedef struct {
+    uint64_t seed;                  // Seed of every random choice
+    unsigned long calls;            // Calls placed
+    unsigned long registrations;    // REGISTER transactions
+    uint32_t call_interval_ms;      // Time between two call attempts
+    uint32_t register_interval_ms;  // Time between two REGISTER transactions
+    uint32_t answer_ms;             // Time the callee rings before answering
+    uint32_t hold_ms;               // Talk time of answered calls
+    uint32_t delay_min_ms;          // One-way network delay range
+    uint32_t delay_max_ms;
+    double loss;                    // Probability that a datagram is lost
+    double busy;                    // Fraction of calls the callee rejects with 486
+    double no_answer;               // Fraction of calls the callee lets ring forever
+    double cancel;                  // Fraction of calls the caller cancels while ringing
+} sim_config_t;
+
+/**
+ * @struct sim_result_t
+ * @brief Outcome of a simulation run, as seen by the simulated UAs and the server.
+ */
+typedef struct {
+    unsigned long calls_answered;       // Caller got a 200 OK
+    unsigned long calls_busy;           // Caller got 486
+    unsigned long calls_cancelled;      // Caller got 487 after cancelling
+    unsigned long calls_timed_out;      // Caller got 408 from the server's call timer
+    unsigned long calls_failed;         // Caller got another final response (500, 404, ...)
+    unsigned long calls_unresolved;     // Caller never got a final response
+    unsigned long registrations_ok;
+    unsigned long registrations_failed; // Rejected, or every retransmission lost
+    unsigned long datagrams;            // Datagrams sent by the UAs and the server
+    unsigned long datagrams_lost;
+    unsigned long retransmissions;      // Datagrams resent by the UAs
+    unsigned long timers_fired;         // Server timers that expired
+    int calls_left;                     // Calls still in the server's call table at the end
+    uint64_t virtual_ms;                // Simulated time
+    uint64_t digest;                    // Hash of every event in order, equal for equal configurations
+} sim_result_t;
+
+/**
+ * @brief Fills a configuration with the defaults: 1000 calls and 100 registrations, 1% loss,
+ * 5-50 ms delay, 5% busy, 1% unanswered and 5% cancelled calls.
+ */
+void sim_config_defaults(sim_config_t *config);
+
+/**
+ * @brief Runs a simulation to completion.
+ *
+ * The server logs every message to stdout, callers that don't want that redirect it.
+ * @param config The configuration of the run.
+ * @param result Receives the outcome.
+ * @return 0 on success, -1 if memory couldn't be allocated.
+ */
+int sim_run(const sim_config_t *config, sim_result_t *result);
+
+#endif // SIMULATION_H
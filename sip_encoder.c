@@ -0,0 +1,198 @@
+/**
+ * @file sip_encoder.c
+ * @brief Implementation of the compact outgoing message encoder.
+ */
+
+#include "sip_encoder.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Define the global encoder options
+sip_encoder_options_t sip_encoder_options = {
+    .compact_mode = (sip_compact_mode_t)SIP_COMPACT_HEADERS,
+    .mtu_budget = SIP_MTU_BUDGET
+};
+
+static atomic_ulong compacted_count;
+static atomic_ulong over_budget_count;
+
+// RFC 3261 7.3.3 and later extensions: long header name to compact form
+static const struct {
+    const char *name;
+    const char *compact;
+} compact_forms[] = {
+    {"Via", "v"},
+    {"From", "f"},
+    {"To", "t"},
+    {"Call-ID", "i"},
+    {"Contact", "m"},
+    {"Content-Type", "c"},
+    {"Content-Length", "l"},
+    {"Content-Encoding", "e"},
+    {"Supported", "k"},
+    {"Subject", "s"},
+    {"Event", "o"},
+    {"Allow-Events", "u"},
+    {"Refer-To", "r"},
+    {"Referred-By", "b"},
+    {"Session-Expires", "x"},
+};
+
+// Headers that carry no signalling information and are dropped from compact messages
+static const char *optional_headers[] = {
+    "User-Agent",
+    "Server",
+    "Organization",
+    "Date",
+};
+
+/**
+ * @brief Case-insensitive comparison of a header name with a known name.
+ */
+static bool header_name_equals(const char *name, size_t name_len, const char *known) {
+    size_t known_len = strlen(known);
+    if (name_len != known_len) {
+        return false;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        if (tolower((unsigned char)name[i]) != tolower((unsigned char)known[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t sip_encode_compact(const char *in, size_t in_len, char *out, size_t out_size) {
+    const char *end = in + in_len;
+    const char *p = in;
+    size_t used = 0;
+    bool dropping = false;
+
+#define EMIT(src, n)                                   \
+    do {                                               \
+        if (used + (n) >= out_size) return 0;          \
+        memcpy(out + used, (src), (n));                \
+        used += (n);                                   \
+    } while (0)
+
+    // Start line is copied verbatim
+    const char *line_end = strstr(p, "\r\n");
+    if (line_end == NULL || line_end >= end) {
+        return 0;
+    }
+    EMIT(p, (size_t)(line_end - p) + 2);
+    p = line_end + 2;
+
+    // Header lines, up to the empty line that separates the body
+    while (p < end) {
+        line_end = strstr(p, "\r\n");
+        if (line_end == NULL || line_end >= end) {
+            line_end = end;
+        }
+        size_t line_len = (size_t)(line_end - p);
+        size_t term_len = (line_end < end) ? 2 : 0;
+
+        if (line_len == 0) {
+            break;
+        }
+
+        // Folded continuation line belongs to the previous header
+        if (*p == ' ' || *p == '\t') {
+            if (!dropping) {
+                EMIT(p, line_len + term_len);
+            }
+            p = line_end + term_len;
+            continue;
+        }
+
+        const char *colon = memchr(p, ':', line_len);
+        if (colon == NULL) {
+            dropping = false;
+            EMIT(p, line_len + term_len);
+            p = line_end + term_len;
+            continue;
+        }
+
+        size_t name_len = (size_t)(colon - p);
+        while (name_len > 0 && (p[name_len - 1] == ' ' || p[name_len - 1] == '\t')) {
+            name_len--;
+        }
+
+        dropping = false;
+        for (size_t i = 0; i < sizeof(optional_headers) / sizeof(optional_headers[0]); i++) {
+            if (header_name_equals(p, name_len, optional_headers[i])) {
+                dropping = true;
+                break;
+            }
+        }
+        if (dropping) {
+            p = line_end + term_len;
+            continue;
+        }
+
+        const char *compact = NULL;
+        for (size_t i = 0; i < sizeof(compact_forms) / sizeof(compact_forms[0]); i++) {
+            if (header_name_equals(p, name_len, compact_forms[i].name)) {
+                compact = compact_forms[i].compact;
+                break;
+            }
+        }
+
+        if (compact != NULL) {
+            const char *value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            EMIT(compact, strlen(compact));
+            EMIT(": ", 2);
+            EMIT(value, (size_t)(line_end - value) + term_len);
+        } else {
+            EMIT(p, line_len + term_len);
+        }
+        p = line_end + term_len;
+    }
+
+    // Empty line and body are copied verbatim, so Content-Length stays valid
+    if (p < end) {
+        EMIT(p, (size_t)(end - p));
+    }
+#undef EMIT
+
+    out[used] = '\0';
+    return used;
+}
+
+size_t sip_encoder_prepare(const char *in, size_t in_len, char *scratch, size_t scratch_size, const char **out) {
+    const sip_encoder_options_t *options = &sip_encoder_options;
+    size_t out_len = in_len;
+    *out = in;
+
+    bool compact = options->compact_mode == SIP_COMPACT_ALWAYS ||
+                   (options->compact_mode == SIP_COMPACT_OVER_BUDGET && in_len > options->mtu_budget);
+    if (compact) {
+        size_t compact_len = sip_encode_compact(in, in_len, scratch, scratch_size);
+        if (compact_len > 0) {
+            *out = scratch;
+            out_len = compact_len;
+            atomic_fetch_add(&compacted_count, 1);
+        }
+    }
+
+    if (out_len > options->mtu_budget) {
+        // RFC 3261 18.1.1 would switch to TCP here, only UDP is available so send it anyway
+        atomic_fetch_add(&over_budget_count, 1);
+        printf("!!! WARNING !!! Outgoing message of %zu bytes exceeds MTU budget of %zu bytes, may be fragmented\r\n",
+               out_len, options->mtu_budget);
+    }
+    return out_len;
+}
+
+sip_encoder_stats_t sip_encoder_get_stats(void) {
+    sip_encoder_stats_t stats;
+    stats.compacted = atomic_load(&compacted_count);
+    stats.over_budget = atomic_load(&over_budget_count);
+    return stats;
+}
@@ -0,0 +1,86 @@
+/**
+ * @file sip_encoder.h
+ * @brief Outgoing message encoder that keeps datagrams under the path MTU budget.
+ *
+ * Messages built by the state machine copy the A-leg's long-form headers and the full SDP,
+ * so large INVITEs can exceed the path MTU and get fragmented at the IP layer. The encoder
+ * rewrites header names to their RFC 3261 compact forms, drops headers that carry no
+ * signalling information, and reports messages that still exceed the configured budget.
+ */
+
+#ifndef SIP_ENCODER_H
+#define SIP_ENCODER_H
+
+#include <stddef.h>
+
+// Compact mode: 0 = never, 1 = always, 2 = only when the message exceeds the MTU budget
+#ifndef SIP_COMPACT_HEADERS
+#define SIP_COMPACT_HEADERS 2
+#endif
+
+// RFC 3261 18.1.1: keep UDP requests at least 200 bytes below a 1500 byte path MTU
+#ifndef SIP_MTU_BUDGET
+#define SIP_MTU_BUDGET 1300
+#endif
+
+/**
+ * @enum sip_compact_mode_t
+ * @brief When the encoder compacts outgoing messages.
+ */
+typedef enum {
+    SIP_COMPACT_NEVER = 0,
+    SIP_COMPACT_ALWAYS = 1,
+    SIP_COMPACT_OVER_BUDGET = 2
+} sip_compact_mode_t;
+
+/**
+ * @struct sip_encoder_options_t
+ * @brief Encoder configuration.
+ */
+typedef struct {
+    sip_compact_mode_t compact_mode;    // When to compact messages
+    size_t mtu_budget;                  // Max datagram size before fragmentation is expected
+} sip_encoder_options_t;
+
+/**
+ * @struct sip_encoder_stats_t
+ * @brief Encoder counters.
+ */
+typedef struct {
+    unsigned long compacted;    // Messages rewritten in compact form
+    unsigned long over_budget;  // Messages sent although larger than the MTU budget
+} sip_encoder_stats_t;
+
+// Declare the global encoder options, initialized from the SIP_COMPACT_HEADERS and SIP_MTU_BUDGET macros
+extern sip_encoder_options_t sip_encoder_options;
+
+/**
+ * @brief Rewrites a SIP message with compact header names and without optional headers.
+ * @param in The message to encode.
+ * @param in_len The length of the message.
+ * @param out The output buffer.
+ * @param out_size The size of the output buffer.
+ * @return The length of the encoded message (NUL terminated), or 0 if it does not fit in out.
+ */
+size_t sip_encode_compact(const char *in, size_t in_len, char *out, size_t out_size);
+
+/**
+ * @brief Applies the encoder options to an outgoing message.
+ *
+ * Compacts the message into scratch according to sip_encoder_options and reports messages
+ * still larger than the MTU budget. Only UDP is available, so over-budget messages are sent anyway.
+ * @param in The message to send.
+ * @param in_len The length of the message.
+ * @param scratch Buffer used for the compacted form.
+ * @param scratch_size The size of scratch.
+ * @param out Receives the message to put on the wire (in or scratch).
+ * @return The length of *out.
+ */
+size_t sip_encoder_prepare(const char *in, size_t in_len, char *scratch, size_t scratch_size, const char **out);
+
+/**
+ * @brief Returns a snapshot of the encoder counters.
+ */
+sip_encoder_stats_t sip_encoder_get_stats(void);
+
+#endif // SIP_ENCODER_H
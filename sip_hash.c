@@ -0,0 +1,154 @@
+/**
+ * @file sip_hash.c
+ * @brief Implementation of the keyed hash.
+ */
+
+#define _GNU_SOURCE
+#include "sip_hash.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(SIP_HASH_PORTABLE)
+#include <immintrin.h>
+#define SIP_HASH_AES 1
+#endif
+
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+static uint8_t hash_key[SIP_HASH_KEY_SIZE];
+static bool use_aes = false;
+
+static void hash_init_once(void) {
+#ifdef SIP_HASH_AES
+    __builtin_cpu_init();
+    use_aes = __builtin_cpu_supports("aes");
+#endif
+    if (getrandom(hash_key, sizeof(hash_key), 0) != (ssize_t)sizeof(hash_key)) {
+        // No entropy source, still differs from run to run
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t fallback[4] = { (uint64_t)now.tv_nsec, (uint64_t)now.tv_sec, (uint64_t)getpid(), (uintptr_t)&now };
+        memcpy(hash_key, fallback, sizeof(hash_key));
+    }
+}
+
+void sip_hash_init(void) {
+    pthread_once(&hash_once, hash_init_once);
+}
+
+void sip_hash_set_key(const uint8_t key[SIP_HASH_KEY_SIZE]) {
+    sip_hash_init();
+    memcpy(hash_key, key, SIP_HASH_KEY_SIZE);
+}
+
+const char *sip_hash_implementation(void) {
+    sip_hash_init();
+    return use_aes ? "aes-ni" : "siphash";
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                    \
+    do {                                                            \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                    \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                    \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+static uint64_t load_le64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+uint64_t sip_siphash24(const uint8_t key[16], const void *data, size_t len) {
+    const uint8_t *in = data;
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const uint8_t *end = in + len - (len % 8);
+    for (; in != end; in += 8) {
+        uint64_t m = load_le64(in);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // The last 0 to 7 bytes, with the length in the top byte
+    uint8_t tail[8] = {0};
+    memcpy(tail, in, len % 8);
+    uint64_t b = ((uint64_t)len << 56) | load_le64(tail);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#ifdef SIP_HASH_AES
+/**
+ * @brief Two AES rounds per 16-byte block, keyed with both halves of the key.
+ */
+__attribute__((target("aes,sse2")))
+static uint64_t aes_hash(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *in = data;
+    const __m128i k0 = _mm_loadu_si128((const __m128i *)hash_key);
+    const __m128i k1 = _mm_loadu_si128((const __m128i *)(hash_key + 16));
+    __m128i state = _mm_xor_si128(k0, _mm_set_epi64x((long long)len, (long long)seed));
+
+    for (; len >= 16; in += 16, len -= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)in);
+        state = _mm_aesenc_si128(_mm_xor_si128(state, block), k1);
+        state = _mm_aesenc_si128(state, k0);
+    }
+    if (len > 0) {
+        uint8_t tail[16] = {0};
+        memcpy(tail, in, len);
+        __m128i block = _mm_loadu_si128((const __m128i *)tail);
+        state = _mm_aesenc_si128(_mm_xor_si128(state, block), k1);
+        state = _mm_aesenc_si128(state, k0);
+    }
+
+    state = _mm_aesenc_si128(state, k1);
+    state = _mm_aesenclast_si128(state, k0);
+    return (uint64_t)_mm_cvtsi128_si64(state) ^ (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(state, state));
+}
+#endif
+
+uint64_t sip_hash(const void *data, size_t len, uint64_t seed) {
+    sip_hash_init();
+#ifdef SIP_HASH_AES
+    if (use_aes) {
+        return aes_hash(data, len, seed);
+    }
+#endif
+    uint8_t key[16];
+    memcpy(key, hash_key, sizeof(key));
+    for (int i = 0; i < 8; i++) {
+        key[i] ^= (uint8_t)(seed >> (8 * i));
+    }
+    return sip_siphash24(key, data, len);
+}
+
+uint64_t sip_hash_call_id(const char *call_id, size_t len) {
+    size_t skipped = len < 5 ? len : 5;
+    uint64_t hash = sip_hash(call_id + skipped, len - skipped, 0);
+    return hash != 0 ? hash : 1;
+}
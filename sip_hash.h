@@ -0,0 +1,62 @@
+/**
+ * @file sip_hash.h
+ * @brief Keyed hash shared by the lookup tables (calls, limits, duplicate and unknown-user filters).
+ *
+ * Call-IDs, usernames and source addresses are chosen by whoever sends the datagrams, so a table
+ * hashed with a fixed function can be flooded with keys that all land in one slot. Every table
+ * hashes with the same secret random key, drawn once per server before the workers start (worker
+ * processes inherit it, so the tables in shared memory agree).
+ *
+ * Where the CPU has AES-NI, a block of 16 bytes costs two AES rounds keyed with the secret. Other
+ * CPUs use SipHash-2-4. CRC32C instructions are not used: CRC is linear, a key doesn't stop
+ * collisions from being computed.
+ */
+
+#ifndef SIP_HASH_H
+#define SIP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIP_HASH_KEY_SIZE 32
+
+/**
+ * @brief Picks the implementation and draws a random key, if sip_hash_set_key() wasn't called.
+ *
+ * Called by sip_server_init(); the hash functions call it too, so tables used on their own work.
+ */
+void sip_hash_init(void);
+
+/**
+ * @brief Replaces the key, for runs that must hash the same every time (e.g. a simulation).
+ *
+ * Tables filled with the previous key must be rebuilt.
+ */
+void sip_hash_set_key(const uint8_t key[SIP_HASH_KEY_SIZE]);
+
+/**
+ * @brief Returns "aes-ni" or "siphash".
+ */
+const char *sip_hash_implementation(void);
+
+/**
+ * @brief Hashes data with the server key.
+ * @param seed Mixed in with the data, e.g. to hash a value together with an address.
+ */
+uint64_t sip_hash(const void *data, size_t len, uint64_t seed);
+
+/**
+ * @brief Hashes a Call-ID the same for both legs of a call, never 0.
+ *
+ * The B-leg Call-ID is the A-leg Call-ID with its first 5 characters replaced, so they are not hashed.
+ * @param call_id The Call-ID value, not necessarily NUL-terminated.
+ * @param len Its length.
+ */
+uint64_t sip_hash_call_id(const char *call_id, size_t len);
+
+/**
+ * @brief SipHash-2-4 of data with a 16-byte key, the portable implementation.
+ */
+uint64_t sip_siphash24(const uint8_t key[16], const void *data, size_t len);
+
+#endif // SIP_HASH_H
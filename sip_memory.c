@@ -0,0 +1,159 @@
+/**
+ * @file sip_memory.c
+ * @brief Implementation of the per-subsystem memory accounts.
+ */
+
+#define _GNU_SOURCE
+#include "sip_memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const subsystem_names[SIP_MEMORY_SUBSYSTEMS] = {
+    [SIP_MEMORY_MESSAGES] = "messages",
+    [SIP_MEMORY_CALLS] = "calls",
+    [SIP_MEMORY_REGISTRAR] = "registrar",
+    [SIP_MEMORY_TRANSACTIONS] = "transactions",
+};
+
+void sip_memory_init(sip_memory_t *memory) {
+    for (int i = 0; i < SIP_MEMORY_SUBSYSTEMS; i++) {
+        sip_memory_account_t *account = &memory->accounts[i];
+        atomic_init(&account->bytes, 0);
+        atomic_init(&account->objects, 0);
+        atomic_init(&account->peak_bytes, 0);
+        atomic_init(&account->ceiling_bytes, 0);
+        atomic_init(&account->shed, 0);
+        account->reserved_bytes = 0;
+    }
+    atomic_store(&memory->accounts[SIP_MEMORY_MESSAGES].ceiling_bytes, SIP_MEMORY_MESSAGES_CEILING);
+    atomic_store(&memory->accounts[SIP_MEMORY_CALLS].ceiling_bytes, SIP_MEMORY_CALLS_CEILING);
+    atomic_store(&memory->accounts[SIP_MEMORY_REGISTRAR].ceiling_bytes, SIP_MEMORY_REGISTRAR_CEILING);
+}
+
+void sip_memory_set_reserved(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes) {
+    memory->accounts[subsystem].reserved_bytes = bytes;
+}
+
+void sip_memory_set_ceiling(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes) {
+    atomic_store(&memory->accounts[subsystem].ceiling_bytes, bytes);
+}
+
+/**
+ * @brief Parses a size in bytes with an optional k or m suffix.
+ */
+static bool parse_size(const char *value, size_t *bytes) {
+    char *end;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (end == value || value[0] == '-') {
+        return false;
+    }
+    if (*end == 'k' || *end == 'K') {
+        parsed *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        parsed *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *bytes = (size_t)parsed;
+    return true;
+}
+
+int sip_memory_configure(sip_memory_t *memory, const char *spec) {
+    size_t ceilings[SIP_MEMORY_SUBSYSTEMS];
+    bool set[SIP_MEMORY_SUBSYSTEMS] = {false};
+    char copy[256];
+
+    if (spec == NULL || strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    // Parse everything first, so an invalid specification changes nothing
+    char *save;
+    for (char *setting = strtok_r(copy, ",", &save); setting != NULL; setting = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(setting, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        int subsystem = -1;
+        // The transaction table has a fixed size, it takes no ceiling
+        for (int i = 0; i < SIP_MEMORY_TRANSACTIONS; i++) {
+            if (strcmp(setting, subsystem_names[i]) == 0) {
+                subsystem = i;
+            }
+        }
+        if (subsystem < 0 || !parse_size(value, &ceilings[subsystem])) {
+            return -1;
+        }
+        set[subsystem] = true;
+    }
+    for (int i = 0; i < SIP_MEMORY_SUBSYSTEMS; i++) {
+        if (set[i]) {
+            sip_memory_set_ceiling(memory, (sip_memory_subsystem_t)i, ceilings[i]);
+        }
+    }
+    return 0;
+}
+
+static void update_peak(sip_memory_account_t *account, size_t bytes) {
+    size_t peak = atomic_load_explicit(&account->peak_bytes, memory_order_relaxed);
+    while (bytes > peak &&
+           !atomic_compare_exchange_weak_explicit(&account->peak_bytes, &peak, bytes,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+bool sip_memory_charge(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes) {
+    sip_memory_account_t *account = &memory->accounts[subsystem];
+    size_t ceiling = atomic_load_explicit(&account->ceiling_bytes, memory_order_relaxed);
+    size_t used = atomic_fetch_add_explicit(&account->bytes, bytes, memory_order_relaxed) + bytes;
+
+    if (ceiling != 0 && used > ceiling) {
+        // Concurrent charges may both be refused near the ceiling, never both admitted past it
+        atomic_fetch_sub_explicit(&account->bytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&account->shed, 1, memory_order_relaxed);
+        return false;
+    }
+    atomic_fetch_add_explicit(&account->objects, 1, memory_order_relaxed);
+    update_peak(account, used);
+    return true;
+}
+
+void sip_memory_force_charge(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes) {
+    sip_memory_account_t *account = &memory->accounts[subsystem];
+    size_t used = atomic_fetch_add_explicit(&account->bytes, bytes, memory_order_relaxed) + bytes;
+    atomic_fetch_add_explicit(&account->objects, 1, memory_order_relaxed);
+    update_peak(account, used);
+}
+
+void sip_memory_credit(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes) {
+    sip_memory_account_t *account = &memory->accounts[subsystem];
+    atomic_fetch_sub_explicit(&account->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&account->objects, 1, memory_order_relaxed);
+}
+
+void sip_memory_set_usage(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes, size_t objects) {
+    sip_memory_account_t *account = &memory->accounts[subsystem];
+    atomic_store_explicit(&account->bytes, bytes, memory_order_relaxed);
+    atomic_store_explicit(&account->objects, objects, memory_order_relaxed);
+    update_peak(account, bytes);
+}
+
+void sip_memory_snapshot(sip_memory_t *memory, sip_memory_subsystem_t subsystem, sip_memory_stats_t *stats) {
+    sip_memory_account_t *account = &memory->accounts[subsystem];
+    stats->bytes = atomic_load_explicit(&account->bytes, memory_order_relaxed);
+    stats->objects = atomic_load_explicit(&account->objects, memory_order_relaxed);
+    stats->peak_bytes = atomic_load_explicit(&account->peak_bytes, memory_order_relaxed);
+    stats->ceiling_bytes = atomic_load_explicit(&account->ceiling_bytes, memory_order_relaxed);
+    stats->reserved_bytes = account->reserved_bytes;
+    stats->shed = atomic_load_explicit(&account->shed, memory_order_relaxed);
+}
+
+const char *sip_memory_subsystem_name(sip_memory_subsystem_t subsystem) {
+    return subsystem < SIP_MEMORY_SUBSYSTEMS ? subsystem_names[subsystem] : "unknown";
+}
@@ -0,0 +1,142 @@
+/**
+ * @file sip_memory.h
+ * @brief Per-subsystem memory accounting and ceilings.
+ *
+ * Each subsystem that holds memory on behalf of traffic (received messages, calls, registrar
+ * bindings) has an account of the bytes and objects it holds. A subsystem charges its account
+ * before taking more and credits it when done. When a charge would take an account past its
+ * ceiling the charge is refused, and the subsystem sheds the work instead of growing: received
+ * datagrams are dropped before they are queued (the UA retransmits), new calls and new
+ * registrations are answered with 503 and a Retry-After.
+ *
+ * In-flight transactions are tracked by the duplicate filter's fixed table, which can't grow.
+ * Their account is only reported, see sip_server_memory_stats().
+ *
+ * The accounts are plain atomics without pointers, so they live in the store and are shared by
+ * the worker processes of the prefork mode.
+ */
+
+#ifndef SIP_MEMORY_H
+#define SIP_MEMORY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Default ceilings in bytes, 0 for none. Overridden at run time with sip_memory_configure().
+#ifndef SIP_MEMORY_MESSAGES_CEILING
+#define SIP_MEMORY_MESSAGES_CEILING 0
+#endif
+#ifndef SIP_MEMORY_CALLS_CEILING
+#define SIP_MEMORY_CALLS_CEILING 0
+#endif
+#ifndef SIP_MEMORY_REGISTRAR_CEILING
+#define SIP_MEMORY_REGISTRAR_CEILING 0
+#endif
+
+#ifndef SIP_MEMORY_RETRY_AFTER
+#define SIP_MEMORY_RETRY_AFTER 5    // Retry-After of the 503 sent when a ceiling sheds a request, in seconds
+#endif
+
+/**
+ * @enum sip_memory_subsystem_t
+ * @brief The accounted subsystems.
+ */
+typedef enum {
+    SIP_MEMORY_MESSAGES,        // Received messages queued for or being processed by a worker
+    SIP_MEMORY_CALLS,           // Call table entries in use
+    SIP_MEMORY_REGISTRAR,       // Registered bindings of the location store
+    SIP_MEMORY_TRANSACTIONS,    // Duplicate filter entries of messages in flight, reported only
+    SIP_MEMORY_SUBSYSTEMS
+} sip_memory_subsystem_t;
+
+/**
+ * @struct sip_memory_account_t
+ * @brief Usage and ceiling of one subsystem.
+ */
+typedef struct {
+    atomic_size_t bytes;
+    atomic_size_t objects;
+    atomic_size_t peak_bytes;
+    atomic_size_t ceiling_bytes;    // 0 for no ceiling
+    atomic_ulong shed;              // Charges refused by the ceiling
+    size_t reserved_bytes;          // Preallocated by a fixed-size table, whether used or not
+} sip_memory_account_t;
+
+/**
+ * @struct sip_memory_t
+ * @brief The accounts of all subsystems.
+ */
+typedef struct {
+    sip_memory_account_t accounts[SIP_MEMORY_SUBSYSTEMS];
+} sip_memory_t;
+
+/**
+ * @struct sip_memory_stats_t
+ * @brief A snapshot of one account.
+ */
+typedef struct {
+    size_t bytes;
+    size_t objects;
+    size_t peak_bytes;
+    size_t ceiling_bytes;
+    size_t reserved_bytes;
+    unsigned long shed;
+} sip_memory_stats_t;
+
+/**
+ * @brief Initializes empty accounts with the default ceilings.
+ */
+void sip_memory_init(sip_memory_t *memory);
+
+/**
+ * @brief Records the size of the fixed-size table a subsystem is preallocated in.
+ */
+void sip_memory_set_reserved(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes);
+
+/**
+ * @brief Sets the ceiling of a subsystem.
+ * @param bytes The ceiling in bytes, 0 for none.
+ */
+void sip_memory_set_ceiling(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes);
+
+/**
+ * @brief Sets ceilings from a specification like "messages=64k,calls=16k,registrar=8k".
+ *
+ * Sizes are in bytes, with an optional k or m suffix. Subsystems not named keep their ceiling.
+ * @return 0 on success, -1 if the specification is invalid (no ceiling is changed then).
+ */
+int sip_memory_configure(sip_memory_t *memory, const char *spec);
+
+/**
+ * @brief Charges one object of a subsystem.
+ * @return true if the object fits under the ceiling, false if the caller must shed it.
+ */
+bool sip_memory_charge(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes);
+
+/**
+ * @brief Charges one object of a subsystem even past its ceiling, for work that must never be shed.
+ */
+void sip_memory_force_charge(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes);
+
+/**
+ * @brief Credits one object charged with sip_memory_charge() or sip_memory_force_charge().
+ */
+void sip_memory_credit(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes);
+
+/**
+ * @brief Sets the usage of a subsystem that counts its objects itself, instead of charging them.
+ */
+void sip_memory_set_usage(sip_memory_t *memory, sip_memory_subsystem_t subsystem, size_t bytes, size_t objects);
+
+/**
+ * @brief Copies the account of a subsystem.
+ */
+void sip_memory_snapshot(sip_memory_t *memory, sip_memory_subsystem_t subsystem, sip_memory_stats_t *stats);
+
+/**
+ * @brief Returns the name of a subsystem, as used by sip_memory_configure().
+ */
+const char *sip_memory_subsystem_name(sip_memory_subsystem_t subsystem);
+
+#endif // SIP_MEMORY_H
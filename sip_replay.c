@@ -0,0 +1,349 @@
+/**
+ * @file sip_replay.c
+ * @brief Replays the SIP traffic of a pcap/pcapng capture into the server.
+ *
+ * Datagrams sent to the server port in the capture are replayed, either directly into the
+ * in-process parsing and state machine path (default) or over UDP to a running server
+ * (--udp). Each client address of the capture is rewritten to its own loopback address.
+ * Timing follows the capture divided by --speed, 0 replays as fast as possible.
+ *
+ * The datagrams the original server sent are the expected outcome: responses are tallied
+ * by status code and CSeq method, requests by method, and compared with what the server
+ * sent during the replay.
+ */
+
+#define _GNU_SOURCE
+#include "sip_server.h"
+#include "pcap_reader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define REPLAY_MAX_CLIENTS 250      // Distinct client addresses, mapped to 127.0.0.2 and up
+#define REPLAY_MAX_OUTCOMES 64      // Distinct outcome keys
+#define REPLAY_DRAIN_MS 500         // UDP mode: time to wait for the last responses
+
+typedef struct {
+    char key[32];
+    unsigned long captured;
+    unsigned long replayed;
+} outcome_t;
+
+typedef struct {
+    struct sockaddr_in original;
+    struct sockaddr_in loopback;
+    int socket_fd;                  // UDP mode only
+} client_t;
+
+static outcome_t outcomes[REPLAY_MAX_OUTCOMES];
+static int outcome_count = 0;
+static client_t clients[REPLAY_MAX_CLIENTS];
+static int client_count = 0;
+static pcap_reader_t reader;
+
+/**
+ * @brief Returns the outcome key of a message: "<code> <CSeq method>" or "<method>".
+ */
+static bool outcome_key(const char *payload, size_t len, char *key, size_t key_size) {
+    char line[64] = {0};
+    size_t n = 0;
+    while (n < len && n < sizeof(line) - 1 && payload[n] != '\r' && payload[n] != '\n') {
+        line[n] = payload[n];
+        n++;
+    }
+
+    if (strncmp(line, "SIP/2.0 ", 8) == 0) {
+        char method[20] = "?";
+        const char *cseq = memmem(payload, len, "CSeq:", 5);
+        if (cseq != NULL) {
+            sscanf(cseq + 5, " %*d %19[A-Z]", method);
+        }
+        snprintf(key, key_size, "%.3s %s", line + 8, method);
+        return true;
+    }
+    char method[20] = {0};
+    if (sscanf(line, "%19[A-Z] ", method) != 1) {
+        return false;
+    }
+    snprintf(key, key_size, "%s", method);
+    return true;
+}
+
+static void count_outcome(const char *payload, size_t len, bool captured) {
+    char key[32];
+    if (!outcome_key(payload, len, key, sizeof(key))) {
+        return;
+    }
+    for (int i = 0; i < outcome_count; i++) {
+        if (strcmp(outcomes[i].key, key) == 0) {
+            captured ? outcomes[i].captured++ : outcomes[i].replayed++;
+            return;
+        }
+    }
+    if (outcome_count < REPLAY_MAX_OUTCOMES) {
+        outcome_t *outcome = &outcomes[outcome_count++];
+        snprintf(outcome->key, sizeof(outcome->key), "%s", key);
+        captured ? outcome->captured++ : outcome->replayed++;
+    }
+}
+
+static void recording_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port) {
+    (void)user_data;
+    (void)destination;
+    (void)port;
+    count_outcome(message->buffer, strlen(message->buffer), false);
+}
+
+/**
+ * @brief Returns the loopback client a captured address is replayed from, adding it if new.
+ */
+static client_t *client_for(const struct sockaddr_in *original, bool udp) {
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].original.sin_addr.s_addr == original->sin_addr.s_addr &&
+            clients[i].original.sin_port == original->sin_port) {
+            return &clients[i];
+        }
+    }
+    if (client_count == REPLAY_MAX_CLIENTS) {
+        return NULL;
+    }
+
+    client_t *client = &clients[client_count];
+    client->original = *original;
+    memset(&client->loopback, 0, sizeof(client->loopback));
+    client->loopback.sin_family = AF_INET;
+    client->loopback.sin_addr.s_addr = htonl(0x7f000002u + (uint32_t)client_count);
+    client->loopback.sin_port = original->sin_port;
+    client->socket_fd = -1;
+
+    if (udp) {
+        client->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (client->socket_fd < 0) {
+            perror("Socket creation failed");
+            return NULL;
+        }
+        fcntl(client->socket_fd, F_SETFL, O_NONBLOCK);
+        if (bind(client->socket_fd, (struct sockaddr *)&client->loopback, sizeof(client->loopback)) < 0) {
+            // Port taken: any port on the same loopback address will do
+            client->loopback.sin_port = 0;
+            socklen_t len = sizeof(client->loopback);
+            if (bind(client->socket_fd, (struct sockaddr *)&client->loopback, sizeof(client->loopback)) < 0 ||
+                getsockname(client->socket_fd, (struct sockaddr *)&client->loopback, &len) < 0) {
+                perror("Socket bind failed");
+                close(client->socket_fd);
+                return NULL;
+            }
+        }
+    }
+    client_count++;
+    return client;
+}
+
+/**
+ * @brief UDP mode: tallies the datagrams the server sent to the replayed clients.
+ * @param timeout_ms How long to wait for the first datagram.
+ */
+static void drain_responses(int timeout_ms) {
+    struct pollfd fds[REPLAY_MAX_CLIENTS];
+    char buffer[BUFFER_SIZE];
+
+    for (int i = 0; i < client_count; i++) {
+        fds[i].fd = clients[i].socket_fd;
+        fds[i].events = POLLIN;
+    }
+    while (client_count > 0 && poll(fds, (nfds_t)client_count, timeout_ms) > 0) {
+        for (int i = 0; i < client_count; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(fds[i].fd, buffer, sizeof(buffer), 0)) > 0) {
+                count_outcome(buffer, (size_t)n, false);
+            }
+        }
+        timeout_ms = 0;
+    }
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    uint64_t now = monotonic_ns();
+    if (deadline > now) {
+        struct timespec ts = { .tv_sec = (time_t)((deadline - now) / 1000000000ULL),
+                               .tv_nsec = (long)((deadline - now) % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--udp HOST[:PORT]] [--speed FACTOR] [--port PORT] [--verbose] [--strict] CAPTURE\n"
+            "  --udp HOST[:PORT]  send to a running server instead of replaying in-process\n"
+            "  --speed FACTOR     replay at FACTOR times the captured rate, 0 (default) = as fast as possible\n"
+            "  --port PORT        server port in the capture (default %d)\n"
+            "  --verbose          keep the in-process server's log output\n"
+            "  --strict           exit with status 1 if the outcomes differ from the capture\n",
+            program, SIP_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    const char *udp_target = NULL;
+    double speed = 0.0;
+    int server_port = SIP_PORT;
+    bool verbose = false;
+    bool strict = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--udp") == 0 && i + 1 < argc) {
+            udp_target = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "--strict") == 0) {
+            strict = true;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (path == NULL || speed < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    if (udp_target != NULL) {
+        char host[INET_ADDRSTRLEN] = {0};
+        int port = SIP_PORT;
+        if (sscanf(udp_target, "%15[0-9.]:%d", host, &port) < 1 || inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+            fprintf(stderr, "Invalid --udp target: %s\n", udp_target);
+            return 2;
+        }
+        target.sin_family = AF_INET;
+        target.sin_port = htons(port);
+    }
+
+    if (pcap_reader_open(&reader, path) < 0) {
+        return 1;
+    }
+
+    static sip_server_t server;
+    const sip_transport_t transport = { .send = recording_transport_send, .user_data = NULL };
+    sip_server_init(&server, &transport);
+
+    // The in-process server logs every message
+    int saved_stdout = -1;
+    if (udp_target == NULL && !verbose) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    pcap_datagram_t datagram;
+    unsigned long replayed = 0;
+    unsigned long other = 0;
+    uint64_t first_ts = 0;
+    uint64_t start = monotonic_ns();
+    int ret;
+
+    while ((ret = pcap_reader_next(&reader, &datagram)) > 0) {
+        if (ntohs(datagram.src.sin_port) == server_port) {
+            // Sent by the original server: expected outcome
+            count_outcome(datagram.payload, datagram.len, true);
+            continue;
+        }
+        if (ntohs(datagram.dst.sin_port) != server_port || datagram.len == 0 || datagram.len > BUFFER_SIZE) {
+            other++;
+            continue;
+        }
+        client_t *client = client_for(&datagram.src, udp_target != NULL);
+        if (client == NULL) {
+            other++;
+            continue;
+        }
+
+        if (speed > 0) {
+            if (replayed == 0) {
+                first_ts = datagram.ts_ns;
+            }
+            uint64_t offset = datagram.ts_ns > first_ts ? datagram.ts_ns - first_ts : 0;
+            sleep_until_ns(start + (uint64_t)((double)offset / speed));
+        }
+
+        if (udp_target != NULL) {
+            if (sendto(client->socket_fd, datagram.payload, datagram.len, 0, (struct sockaddr *)&target, sizeof(target)) < 0) {
+                perror("Send failed");
+            }
+            drain_responses(0);
+        } else {
+            sip_message_t message;
+            memset(&message, 0, sizeof(message));
+            memcpy(message.buffer, datagram.payload, datagram.len);
+            message.client_addr = client->loopback;
+            message.client_addr_len = sizeof(message.client_addr);
+            process_sip_message(&server, &message);
+        }
+        replayed++;
+    }
+    double elapsed = (double)(monotonic_ns() - start) / 1e9;
+    if (udp_target != NULL) {
+        drain_responses(REPLAY_DRAIN_MS);
+    }
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Malformed capture, stopped after %lu datagrams\n", replayed);
+    }
+
+    printf("Replayed %lu datagrams from %d clients in %.3f s (%.0f msg/s), %s\n",
+           replayed, client_count, elapsed, elapsed > 0 ? (double)replayed / elapsed : 0.0,
+           udp_target != NULL ? "over UDP" : "in-process");
+    printf("Skipped %lu non-UDP packets and %lu datagrams not sent to port %d\n",
+           reader.skipped, other, server_port);
+    printf("\n%-20s %10s %10s %8s\n", "Outcome", "Captured", "Replayed", "Diff");
+    int differences = 0;
+    for (int i = 0; i < outcome_count; i++) {
+        long diff = (long)outcomes[i].replayed - (long)outcomes[i].captured;
+        printf("%-20s %10lu %10lu %+8ld%s\n", outcomes[i].key, outcomes[i].captured, outcomes[i].replayed,
+               diff, diff != 0 ? "  <<" : "");
+        if (diff != 0) {
+            differences++;
+        }
+    }
+    printf("\n%d outcome%s differ%s from the capture\n", differences, differences == 1 ? "" : "s",
+           differences == 1 ? "s" : "");
+
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].socket_fd >= 0) {
+            close(clients[i].socket_fd);
+        }
+    }
+    pcap_reader_close(&reader);
+    sip_server_destroy(&server);
+    return (strict && differences > 0) ? 1 : 0;
+}
@@ -3,37 +3,177 @@
  * @brief Implementation of SIP server functionalities, including message processing and queue management.
  */
 
+#define _GNU_SOURCE
 #include "sip_server.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <arpa/inet.h> 
-#include "network_utils.h"
+#include <sys/uio.h>
+#include <time.h>
+#include "shared_mem.h"
 
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// Contact of the server in its responses to A's INVITE
+#define SERVER_CONTACT_LINE "Contact: <sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":" STRINGIFY(SIP_PORT) ">\r\n"
+#define NO_BODY "Content-Length: 0\r\n\r\n"
+// A gather_message() segment holding a string literal
+#define LITERAL_SEGMENT(literal) { (void *)(literal), sizeof(literal) - 1 }
 
 // Each entry represents a softphone/UE with its corresponding phone number, IP address, and SIP port,
 // so that they can be correctly reached as the called party by the SIP server.
 // *MUST* be set before compiling.
-location_entry_t location_entries[] = {
-    {"1001","defaultpassword", "192.168.192.1", 5060, SIP_SERVER_IP_ADDRESS, false},
-    {"1002","defaultpassword",  "192.168.192.1", 5070, SIP_SERVER_IP_ADDRESS, false},
-    {"1003","defaultpassword",  "192.168.1.103", 5060, SIP_SERVER_IP_ADDRESS, false},
-    {"1004","defaultpassword",  "192.168.1.104", 5060, SIP_SERVER_IP_ADDRESS, false},
-    {"1005","defaultpassword",  "192.168.184.1", 5060, SIP_SERVER_IP_ADDRESS, false},
-    {"1006","defaultpassword",  "192.168.184.1", 5070, SIP_SERVER_IP_ADDRESS, false},
-    {"1007","defaultpassword",  "192.168.1.4", 5060, SIP_SERVER_IP_ADDRESS, false},
-    {"1008","defaultpassword",  "192.168.1.4", 5070, SIP_SERVER_IP_ADDRESS, false},
+static const location_entry_t provisioned_locations[] = {
+    {"1001","defaultpassword", "192.168.192.1", 5060, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1002","defaultpassword",  "192.168.192.1", 5070, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1003","defaultpassword",  "192.168.1.103", 5060, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1004","defaultpassword",  "192.168.1.104", 5060, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1005","defaultpassword",  "192.168.184.1", 5060, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1006","defaultpassword",  "192.168.184.1", 5070, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1007","defaultpassword",  "192.168.1.4", 5060, SIP_SERVER_IP_ADDRESS, false, false},
+    {"1008","defaultpassword",  "192.168.1.4", 5070, SIP_SERVER_IP_ADDRESS, false, false},
 };
 
-int location_size = sizeof(location_entries) / sizeof(location_entry_t);
+/**
+ * @brief Initializes a store with the provisioned users and an empty call table.
+ * @param store The store to initialize, e.g. placed in a shared memory segment.
+ * @param process_shared true if the store is shared by several worker processes.
+ */
+void sip_store_init(sip_store_t *store, bool process_shared) {
+    store->process_shared = process_shared;
+    memset(store->location_entries, 0, sizeof(store->location_entries));
+    memcpy(store->location_entries, provisioned_locations, sizeof(provisioned_locations));
+    memset(store->registration_cache, 0, sizeof(store->registration_cache));
+    atomic_store(&store->registration_cache_hits, 0);
+    store->location_size = (int)(sizeof(provisioned_locations) / sizeof(location_entry_t));
+    shm_mutex_init(&store->location_mutex, process_shared);
+    store->keepalive_slot = 0;
+    store->keepalive_pending = false;
+    atomic_store(&store->keepalives, 0);
+    dedup_filter_init(&store->dedup_filter, process_shared);
+    user_filter_init(&store->user_filter, process_shared);
+    sip_store_provisioning_changed(store);
+    atomic_store(&store->cseq_number, 1);
+    sip_timer_wheel_init(&store->timers, process_shared);
+    init_call_map(&store->call_map, process_shared);
+    sip_memory_init(&store->memory);
+    call_limits_init(&store->call_limits);
+    cost_counters_init(&store->costs);
+    sip_memory_set_reserved(&store->memory, SIP_MEMORY_CALLS, sizeof(store->call_map.calls));
+    sip_memory_set_reserved(&store->memory, SIP_MEMORY_REGISTRAR, sizeof(store->location_entries));
+    sip_memory_set_reserved(&store->memory, SIP_MEMORY_TRANSACTIONS, sizeof(store->dedup_filter.slots));
+    sip_subscription_store_init(&store->subscriptions, process_shared);
+    sip_im_store_init(&store->instant_messages, process_shared);
+    sip_trace_filter_init(&store->trace);
+    shm_seqlock_init(&store->trace_lock);
+}
+
+/**
+ * @brief Rebuilds the unknown-user filter from the location store.
+ * Must be called whenever users are added to or removed from location_entries.
+ * @param store The store whose provisioning changed.
+ */
+void sip_store_provisioning_changed(sip_store_t *store) {
+    _Static_assert(offsetof(location_entry_t, username) == 0, "the user filter reads usernames at the start of each entry");
+    user_filter_rebuild(&store->user_filter, store->location_entries,
+                        (size_t)store->location_size, sizeof(location_entry_t));
+}
+
+_Static_assert(IM_DELIVERY_TIMER_ID < SIP_TIMER_CAPACITY, "timer wheel too small for the call, location, subscription, keep-alive and delivery timers");
+_Static_assert(EMERGENCY_RESERVED_CALLS < MAX_CALLS, "the emergency reservation leaves no entry for other calls");
+
+/**
+ * @brief The default server clock: monotonic time in milliseconds.
+ */
+static uint64_t monotonic_clock_ms(void *user_data) {
+    (void)user_data;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Initializes a server with a process-local store.
+ * @param server The server to initialize.
+ * @param transport The transport used to send messages, copied into the server.
+ */
+void sip_server_init(sip_server_t *server, const sip_transport_t *transport) {
+    memset(server, 0, sizeof(*server));
+    // The hash key is drawn before any table is filled and before worker processes are forked
+    sip_hash_init();
+    sip_store_init(&server->local_store, false);
+    server->store = &server->local_store;
+    if (transport != NULL) {
+        server->transport = *transport;
+    }
+    server->clock.now_ms = monotonic_clock_ms;
+    sip_server_set_emergency_numbers(server, EMERGENCY_NUMBERS);
+}
+
+/**
+ * @brief Releases the resources of a server's process-local store.
+ * @param server The server to destroy.
+ */
+void sip_server_destroy(sip_server_t *server) {
+    destroy_call_map(&server->local_store.call_map);
+    dedup_filter_destroy(&server->local_store.dedup_filter);
+    user_filter_destroy(&server->local_store.user_filter);
+    sip_timer_wheel_destroy(&server->local_store.timers);
+    pthread_mutex_destroy(&server->local_store.location_mutex);
+    sip_subscription_store_destroy(&server->local_store.subscriptions);
+    sip_im_store_destroy(&server->local_store.instant_messages);
+}
+
+/**
+ * @brief Sends a message through the server's transport.
+ * @param server The server.
+ * @param message The SIP message to be sent.
+ * @param destination The IP address of the destination.
+ * @param port The port number on the destination.
+ */
+void sip_server_send(sip_server_t *server, const sip_message_t *message, const char *destination, int port) {
+    if (server->transport.send != NULL) {
+        server->transport.send(server->transport.user_data, message, destination, port);
+    }
+}
+
+/**
+ * @brief Sends several messages through the server's transport, at once if it supports batches.
+ * @param server The server.
+ * @param batch The messages and their destinations.
+ * @param count Number of messages in batch.
+ */
+void sip_server_send_batch(sip_server_t *server, const sip_outgoing_t *batch, size_t count) {
+    if (server->transport.send_batch != NULL) {
+        server->transport.send_batch(server->transport.user_data, batch, count);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sip_server_send(server, batch[i].message, batch[i].destination, batch[i].port);
+    }
+}
 
-// Define the global call map
-call_map_t call_map;
+/**
+ * @brief Returns the next CSeq number for a request generated by the server.
+ */
+int next_cseq_number(sip_server_t *server) {
+    return atomic_fetch_add(&server->store->cseq_number, 1);
+}
 
-// Define global cseq number
-int cseq_number = 1;
+/**
+ * @brief Returns the current time of the server's clock in milliseconds.
+ */
+uint64_t sip_server_now_ms(sip_server_t *server) {
+    return server->clock.now_ms(server->clock.user_data);
+}
 
 /**
  * @brief Initializes a message queue.
@@ -46,6 +186,8 @@ void initialize_message_queue(message_queue_t *queue, int capacity) {
     queue->size = 0;
     queue->front = 0;
     queue->rear = -1;
+    queue->urgent_size = 0;
+    queue->urgent_front = 0;
     pthread_mutex_init(&queue->mutex, NULL);
     pthread_cond_init(&queue->cond, NULL);
 }
@@ -58,6 +200,9 @@ void destroy_message_queue(message_queue_t *queue) {
     for (int i = 0; i < queue->size; i++) {
         free(queue->messages[(queue->front + i) % queue->capacity]);
     }
+    for (int i = 0; i < queue->urgent_size; i++) {
+        free(queue->urgent[(queue->urgent_front + i) % EMERGENCY_QUEUE_CAPACITY]);
+    }
     free(queue->messages);
     pthread_mutex_destroy(&queue->mutex);
     pthread_cond_destroy(&queue->cond);
@@ -65,12 +210,23 @@ void destroy_message_queue(message_queue_t *queue) {
 
 /**
  * @brief Enqueues a message into the queue.
+ *
+ * A priority message goes to the queue's urgent slots, which only priority messages use, so it
+ * is neither refused nor delayed by a backlog of other messages. It falls back to the regular
+ * slots when the urgent ones are full.
  * @param queue Pointer to the message queue where the message will be enqueued.
  * @param message Pointer to the message to enqueue.
  * @return 1 on success, 0 if the queue is full.
  */
 int enqueue_message(message_queue_t *queue, sip_message_t *message) {
     pthread_mutex_lock(&queue->mutex);
+    if (message != NULL && message->priority && queue->urgent_size < EMERGENCY_QUEUE_CAPACITY) {
+        queue->urgent[(queue->urgent_front + queue->urgent_size) % EMERGENCY_QUEUE_CAPACITY] = message;
+        queue->urgent_size++;
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+        return 1;
+    }
     if (queue->size == queue->capacity) {
         pthread_mutex_unlock(&queue->mutex);
         return 0;
@@ -86,7 +242,7 @@ int enqueue_message(message_queue_t *queue, sip_message_t *message) {
 }
 
 /**
- * @brief Dequeues a message from the queue.
+ * @brief Dequeues a message from the queue, priority messages first.
  * @param queue Pointer to the message queue to dequeue from.
  * @param message Double pointer to store the dequeued message.
  * @return 1 on success, 0 if the queue is empty.
@@ -94,10 +250,18 @@ int enqueue_message(message_queue_t *queue, sip_message_t *message) {
 int dequeue_message(message_queue_t *queue, sip_message_t **message) {
     pthread_mutex_lock(&queue->mutex);
 
-    while (queue->size == 0) {
+    while (queue->size == 0 && queue->urgent_size == 0) {
         pthread_cond_wait(&queue->cond, &queue->mutex);
     }
 
+    if (queue->urgent_size > 0) {
+        *message = queue->urgent[queue->urgent_front];
+        queue->urgent_front = (queue->urgent_front + 1) % EMERGENCY_QUEUE_CAPACITY;
+        queue->urgent_size--;
+        pthread_mutex_unlock(&queue->mutex);
+        return 1;
+    }
+
     *message = queue->messages[queue->front];
     queue->front = (queue->front + 1) % queue->capacity;
     queue->size--;
@@ -208,6 +372,412 @@ bool parse_authorization_header(const char *authorization_header, char *username
     return true;
 }
 
+/**
+ * @brief Answers a request with a final response from the server itself, typically a refusal.
+ * @param server The server.
+ * @param message The request, the response goes back to its source address.
+ * @param status The status code and reason phrase, e.g. "503 Service Unavailable".
+ * @param extra Additional header lines, each ending with CRLF, or "".
+ * @param via_header The request's headers, as complete header lines.
+ */
+static void send_local_response(sip_server_t *server, sip_message_t *message, const char *status, const char *extra,
+                                const char *via_header, const char *from_header, const char *to_header,
+                                const char *call_id_header, const char *cseq_header) {
+    char refusal[BUFFER_SIZE] = {0};
+    snprintf(refusal, BUFFER_SIZE,
+        "SIP/2.0 %s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s"
+        "User-Agent: TinySIP\r\n"
+        "Content-Length: 0\r\n\r\n",
+        status, via_header, from_header, to_header, call_id_header, cseq_header, extra);
+
+    SIP_TRACE("Tx SIP message %s:\r\n%s\r\n", status, refusal);
+    sip_message_t response;
+    memset(&response, 0, sizeof(response));
+    strncpy(response.buffer, refusal, BUFFER_SIZE - 1);
+    sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+}
+
+/**
+ * @brief Answers a request from the server itself, with the values of the request's headers.
+ * @param to The To of the response, with a tag if it creates or is in a dialog.
+ * @param extra Additional header lines, each ending with CRLF, or "".
+ */
+void sip_server_send_reply(sip_server_t *server, const sip_message_t *message, const char *status,
+                           const char *via, const char *from, const char *to, const char *call_id,
+                           const char *cseq, const char *extra) {
+    sip_message_t response;
+    memset(&response, 0, sizeof(response));
+    snprintf(response.buffer, BUFFER_SIZE,
+        "SIP/2.0 %s\r\n"
+        "Via: %s\r\n"
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %s\r\n"
+        "%s"
+        "User-Agent: TinySIP\r\n"
+        "Content-Length: 0\r\n\r\n",
+        status, via, from, to, call_id, cseq, extra);
+    SIP_TRACE("Tx SIP message %s (response to %s):\r\n%s\r\n", status, cseq, response.buffer);
+    sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+}
+
+/**
+ * @brief Sheds a request with 503 Service Unavailable, asking the UA to retry later.
+ * @param server The server.
+ * @param message The request, the response goes back to its source address.
+ * @param via_header The request's headers, as complete header lines.
+ */
+static void send_service_unavailable(sip_server_t *server, sip_message_t *message, const char *via_header,
+                                     const char *from_header, const char *to_header,
+                                     const char *call_id_header, const char *cseq_header) {
+    send_local_response(server, message, "503 Service Unavailable", "Retry-After: " STRINGIFY(SIP_MEMORY_RETRY_AFTER) "\r\n",
+                        via_header, from_header, to_header, call_id_header, cseq_header);
+}
+
+/**
+ * @brief Tells whether the Contact of a REGISTER is the address it came from, i.e. no NAT is in between.
+ * @param contact_header The Contact header line.
+ * @param ip The source address of the REGISTER.
+ * @param port The source port of the REGISTER.
+ */
+static bool contact_is_source(const char *contact_header, const char *ip, int port) {
+    const char *host = strchr(contact_header, '@');
+    if (host == NULL) {
+        host = strstr(contact_header, "sip:");
+        if (host == NULL) {
+            return true;    // Nothing to compare with
+        }
+        host += strlen("sip");
+    }
+    host++;
+    size_t host_len = strcspn(host, ":;>");
+    int contact_port = host[host_len] == ':' ? atoi(host + host_len + 1) : SIP_PORT;
+    return host_len == strlen(ip) && strncmp(host, ip, host_len) == 0 && contact_port == port;
+}
+
+/**
+ * @brief Arms the keep-alive timer for the next batch, unless it is armed already.
+ * The location lock must be held.
+ */
+static void arm_keepalive_timer(sip_server_t *server) {
+    if (KEEPALIVE_INTERVAL_MS > 0 && !server->store->keepalive_pending) {
+        server->store->keepalive_pending = true;
+        sip_timer_arm(&server->store->timers, KEEPALIVE_TIMER_ID,
+                      sip_server_now_ms(server) + KEEPALIVE_INTERVAL_MS / KEEPALIVE_SLOTS);
+    }
+}
+
+/**
+ * @brief Copies the user part of the first sip: or tel: URI of a header.
+ * @return true if a non-empty user part fits in size.
+ */
+bool sip_header_username(const char *header, char *username, size_t size) {
+    const char *start = strstr(header, "sip:");
+    if (start == NULL) {
+        start = strstr(header, "tel:");
+    }
+    if (start == NULL) {
+        return false;
+    }
+    start += strlen("sip:");
+    size_t len = strcspn(start, "@;>: \r\n");
+    if (len == 0 || len >= size) {
+        return false;
+    }
+    memcpy(username, start, len);
+    username[len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Copies the value of a header, without its name and leading spaces.
+ * @return true if the header is present and its value fits in size.
+ */
+bool sip_header_value(const char *buffer, const char *name, char *value, size_t size) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+    const char *start = strstr(buffer, pattern);
+    if (start == NULL) {
+        return false;
+    }
+    start += strlen(pattern);
+    while (*start == ' ') {
+        start++;
+    }
+    size_t len = strcspn(start, "\r\n");
+    if (len >= size) {
+        return false;
+    }
+    memcpy(value, start, len);
+    value[len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Finds a header line of a message without copying it.
+ * @param name The header name with its colon and space, e.g. "Via: ".
+ * @param len Set to the length of the line without its CRLF, 0 if the header is missing.
+ * @return The start of the line, NULL if the header is missing.
+ */
+static const char *find_header_line(const char *buffer, const char *name, size_t *len) {
+    *len = 0;
+    const char *start = strstr(buffer, name);
+    if (start == NULL) {
+        return NULL;
+    }
+    const char *end = strstr(start, "\r\n");
+    if (end == NULL) {
+        return NULL;
+    }
+    *len = (size_t)(end - start);
+    return start;
+}
+
+/**
+ * @brief Finds a header line by its full or its compact name, e.g. "Supported" or "k".
+ * @param len Set to the length of the line without its CRLF, 0 if the header is missing.
+ * @return The start of the line, NULL if the header is missing.
+ */
+static const char *find_header_line_any_form(const char *buffer, const char *name, const char *compact, size_t *len) {
+    const char *names[2] = { name, compact };
+    *len = 0;
+    for (int i = 0; i < 2; i++) {
+        char pattern[32];
+        snprintf(pattern, sizeof(pattern), "\r\n%s:", names[i]);
+        const char *start = strstr(buffer, pattern);
+        if (start != NULL) {
+            return find_header_line(start + 2, pattern + 2, len);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the Session-Expires of a message (RFC 4028), in its full or compact form.
+ * @param refresher Set to the refresher parameter, "uac" or "uas", or "" if there is none.
+ * @return The session interval in seconds, 0 if the header is missing.
+ */
+static int session_expires_of(const char *buffer, const char **refresher) {
+    size_t len;
+    const char *line = find_header_line_any_form(buffer, "Session-Expires", "x", &len);
+    *refresher = "";
+    if (line == NULL) {
+        return 0;
+    }
+    if (memmem(line, len, "refresher=uac", strlen("refresher=uac")) != NULL) {
+        *refresher = "uac";
+    } else if (memmem(line, len, "refresher=uas", strlen("refresher=uas")) != NULL) {
+        *refresher = "uas";
+    }
+    return atoi(line + strcspn(line, ":") + 1);
+}
+
+/**
+ * @brief Tells whether a message carries a body after its headers.
+ */
+static bool has_body(const char *buffer) {
+    const char *end_of_headers = strstr(buffer, "\r\n\r\n");
+    return end_of_headers != NULL && end_of_headers[4] != '\0';
+}
+
+/**
+ * @brief Tells whether a request lists the timer option (RFC 4028) in its Supported header.
+ */
+static bool supports_session_timer(const char *buffer) {
+    size_t len;
+    const char *line = find_header_line_any_form(buffer, "Supported", "k", &len);
+    return line != NULL && memmem(line, len, "timer", strlen("timer")) != NULL;
+}
+
+/**
+ * @brief Time from a refresh until a session is given up on: the interval, less a third of it
+ * or 32 seconds, whichever is less, for the refresh in flight (RFC 4028 section 10).
+ */
+static uint64_t session_timeout_ms(const call_t *call) {
+    int margin = call->session_expires / 3 < 32 ? call->session_expires / 3 : 32;
+    return (uint64_t)(call->session_expires - margin) * 1000;
+}
+
+/**
+ * @brief Returns the length of a Contact line up to its expires parameter, if it has one.
+ * A parameter inside the <> of the URI belongs to the URI and is not looked at.
+ */
+static size_t contact_binding_length(const char *contact, size_t contact_len) {
+    size_t params = 0;
+    for (size_t i = 0; i < contact_len; i++) {
+        if (contact[i] == '>') {
+            params = i;
+        }
+    }
+    for (size_t i = params; i + strlen(";expires=") <= contact_len; i++) {
+        if (strncmp(contact + i, ";expires=", strlen(";expires=")) == 0) {
+            return i;
+        }
+    }
+    return contact_len;
+}
+
+/**
+ * @brief Returns the expiry a REGISTER asks for, in seconds.
+ *
+ * The Contact's expires parameter takes precedence over the Expires header (RFC 3261 10.2.1.1).
+ * @return The requested expiry, -1 if the REGISTER asks for none.
+ */
+static int requested_expires(const char *buffer, const char *contact, size_t contact_len) {
+    size_t binding_len = contact_binding_length(contact, contact_len);
+    if (binding_len < contact_len) {
+        return atoi(contact + binding_len + strlen(";expires="));
+    }
+    size_t len;
+    const char *expires = find_header_line(buffer, "\r\nExpires: ", &len);
+    if (expires != NULL) {
+        return atoi(expires + strlen("\r\nExpires: "));
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the expiry granted to a REGISTER, in seconds.
+ *
+ * Requests without an expiry get REGISTRATION_EXPIRES, longer ones are cut down to
+ * REGISTRATION_MAX_EXPIRES. With REGISTRATION_JITTER_PERCENT, up to that share is taken off,
+ * derived from the Call-ID: each binding keeps the same expiry, but bindings that registered
+ * together (e.g. after a power cut) drift apart instead of refreshing in the same second.
+ * @param requested The requested expiry, -1 if none, at least REGISTRATION_MIN_EXPIRES otherwise.
+ * @param call_id_header The Call-ID line of the REGISTER.
+ */
+static int grant_expires(int requested, const char *call_id_header) {
+    int granted = requested < 0 ? REGISTRATION_EXPIRES : requested;
+    if (granted > REGISTRATION_MAX_EXPIRES) {
+        granted = REGISTRATION_MAX_EXPIRES;
+    }
+    if (REGISTRATION_JITTER_PERCENT > 0) {
+        uint64_t hash = FNV_OFFSET_BASIS;
+        for (const char *p = call_id_header; *p != '\0'; p++) {
+            hash = (hash ^ (unsigned char)*p) * FNV_PRIME;
+        }
+        int jitter = (int)(hash % ((uint64_t)granted * REGISTRATION_JITTER_PERCENT / 100 + 1));
+        if (granted - jitter >= REGISTRATION_MIN_EXPIRES) {
+            granted -= jitter;
+        }
+    }
+    return granted;
+}
+
+/**
+ * @brief Answers a REGISTER with 200 OK, the binding's Contact and the granted expiry.
+ * @param via_header The request's headers, as complete header lines.
+ * @param contact_header The Contact line, only its first binding_len characters are sent.
+ */
+static void send_register_ok(sip_server_t *server, sip_message_t *message, const char *via_header,
+                             const char *from_header, const char *to_header, const char *call_id_header,
+                             const char *cseq_header, const char *contact_header, size_t binding_len, int expires) {
+    sip_message_t response;
+    memset(&response, 0, sizeof(response));
+    snprintf(response.buffer, BUFFER_SIZE,
+        "SIP/2.0 200 OK\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%s\r\n"
+        "%.*s;expires=%d\r\n"
+        "Content-Length: 0\r\n\r\n",
+        via_header, from_header, to_header, call_id_header, cseq_header,
+        (int)binding_len, contact_header, expires);
+
+    //printf("\r\n===========================================================\r\n");
+    SIP_TRACE("Tx SIP message 200 OK(response to REGISTER):\r\n%s\r\n", response.buffer);
+    //printf("==============================================================\r\n");
+    sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+}
+
+/**
+ * @brief Checks that a cached line is followed by CRLF and equals a line of the message.
+ * @return The cached text after the line, NULL if it doesn't match.
+ */
+static const char *match_cached_line(const char *cached, const char *line, size_t len) {
+    if (strncmp(cached, line, len) != 0 || strncmp(cached + len, "\r\n", 2) != 0) {
+        return NULL;
+    }
+    return cached + len + 2;
+}
+
+/**
+ * @brief Answers a REGISTER refresh that changes nothing from the binding's cache.
+ *
+ * Most REGISTERs are periodic refreshes: same source address, same From, To, Call-ID and
+ * Contact, same requested expiry. Those only need the registration timer re-armed and a
+ * 200 OK with the new Via and CSeq, which is put together from the lines kept by the last
+ * full handle_register() run, without copying and logging every header again.
+ * @return true if the REGISTER was answered, false if it needs the full path.
+ */
+static bool answer_cached_refresh(sip_server_t *server, sip_message_t *message) {
+    size_t via_len, from_len, to_len, call_id_len, cseq_len, contact_len;
+    const char *via = find_header_line(message->buffer, "Via: ", &via_len);
+    const char *from = find_header_line(message->buffer, "From: ", &from_len);
+    const char *to = find_header_line(message->buffer, "To: ", &to_len);
+    const char *call_id = find_header_line(message->buffer, "Call-ID: ", &call_id_len);
+    const char *cseq = find_header_line(message->buffer, "CSeq: ", &cseq_len);
+    const char *contact = find_header_line(message->buffer, "Contact: ", &contact_len);
+    if (via == NULL || from == NULL || to == NULL || call_id == NULL || cseq == NULL || contact == NULL) {
+        return false;
+    }
+    char username[MAX_USERNAME_LENGTH];
+    location_entry_t *user;
+    if (!sip_header_username(from, username, sizeof(username)) ||
+        (user = find_location_entry_by_userid(server, username)) == NULL) {
+        return false;
+    }
+    int requested = requested_expires(message->buffer, contact, contact_len);
+    size_t binding_len = contact_binding_length(contact, contact_len);
+    int port = ntohs(message->client_addr.sin_port);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &message->client_addr.sin_addr, ip, sizeof(ip));
+
+    int index = (int)(user - server->store->location_entries);
+    const registration_cache_t *cache = &server->store->registration_cache[index];
+    sip_message_t response;
+    shm_mutex_lock(&server->store->location_mutex);
+    const char *rest = cache->dialog;
+    bool hit = cache->valid && user->registered && requested != 0 &&
+               cache->requested_expires == requested &&
+               cache->source_port == port && strcmp(cache->source_ip, ip) == 0 &&
+               (rest = match_cached_line(rest, from, from_len)) != NULL &&
+               (rest = match_cached_line(rest, to, to_len)) != NULL &&
+               (rest = match_cached_line(rest, call_id, call_id_len)) != NULL &&
+               strlen(cache->contact) == binding_len && strncmp(cache->contact, contact, binding_len) == 0;
+    if (hit) {
+        sip_timer_arm(&server->store->timers, LOCATION_TIMER_ID(index),
+                      sip_server_now_ms(server) + (uint64_t)cache->granted_expires * 1000);
+        memset(&response, 0, sizeof(response));
+        snprintf(response.buffer, BUFFER_SIZE,
+            "SIP/2.0 200 OK\r\n"
+            "%.*s\r\n"
+            "%s"
+            "%.*s\r\n"
+            "%s;expires=%d\r\n"
+            "Content-Length: 0\r\n\r\n",
+            (int)via_len, via, cache->dialog, (int)cseq_len, cseq, cache->contact, cache->granted_expires);
+    }
+    pthread_mutex_unlock(&server->store->location_mutex);
+    if (!hit) {
+        return false;
+    }
+
+    atomic_fetch_add(&server->store->registration_cache_hits, 1);
+    SIP_TRACE("REGISTER refresh of user %s unchanged, 200 OK from cache\n", username);
+    sip_server_send(server, &response, ip, port);
+    return true;
+}
+
 /**
  * @brief Handles SIP REGISTER messages.
  *
@@ -215,11 +785,18 @@ bool parse_authorization_header(const char *authorization_header, char *username
  * and if the user is found, registers the user, sends a 200 OK response,
  * and records the source address and source port of the incoming request.
  * If the user is not found, it sends a 404 Not Found response.
+ * The granted expiry follows REGISTRATION_MIN/MAX_EXPIRES: too short a request gets
+ * 423 Interval Too Brief, an expiry of 0 removes the binding. Unchanged refreshes are
+ * answered by answer_cached_refresh().
  * Authentication (e.g., Digest) is currently not performed but will be implemented in the future (TODO).
+ * @param server The server handling the message
  * @param message A pointer to the sip_message_t struct containing the received data
- * @return 0 for success, -1 if message is invalid
+ * @return How the REGISTER was answered, COST_REGISTER_INVALID if message is invalid
  */
-int handle_register(sip_message_t *message) {
+static cost_register_outcome_t register_binding(sip_server_t *server, sip_message_t *message) {
+    if (answer_cached_refresh(server, message)) {
+        return COST_REGISTER_CACHED;
+    }
 
     char *from_start = strstr(message->buffer, "From: ");
     char *via_start = strstr(message->buffer, "Via: ");
@@ -237,7 +814,7 @@ int handle_register(sip_message_t *message) {
     
     char response_buffer[BUFFER_SIZE] = {0};
 
-    printf("Extracted Headers: \r\n");
+    SIP_TRACE("Extracted Headers: \r\n");
 
     if (via_start != NULL) {
         char *via_end = strstr(via_start, "\r\n");
@@ -245,7 +822,7 @@ int handle_register(sip_message_t *message) {
             size_t via_len = via_end - via_start;
             strncpy(via_header, via_start, via_len);
             via_header[via_len] = '\0';
-            printf("[%s]\r\n", via_header);
+            SIP_TRACE("[%s]\r\n", via_header);
         }
     }
 
@@ -255,7 +832,7 @@ int handle_register(sip_message_t *message) {
             size_t from_len = from_end - from_start;
             strncpy(from_header, from_start, from_len);
             from_header[from_len] = '\0';
-            printf("[%s]\r\n", from_header);
+            SIP_TRACE("[%s]\r\n", from_header);
         }
     }
 
@@ -265,7 +842,7 @@ int handle_register(sip_message_t *message) {
             size_t to_len = to_end - to_start;
             strncpy(to_header, to_start, to_len);
             to_header[to_len] = '\0';
-            printf("[%s]\r\n", to_header);
+            SIP_TRACE("[%s]\r\n", to_header);
         }
     }
 
@@ -275,7 +852,7 @@ int handle_register(sip_message_t *message) {
             size_t cseq_len = cseq_end - cseq_start;
             strncpy(cseq_header, cseq_start, cseq_len);
             cseq_header[cseq_len] = '\0';
-            printf("[%s]\r\n", cseq_header);
+            SIP_TRACE("[%s]\r\n", cseq_header);
         }
     }
 
@@ -285,7 +862,7 @@ int handle_register(sip_message_t *message) {
             size_t call_id_len = call_id_end - call_id_start;
             strncpy(call_id_header, call_id_start, call_id_len);
             call_id_header[call_id_len] = '\0';
-            printf("[%s]\r\n", call_id_header);
+            SIP_TRACE("[%s]\r\n", call_id_header);
         }
     }
 
@@ -295,25 +872,25 @@ int handle_register(sip_message_t *message) {
             size_t contact_len = contact_end - contact_start;
             strncpy(contact_header, contact_start, contact_len);
             contact_header[contact_len] = '\0';
-            printf("[%s]\r\n", contact_header);
+            SIP_TRACE("[%s]\r\n", contact_header);
         }
     }
 
     char *from_header_user_start = strstr(from_header, "sip:");
-    if (from_header_user_start == NULL) return -1;
+    if (from_header_user_start == NULL) return COST_REGISTER_INVALID;
     from_header_user_start += strlen("sip:");
     char *from_header_user_end = strchr(from_header_user_start, '@');
-    if (from_header_user_end == NULL) return -1;
+    if (from_header_user_end == NULL) return COST_REGISTER_INVALID;
   
     size_t username_len = from_header_user_end - from_header_user_start;
     if (username_len >= MAX_USERNAME_LENGTH) {
-        return -1; // Username too long
+        return COST_REGISTER_INVALID; // Username too long
     }
     char username[MAX_USERNAME_LENGTH] = {0};
     strncpy(username, from_header_user_start, username_len);
     username[username_len] = '\0';
 
-    location_entry_t *user = find_location_entry_by_userid(username);
+    location_entry_t *user = find_location_entry_by_userid(server, username);
     if (user == NULL) {
          snprintf(response_buffer, BUFFER_SIZE,
                  "SIP/2.0 404 Not Found\r\n"
@@ -329,114 +906,802 @@ int handle_register(sip_message_t *message) {
                  call_id_header,
                  cseq_header
             );
-        printf("User '%s' not found. Sending 404 Not Found.\n", username);
+        SIP_TRACE("User '%s' not found. Sending 404 Not Found.\n", username);
+        user_filter_remember_rejection(&server->store->user_filter, username,
+                                       &message->client_addr.sin_addr, sip_server_now_ms(server));
         
         //printf("\r\n===========================================================\r\n");
-        printf("Tx SIP message 404 Not Found:\r\n%s\r\n", response_buffer);
+        SIP_TRACE("Tx SIP message 404 Not Found:\r\n%s\r\n", response_buffer);
         //printf("==============================================================\r\n");
         sip_message_t response;
         memset(&response, 0, sizeof(response));
         strncpy(response.buffer, response_buffer, BUFFER_SIZE-1);
-        send_sip_message(&response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+        sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
 
-       return 0;
+       return COST_REGISTER_UNKNOWN_USER;
     }
    
 
     char temp_ip[INET_ADDRSTRLEN] = {0};
     int temp_port = 0;
+    int index = (int)(user - server->store->location_entries);
+    registration_cache_t *cache = &server->store->registration_cache[index];
 
     inet_ntop(AF_INET, &(message->client_addr.sin_addr), temp_ip, INET_ADDRSTRLEN);
     temp_port = ntohs(message->client_addr.sin_port);
+
+    size_t contact_len = strlen(contact_header);
+    int requested = requested_expires(message->buffer, contact_header, contact_len);
+    size_t binding_len = contact_binding_length(contact_header, contact_len);
+    if (requested == 0) {
+        // Removes the binding, see RFC 3261 10.2.2
+        bool removed = false;
+        shm_mutex_lock(&server->store->location_mutex);
+        if (user->registered) {
+            user->registered = false;
+            user->nated = false;
+            sip_memory_credit(&server->store->memory, SIP_MEMORY_REGISTRAR, sizeof(location_entry_t));
+            sip_timer_cancel(&server->store->timers, LOCATION_TIMER_ID(index));
+            removed = true;
+        }
+        cache->valid = false;
+        pthread_mutex_unlock(&server->store->location_mutex);
+        if (removed) {
+            sip_subscriptions_changed(server, index);
+        }
+        SIP_TRACE("User %s unregistered\n", user->username);
+        send_register_ok(server, message, via_header, from_header, to_header, call_id_header, cseq_header,
+                         contact_header, binding_len, 0);
+        return COST_REGISTER_REMOVED;
+    }
+    if (requested > 0 && requested < REGISTRATION_MIN_EXPIRES) {
+        snprintf(response_buffer, BUFFER_SIZE,
+                 "SIP/2.0 423 Interval Too Brief\r\n"
+                 "%s\r\n"
+                 "%s\r\n"
+                 "%s\r\n"
+                 "%s\r\n"
+                 "%s\r\n"
+                 "Min-Expires: %d\r\n"
+                 "Content-Length: 0\r\n\r\n",
+                 via_header, from_header, to_header, call_id_header, cseq_header, REGISTRATION_MIN_EXPIRES);
+        SIP_TRACE("Tx SIP message 423 Interval Too Brief:\r\n%s\r\n", response_buffer);
+        sip_message_t response;
+        memset(&response, 0, sizeof(response));
+        strncpy(response.buffer, response_buffer, BUFFER_SIZE-1);
+        sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+        return COST_REGISTER_TOO_BRIEF;
+    }
+    int granted = grant_expires(requested, call_id_header);
+
+    shm_mutex_lock(&server->store->location_mutex);
+    // A new binding takes registrar memory, a refresh keeps the one it holds
+    if (!user->registered && !sip_memory_charge(&server->store->memory, SIP_MEMORY_REGISTRAR, sizeof(location_entry_t))) {
+        pthread_mutex_unlock(&server->store->location_mutex);
+        SIP_TRACE("Registrar memory ceiling reached. Rejecting REGISTER of user '%s'.\n", username);
+        send_service_unavailable(server, message, via_header, from_header, to_header, call_id_header, cseq_header);
+        return COST_REGISTER_REFUSED;
+    }
     strncpy(user->ip_str, temp_ip, INET_ADDRSTRLEN - 1);
     user->port = temp_port;
     user->registered = true;
-    printf("User %s registered successfully from %s:%d\n", user->username, user->ip_str, user->port);
-    printf("Location entry for user '%s' updated to IP: %s, Port: %d\n", user->username, user->ip_str, user->port);
+    // Behind a NAT the binding only stays open if something crosses it regularly
+    user->nated = !contact_is_source(contact_header, temp_ip, temp_port);
+    if (user->nated) {
+        arm_keepalive_timer(server);
+    }
+    sip_timer_arm(&server->store->timers, LOCATION_TIMER_ID(index),
+                  sip_server_now_ms(server) + (uint64_t)granted * 1000);
+    // Refreshes of this binding that change nothing are answered from here, see answer_cached_refresh()
+    cache->valid = true;
+    memcpy(cache->source_ip, temp_ip, sizeof(cache->source_ip));
+    cache->source_port = temp_port;
+    cache->requested_expires = requested;
+    cache->granted_expires = granted;
+    snprintf(cache->dialog, sizeof(cache->dialog), "%s\r\n%s\r\n%s\r\n", from_header, to_header, call_id_header);
+    snprintf(cache->contact, sizeof(cache->contact), "%.*s", (int)binding_len, contact_header);
+    pthread_mutex_unlock(&server->store->location_mutex);
+    sip_subscriptions_changed(server, index);
+    sip_im_user_registered(server, index);
+    SIP_TRACE("User %s registered successfully from %s:%d\n", user->username, temp_ip, temp_port);
+    SIP_TRACE("Location entry for user '%s' updated to IP: %s, Port: %d\n", user->username, temp_ip, temp_port);
+
+    SIP_TRACE("REGISTER successful. Sending 200 OK.\n");
+    send_register_ok(server, message, via_header, from_header, to_header, call_id_header, cseq_header,
+                     contact_header, binding_len, granted);
+    return COST_REGISTER_BOUND;
+}
 
-   snprintf(response_buffer, BUFFER_SIZE,
-        "SIP/2.0 200 OK\r\n"
-        "%.*s\r\n"
-        "%.*s\r\n"
-        "%.*s\r\n"
-        "%.*s\r\n"
-        "%.*s\r\n"
-         "%.*s;expires=7200\r\n"
-         "Content-Length: 0\r\n\r\n",
-        (int)strlen(via_header), via_header,
-        (int)strlen(from_header), from_header,
-        (int)strlen(to_header), to_header,
-        (int)strlen(call_id_header), call_id_header,
-        (int)strlen(cseq_header), cseq_header,
-        (int)strlen(contact_header), contact_header
-        );    
-    
-    printf("REGISTER successful. Sending 200 OK.\n");
+/**
+ * @brief Handles SIP REGISTER messages, see register_binding().
+ * @param server The server handling the message
+ * @param message A pointer to the sip_message_t struct containing the received data
+ * @return 0 for success, -1 if message is invalid
+ */
+int handle_register(sip_server_t *server, sip_message_t *message) {
+#ifdef COST_COUNTERS
+    uint64_t started = cost_cycles();
+#endif
+    cost_register_outcome_t outcome = register_binding(server, message);
+#ifdef COST_COUNTERS
+    cost_count_register(&server->store->costs, outcome, cost_cycles() - started);
+#endif
+    return outcome == COST_REGISTER_INVALID ? -1 : 0;
+}
 
-    //printf("\r\n===========================================================\r\n");
-    printf("Tx SIP message 200 OK(response to REGISTER):\r\n%s\r\n", response_buffer);
-    //printf("==============================================================\r\n");
-    sip_message_t response;
-    memset(&response, 0, sizeof(response));
-    strncpy(response.buffer, response_buffer, BUFFER_SIZE-1);
-    send_sip_message(&response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
-  
-    return 0;
+/**
+ * @brief (Re)starts the timer of a call, replacing any running one.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ * @param timeout_ms Time from now until sip_server_run_timers() gives up on the call.
+ */
+static void arm_call_timer(sip_server_t *server, call_t *call, uint64_t timeout_ms) {
+    sip_timer_arm(&server->store->timers, CALL_TIMER_ID(call->index), sip_server_now_ms(server) + timeout_ms);
 }
 
 /**
- * @brief State machine processing function.
- * @param call A pointer to the call struct (or NULL if not found).
- * @param message_type Request Method or Status Code (REQUEST_METHOD or STATUS_CODE).
- * @param method_or_code The parsed Request Method (INVITE, ACK, BYE, etc.) or Status Code string.
- * @param has_sdp A boolean value indicating if a remote media description exists.
- * @param message A pointer to the sip_message_t struct containing full message information, used for getting client transport address
- * @param raw_sip_message A pointer to the raw SIP message buffer for further parsing.
- * @param leg_type The leg type where the call_id was found. Indicates which leg (a or b) the SIP message was received from.
+ * @brief Moves a call to a new state and publishes its summary for the admin socket.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ * @param state The new state.
  */
-void handle_state_machine(call_t *call, int message_type, const char *method_or_code, bool has_sdp, sip_message_t *message, const char *raw_sip_message, int leg_type) {
-    (void)raw_sip_message;
-    char *from_start = strstr(message->buffer, "From: ");
-    char *via_start = strstr(message->buffer, "Via: ");
-    char *cseq_start = strstr(message->buffer, "CSeq: ");
-    char *to_start = strstr(message->buffer, "To: ");
-    char *call_id_start = strstr(message->buffer, "Call-ID: ");
-    
-    char from_header[HEADER_SIZE] = {0};
-    char via_header[HEADER_SIZE] = {0};
-    char cseq_header[HEADER_SIZE] = {0};
-    char to_header[HEADER_SIZE] = {0};
-    char call_id_header[HEADER_SIZE] = {0};
+static void set_call_state(sip_server_t *server, call_t *call, call_state_t state) {
+    uint64_t now_ms = sip_server_now_ms(server);
+    call_summary_t summary;
+    memset(&summary, 0, sizeof(summary));
+    call->call_state = state;
+    summary.active = call->is_active;
+    summary.state = state;
+    strncpy(summary.call_id, call->a_leg_uuid, sizeof(summary.call_id) - 1);
+    strncpy(summary.caller, call->caller, sizeof(summary.caller) - 1);
+    strncpy(summary.callee, call->callee, sizeof(summary.callee) - 1);
+    strncpy(summary.a_leg_ip_str, call->a_leg_ip_str, sizeof(summary.a_leg_ip_str) - 1);
+    summary.a_leg_port = call->a_leg_port;
+    strncpy(summary.b_leg_ip_str, call->b_leg_ip_str, sizeof(summary.b_leg_ip_str) - 1);
+    summary.b_leg_port = call->b_leg_port;
+    // Only the call's worker writes the summary, it can read its own writes without the seqlock
+    summary.started_ms = state == CALL_STATE_ROUTING ? now_ms : call->summary.started_ms;
+    summary.state_ms = now_ms;
+    shm_seqlock_write(&call->summary_lock, &call->summary, &summary, sizeof(summary));
+}
 
-    printf("Extracted Headers: \r\n");
+/**
+ * @brief Stops the timer of a call and returns the call to the call map.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ */
+static void end_call(sip_server_t *server, call_t *call) {
+    sip_timer_cancel(&server->store->timers, CALL_TIMER_ID(call->index));
+    sip_presence_call_ended(server, call);
+    call_limits_release(&server->store->call_limits, &call->limits);
+    release_call(&server->store->call_map, call);
+    sip_memory_credit(&server->store->memory, SIP_MEMORY_CALLS, sizeof(call_t));
+}
 
-    if (via_start != NULL) {
-        char *via_end = strstr(via_start, "\r\n");
-        if (via_end != NULL) {
-            size_t via_len = via_end - via_start;
-            strncpy(via_header, via_start, via_len);
-            via_header[via_len] = '\0';
-            printf("[%s]\r\n", via_header);
+/**
+ * @brief Puts a message together from segments, like writev() into the message buffer.
+ * What doesn't fit in BUFFER_SIZE - 1 bytes is cut off, like the snprintf()-built messages.
+ * @param message The message to fill.
+ * @param segments The pieces of the message, in order.
+ * @param count Number of segments.
+ */
+static void gather_message(sip_message_t *message, const struct iovec *segments, size_t count) {
+    memset(message, 0, sizeof(*message));
+    size_t len = 0;
+    for (size_t i = 0; i < count && len < BUFFER_SIZE - 1; i++) {
+        size_t n = segments[i].iov_len;
+        if (n > BUFFER_SIZE - 1 - len) {
+            n = BUFFER_SIZE - 1 - len;
         }
+        memcpy(message->buffer + len, segments[i].iov_base, n);
+        len += n;
     }
+}
 
-    if (from_start != NULL) {
-        char *from_end = strstr(from_start, "\r\n");
-        if (from_end != NULL) {
-            size_t from_len = from_end - from_start;
-            strncpy(from_header, from_start, from_len);
-            from_header[from_len] = '\0';
-            printf("[%s]\r\n", from_header);
-        }
+/**
+ * @brief Serialises the lines shared by the responses to A's INVITE, once its headers are stored.
+ * @param call The call, its lock must be held.
+ */
+static void serialise_a_leg_headers(call_t *call) {
+    sip_header_info_t *leg = &call->a_leg_header;
+    leg->block_len = 0;
+    if (leg->from[0] == '\0' || leg->via[0] == '\0' || leg->cseq[0] == '\0' || leg->to[0] == '\0') {
+        return;
+    }
+    int len = snprintf(leg->block, sizeof(leg->block), "%s\r\n%s\r\n%s\r\nCall-ID: %s\r\n%s\r\nUser-Agent: TinySIP\r\n",
+                       leg->via, leg->from, leg->to, call->a_leg_uuid, leg->cseq);
+    if (len > 0 && (size_t)len < sizeof(leg->block)) {
+        leg->block_len = (size_t)len;
     }
+}
 
-    if (to_start != NULL) {
+/**
+ * @brief Serialises the From, To and Call-ID lines of the server's requests on the B leg.
+ * Called when the INVITE to B is built and again when B's To changes.
+ * @param call The call, its lock must be held.
+ */
+static void serialise_b_leg_dialog(call_t *call) {
+    sip_header_info_t *leg = &call->b_leg_header;
+    leg->block_len = 0;
+    if (leg->from[0] == '\0' || leg->to[0] == '\0') {
+        return;
+    }
+    int len = snprintf(leg->block, sizeof(leg->block), "%s\r\n%s\r\nCall-ID: %s\r\n",
+                       leg->from, leg->to, call->b_leg_uuid);
+    if (len > 0 && (size_t)len < sizeof(leg->block)) {
+        leg->block_len = (size_t)len;
+    }
+}
+
+/**
+ * @brief Sends a response to A's INVITE made of its status, the serialised A leg lines and a tail.
+ * Nothing is sent if the A leg lines are unknown.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ * @param status The status code and reason, e.g. "180 Ringing".
+ * @param contact SERVER_CONTACT_LINE, or "" for none.
+ * @param tail The rest of the message: NO_BODY, or the Content-Type line of the SDP forwarded and what follows it.
+ * @param description What the response is, for the log.
+ */
+static void send_a_leg_response(sip_server_t *server, call_t *call, const char *status,
+                                const char *contact, const char *tail, const char *description) {
+    if (call->a_leg_header.block_len == 0) {
+        return;
+    }
+    const struct iovec segments[] = {
+        LITERAL_SEGMENT("SIP/2.0 "),
+        { (void *)status, strlen(status) },
+        LITERAL_SEGMENT("\r\n"),
+        { call->a_leg_header.block, call->a_leg_header.block_len },
+        { (void *)contact, strlen(contact) },
+        { (void *)tail, strlen(tail) },
+    };
+    sip_message_t response;
+    gather_message(&response, segments, sizeof(segments) / sizeof(segments[0]));
+    SIP_TRACE("Tx SIP message %s:\r\n%s\r\n", description, response.buffer);
+    sip_server_send(server, &response, call->a_leg_ip_str, call->a_leg_port);
+}
+
+/**
+ * @brief Sends a request to B: request line and Via, the serialised B leg lines, then the rest.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ * @param head The request line and the Via line.
+ * @param rest The lines after Call-ID, up to the end of the message.
+ * @param description What the request is, for the log.
+ */
+static void send_b_leg_request(sip_server_t *server, call_t *call, const char *head, const char *rest,
+                               const char *description) {
+    const struct iovec segments[] = {
+        { (void *)head, strlen(head) },
+        { call->b_leg_header.block, call->b_leg_header.block_len },
+        { (void *)rest, strlen(rest) },
+    };
+    sip_message_t request;
+    gather_message(&request, segments, sizeof(segments) / sizeof(segments[0]));
+    SIP_TRACE("Tx SIP message %s:\r\n%s\r\n", description, request.buffer);
+    sip_server_send(server, &request, call->b_leg_ip_str, call->b_leg_port);
+}
+
+/**
+ * @brief Sends the server's BYE to B, with a new Via and CSeq.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ */
+static void send_bye_to_b_leg(sip_server_t *server, call_t *call) {
+    // Generate Via header for b-leg
+    snprintf(call->b_leg_header.via, HEADER_SIZE, "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
+        SIP_SERVER_IP_ADDRESS,
+        SIP_PORT,
+        (unsigned long)time(NULL)
+    );
+
+    char bye_head[BUFFER_SIZE] = {0};
+    char bye_rest[HEADER_SIZE] = {0};
+    snprintf(bye_head, BUFFER_SIZE, "BYE sip:%s@%s:%d SIP/2.0\r\n%s",
+             call->callee, call->b_leg_ip_str, call->b_leg_port, call->b_leg_header.via);
+    snprintf(bye_rest, HEADER_SIZE,
+        "CSeq: %d BYE\r\n"
+        "User-Agent: TinySIP\r\n"
+        "Content-Length: 0\r\n\r\n",
+        next_cseq_number(server)
+    );
+    send_b_leg_request(server, call, bye_head, bye_rest, "BYE to B leg");
+}
+
+/**
+ * @brief Serialises the From, To and Call-ID lines of the server's requests on the A leg: the
+ * From and To of A's INVITE swapped.
+ * @param call The call, its lock must be held.
+ * @param lines Receives the lines, each followed by CRLF.
+ * @param size Size of lines.
+ * @return The length of the lines, 0 if they don't fit.
+ */
+static size_t serialise_a_leg_dialog(const call_t *call, char *lines, size_t size) {
+    const char *from = strstr(call->a_leg_header.from, "From: ");
+    const char *to = strstr(call->a_leg_header.to, "To: ");
+    int len = snprintf(lines, size, "From: %s\r\nTo: %s\r\nCall-ID: %s\r\n",
+                       to != NULL ? to + strlen("To: ") : "",
+                       from != NULL ? from + strlen("From: ") : "",
+                       call->a_leg_uuid);
+    return len > 0 && (size_t)len < size ? (size_t)len : 0;
+}
+
+/**
+ * @brief Sends the server's BYE to A's Contact, with a new Via and CSeq and the From and To
+ * of A's INVITE swapped.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ */
+static void send_bye_to_a_leg(sip_server_t *server, call_t *call) {
+    // Generate Via header for a-leg
+    snprintf(call->a_leg_header.via, HEADER_SIZE, "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
+        SIP_SERVER_IP_ADDRESS,
+        SIP_PORT,
+        (unsigned long)time(NULL)
+    );
+
+    char bye_head[BUFFER_SIZE] = {0};
+    char dialog[LEG_HEADER_BLOCK_SIZE];
+    char bye_rest[HEADER_SIZE] = {0};
+    snprintf(bye_head, BUFFER_SIZE, "BYE %s SIP/2.0\r\n%s", call->a_leg_contact, call->a_leg_header.via);
+    size_t dialog_len = serialise_a_leg_dialog(call, dialog, sizeof(dialog));
+    snprintf(bye_rest, HEADER_SIZE,
+        "CSeq: %d BYE\r\n"
+        "User-Agent: TinySIP\r\n"
+        "Content-Length: 0\r\n\r\n",
+        next_cseq_number(server)
+    );
+    const struct iovec segments[] = {
+        { bye_head, strlen(bye_head) },
+        { dialog, dialog_len },
+        { bye_rest, strlen(bye_rest) },
+    };
+    sip_message_t bye;
+    gather_message(&bye, segments, sizeof(segments) / sizeof(segments[0]));
+    SIP_TRACE("Tx SIP message BYE to A leg:\r\n%s\r\n", bye.buffer);
+    sip_server_send(server, &bye, call->a_leg_ip_str, call->a_leg_port);
+}
+
+/**
+ * @brief Tells whether a header line has the given name, in full or compact form.
+ * @param line The header line.
+ * @param len Length of the line, without its CRLF.
+ * @param name The name, e.g. "Call-ID".
+ * @param compact The compact form, e.g. "i", or NULL if it has none.
+ */
+static bool header_is(const char *line, size_t len, const char *name, const char *compact) {
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL) {
+        return false;
+    }
+    size_t name_len = (size_t)(colon - line);
+    while (name_len > 0 && (line[name_len - 1] == ' ' || line[name_len - 1] == '\t')) {
+        name_len--;
+    }
+    return (name_len == strlen(name) && strncasecmp(line, name, name_len) == 0) ||
+           (compact != NULL && name_len == strlen(compact) && strncasecmp(line, compact, name_len) == 0);
+}
+
+/**
+ * @brief Sorts the header lines of a message relayed between the legs of a connected call.
+ *
+ * The Via, From, To, Call-ID and CSeq lines are the sender's transaction, copied to transaction
+ * if given. Contact, Route and Record-Route lines are dropped, the other leg gets the server's
+ * Contact. All other lines, then the empty line and the body, are passed on where they are in
+ * the message: passed gets segments of the buffer, consecutive lines in one segment.
+ * @param buffer The message.
+ * @param passed Receives the segments passed on.
+ * @param max_passed Room in passed.
+ * @param transaction Receives the transaction lines with their CRLFs, or NULL.
+ * @param size Size of transaction.
+ * @param transaction_len Receives the length of the transaction lines, or NULL.
+ * @param has_contact Set if the message has a Contact line.
+ * @return The number of segments in passed, -1 if the message is incomplete or its lines don't fit.
+ */
+static int sort_relayed_lines(const char *buffer, struct iovec *passed, int max_passed,
+                              char *transaction, size_t size, size_t *transaction_len, bool *has_contact) {
+    const char *end_of_headers = strstr(buffer, "\r\n\r\n");
+    const char *line = strstr(buffer, "\r\n");
+    if (end_of_headers == NULL || line == NULL) {
+        return -1;
+    }
+    int count = 0;
+    size_t copied = 0;
+    *has_contact = false;
+    for (line += 2; line < end_of_headers + 2; ) {
+        const char *line_end = strstr(line, "\r\n");
+        size_t len = (size_t)(line_end - line);
+        if (header_is(line, len, "Via", "v") || header_is(line, len, "From", "f") || header_is(line, len, "To", "t") ||
+            header_is(line, len, "Call-ID", "i") || header_is(line, len, "CSeq", NULL)) {
+            if (transaction != NULL) {
+                if (copied + len + 2 >= size) {
+                    return -1;
+                }
+                memcpy(transaction + copied, line, len + 2);
+                copied += len + 2;
+            }
+        } else if (header_is(line, len, "Contact", "m")) {
+            *has_contact = true;
+        } else if (!header_is(line, len, "Route", NULL) && !header_is(line, len, "Record-Route", NULL)) {
+            if (count > 0 && (const char *)passed[count - 1].iov_base + passed[count - 1].iov_len == line) {
+                passed[count - 1].iov_len += len + 2;
+            } else if (count < max_passed - 1) {
+                passed[count++] = (struct iovec){ (void *)line, len + 2 };
+            } else {
+                return -1;
+            }
+        }
+        line = line_end + 2;
+    }
+    // The empty line and the body
+    passed[count++] = (struct iovec){ (void *)(end_of_headers + 2), strlen(end_of_headers + 2) };
+    if (transaction != NULL) {
+        transaction[copied] = '\0';
+        *transaction_len = copied;
+    }
+    return count;
+}
+
+/**
+ * @brief Sends a request of the server's on a leg of a connected call.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ * @param to_leg The leg to send the request on.
+ * @param method The method, e.g. "INFO".
+ * @param cseq CSeq number of the request.
+ * @param branch Via branch of the request.
+ * @param contact true to add the server's Contact.
+ * @param passed Segments of the rest of the message, up to the end of the body.
+ * @param passed_count Number of segments.
+ */
+static void send_in_dialog_request(sip_server_t *server, call_t *call, int to_leg, const char *method, int cseq,
+                                   const char *branch, bool contact, const struct iovec *passed, int passed_count) {
+    char head[2 * HEADER_SIZE];
+    char a_leg_dialog[LEG_HEADER_BLOCK_SIZE];
+    char tail[HEADER_SIZE];
+    struct iovec segments[3 + IN_DIALOG_SEGMENTS];
+    if (to_leg == B_LEG) {
+        snprintf(head, sizeof(head), "%s sip:%s@%s:%d SIP/2.0\r\nVia: SIP/2.0/UDP %s:%d;branch=%s\r\n",
+                 method, call->callee, call->b_leg_ip_str, call->b_leg_port, SIP_SERVER_IP_ADDRESS, SIP_PORT, branch);
+        segments[1] = (struct iovec){ call->b_leg_header.block, call->b_leg_header.block_len };
+    } else {
+        snprintf(head, sizeof(head), "%s %s SIP/2.0\r\nVia: SIP/2.0/UDP %s:%d;branch=%s\r\n",
+                 method, call->a_leg_contact, SIP_SERVER_IP_ADDRESS, SIP_PORT, branch);
+        segments[1] = (struct iovec){ a_leg_dialog, serialise_a_leg_dialog(call, a_leg_dialog, sizeof(a_leg_dialog)) };
+    }
+    snprintf(tail, sizeof(tail), "CSeq: %d %s\r\n%s", cseq, method, contact ? SERVER_CONTACT_LINE : "");
+    segments[0] = (struct iovec){ head, strlen(head) };
+    segments[2] = (struct iovec){ tail, strlen(tail) };
+    for (int i = 0; i < passed_count; i++) {
+        segments[3 + i] = passed[i];
+    }
+    sip_message_t request;
+    gather_message(&request, segments, 3 + (size_t)passed_count);
+    SIP_TRACE("Tx SIP message %s to %s leg:\r\n%s\r\n", method, to_leg == A_LEG ? "A" : "B", request.buffer);
+    sip_server_send(server, &request, to_leg == A_LEG ? call->a_leg_ip_str : call->b_leg_ip_str,
+                    to_leg == A_LEG ? call->a_leg_port : call->b_leg_port);
+}
+
+/**
+ * @brief Returns the number of a CSeq line, and the method after it.
+ * @return The number, 0 if the message has no CSeq.
+ */
+static int cseq_of(const char *buffer, const char **method, size_t *method_len) {
+    size_t len;
+    const char *line = find_header_line(buffer, "CSeq: ", &len);
+    if (line == NULL) {
+        return 0;
+    }
+    char *end;
+    long number = strtol(line + strlen("CSeq: "), &end, 10);
+    while (*end == ' ') {
+        end++;
+    }
+    *method = end;
+    *method_len = (size_t)(line + len - end);
+    return number > 0 && number <= INT32_MAX ? (int)number : 0;
+}
+
+/**
+ * @brief Relays a re-INVITE, UPDATE or INFO of a connected call to the other leg.
+ *
+ * A retransmission goes out again with the CSeq and branch of the first. A re-INVITE while
+ * another one is under way is answered 491 Request Pending. With all slots taken, the oldest
+ * request is given up: its responses won't be relayed.
+ */
+static void relay_in_dialog_request(sip_server_t *server, call_t *call, sip_message_t *message, const char *method,
+                                    int leg_type) {
+    struct iovec passed[IN_DIALOG_SEGMENTS];
+    char lines[LEG_HEADER_BLOCK_SIZE];
+    size_t lines_len = 0;
+    bool has_contact;
+    int passed_count = sort_relayed_lines(message->buffer, passed, IN_DIALOG_SEGMENTS, lines, sizeof(lines),
+                                          &lines_len, &has_contact);
+    const char *cseq_method;
+    size_t cseq_method_len;
+    int origin_cseq = cseq_of(message->buffer, &cseq_method, &cseq_method_len);
+    if (passed_count < 0 || origin_cseq == 0) {
+        SIP_TRACE("  !!! WARNING !!! %s from %s leg can't be relayed, dropped\r\n", method, leg_type == A_LEG ? "A" : "B");
+        return;
+    }
+
+    in_dialog_request_t *slot = NULL;
+    in_dialog_request_t *oldest = &call->in_dialog[0];
+    bool invite_pending = false;
+    for (int i = 0; i < IN_DIALOG_PENDING; i++) {
+        in_dialog_request_t *pending = &call->in_dialog[i];
+        if (pending->cseq != 0 && pending->from_leg == leg_type && pending->origin_cseq == origin_cseq &&
+            strcmp(pending->method, method) == 0) {
+            slot = pending;
+            break;
+        }
+        if (pending->cseq != 0 && strcmp(pending->method, "INVITE") == 0) {
+            invite_pending = true;
+        }
+        if (pending->cseq < oldest->cseq) {
+            oldest = pending;
+        }
+    }
+    if (slot == NULL && invite_pending && strcmp(method, "INVITE") == 0) {
+        const struct iovec segments[] = {
+            LITERAL_SEGMENT("SIP/2.0 491 Request Pending\r\n"),
+            { lines, lines_len },
+            LITERAL_SEGMENT("User-Agent: TinySIP\r\n" NO_BODY),
+        };
+        sip_message_t response;
+        gather_message(&response, segments, sizeof(segments) / sizeof(segments[0]));
+        SIP_TRACE("Tx SIP message 491 Request Pending:\r\n%s\r\n", response.buffer);
+        sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+        return;
+    }
+    if (slot == NULL) {
+        if (oldest->cseq != 0) {
+            SIP_TRACE("  !!! WARNING !!! Call %d: %s of CSeq %d given up for a new request\r\n", call->index, oldest->method, oldest->cseq);
+        }
+        slot = oldest;
+        slot->cseq = next_cseq_number(server);
+        slot->origin_cseq = origin_cseq;
+        slot->from_leg = leg_type;
+        slot->awaiting_ack = false;
+        snprintf(slot->method, sizeof(slot->method), "%s", method);
+        memcpy(slot->lines, lines, lines_len + 1);
+        slot->lines_len = lines_len;
+    }
+
+    char branch[32];
+    snprintf(branch, sizeof(branch), "z9hG4bK-dlg-%d", slot->cseq);
+    send_in_dialog_request(server, call, leg_type == A_LEG ? B_LEG : A_LEG, method, slot->cseq, branch, has_contact,
+                           passed, passed_count);
+}
+
+/**
+ * @brief Restarts the session timer on a 2xx to a relayed re-INVITE or UPDATE, which refreshes
+ * the session (RFC 4028). The interval and refresher it names, if any, become the call's.
+ */
+static void refresh_session(sip_server_t *server, call_t *call, const char *buffer, int requester) {
+    const char *refresher;
+    int interval = session_expires_of(buffer, &refresher);
+    if (interval >= SESSION_MIN_SE) {
+        call->session_expires = interval < SESSION_EXPIRES ? interval : SESSION_EXPIRES;
+        bool requester_refreshes = strcmp(refresher, "uas") != 0;
+        call->a_leg_refreshes = (requester == A_LEG) == requester_refreshes;
+        call->b_leg_refreshes = (requester == B_LEG) == requester_refreshes;
+    }
+    if (call->a_leg_refreshes || call->b_leg_refreshes) {
+        arm_call_timer(server, call, session_timeout_ms(call));
+    }
+}
+
+/**
+ * @brief Relays a response to a relayed request back to the request's sender, with the
+ * sender's own transaction lines. 100 Trying stops here. Retransmissions of a 2xx to a
+ * re-INVITE are relayed again until the sender's ACK comes. The server ACKs a failure to a
+ * re-INVITE itself, the sender's ACK of it is absorbed.
+ * @return false if the response isn't for a relayed request.
+ */
+static bool relay_in_dialog_response(sip_server_t *server, call_t *call, sip_message_t *message, int leg_type) {
+    const char *method;
+    size_t method_len;
+    int cseq = cseq_of(message->buffer, &method, &method_len);
+    int code = atoi(message->buffer + strlen("SIP/2.0 "));
+    bool is_2xx = code >= 200 && code < 300;
+    in_dialog_request_t *slot = NULL;
+    for (int i = 0; i < IN_DIALOG_PENDING && cseq != 0; i++) {
+        in_dialog_request_t *pending = &call->in_dialog[i];
+        if (pending->cseq == cseq && pending->from_leg != leg_type && (!pending->awaiting_ack || is_2xx) &&
+            strlen(pending->method) == method_len && strncmp(pending->method, method, method_len) == 0) {
+            slot = pending;
+            break;
+        }
+    }
+    if (slot == NULL) {
+        return false;
+    }
+    if (code == 100) {
+        return true;
+    }
+
+    struct iovec passed[IN_DIALOG_SEGMENTS];
+    bool has_contact;
+    int passed_count = sort_relayed_lines(message->buffer, passed, IN_DIALOG_SEGMENTS, NULL, 0, NULL, &has_contact);
+    const char *status_end = strstr(message->buffer, "\r\n");
+    if (passed_count < 0 || status_end == NULL) {
+        return true;
+    }
+    struct iovec segments[3 + IN_DIALOG_SEGMENTS] = {
+        { message->buffer, (size_t)(status_end + 2 - message->buffer) },
+        { slot->lines, slot->lines_len },
+        { (void *)SERVER_CONTACT_LINE, has_contact ? strlen(SERVER_CONTACT_LINE) : 0 },
+    };
+    for (int i = 0; i < passed_count; i++) {
+        segments[3 + i] = passed[i];
+    }
+    sip_message_t response;
+    gather_message(&response, segments, 3 + (size_t)passed_count);
+    SIP_TRACE("Tx SIP message %d (response to %s) to %s leg:\r\n%s\r\n", code, slot->method,
+              slot->from_leg == A_LEG ? "A" : "B", response.buffer);
+    sip_server_send(server, &response, slot->from_leg == A_LEG ? call->a_leg_ip_str : call->b_leg_ip_str,
+                    slot->from_leg == A_LEG ? call->a_leg_port : call->b_leg_port);
+
+    if (code < 200) {
+        return true;
+    }
+    if (slot->awaiting_ack) {
+        return true;    // A retransmission, the session was refreshed by the first
+    }
+    bool is_invite = strcmp(slot->method, "INVITE") == 0;
+    if (is_2xx && (is_invite || strcmp(slot->method, "UPDATE") == 0)) {
+        refresh_session(server, call, message->buffer, slot->from_leg);
+    }
+    if (is_invite && is_2xx) {
+        slot->awaiting_ack = true;
+        return true;
+    }
+    if (is_invite) {
+        // The ACK of a failure is hop by hop: in the INVITE's transaction, from the server
+        char branch[32];
+        snprintf(branch, sizeof(branch), "z9hG4bK-dlg-%d", slot->cseq);
+        const struct iovec no_body = LITERAL_SEGMENT(NO_BODY);
+        send_in_dialog_request(server, call, leg_type, "ACK", slot->cseq, branch, false, &no_body, 1);
+    }
+    slot->cseq = 0;
+    return true;
+}
+
+/**
+ * @brief Relays the ACK of a 2xx to a relayed re-INVITE, with the body it may carry. The ACK
+ * of a failure was sent by the server already, the sender's stops here.
+ */
+static void relay_in_dialog_ack(sip_server_t *server, call_t *call, sip_message_t *message, int leg_type) {
+    const char *method;
+    size_t method_len;
+    int origin_cseq = cseq_of(message->buffer, &method, &method_len);
+    for (int i = 0; i < IN_DIALOG_PENDING && origin_cseq != 0; i++) {
+        in_dialog_request_t *slot = &call->in_dialog[i];
+        if (slot->cseq == 0 || slot->from_leg != leg_type || slot->origin_cseq != origin_cseq) {
+            continue;
+        }
+        if (slot->awaiting_ack) {
+            struct iovec passed[IN_DIALOG_SEGMENTS];
+            bool has_contact;
+            int passed_count = sort_relayed_lines(message->buffer, passed, IN_DIALOG_SEGMENTS, NULL, 0, NULL, &has_contact);
+            if (passed_count > 0) {
+                char branch[32];
+                snprintf(branch, sizeof(branch), "z9hG4bK-dlg-%d-ack", slot->cseq);
+                send_in_dialog_request(server, call, leg_type == A_LEG ? B_LEG : A_LEG, "ACK", slot->cseq, branch,
+                                       false, passed, passed_count);
+            }
+            slot->cseq = 0;
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Tells whether an INVITE or ACK from A belongs to the INVITE that set up the call,
+ * a retransmission or a late ACK, rather than to a re-INVITE.
+ */
+static bool is_call_setup(const call_t *call, const sip_message_t *message, int leg_type) {
+    const char *method;
+    size_t method_len;
+    return leg_type == A_LEG && cseq_of(message->buffer, &method, &method_len) == extract_cseq_number(call->a_leg_header.cseq);
+}
+
+/**
+ * @brief The fast path of a connected call's in-dialog requests: re-INVITE (hold, resume,
+ * codec change), UPDATE with a body, and INFO (DTMF), their responses and the ACKs of the
+ * re-INVITEs.
+ *
+ * They are relayed to the other leg without going through the state machine. Only the request
+ * line, Via, From, To, Call-ID, CSeq and Contact become the other leg's: the other header
+ * lines and the body are passed on as segments of the received buffer, copied once by
+ * gather_message(). The sender's own lines are kept in a slot of call->in_dialog to answer it
+ * with. A body-less UPDATE, a session refresh, is answered by the state machine itself.
+ * @return true if the message was taken care of.
+ */
+static bool relay_in_dialog(sip_server_t *server, call_t *call, int message_type, const char *method_or_code,
+                            sip_message_t *message, int leg_type) {
+    if (message_type == STATUS_CODE) {
+        return relay_in_dialog_response(server, call, message, leg_type);
+    }
+    bool is_ack = strcmp(method_or_code, "ACK") == 0;
+    if (is_ack || strcmp(method_or_code, "INVITE") == 0) {
+        if (is_call_setup(call, message, leg_type)) {
+            return false;
+        }
+        if (is_ack) {
+            relay_in_dialog_ack(server, call, message, leg_type);
+            return true;
+        }
+    } else if (strcmp(method_or_code, "INFO") != 0 &&
+               (strcmp(method_or_code, "UPDATE") != 0 || !has_body(message->buffer))) {
+        return false;
+    }
+    relay_in_dialog_request(server, call, message, method_or_code, leg_type);
+    return true;
+}
+
+/**
+ * @brief State machine processing function.
+ * @param server The server handling the message.
+ * @param call A pointer to the call struct (or NULL if not found).
+ * @param message_type Request Method or Status Code (REQUEST_METHOD or STATUS_CODE).
+ * @param method_or_code The parsed Request Method (INVITE, ACK, BYE, etc.) or Status Code string.
+ * @param has_sdp A boolean value indicating if a remote media description exists.
+ * @param message A pointer to the sip_message_t struct containing full message information, used for getting client transport address
+ * @param raw_sip_message A pointer to the raw SIP message buffer for further parsing.
+ * @param leg_type The leg type where the call_id was found. Indicates which leg (a or b) the SIP message was received from.
+ */
+void handle_state_machine(sip_server_t *server, call_t *call, int message_type, const char *method_or_code, bool has_sdp, sip_message_t *message, const char *raw_sip_message, int leg_type) {
+    (void)raw_sip_message;
+    // In-dialog requests of a connected call and their responses skip the header extraction below
+    if (call != NULL && call->call_state == CALL_STATE_CONNECTED &&
+        relay_in_dialog(server, call, message_type, method_or_code, message, leg_type)) {
+        return;
+    }
+
+    char *from_start = strstr(message->buffer, "From: ");
+    char *via_start = strstr(message->buffer, "Via: ");
+    char *cseq_start = strstr(message->buffer, "CSeq: ");
+    char *to_start = strstr(message->buffer, "To: ");
+    char *call_id_start = strstr(message->buffer, "Call-ID: ");
+    
+    char from_header[HEADER_SIZE] = {0};
+    char via_header[HEADER_SIZE] = {0};
+    char cseq_header[HEADER_SIZE] = {0};
+    char to_header[HEADER_SIZE] = {0};
+    char call_id_header[HEADER_SIZE] = {0};
+
+    SIP_TRACE("Extracted Headers: \r\n");
+
+    if (via_start != NULL) {
+        char *via_end = strstr(via_start, "\r\n");
+        if (via_end != NULL) {
+            size_t via_len = via_end - via_start;
+            strncpy(via_header, via_start, via_len);
+            via_header[via_len] = '\0';
+            SIP_TRACE("[%s]\r\n", via_header);
+        }
+    }
+
+    if (from_start != NULL) {
+        char *from_end = strstr(from_start, "\r\n");
+        if (from_end != NULL) {
+            size_t from_len = from_end - from_start;
+            strncpy(from_header, from_start, from_len);
+            from_header[from_len] = '\0';
+            SIP_TRACE("[%s]\r\n", from_header);
+        }
+    }
+
+    if (to_start != NULL) {
         char *to_end = strstr(to_start, "\r\n");
         if (to_end != NULL) {
             size_t to_len = to_end - to_start;
             strncpy(to_header, to_start, to_len);
             to_header[to_len] = '\0';
-            printf("[%s]\r\n", to_header);
+            SIP_TRACE("[%s]\r\n", to_header);
         }
     }
 
@@ -446,7 +1711,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
             size_t cseq_len = cseq_end - cseq_start;
             strncpy(cseq_header, cseq_start, cseq_len);
             cseq_header[cseq_len] = '\0';
-            printf("[%s]\r\n", cseq_header);
+            SIP_TRACE("[%s]\r\n", cseq_header);
         }
     }
     
@@ -456,7 +1721,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
             size_t call_id_len = call_id_end - call_id_start;
             strncpy(call_id_header, call_id_start, call_id_len);
             call_id_header[call_id_len] = '\0';
-            printf("[%s]\r\n", call_id_header);
+            SIP_TRACE("[%s]\r\n", call_id_header);
         }
     }
 
@@ -477,7 +1742,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
     }
 
     if (call == NULL) {
-        printf("call does not exist, Method/Status Code: [%s] \r\n", method_or_code);
+        SIP_TRACE("call does not exist, Method/Status Code: [%s] \r\n", method_or_code);
         
         if(message_type == REQUEST_METHOD && strcmp(method_or_code, "INVITE") == 0){
             // The event "INVITE from A-leg" when the call state is CALL_STATE_IDLE
@@ -511,15 +1776,74 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
             }
 
             strcpy(via_header, new_via_header);
-            printf("Updated Via Header: [%s]\r\n", via_header);
+            SIP_TRACE("Updated Via Header: [%s]\r\n", via_header);
             
+            // Extract Call-ID from INVITE request, it becomes the call's a_leg_uuid
+            char invite_call_id[MAX_UUID_LENGTH] = {0};
+            if (call_id_start != NULL) {
+                call_id_start += strlen("Call-ID:");
+                while (*call_id_start == ' ') {
+                    call_id_start++;
+                }
+                char *call_id_end = strstr(call_id_start, "\r\n");
+                if (call_id_end != NULL && (size_t)(call_id_end - call_id_start) < MAX_UUID_LENGTH) {
+                    strncpy(invite_call_id, call_id_start, call_id_end - call_id_start);
+                }
+            }
+
+            // A caller or peer over one of its call limits is refused, and over the call store's memory
+            // ceiling the call is shed, before it takes a call table entry. Emergency calls are exempt.
+            bool emergency = sip_server_is_emergency(server, message);
+
+            // Session timer (RFC 4028): an interval below our minimum is refused before anything is taken
+            const char *a_refresher;
+            int requested_interval = session_expires_of(message->buffer, &a_refresher);
+            if (!emergency && requested_interval > 0 && requested_interval < SESSION_MIN_SE) {
+                SIP_TRACE("Session interval of %d s too small. Rejecting INVITE.\n", requested_interval);
+                send_local_response(server, message, "422 Session Interval Too Small", "Min-SE: " STRINGIFY(SESSION_MIN_SE) "\r\n",
+                                    via_header, from_header, to_header, call_id_header, cseq_header);
+                return;
+            }
+
+            call_limit_ticket_t limits;
+            call_limit_ticket_clear(&limits);
+            if (!emergency) {
+                char caller[MAX_USERNAME_LENGTH] = {0};
+                sip_header_username(from_header, caller, sizeof(caller));
+                call_limit_verdict_t verdict = call_limits_acquire(&server->store->call_limits, caller,
+                                                                   &message->client_addr.sin_addr,
+                                                                   sip_server_now_ms(server), &limits);
+                if (verdict == CALL_LIMIT_AOR_BUSY) {
+                    SIP_TRACE("Caller %s holds its maximum of calls. Rejecting INVITE.\n", caller);
+                    send_local_response(server, message, "486 Busy Here", "",
+                                        via_header, from_header, to_header, call_id_header, cseq_header);
+                    return;
+                }
+                if (verdict != CALL_LIMIT_OK) {
+                    SIP_TRACE("Call limit of caller %s or its peer reached. Rejecting INVITE.\n", caller);
+                    send_service_unavailable(server, message, via_header, from_header, to_header, call_id_header, cseq_header);
+                    return;
+                }
+            }
+            if (emergency) {
+                SIP_TRACE("Emergency call, exempt from shedding.\n");
+                sip_memory_force_charge(&server->store->memory, SIP_MEMORY_CALLS, sizeof(call_t));
+            } else if (!sip_memory_charge(&server->store->memory, SIP_MEMORY_CALLS, sizeof(call_t))) {
+                SIP_TRACE("Call memory ceiling reached. Rejecting INVITE.\n");
+                call_limits_release(&server->store->call_limits, &limits);
+                send_service_unavailable(server, message, via_header, from_header, to_header, call_id_header, cseq_header);
+                return;
+            }
+
             // 1. Use allocate_new_call function to get a new and unused call_t struct pointer from call_map.
-            call = allocate_new_call(&call_map);
+            call = allocate_new_call(&server->store->call_map, invite_call_id, emergency);
             if(call == NULL){
+                sip_memory_credit(&server->store->memory, SIP_MEMORY_CALLS, sizeof(call_t));
+                call_limits_release(&server->store->call_limits, &limits);
                 // If returns NULL, print error and send a 500 error to the caller. 
                 // 500 error only fill the necessary fields, the needed information can extract from INVITE. 
                 // The destination address is extracted from sip_message_t *message
-                printf("Error: Failed to allocate new call.\n");
+                SIP_TRACE("Error: Failed to allocate new call.\n");
                 char response_500[BUFFER_SIZE] = {0};
                 if (from_header[0] != '\0' && via_header[0] != '\0' && cseq_header[0] != '\0' && to_header[0] != '\0' && call_id_header[0] != '\0') {
                      char *uri_start = strchr(from_header, '<');
@@ -544,35 +1868,39 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                                 (char*)via_header, (char*)from_header, (char*)to_header, call_id_header, (char*)cseq_header); 
 
                             //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 500 Server Internal Error:\r\n%s\r\n", response_500);
+                            SIP_TRACE("Tx SIP message 500 Server Internal Error:\r\n%s\r\n", response_500);
                             //printf("==============================================================\r\n");
                             sip_message_t response;
                             memset(&response, 0, sizeof(response));
                             strncpy(response.buffer, response_500, BUFFER_SIZE-1);
-                            send_sip_message(&response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+                            sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
                         }
                     }
                 }
                 
                 return;
             }
-            // 2. If return not NULL, set call_t to occupied,
-            // Extract Call-ID from INVITE request, set call_t's a_leg_uuid and b_leg_uuid, and b_leg_uuid is same with a_leg_uuid, but first 5 chars changed to "b-leg" 
-            if (call_id_start != NULL) {
-                call_id_start += strlen("Call-ID:");
-                while (*call_id_start == ' ') {
-                    call_id_start++;
-                }
-                char *call_id_end = strstr(call_id_start, "\r\n");
-                if (call_id_end != NULL) {
-                    size_t call_id_len = call_id_end - call_id_start;
-                    strncpy(call->a_leg_uuid, call_id_start, call_id_len);
-                    call->a_leg_uuid[call_id_len] = '\0';
-                    strncpy(call->b_leg_uuid, call_id_start, call_id_len);
-                    call->b_leg_uuid[call_id_len] = '\0'; 
-                    memcpy(call->b_leg_uuid, "b-leg", 5);
-                }
+            // A call set up by a traced INVITE stays traced for both legs
+            call->traced = sip_trace_on;
+            call->limits = limits;
+
+            // The session interval offered to B: A's, capped at ours but never below A's Min-SE.
+            // A refreshes the session if it supports session timers and didn't leave it to us.
+            size_t min_se_len;
+            const char *min_se = find_header_line(message->buffer, "Min-SE: ", &min_se_len);
+            int a_min_se = min_se != NULL ? atoi(min_se + strlen("Min-SE: ")) : 0;
+            call->session_expires = requested_interval > 0 && requested_interval < SESSION_EXPIRES ? requested_interval : SESSION_EXPIRES;
+            if (call->session_expires < a_min_se) {
+                call->session_expires = a_min_se;
+            }
+            if (call->session_expires < SESSION_MIN_SE) {
+                call->session_expires = SESSION_MIN_SE;
             }
+            call->a_leg_refreshes = supports_session_timer(message->buffer) && strcmp(a_refresher, "uas") != 0;
+            call->b_leg_refreshes = false;
+
+            // 2. If return not NULL, the call_t is occupied and its a_leg_uuid and b_leg_uuid are set,
+            // b_leg_uuid is same with a_leg_uuid, but first 5 chars changed to "b-leg"
             // Set call_t's a_leg_addr using transport address from sip_message_t structure
             inet_ntop(AF_INET, &(message->client_addr.sin_addr), call->a_leg_ip_str, INET_ADDRSTRLEN);
             call->a_leg_port = ntohs(message->client_addr.sin_port);
@@ -617,13 +1945,17 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                         callee_uri[username_len] = '\0';
 
                         // find location
-                        location_entry_t *location = find_location_entry_by_userid(callee_uri);
+                        location_entry_t *location = find_location_entry_by_userid(server, callee_uri);
                         if (location != NULL) {
+                            shm_mutex_lock(&server->store->location_mutex);
                             strcpy(call->b_leg_ip_str, location->ip_str);
                             call->b_leg_port = location->port;
-                            printf("Found location: %s, %s:%d\r\n", location->username, location->ip_str, location->port);
+                            pthread_mutex_unlock(&server->store->location_mutex);
+                            SIP_TRACE("Found location: %s, %s:%d\r\n", location->username, call->b_leg_ip_str, call->b_leg_port);
                         } else {
-                            printf("Error: Location not found for user: sip:%s.\r\n", callee_uri);
+                            SIP_TRACE("Error: Location not found for user: sip:%s.\r\n", callee_uri);
+                            user_filter_remember_rejection(&server->store->user_filter, callee_uri,
+                                                           &message->client_addr.sin_addr, sip_server_now_ms(server));
                             char response_404[BUFFER_SIZE] = {0};
                             if (from_header[0] != '\0' && via_header[0] != '\0' && cseq_header[0] != '\0' && to_header[0] != '\0' && call_id_header[0] != '\0') {
                                 snprintf(response_404, BUFFER_SIZE,
@@ -637,14 +1969,14 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                                     "Content-Length: 0\r\n\r\n",
                                 (char*)via_header, (char*)from_header, (char*)to_header, (char*)call_id_header, (char*)cseq_header);
                                 //printf("\r\n===========================================================\r\n");
-                                printf("Tx SIP message 404 Not Found:\r\n%s\r\n", response_404);
+                                SIP_TRACE("Tx SIP message 404 Not Found:\r\n%s\r\n", response_404);
                                 //printf("==============================================================\r\n");
                                 sip_message_t response;
                                 memset(&response, 0, sizeof(response));
                                 strncpy(response.buffer, response_404, BUFFER_SIZE-1);
-                                send_sip_message(&response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
+                                sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
                             }
-                            init_call(call, call->index);
+                            end_call(server, call);
                             return;
                         }
                     }
@@ -684,7 +2016,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                                         
                                         memmove(call->a_leg_contact, uri_start, uri_len);
                                         call->a_leg_contact[uri_len] = '\0';
-                                        printf("Extracted Contact URI: [%s]\r\n", call->a_leg_contact);
+                                        SIP_TRACE("Extracted Contact URI: [%s]\r\n", call->a_leg_contact);
                                     }
                                 }
                             }
@@ -692,28 +2024,12 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                    }
             }          
 
-            // Finish 100 Trying response encoding for UE A, the necessary content can extract from INVITE.
-            char trying_100[BUFFER_SIZE] = {0};
-            if (from_header[0] != '\0' && via_header[0] != '\0' && cseq_header[0] != '\0' && to_header[0] != '\0' && call_id_header[0] != '\0') {
-                snprintf(trying_100, BUFFER_SIZE,
-                   "SIP/2.0 100 Trying\r\n"
-                   "%s\r\n"
-                   "%s\r\n"
-                   "%s\r\n"
-                   "%s\r\n"
-                   "%s\r\n"
-                   "User-Agent: TinySIP\r\n"
-                   "Content-Length: 0\r\n\r\n",
-                   (char*)via_header,(char*)from_header, (char*)to_header,(char*)call_id_header,(char*)cseq_header);
-
-                //printf("\r\n===========================================================\r\n");
-                printf("Tx SIP message 100 Trying to A-leg:\r\n%s\r\n", trying_100);
-                //printf("==============================================================\r\n");
+            // Serialise the lines all responses to the INVITE repeat, once
+            serialise_a_leg_headers(call);
 
-                sip_message_t response;
-                memset(&response, 0, sizeof(response));
-                strncpy(response.buffer, trying_100, BUFFER_SIZE-1);
-                send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
+            // Finish 100 Trying response encoding for UE A, from the serialised A leg lines.
+            if (call_id_header[0] != '\0') {
+                send_a_leg_response(server, call, "100 Trying", "", NO_BODY, "100 Trying to A-leg");
             }
             
             // Finish encoding INVITE message to UE B, extract needed content from original INVITE, send the new INVITE to UE B based on b-leg address in the minimal location server
@@ -732,12 +2048,13 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                 );                
                 
                 // Generate CSeq header for b-leg
-                snprintf(call->b_leg_header.cseq, HEADER_SIZE, "CSeq: %d INVITE\r\n", cseq_number++);
+                snprintf(call->b_leg_header.cseq, HEADER_SIZE, "CSeq: %d INVITE\r\n", next_cseq_number(server));
                 
                 // Extract From and To information from a-leg headers.
                 strncpy(call->b_leg_header.from, from_header, HEADER_SIZE - 1);
                 // strncpy(call->b_leg_header.to, to_header, HEADER_SIZE - 1);
                 snprintf(call->b_leg_header.to, BUFFER_SIZE - 1, "To: <sip:%s@%s:%d;ob>", callee_uri, call->b_leg_ip_str, call->b_leg_port);
+                serialise_b_leg_dialog(call);
                 
                 strncpy(call->callee, callee_uri, sizeof(call->callee) - 1);
 
@@ -751,6 +2068,9 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                      "%s" // CSeq header
                     "Max-Forwards: %d\r\n"
                     "Contact: <sip:%s@%s:%d>\r\n"
+                    "Supported: timer\r\n"
+                    "Session-Expires: %d;refresher=uas\r\n"
+                    "Min-SE: %d\r\n"
                     "%s",
                     callee_uri,
                     call->b_leg_ip_str,
@@ -762,36 +2082,43 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                     call->b_leg_header.cseq,
                     max_forwards,
                     "TinySIP", SIP_SERVER_IP_ADDRESS, SIP_PORT,
+                    call->session_expires, SESSION_MIN_SE,
                     message->buffer + sdp_start_index
                 );
                 //printf("\r\n===========================================================\r\n");
-                printf("Tx SIP message INVITE to B-leg:\r\n%s\r\n", invite_to_b);
+                SIP_TRACE("Tx SIP message INVITE to B-leg:\r\n%s\r\n", invite_to_b);
                 //printf("==============================================================\r\n");                
             }
             sip_message_t inv_b;
             memset(&inv_b, 0, sizeof(inv_b));
             strncpy(inv_b.buffer, invite_to_b, BUFFER_SIZE-1);
-            send_sip_message(&inv_b, call->b_leg_ip_str, call->b_leg_port);
+            sip_server_send(server, &inv_b, call->b_leg_ip_str, call->b_leg_port);
+            arm_call_timer(server, call, CALL_SETUP_TIMEOUT_MS);
+            // Both parties show as on the phone to their presence watchers until end_call()
+            sip_header_username(from_header, call->caller, sizeof(call->caller));
+            strncpy(call->callee, callee_uri, sizeof(call->callee) - 1);
+            sip_presence_call_started(server, call);
             // Set call_t's call_state to CHANNEL_STATE_ROUTING.
-            call->call_state = CALL_STATE_ROUTING;
-            printf("  Call %d state transitioned to CALL_STATE_ROUTING.\r\n", call->index);
+            set_call_state(server, call, CALL_STATE_ROUTING);
+            SIP_TRACE("  Call %d state transitioned to CALL_STATE_ROUTING.\r\n", call->index);
         }  else {
-              printf("Unexpected message, the call may have already been released Method/Status Code: [%s], leg_type: [%d]\r\n", method_or_code, leg_type);
+              SIP_TRACE("Unexpected message, the call may have already been released Method/Status Code: [%s], leg_type: [%d]\r\n", method_or_code, leg_type);
         }
     } else {
-        printf("Existing call [%d], Method/Status Code: [%s], leg_type: [%d]\r\n", call->index, method_or_code, leg_type);
-        // refresh the to headers for later use in responses (B leg or A leg)
-        if (leg_type == B_LEG){
+        SIP_TRACE("Existing call [%d], Method/Status Code: [%s], leg_type: [%d]\r\n", call->index, method_or_code, leg_type);
+        // refresh the to headers for later use in responses (B leg or A leg), re-serialised once B's tag is learned
+        if (leg_type == B_LEG && message_type == STATUS_CODE && strcmp(call->b_leg_header.to, to_header) != 0) {
             strncpy(call->b_leg_header.to, to_header, HEADER_SIZE - 1);
+            serialise_b_leg_dialog(call);
         }
         switch (call->call_state) {
             case CALL_STATE_ROUTING:
             case CALL_STATE_RINGING:
                 if (CALL_STATE_ROUTING == call->call_state){
-                    printf("  Current call state: CALL_STATE_ROUTING\r\n");
+                    SIP_TRACE("  Current call state: CALL_STATE_ROUTING\r\n");
                 }
                 if (CALL_STATE_RINGING == call->call_state){
-                    printf("  Current call state: CALL_STATE_RINGING\r\n");
+                    SIP_TRACE("  Current call state: CALL_STATE_RINGING\r\n");
                 }
                 
                 // event CANCEL from a-leg when the call state is CALL_STATE_ROUTING/CALL_STATE_RINGING
@@ -802,7 +2129,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                 // Set call state to DISCONNECTING
                 
                 if (message_type == REQUEST_METHOD && strcmp(method_or_code, "CANCEL") == 0 && leg_type == A_LEG) {
-                    printf("  Processing CANCEL from A leg\r\n");
+                    SIP_TRACE("  Processing CANCEL from A leg\r\n");
 
                     // 1. Build a SIP/2.0 200 OK response of CANCEL for A leg, using headers from the message data.
                     char ok_200_cancel[BUFFER_SIZE] = {0};
@@ -819,217 +2146,65 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                             (char*)via_header, (char*)from_header, (char*)to_header, call_id_header, (char*)cseq_header);
 
                         //printf("\r\n===========================================================\r\n");
-                        printf("Tx SIP message 200 OK(response to CANCEL):\r\n%s\r\n", ok_200_cancel);
+                        SIP_TRACE("Tx SIP message 200 OK(response to CANCEL):\r\n%s\r\n", ok_200_cancel);
                         //printf("==============================================================\r\n");
 
                         sip_message_t response;
                         memset(&response, 0, sizeof(response));
                         strncpy(response.buffer, ok_200_cancel, BUFFER_SIZE - 1);
-                        send_sip_message(&response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
-                    }
-
-                    // 2. Build a SIP/2.0 487 Request Terminated response for A leg, using headers from A leg's call data, and send it to A leg.
-                    char terminated_487[BUFFER_SIZE] = {0};
-                    if (call->a_leg_header.from[0] != '\0' && call->a_leg_header.via[0] != '\0' && call->a_leg_header.cseq[0] != '\0' && call->a_leg_header.to[0] != '\0') {
-                        snprintf(terminated_487, BUFFER_SIZE,
-                            "SIP/2.0 487 Request Terminated\r\n"
-                            "%s\r\n"
-                            "%s\r\n"
-                            "%s\r\n"
-                            "Call-ID: %s\r\n"
-                            "%s\r\n"
-                            "User-Agent: TinySIP\r\n"
-                            "Content-Length: 0\r\n\r\n",
-                            call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, call->a_leg_uuid, call->a_leg_header.cseq
-                        );
-
-                        //printf("\r\n===========================================================\r\n");
-                        printf("Tx SIP message 487 Request Terminated to A-leg:\r\n%s\r\n", terminated_487);
-                        //printf("==============================================================\r\n");
-
-                        sip_message_t response;
-                        memset(&response, 0, sizeof(response));
-                        strncpy(response.buffer, terminated_487, BUFFER_SIZE - 1);
-                        send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
+                        sip_server_send(server, &response, inet_ntoa(message->client_addr.sin_addr), ntohs(message->client_addr.sin_port));
                     }
 
-                    // 3. Build a CANCEL request for B leg, Send it to B leg. CSeq is set to CANCEL, and the number is generated using cseq_number++.
-                    char cancel_b[BUFFER_SIZE] = {0};
-                    //char *first_line_end = strstr(message->buffer, "\r\n");
-                     //if(first_line_end != NULL) {
-                    //    size_t first_line_len = first_line_end - message->buffer;
-                    //   char first_line[first_line_len+1];
-                    //    strncpy(first_line, message->buffer, first_line_len);
-                    //    first_line[first_line_len] = '\0';
-
-                        int cseq_value = extract_cseq_number(call->b_leg_header.cseq);
-                        snprintf(cancel_b, BUFFER_SIZE,
-                                "CANCEL sip:%s@%s:%d SIP/2.0\r\n"
-                                "%s"  //..
-                                "%s\r\n"
-                                "%s\r\n"
-                                "Call-ID: %s\r\n"
-                                "User-Agent: TinySIP\r\n"
-                                "CSeq: %d CANCEL\r\n"
-                                "Max-Forwards: %d\r\n"
-                                "Content-Length: 0\r\n\r\n",
-                                call->callee,
-                                call->b_leg_ip_str,
-                                call->b_leg_port,
-                                call->b_leg_header.via,
-                                call->b_leg_header.from,
-                                call->b_leg_header.to,
-                                call->b_leg_uuid,
-                                cseq_value,
-                                max_forwards
-                            );
-                    // }
-
-                    //printf("\r\n===========================================================\r\n");
-                    printf("Tx SIP message CANCEL to B-leg:\r\n%s\r\n", cancel_b);
-                    //printf("==============================================================\r\n");
-
-                    sip_message_t response_cancel_b;
-                    memset(&response_cancel_b, 0, sizeof(response_cancel_b));
-                    strncpy(response_cancel_b.buffer, cancel_b, BUFFER_SIZE - 1);
-                    send_sip_message(&response_cancel_b, call->b_leg_ip_str, call->b_leg_port);
+                    // 2. Build a SIP/2.0 487 Request Terminated response for A leg, from the serialised A leg lines, and send it to A leg.
+                    send_a_leg_response(server, call, "487 Request Terminated", "", NO_BODY, "487 Request Terminated to A-leg");
+
+                    // 3. Build a CANCEL request for B leg, Send it to B leg. CSeq is set to CANCEL, with the number of the INVITE to B.
+                    char cancel_head[BUFFER_SIZE] = {0};
+                    char cancel_rest[HEADER_SIZE] = {0};
+                    snprintf(cancel_head, BUFFER_SIZE, "CANCEL sip:%s@%s:%d SIP/2.0\r\n%s",
+                             call->callee, call->b_leg_ip_str, call->b_leg_port, call->b_leg_header.via);
+                    snprintf(cancel_rest, HEADER_SIZE,
+                             "User-Agent: TinySIP\r\n"
+                             "CSeq: %d CANCEL\r\n"
+                             "Max-Forwards: %d\r\n"
+                             "Content-Length: 0\r\n\r\n",
+                             extract_cseq_number(call->b_leg_header.cseq), max_forwards);
+                    send_b_leg_request(server, call, cancel_head, cancel_rest, "CANCEL to B-leg");
                     
                     // Set call state to DISCONNECTING
-                    call->call_state = CALL_DISCONNECTING;
-                    printf("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
+                    set_call_state(server, call, CALL_DISCONNECTING);
+                    arm_call_timer(server, call, CALL_TRANSACTION_TIMEOUT_MS);
+                    SIP_TRACE("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
                     break;
                 }else if (message_type == STATUS_CODE && strcmp(method_or_code, "183") == 0 && leg_type == B_LEG) {
-                    printf("  Response 183 from B leg\r\n");
+                    SIP_TRACE("  Response 183 from B leg\r\n");
 
                     // 1. Build the 183 response to A leg, using headers from A leg's call data, and send it to A leg.
                     // The destination address is also taken from A leg's data. If there is SDP in the message, extract it; otherwise, use Content-Length: 0.
-                    char early_183[BUFFER_SIZE] = {0};
-
-                    if (call->a_leg_header.from[0] != '\0' && call->a_leg_header.via[0] != '\0' && call->a_leg_header.cseq[0] != '\0' && call->a_leg_header.to[0] != '\0') {
-                        char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
-                        
-                        if (content_type_start != NULL) {
-                            // If SDP is found, extract it from the message buffer
-                            int sdp_start_index = content_type_start - message->buffer;
-                            snprintf(early_183, BUFFER_SIZE,
-                                     "SIP/2.0 183 Session Progress\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "Call-ID: %s\r\n"
-                                     "%s\r\n"
-                                     "User-Agent: TinySIP\r\n"
-                                     "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                     "%s",
-                                     call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, call->a_leg_uuid, call->a_leg_header.cseq,
-                                     SIP_SERVER_IP_ADDRESS, SIP_PORT,
-                                     message->buffer + sdp_start_index
-                                     );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 183 Session Progress to A-leg:\r\n%s\r\n", early_183);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, early_183, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-                        } else {
-                            // If no SDP, build the 183 response without SDP
-                            snprintf(early_183, BUFFER_SIZE,
-                                     "SIP/2.0 183 Session Progress\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "Call-ID: %s\r\n"
-                                     "%s\r\n"
-                                     "User-Agent: TinySIP\r\n"
-                                     "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                     "Content-Length: 0\r\n\r\n",
-                                     call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, call->a_leg_uuid, call->a_leg_header.cseq,
-                                     SIP_SERVER_IP_ADDRESS, SIP_PORT
-                                     );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 183 Session Progress to A-leg:\r\n%s\r\n", early_183);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, early_183, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-                        }
-                    }
+                    char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
+                    send_a_leg_response(server, call, "183 Session Progress", SERVER_CONTACT_LINE,
+                                        content_type_start != NULL ? content_type_start : NO_BODY,
+                                        "183 Session Progress to A-leg");
 
                     // If SDP exists, set media information
                     if (has_sdp) {
                         call->a_leg_media.local_media = true;
                         call->b_leg_media.remote_media = true;
                     }
+                    arm_call_timer(server, call, CALL_RINGING_TIMEOUT_MS);
                     break;
                 }else if (message_type == STATUS_CODE && strcmp(method_or_code, "180") == 0 && leg_type == B_LEG) {
-                    printf("  Processing 180 Ringing from B leg\r\n");
+                    SIP_TRACE("  Processing 180 Ringing from B leg\r\n");
                     
                     // event 180 from b-leg when the call state is CALL_STATE_ROUTING
                     // Action 2
                     // Build the 180 response to A leg
                     // Set the call state to CALL_STATE_RINGING.
                     
-                    char ringing_180[BUFFER_SIZE] = {0};
-
-                    if (call->a_leg_header.from[0] != '\0' && call->a_leg_header.via[0] != '\0' && call->a_leg_header.cseq[0] != '\0' && call->a_leg_header.to[0] != '\0') {
-                        char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
-
-                        if (content_type_start != NULL) {
-                            // If SDP is found, extract it from the message buffer
-                            int sdp_start_index = content_type_start - message->buffer;
-                            snprintf(ringing_180, BUFFER_SIZE,
-                                     "SIP/2.0 180 Ringing\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "Call-ID: %s\r\n"
-                                     "%s\r\n"
-                                     "User-Agent: TinySIP\r\n"
-                                     "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                     "%s",
-                                     call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, 
-                                     call->a_leg_uuid, call->a_leg_header.cseq, SIP_SERVER_IP_ADDRESS, SIP_PORT, 
-                                     message->buffer + sdp_start_index);
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 180 Ringing to A-leg:\r\n%s\r\n", ringing_180);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, ringing_180, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-                        } else {
-                            // If no SDP, build the 180 response without SDP
-                            snprintf(ringing_180, BUFFER_SIZE,
-                                     "SIP/2.0 180 Ringing\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "%s\r\n"
-                                     "Call-ID: %s\r\n"
-                                     "%s\r\n"
-                                     "User-Agent: TinySIP\r\n"
-                                     "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                     "Content-Length: 0\r\n\r\n",
-                                     call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, 
-                                     call->a_leg_uuid, call->a_leg_header.cseq, SIP_SERVER_IP_ADDRESS, SIP_PORT);
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 180 Ringing to A-leg:\r\n%s\r\n", ringing_180);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, ringing_180, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-                        }
-                    }
+                    char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
+                    send_a_leg_response(server, call, "180 Ringing", SERVER_CONTACT_LINE,
+                                        content_type_start != NULL ? content_type_start : NO_BODY,
+                                        "180 Ringing to A-leg");
 
                     // 2. if there is SDP, set the media information.
                     if (has_sdp) {
@@ -1038,19 +2213,18 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                     }
 
                     // 3. Set the call state to CALL_STATE_RINGING.
-                    call->call_state = CALL_STATE_RINGING;
-                    printf("  Call %d state transitioned to CALL_STATE_RINGING.\r\n", call->index);
+                    set_call_state(server, call, CALL_STATE_RINGING);
+                    arm_call_timer(server, call, CALL_RINGING_TIMEOUT_MS);
+                    SIP_TRACE("  Call %d state transitioned to CALL_STATE_RINGING.\r\n", call->index);
                     break;
                 }else if (message_type == STATUS_CODE && strcmp(method_or_code, "200") == 0 && leg_type == B_LEG) {
-                    printf("  Processing 200 OK from B leg\r\n");
+                    SIP_TRACE("  Processing 200 OK from B leg\r\n");
                     
                     // event 200(2xx) from b-leg when the call state is CALL_STATE_ROUTING/CALL_STATE_RINGING
                     // Action 3
                     // Construct a 200 OK response for A leg
                     // Set the state to CALL_STATE_ANSWERED.
                     
-                    char ok_200[BUFFER_SIZE] = {0};
-
                     // Extract Contact for B leg
                     char *contact_start = strstr(message->buffer, "Contact: ");
 
@@ -1072,7 +2246,7 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
 
                                             memmove(call->b_leg_contact, uri_start, uri_len);
                                             call->b_leg_contact[uri_len] = '\0';
-                                            printf("Extracted Contact URI for B leg: [%s]\r\n", call->b_leg_contact);
+                                            SIP_TRACE("Extracted Contact URI for B leg: [%s]\r\n", call->b_leg_contact);
                                         }
                                     }
                                 }
@@ -1080,60 +2254,24 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                         }
                     }
 
-                    if (call->a_leg_header.from[0] != '\0' && call->a_leg_header.via[0] != '\0' && call->a_leg_header.cseq[0] != '\0' && call->a_leg_header.to[0] != '\0') {
-                        char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
+                    // B refreshes the session if its answer makes it the refresher, it may lower the interval
+                    const char *b_refresher;
+                    int b_interval = session_expires_of(message->buffer, &b_refresher);
+                    if (b_interval >= SESSION_MIN_SE && b_interval <= call->session_expires) {
+                        call->session_expires = b_interval;
+                        call->b_leg_refreshes = strcmp(b_refresher, "uas") == 0;
+                    }
 
-                        if (content_type_start != NULL) {
-                            int sdp_start_index = content_type_start - message->buffer;
-                            snprintf(ok_200, BUFFER_SIZE,
-                                "SIP/2.0 200 OK\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "Call-ID: %s\r\n"
-                                "%s\r\n"
-                                "User-Agent: TinySIP\r\n"
-                                "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                "%s",
-                                call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, call->a_leg_uuid, call->a_leg_header.cseq,
-                                SIP_SERVER_IP_ADDRESS, SIP_PORT,
-                                message->buffer + sdp_start_index
-                            );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 200 OK(response to INVITE) to A leg:\r\n%s\r\n", ok_200);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, ok_200, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-
-                        } else {
-                            snprintf(ok_200, BUFFER_SIZE,
-                                "SIP/2.0 200 OK\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "Call-ID: %s\r\n"
-                                "%s\r\n"
-                                "User-Agent: TinySIP\r\n"
-                                "Contact: <sip:TinySIP@%s:%d>\r\n"
-                                "Content-Length: 0\r\n\r\n",
-                                call->a_leg_header.via, call->a_leg_header.from, call->a_leg_header.to, call->a_leg_uuid, call->a_leg_header.cseq,
-                                SIP_SERVER_IP_ADDRESS, SIP_PORT
-                            );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message 200 OK(response to INVITE) to A leg:\r\n%s\r\n", ok_200);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, ok_200, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
-                        }
+                    // A is told to refresh the session if it can
+                    char contact_lines[sizeof(SERVER_CONTACT_LINE) + 64] = SERVER_CONTACT_LINE;
+                    if (call->a_leg_refreshes) {
+                        snprintf(contact_lines, sizeof(contact_lines),
+                                 SERVER_CONTACT_LINE "Require: timer\r\nSession-Expires: %d;refresher=uac\r\n", call->session_expires);
                     }
+                    char *content_type_start = strstr(message->buffer, "Content-Type: application/sdp");
+                    send_a_leg_response(server, call, "200 OK", contact_lines,
+                                        content_type_start != NULL ? content_type_start : NO_BODY,
+                                        "200 OK(response to INVITE) to A leg");
 
                     // 2. if there is SDP, set the media information.
                     if (has_sdp) {
@@ -1142,87 +2280,53 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                     }
 
                     // 3. Set the state to CALL_STATE_ANSWERED.
-                    call->call_state = CALL_STATE_ANSWERED;
-                    printf("  Call %d state transitioned to CALL_STATE_ANSWERED.\r\n", call->index);
+                    set_call_state(server, call, CALL_STATE_ANSWERED);
+                    arm_call_timer(server, call, CALL_TRANSACTION_TIMEOUT_MS);
+                    SIP_TRACE("  Call %d state transitioned to CALL_STATE_ANSWERED.\r\n", call->index);
                     break;
                 }else if (message_type == STATUS_CODE && leg_type == B_LEG) {
                     int temp_response_code = atoi(method_or_code);
 
                     if (temp_response_code >= 100 && temp_response_code < 200) {
-                        printf("  Response [%s] from B leg, do nothing\r\n", method_or_code);
+                        SIP_TRACE("  Response [%s] from B leg, do nothing\r\n", method_or_code);
                         break;
                     }else if (temp_response_code >= 400 && temp_response_code < 700) {
-                        printf("  Response [%s] from B leg, send ACK and response\r\n", method_or_code);
+                        SIP_TRACE("  Response [%s] from B leg, send ACK and response\r\n", method_or_code);
                         // event 400~699 from b-leg when the call state is CALL_STATE_ROUTING/CALL_STATE_RINGING
                         // Action 7
                         // Construct an ACK for B leg,
                         // Construct the same error STATUS_CODE for A leg
                         // Set the state to CALL_STATE_IDLE
                         
-                        char ack_b[BUFFER_SIZE] = {0};
-                        if (call->b_leg_header.from[0] != '\0' && call->b_leg_header.via[0] != '\0' && call->b_leg_header.cseq[0] != '\0' && call->b_leg_header.to[0] != '\0') {
-                            int cseq_value = extract_cseq_number(cseq_header);
-                            snprintf(ack_b, BUFFER_SIZE,
+                        if (call->b_leg_header.block_len != 0 && call->b_leg_header.via[0] != '\0' && call->b_leg_header.cseq[0] != '\0') {
+                            char ack_head[BUFFER_SIZE] = {0};
+                            char ack_rest[HEADER_SIZE] = {0};
+                            snprintf(ack_head, BUFFER_SIZE,
                                 "ACK sip:%s@%s:%d SIP/2.0\r\n"
-                                "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n"
-                                "%s\r\n"
-                                "%s\r\n"   
-                                "Call-ID: %s\r\n"
-                                "CSeq: %d ACK\r\n"
-                                 "User-Agent: TinySIP\r\n"
-                                "Max-Forwards: 70\r\n"
-                                "Content-Length: 0\r\n\r\n",
+                                "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
                                 call->callee, call->b_leg_ip_str, call->b_leg_port,
                                 SIP_SERVER_IP_ADDRESS, SIP_PORT,
-                                (unsigned long)time(NULL),
-                                call->b_leg_header.from, call->b_leg_header.to, call->b_leg_uuid, cseq_value
+                                (unsigned long)time(NULL)
                             );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message ACK to B-leg:\r\n%s\r\n", ack_b);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response_ack;
-                            memset(&response_ack, 0, sizeof(response_ack));
-                            strncpy(response_ack.buffer, ack_b, BUFFER_SIZE - 1);
-                            send_sip_message(&response_ack, call->b_leg_ip_str, call->b_leg_port);
-                        }
-
-                        // 2. Construct the same response for A leg, using header fields from A leg's call data and sending it to A leg.
-                        // The target address is taken from A leg's data. Content-Length is set to 0.
-                        char err_response[BUFFER_SIZE] = {0};
-                        if (call->a_leg_header.from[0] != '\0' && call->a_leg_header.via[0] != '\0' && call->a_leg_header.cseq[0] != '\0' && call->a_leg_header.to[0] != '\0') {
-                            snprintf(err_response, BUFFER_SIZE,
-                                "SIP/2.0 %s\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "%s\r\n"
-                                "Call-ID: %s\r\n"
-                                "%s\r\n"
+                            snprintf(ack_rest, HEADER_SIZE,
+                                "CSeq: %d ACK\r\n"
                                 "User-Agent: TinySIP\r\n"
+                                "Max-Forwards: 70\r\n"
                                 "Content-Length: 0\r\n\r\n",
-                                method_or_code,
-                                call->a_leg_header.via,
-                                call->a_leg_header.from,
-                                call->a_leg_header.to,
-                                call->a_leg_uuid,
-                                call->a_leg_header.cseq
+                                extract_cseq_number(cseq_header)
                             );
-
-                            //printf("\r\n===========================================================\r\n");
-                            printf("Tx SIP message forword  err_response %s to A-leg:\r\n%s\r\n", method_or_code, err_response);
-                            //printf("==============================================================\r\n");
-
-                            sip_message_t response;
-                            memset(&response, 0, sizeof(response));
-                            strncpy(response.buffer, err_response, BUFFER_SIZE - 1);
-                            send_sip_message(&response, call->a_leg_ip_str, call->a_leg_port);
+                            send_b_leg_request(server, call, ack_head, ack_rest, "ACK to B-leg");
                         }
 
-                        // 3. Set the state to CALL_STATE_IDLE and reinitialize the call.
-                        init_call(call, call->index);
-                        call->call_state = CALL_STATE_IDLE;
-                        printf("  Call %d state transitioned to CALL_STATE_IDLE.\r\n", call->index);
+                        // 2. Construct the same response for A leg, from the serialised A leg lines, and send it to A leg.
+                        // The target address is taken from A leg's data. Content-Length is set to 0.
+                        char description[64];
+                        snprintf(description, sizeof(description), "err_response %s to A-leg", method_or_code);
+                        send_a_leg_response(server, call, method_or_code, "", NO_BODY, description);
+
+                        // 3. Set the state to CALL_STATE_IDLE and release the call.
+                        SIP_TRACE("  Call %d state transitioned to CALL_STATE_IDLE.\r\n", call->index);
+                        end_call(server, call);
                         break;
                     }
                 }
@@ -1230,57 +2334,52 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
 
 
             case CALL_STATE_ANSWERED:
-                printf("  Current call state: CALL_STATE_ANSWERED\r\n");
+                SIP_TRACE("  Current call state: CALL_STATE_ANSWERED\r\n");
 
                 // event ACK from a-leg when the call state is CALL_STATE_ANSWERED
                 // Action 4: 
                 // Send ACK to B-leg
                 // Set state to CALL_STATE_CONNECTED.
                 if (message_type == REQUEST_METHOD && strcmp(method_or_code, "ACK") == 0 && leg_type == A_LEG) {
-                    printf("  Processing ACK from A leg\r\n");
+                    SIP_TRACE("  Processing ACK from A leg\r\n");
 
                     // 1. Construct an ACK for B leg, using header fields from B leg's call data and sending it to B leg.
                     // The target address is taken from B leg's data. Content-Length is set to 0
-                    char ack_b[BUFFER_SIZE] = {0};
-                    if (call->b_leg_header.from[0] != '\0' && call->b_leg_header.via[0] != '\0' && call->b_leg_header.cseq[0] != '\0' && call->b_leg_header.to[0] != '\0') {
-                        int cseq_value = extract_cseq_number(call->b_leg_header.cseq);
-                        snprintf(ack_b, BUFFER_SIZE,
+                    if (call->b_leg_header.block_len != 0 && call->b_leg_header.via[0] != '\0' && call->b_leg_header.cseq[0] != '\0') {
+                        char ack_head[BUFFER_SIZE] = {0};
+                        char ack_rest[HEADER_SIZE] = {0};
+                        snprintf(ack_head, BUFFER_SIZE,
                             "ACK sip:%s@%s:%d SIP/2.0\r\n"
-                            "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n"
-                            "%s\r\n"
-                            "%s\r\n"   
-                            "Call-ID: %s\r\n"
+                            "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
+                            call->callee, call->b_leg_ip_str, call->b_leg_port,
+                            SIP_SERVER_IP_ADDRESS, SIP_PORT,
+                            (unsigned long)time(NULL)
+                        );
+                        snprintf(ack_rest, HEADER_SIZE,
                             "CSeq: %d ACK\r\n"
                             "User-Agent: TinySIP\r\n"
                             "Max-Forwards: %d\r\n"
                             "Content-Length: 0\r\n\r\n",
-                            call->callee, call->b_leg_ip_str, call->b_leg_port,
-                            SIP_SERVER_IP_ADDRESS, SIP_PORT,
-                            (unsigned long)time(NULL),
-                            call->b_leg_header.from, call->b_leg_header.to, call->b_leg_uuid, cseq_value,
-                            max_forwards
+                            extract_cseq_number(call->b_leg_header.cseq), max_forwards
                         );
-
-
-                        //printf("\r\n===========================================================\r\n");
-                        printf("Tx SIP message ACK to B-leg:\r\n%s\r\n", ack_b);
-                        //printf("==============================================================\r\n");
-
-                        sip_message_t response_ack;
-                        memset(&response_ack, 0, sizeof(response_ack));
-                        strncpy(response_ack.buffer, ack_b, BUFFER_SIZE - 1);
-                        send_sip_message(&response_ack, call->b_leg_ip_str, call->b_leg_port);
+                        send_b_leg_request(server, call, ack_head, ack_rest, "ACK to B-leg");
                     }
 
-                    call->call_state = CALL_STATE_CONNECTED;
-                    printf("  Call %d state transitioned to CALL_STATE_CONNECTED.\r\n", call->index);
+                    set_call_state(server, call, CALL_STATE_CONNECTED);
+                    // From here the call timer is the session timer, if a leg refreshes the session
+                    if (call->a_leg_refreshes || call->b_leg_refreshes) {
+                        arm_call_timer(server, call, session_timeout_ms(call));
+                    } else {
+                        sip_timer_cancel(&server->store->timers, CALL_TIMER_ID(call->index));
+                    }
+                    SIP_TRACE("  Call %d state transitioned to CALL_STATE_CONNECTED.\r\n", call->index);
                     break;
                 }
 
                 // event CANCEL from a-leg:
                 // This occurs when the calling party initiates a cancellation *while* the 200 OK for INVITE is *in transmission* and hasn't reached the calling party yet.
                 else if (message_type == REQUEST_METHOD && strcmp(method_or_code, "CANCEL") == 0 && leg_type == A_LEG) {
-                    printf("  !!! WARNING !!! received CANCEL from A leg in CALL_STATE_ANSWERED (TODO: release both legs)\r\n");
+                    SIP_TRACE("  !!! WARNING !!! received CANCEL from A leg in CALL_STATE_ANSWERED (TODO: release both legs)\r\n");
                     // TODO: Release both legs properly.
                     break;
                 }
@@ -1289,23 +2388,23 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                 // This could be caused by network issues. A strict approach is to release both legs.
                 // This part is TODO.
                 else if (message_type == REQUEST_METHOD && strcmp(method_or_code, "BYE") == 0 && leg_type == B_LEG) {
-                    printf("  !!! WARNING !!! received BYE from B leg in CALL_STATE_ANSWERED (TODO: release both legs)\r\n");
+                    SIP_TRACE("  !!! WARNING !!! received BYE from B leg in CALL_STATE_ANSWERED (TODO: release both legs)\r\n");
                     // TODO: Release both legs properly.
                     break;
                 } else {
-                    printf("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_STATE_ANSWERED\r\n", message_type, method_or_code);
+                    SIP_TRACE("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_STATE_ANSWERED\r\n", message_type, method_or_code);
                 }
                 break;
 
             case CALL_STATE_CONNECTED:
-                printf("  Current call state: CALL_STATE_CONNECTED\r\n");
+                SIP_TRACE("  Current call state: CALL_STATE_CONNECTED\r\n");
                 if (message_type == REQUEST_METHOD && strcmp(method_or_code, "BYE") == 0 ) {
                 // event BYE from a-leg or b-leg when the call state is  CALL_STATE_CONNECTED
                 // Action 5
                 // Send 200 OK to the sender of BYE
                 // Construct and send BYE to the other leg
                 // Set state to CALL_DISCONNECTING
-                    printf("  Processing BYE from %s leg\r\n", leg_type == A_LEG ? "A":"B");
+                    SIP_TRACE("  Processing BYE from %s leg\r\n", leg_type == A_LEG ? "A":"B");
                     char ok_200_bye[BUFFER_SIZE] = {0};
                     snprintf(ok_200_bye, BUFFER_SIZE,
                          "SIP/2.0 200 OK\r\n"
@@ -1323,155 +2422,524 @@ void handle_state_machine(call_t *call, int message_type, const char *method_or_
                     );
 
                     //printf("\r\n===========================================================\r\n");
-                    printf("Tx SIP message 200 OK(response to BYE) to Sender leg:\r\n%s\r\n", ok_200_bye);
+                    SIP_TRACE("Tx SIP message 200 OK(response to BYE) to Sender leg:\r\n%s\r\n", ok_200_bye);
                     //printf("==============================================================\r\n");
                     sip_message_t response_200ok;
                     memset(&response_200ok, 0, sizeof(response_200ok));
                     strncpy(response_200ok.buffer, ok_200_bye, BUFFER_SIZE - 1);
-                    send_sip_message(&response_200ok, leg_type == A_LEG ? call->a_leg_ip_str: call->b_leg_ip_str, leg_type == A_LEG ? call->a_leg_port: call->b_leg_port);
+                    sip_server_send(server, &response_200ok, leg_type == A_LEG ? call->a_leg_ip_str: call->b_leg_ip_str, leg_type == A_LEG ? call->a_leg_port: call->b_leg_port);
                     
-                    char bye_other_leg[BUFFER_SIZE] = {0};
                     if (leg_type == A_LEG) {
-                        // Generate Via header for b-leg
-                        snprintf(call->b_leg_header.via, HEADER_SIZE, "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
-                            SIP_SERVER_IP_ADDRESS,
-                            SIP_PORT,
-                            (unsigned long)time(NULL)
-                        );
-
-                        snprintf(bye_other_leg, BUFFER_SIZE,
-                            "BYE sip:%s@%s:%d SIP/2.0\r\n"
-                            "%s"
-                            "%s\r\n"
-                            "%s\r\n"
-                            "Call-ID: %s\r\n"
-                            "CSeq: %d BYE\r\n"
-                            "User-Agent: TinySIP\r\n"
-                            "Content-Length: 0\r\n\r\n",
-                            call->callee, call->b_leg_ip_str, call->b_leg_port,
-                            call->b_leg_header.via,
-                            call->b_leg_header.from,
-                            call->b_leg_header.to,
-                            call->b_leg_uuid,
-                            cseq_number++
-                        );
-                        
-
-                        //printf("\r\n===========================================================\r\n");
-                        printf("Tx SIP message BYE to B leg:\r\n%s\r\n", bye_other_leg);
-                        //printf("==============================================================\r\n");
-                        sip_message_t response_bye_other_leg;
-                        memset(&response_bye_other_leg, 0, sizeof(response_bye_other_leg));
-                        strncpy(response_bye_other_leg.buffer, bye_other_leg, BUFFER_SIZE - 1);
-                        send_sip_message(&response_bye_other_leg, call->b_leg_ip_str, call->b_leg_port);
+                        send_bye_to_b_leg(server, call);
                     } else {
-                        // Generate Via header for a-leg
-                        snprintf(call->a_leg_header.via, HEADER_SIZE, "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK%lx\r\n",
-                            SIP_SERVER_IP_ADDRESS,
-                            SIP_PORT,
-                            (unsigned long)time(NULL)
-                        );
-                        
-                        char new_from_header[HEADER_SIZE+10] = {0};
-                        char new_to_header[HEADER_SIZE+10] = {0};
-                        
-                        char temp_from_data[HEADER_SIZE] = {0};
-                        char temp_to_data[HEADER_SIZE] = {0};
-
-                        char *from_start = strstr(call->a_leg_header.from, "From: ");
-                        if (from_start != NULL) {
-                            from_start += strlen("From: "); 
-                            size_t from_len = strlen(from_start);
-                             if (from_len < HEADER_SIZE -1) {
-                                strncpy(temp_from_data, from_start, HEADER_SIZE - 1);
-                                temp_from_data[HEADER_SIZE - 1] = '\0';
-                            }
-                        
-                        }
-
-                         char *to_start = strstr(call->a_leg_header.to, "To: ");
-                        if (to_start != NULL) {
-                            to_start += strlen("To: "); 
-                            size_t to_len = strlen(to_start);
-                            if (to_len < HEADER_SIZE -1) {
-                            strncpy(temp_to_data, to_start, HEADER_SIZE - 1);
-                            temp_to_data[HEADER_SIZE - 1] = '\0';
-                            }
-                          
-                        }
-                        
-
-                        snprintf(new_from_header, HEADER_SIZE+10, "From: %s", temp_to_data);
-                        snprintf(new_to_header, HEADER_SIZE+10, "To: %s", temp_from_data);
-                        
-                        snprintf(bye_other_leg, BUFFER_SIZE,
-                            "BYE %s SIP/2.0\r\n"
-                            "%s"
-                            "%s\r\n"
-                            "%s\r\n"
-                            "Call-ID: %s\r\n"
-                            "CSeq: %d BYE\r\n"
-                            "User-Agent: TinySIP\r\n"
-                            "Content-Length: 0\r\n\r\n",
-                            call->a_leg_contact,
-                            call->a_leg_header.via,
-                            new_from_header,
-                            new_to_header,
-                            call->a_leg_uuid,
-                            cseq_number++
-                        );
-
-                        //printf("\r\n===========================================================\r\n");
-                        printf("Tx SIP message BYE to A leg:\r\n%s\r\n", bye_other_leg);
-                        //printf("==============================================================\r\n");
-                        sip_message_t response_bye_other_leg;
-                        memset(&response_bye_other_leg, 0, sizeof(response_bye_other_leg));
-                        strncpy(response_bye_other_leg.buffer, bye_other_leg, BUFFER_SIZE - 1);
-                        send_sip_message(&response_bye_other_leg, call->a_leg_ip_str, call->a_leg_port);
+                        send_bye_to_a_leg(server, call);
                     }
 
-                    call->call_state = CALL_DISCONNECTING;
-                    printf("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
+                    set_call_state(server, call, CALL_DISCONNECTING);
+                    arm_call_timer(server, call, CALL_TRANSACTION_TIMEOUT_MS);
+                    SIP_TRACE("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
+                } else if (message_type == REQUEST_METHOD && strcmp(method_or_code, "UPDATE") == 0 && !has_body(message->buffer)) {
+                    // event UPDATE without a body from a-leg or b-leg: a session refresh (RFC 4028), answered by the server.
+                    // The sender becomes a refresher, and the session timer restarts.
+                    const char *refresher;
+                    int interval = session_expires_of(message->buffer, &refresher);
+                    if (interval > 0 && interval < SESSION_MIN_SE) {
+                        send_local_response(server, message, "422 Session Interval Too Small", "Min-SE: " STRINGIFY(SESSION_MIN_SE) "\r\n",
+                                            via_header, from_header, to_header, call_id_header, cseq_header);
+                        break;
+                    }
+                    if (interval > 0) {
+                        call->session_expires = interval < SESSION_EXPIRES ? interval : SESSION_EXPIRES;
+                    }
+                    if (leg_type == A_LEG) {
+                        call->a_leg_refreshes = true;
+                    } else {
+                        call->b_leg_refreshes = true;
+                    }
+                    char session_lines[96];
+                    snprintf(session_lines, sizeof(session_lines),
+                             "Require: timer\r\nSession-Expires: %d;refresher=uac\r\n", call->session_expires);
+                    send_local_response(server, message, "200 OK", session_lines,
+                                        via_header, from_header, to_header, call_id_header, cseq_header);
+                    arm_call_timer(server, call, session_timeout_ms(call));
+                    SIP_TRACE("  Call %d session refreshed by %s leg for %d s\r\n", call->index, leg_type == A_LEG ? "A" : "B", call->session_expires);
                 } else {
-                    printf("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_STATE_CONNECTED\r\n", message_type, method_or_code);
+                    SIP_TRACE("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_STATE_CONNECTED\r\n", message_type, method_or_code);
                 }
                 break;
 
             case CALL_DISCONNECTING:
-                printf("  Current call state: CALL_DISCONNECTING\r\n");
+                SIP_TRACE("  Current call state: CALL_DISCONNECTING\r\n");
                 if (message_type == STATUS_CODE && strcmp(method_or_code, "200") == 0) {
                     // event 200 OK of BYE from a-leg or b-leg when the call state is  CALL_DISCONNECTING
                     // Action 8
                     // Set state to CALL_STATE_IDLE
                     if (strstr(cseq_header, "BYE") != NULL || strstr(cseq_header, "CANCEL") != NULL) {
-                        printf("Received 200 OK (response to BYE/CANCEL) for call [%d]. Releasing call data.\r\n", call->index);
-                        init_call(call, call->index);
-                        call->call_state = CALL_STATE_IDLE;
-                        printf("  Call %d state transitioned to CALL_STATE_IDLE.\r\n", call->index);
+                        SIP_TRACE("Received 200 OK (response to BYE/CANCEL) for call [%d]. Releasing call data.\r\n", call->index);
+                        SIP_TRACE("  Call %d state transitioned to CALL_STATE_IDLE.\r\n", call->index);
+                        end_call(server, call);
                     } else {
-                        printf("  !!! WARNING !!! received 200 OK without BYE/CANCEL in CALL_DISCONNECTING\r\n");
+                        SIP_TRACE("  !!! WARNING !!! received 200 OK without BYE/CANCEL in CALL_DISCONNECTING\r\n");
                     }
                 } else {
-                    printf("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_DISCONNECTING\r\n", message_type, method_or_code);
+                    SIP_TRACE("  !!! WARNING !!! Unexpected message type [%d] and status code/method [%s] in CALL_DISCONNECTING\r\n", message_type, method_or_code);
                 }
 
                 break;
 
             default:
-                printf("  Current call state: Unknown state\r\n");
+                SIP_TRACE("  Current call state: Unknown state\r\n");
         }        
         
     }
 }
 
+/**
+ * @brief Charges a received message to the message pool before it is queued.
+ * @param server The server the message is queued for.
+ * @param message The message, its pool_bytes are set if it is admitted.
+ * @return true if the message fits under the pool's ceiling, false if it must be dropped.
+ */
+bool sip_server_admit_message(sip_server_t *server, sip_message_t *message) {
+    message->pool_bytes = 0;
+    message->priority = sip_server_is_emergency(server, message);
+    if (message->priority) {
+        // Emergency INVITEs are never shed, they may take the pool past its ceiling
+        sip_memory_force_charge(&server->store->memory, SIP_MEMORY_MESSAGES, sizeof(sip_message_t));
+    } else if (!sip_memory_charge(&server->store->memory, SIP_MEMORY_MESSAGES, sizeof(sip_message_t))) {
+        return false;
+    }
+    message->pool_bytes = sizeof(sip_message_t);
+    return true;
+}
+
+/**
+ * @brief Replaces the filter of the messages logged, see sip_trace.h.
+ * Workers pick it up with the next message they receive, they are not stalled meanwhile.
+ * Must not be called by two threads at once.
+ */
+void sip_server_set_trace(sip_server_t *server, const sip_trace_filter_t *filter) {
+    shm_seqlock_write(&server->store->trace_lock, &server->store->trace, filter, sizeof(*filter));
+}
+
+/**
+ * @brief Copies the filter of the messages logged.
+ */
+void sip_server_get_trace(sip_server_t *server, sip_trace_filter_t *filter) {
+    shm_seqlock_read(&server->store->trace_lock, filter, &server->store->trace, sizeof(*filter));
+}
+
+/**
+ * @brief Copies the summary of a call without taking its lock, so its worker is never stalled.
+ * @param index The call's index in the call table.
+ * @return true if the call is up, false if the entry is free or the index invalid.
+ */
+bool sip_server_call_summary(sip_server_t *server, int index, call_summary_t *summary) {
+    if (index < 0 || index >= MAX_CALLS) {
+        return false;
+    }
+    call_t *call = &server->store->call_map.calls[index];
+    shm_seqlock_read(&call->summary_lock, summary, &call->summary, sizeof(*summary));
+    return summary->active;
+}
+
+/**
+ * @brief Copies the registered bindings of the location store.
+ * The location lock is only held for the copy, the caller formats them without it.
+ * @param entries Where the bindings are copied.
+ * @param max Room in entries.
+ * @return The number of bindings copied.
+ */
+int sip_server_registrations(sip_server_t *server, location_entry_t *entries, int max) {
+    sip_store_t *store = server->store;
+    location_entry_t snapshot[MAX_LOCATIONS];
+    int size;
+
+    shm_mutex_lock(&store->location_mutex);
+    size = store->location_size;
+    memcpy(snapshot, store->location_entries, (size_t)size * sizeof(location_entry_t));
+    pthread_mutex_unlock(&store->location_mutex);
+
+    int count = 0;
+    for (int i = 0; i < size && count < max; i++) {
+        if (snapshot[i].registered) {
+            entries[count++] = snapshot[i];
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Tells whether a message is an INVITE to an emergency number.
+ *
+ * Only the request line is looked at, so this is cheap enough for the receive thread. The
+ * user part of a sip:, sips: or tel: request URI is compared with the server's emergency
+ * numbers, and service URNs (urn:service:sos, urn:service:sos.police...) always match.
+ * @param server The server, its emergency numbers are matched.
+ * @param message The received message.
+ * @return true if the message is an emergency INVITE.
+ */
+bool sip_server_is_emergency(const sip_server_t *server, const sip_message_t *message) {
+    if (strncmp(message->buffer, "INVITE ", strlen("INVITE ")) != 0) {
+        return false;
+    }
+    const char *uri = message->buffer + strlen("INVITE ");
+    if (strncmp(uri, "urn:service:sos", strlen("urn:service:sos")) == 0) {
+        char next = uri[strlen("urn:service:sos")];
+        return next == ' ' || next == '.' || next == ';' || next == '>';
+    }
+
+    const char *user;
+    if (strncmp(uri, "sip:", strlen("sip:")) == 0 || strncmp(uri, "tel:", strlen("tel:")) == 0) {
+        user = uri + 4;
+    } else if (strncmp(uri, "sips:", strlen("sips:")) == 0) {
+        user = uri + 5;
+    } else {
+        return false;
+    }
+    size_t len = strcspn(user, "@;> \r\n");
+    for (int i = 0; i < server->emergency_count; i++) {
+        if (strlen(server->emergency_numbers[i]) == len && memcmp(server->emergency_numbers[i], user, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Sets the emergency numbers from a comma-separated list like "112,911,999".
+ *
+ * Must be called before the workers start. An empty list leaves only the service URNs.
+ * @return 0 on success, -1 if the list is invalid (the numbers are not changed then).
+ */
+int sip_server_set_emergency_numbers(sip_server_t *server, const char *numbers) {
+    char parsed[MAX_EMERGENCY_NUMBERS][MAX_EMERGENCY_NUMBER_LENGTH];
+    int count = 0;
+
+    if (numbers == NULL) {
+        return -1;
+    }
+    const char *p = numbers;
+    while (*p != '\0') {
+        size_t len = strcspn(p, ",");
+        if (len == 0 || len >= MAX_EMERGENCY_NUMBER_LENGTH || count == MAX_EMERGENCY_NUMBERS ||
+            strcspn(p, "@;> \t\r\n") < len) {
+            return -1;
+        }
+        memcpy(parsed[count], p, len);
+        parsed[count][len] = '\0';
+        count++;
+        p += len;
+        if (*p == ',') {
+            p++;
+            if (*p == '\0') {
+                return -1;
+            }
+        }
+    }
+    memcpy(server->emergency_numbers, parsed, sizeof(parsed));
+    server->emergency_count = count;
+    return 0;
+}
+
+/**
+ * @brief Returns what a message holds once a worker is done with it.
+ *
+ * Clears the message's duplicate filter entry so later retransmissions are let through again, and
+ * credits the message pool if the message was admitted by sip_server_admit_message().
+ * @param server The server that processed the message.
+ * @param message The message, which stays owned by the caller.
+ */
+void complete_message(sip_server_t *server, sip_message_t *message) {
+    dedup_filter_release(&server->store->dedup_filter, message->dedup_hash);
+    if (message->pool_bytes != 0) {
+        sip_memory_credit(&server->store->memory, SIP_MEMORY_MESSAGES, message->pool_bytes);
+        message->pool_bytes = 0;
+    }
+}
+
+/**
+ * @brief Releases a heap-allocated message once a worker is done with it (see complete_message()), then frees it.
+ * @param server The server that processed the message.
+ * @param message The message to release.
+ */
+void release_message(sip_server_t *server, sip_message_t *message) {
+    complete_message(server, message);
+    free(message);
+}
+
+/**
+ * @brief Copies the memory account of a subsystem.
+ * @param server The server.
+ * @param subsystem The subsystem.
+ * @param stats Receives the account.
+ */
+void sip_server_memory_stats(sip_server_t *server, sip_memory_subsystem_t subsystem, sip_memory_stats_t *stats) {
+    sip_store_t *store = server->store;
+    if (subsystem == SIP_MEMORY_TRANSACTIONS) {
+        // The duplicate filter counts its entries itself
+        size_t in_flight = dedup_filter_in_flight(&store->dedup_filter);
+        sip_memory_set_usage(&store->memory, SIP_MEMORY_TRANSACTIONS, in_flight * sizeof(dedup_slot_t), in_flight);
+    }
+    sip_memory_snapshot(&store->memory, subsystem, stats);
+}
+
 /**
  * @brief Worker thread function to process SIP messages.
- * @param arg Pointer to the worker thread's message queue.
+ * @param arg Pointer to the worker thread (worker_thread_t), giving its message queue and server.
  * @return NULL
  */
 void* process_sip_messages(void* arg) {
-    message_queue_t *queue = (message_queue_t *)arg;
+    worker_thread_t *worker = (worker_thread_t *)arg;
     sip_message_t *message;
+
+    while (1) {
+        if (dequeue_message(&worker->queue, &message)) {
+            if (message == NULL) {
+                break;
+            }
+            process_sip_message(worker->server, message);
+            release_message(worker->server, message);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the name of a call state, as shown by the admin socket.
+ */
+const char *call_state_name(call_state_t state) {
+    static const char *const names[] = {
+        [CALL_STATE_IDLE] = "idle",
+        [CALL_STATE_ROUTING] = "routing",
+        [CALL_STATE_RINGING] = "ringing",
+        [CALL_STATE_ANSWERED] = "answered",
+        [CALL_STATE_CONNECTED] = "connected",
+        [CALL_DISCONNECTING] = "disconnecting",
+    };
+    return (size_t)state < sizeof(names) / sizeof(names[0]) ? names[state] : "unknown";
+}
+
+/**
+ * @brief Returns the hash of a message's Call-ID, the same for both legs of a call.
+ *
+ * Computed by the first caller, the receive thread for received datagrams, and kept in the
+ * message for the worker.
+ * @param message The received message.
+ * @return sip_hash_call_id() of the Call-ID, 1 if the message has none.
+ */
+uint64_t message_call_hash(sip_message_t *message) {
+    if (message->call_hash != 0) {
+        return message->call_hash;
+    }
+    size_t len = 0;
+    const char *call_id = strstr(message->buffer, "Call-ID:");
+    if (call_id != NULL) {
+        call_id += strlen("Call-ID:");
+        while (*call_id == ' ') {
+            call_id++;
+        }
+        len = strcspn(call_id, "\r\n");
+    }
+    message->call_hash = len > 0 ? sip_hash_call_id(call_id, len) : 1;
+    return message->call_hash;
+}
+
+/**
+ * @brief Returns the worker a message must be handled by.
+ *
+ * Messages of one call must be handled in order by the same worker, both legs of a call have
+ * the same message_call_hash().
+ * @param message The received message.
+ * @param workers The number of workers.
+ * @return A worker index in [0, workers).
+ */
+int message_worker_index(sip_message_t *message, int workers) {
+    if (workers <= 1) {
+        return 0;
+    }
+    return (int)(message_call_hash(message) % (uint64_t)workers);
+}
+
+/**
+ * @brief Copies the user part of the URI of one header line, without looking past the line.
+ * @param line The header line, e.g. found with find_header_line().
+ * @param len Its length.
+ * @return true if a non-empty user part fits in size.
+ */
+static bool header_line_username(const char *line, size_t len, char *username, size_t size) {
+    char header[HEADER_SIZE];
+    if (line == NULL || len >= sizeof(header)) {
+        return false;
+    }
+    memcpy(header, line, len);
+    header[len] = '\0';
+    return sip_header_username(header, username, size);
+}
+
+/**
+ * @brief Decides whether a received message is traced, see sip_trace.h.
+ * Only the headers the filter looks at are searched for.
+ */
+static bool trace_message(sip_server_t *server, sip_message_t *message) {
+    sip_trace_filter_t trace;
+    sip_server_get_trace(server, &trace);
+    const sip_trace_filter_t *filter = &trace;
+    if (filter->all) {
+        return true;
+    }
+    const char *call_id = NULL;
+    size_t call_id_len = 0;
+    if (filter->call_id[0] != '\0') {
+        call_id = find_header_line(message->buffer, "Call-ID: ", &call_id_len);
+        if (call_id != NULL) {
+            call_id += strlen("Call-ID: ");
+            call_id_len -= strlen("Call-ID: ");
+        }
+    }
+    char from_user[MAX_USERNAME_LENGTH];
+    char to_user[MAX_USERNAME_LENGTH];
+    bool has_from = false, has_to = false;
+    if (filter->user[0] != '\0') {
+        size_t len;
+        const char *line = find_header_line(message->buffer, "From: ", &len);
+        has_from = header_line_username(line, len, from_user, sizeof(from_user));
+        line = find_header_line(message->buffer, "To: ", &len);
+        has_to = header_line_username(line, len, to_user, sizeof(to_user));
+    }
+    uint64_t call_hash = filter->sample != 0 ? message_call_hash(message) : 0;
+    return sip_trace_match(filter, call_id, call_id_len, call_hash, has_from ? from_user : NULL,
+                           has_to ? to_user : NULL, &message->client_addr.sin_addr);
+}
+
+/**
+ * @brief Logs a received message, if it is traced.
+ */
+static void trace_received(const sip_message_t *message) {
+    if (!sip_trace_on) {
+        return;
+    }
+    char source_ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &message->client_addr.sin_addr, source_ip_str, sizeof(source_ip_str));
+    printf("\r\n===========================================================\r\n");
+    printf("Rx SIP message from Source: %s:%d\r\n", source_ip_str, ntohs(message->client_addr.sin_port));
+    printf("received SIP message:\r\n%s\r\n", message->buffer);
+}
+
+/**
+ * @brief Runs the state machine for a message, holding the call's lock if the call exists.
+ */
+static void dispatch_to_call(sip_server_t *server, call_t *call, int message_type, const char *method_or_code, bool has_sdp, sip_message_t *message, int leg_type) {
+#ifdef COST_COUNTERS
+    cost_event_t event = cost_event_classify(message_type == STATUS_CODE, method_or_code);
+    uint64_t started;
+#endif
+    if (call == NULL) {
+#ifdef COST_COUNTERS
+        started = cost_cycles();
+#endif
+        handle_state_machine(server, NULL, message_type, method_or_code, has_sdp, message, message->buffer, leg_type);
+#ifdef COST_COUNTERS
+        cost_count_transition(&server->store->costs, CALL_STATE_IDLE, event, 0, has_sdp, cost_cycles() - started);
+#endif
+        return;
+    }
+    shm_mutex_lock(&call->mutex);
+    if (call->traced && !sip_trace_on) {
+        // The message didn't match the filter, but its dialog did
+        sip_trace_on = true;
+        trace_received(message);
+    }
+#ifdef COST_COUNTERS
+    // The state before the message, the call may be gone after it
+    call_state_t state = call->call_state;
+    started = cost_cycles();
+#endif
+    handle_state_machine(server, call, message_type, method_or_code, has_sdp, message, message->buffer, leg_type);
+#ifdef COST_COUNTERS
+    cost_count_transition(&server->store->costs, state, event, leg_type, has_sdp, cost_cycles() - started);
+#endif
+    pthread_mutex_unlock(&call->mutex);
+}
+
+/**
+ * @brief Answers a request for a user that isn't provisioned with a pre-built 404, when the
+ * unknown-user filter can tell without searching the location store.
+ *
+ * Only REGISTERs (user in From) and initial INVITEs (user in To, which has no tag yet) are
+ * looked at. The 404 is the Via, From, To, Call-ID and CSeq lines copied between constant
+ * text: nothing else is parsed or formatted.
+ * @return true if the request was rejected.
+ */
+static bool reject_unknown_user(sip_server_t *server, sip_message_t *message) {
+    static const char status_line[] = "SIP/2.0 404 Not Found\r\n";
+    static const char trailer[] = "Content-Length: 0\r\n\r\n";
+    bool is_register = strncmp(message->buffer, "REGISTER ", strlen("REGISTER ")) == 0;
+    if (!is_register && strncmp(message->buffer, "INVITE ", strlen("INVITE ")) != 0) {
+        return false;
+    }
+    // Emergency INVITEs always get the full lookup
+    if (!is_register && sip_server_is_emergency(server, message)) {
+        return false;
+    }
+
+    size_t lens[5];
+    const char *lines[5] = {
+        find_header_line(message->buffer, "Via: ", &lens[0]),
+        find_header_line(message->buffer, "From: ", &lens[1]),
+        find_header_line(message->buffer, "To: ", &lens[2]),
+        find_header_line(message->buffer, "Call-ID: ", &lens[3]),
+        find_header_line(message->buffer, "CSeq: ", &lens[4]),
+    };
+    size_t total = sizeof(status_line) + sizeof(trailer);
+    for (int i = 0; i < 5; i++) {
+        if (lines[i] == NULL) {
+            return false;
+        }
+        total += lens[i] + 2;
+    }
+    const char *user_line = is_register ? lines[1] : lines[2];
+    size_t user_len = is_register ? lens[1] : lens[2];
+    char username[MAX_USERNAME_LENGTH];
+    if (total > BUFFER_SIZE ||
+        (!is_register && memmem(lines[2], lens[2], ";tag=", strlen(";tag=")) != NULL) ||
+        !header_line_username(user_line, user_len, username, sizeof(username))) {
+        return false;
+    }
+    user_filter_verdict_t verdict = user_filter_check(&server->store->user_filter, username,
+                                                      &message->client_addr.sin_addr, sip_server_now_ms(server));
+    if (verdict == USER_FILTER_MAYBE_KNOWN) {
+        return false;
+    }
+
+    sip_message_t response;
+    memset(&response, 0, sizeof(response));
+    char *out = response.buffer;
+    memcpy(out, status_line, sizeof(status_line) - 1);
+    out += sizeof(status_line) - 1;
+    for (int i = 0; i < 5; i++) {
+        memcpy(out, lines[i], lens[i]);
+        out += lens[i];
+        memcpy(out, "\r\n", 2);
+        out += 2;
+    }
+    memcpy(out, trailer, sizeof(trailer) - 1);
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &message->client_addr.sin_addr, ip, sizeof(ip));
+    SIP_TRACE("%s for unknown user '%s' from %s rejected with 404 (%s)\n", is_register ? "REGISTER" : "INVITE",
+           username, ip, verdict == USER_FILTER_UNKNOWN ? "Bloom filter" : "negative cache");
+    sip_server_send(server, &response, ip, ntohs(message->client_addr.sin_port));
+    return true;
+}
+
+/**
+ * @brief Parses a single SIP message and dispatches it to the registrar or the call state machine.
+ * The message is not freed.
+ * @param server The server processing the message.
+ * @param message The received message.
+ */
+void process_sip_message(sip_server_t *server, sip_message_t *message) {
     char method[20] = {0};
     char call_id[MAX_UUID_LENGTH] = {0};
     const char *ptr;
@@ -1482,208 +2950,442 @@ void* process_sip_messages(void* arg) {
     bool has_sdp = false;
     call_t *call = NULL;
     int leg_type = 0;
-    char source_ip_str[INET_ADDRSTRLEN] = {0};
 
-    while (1) {
-        if (dequeue_message(queue, &message)) {
-            // Process the SIP message here
-            inet_ntop(AF_INET, &(message->client_addr.sin_addr), source_ip_str, INET_ADDRSTRLEN);
-
-            char *first_line_end = strstr(message->buffer, "\r\n");
-            if (first_line_end == NULL) {
-                free(message);
-                continue; // invalid sip message
-            }
-            size_t first_line_len = first_line_end - message->buffer;
-            char first_line[first_line_len + 1];
-            strncpy(first_line, message->buffer, first_line_len);
-            first_line[first_line_len] = '\0';
-            
-            if (0 == first_line_len)
-            {
-                free(message);
-                continue; // invalid sip message                
+    // Process the SIP message here
+    char *first_line_end = strstr(message->buffer, "\r\n");
+    if (first_line_end == NULL) {
+        return;
+    }
+    size_t first_line_len = first_line_end - message->buffer;
+    char first_line[first_line_len + 1];
+    strncpy(first_line, message->buffer, first_line_len);
+    first_line[first_line_len] = '\0';
+    
+    if (0 == first_line_len)
+    {
+        return;
+    }
+
+    // Decided once, before anything about the message is logged
+    sip_trace_on = trace_message(server, message);
+
+    // Requests for unknown users are answered before anything is logged or parsed
+    if (reject_unknown_user(server, message)) {
+        return;
+    }
+     
+    trace_received(message);
+
+    // Simulate processing and response.
+    // This study case simulates minimal SIP decoding by extracting and logging the Request Method/Status Code, Call-ID, and Content-Type (if application/sdp).
+    // Only Status Codes related to INVITE, CANCEL, or BYE requests are reported to the state machine. Other Status Codes would be handled by a full SIP stack.
+    // A more complete SIP stack will manage decoding exceptions, SIP transaction processing, as well as redundant string matching and performance optimizations during SIP decoding.
+    // This SIP server operates in media bypass mode, so no media processing is performed here; media information is only recorded and forwarded to the other leg.
+    // This SIP server operates in B2BUA mode, not as a proxy. The registration server functionality is not implemented.
+
+    // The SIP_SERVER_IP_ADDRESS macro must be set to the interface address used by the SIP server
+    // so that the SIP server can correctly populate its Via: and Contact: headers. **Note:** This needs to be done before compiling!
+
+    // The PROVISIONED_LOCATIONS should be filled with each softphone/UE's SIP port, address, and phone number
+    // so that they can be correctly reached as the called party by the SIP server. **Note:** This needs to be done before compiling!
+    // The SIP port and address are no longer required, but the phone number must still be set. 
+    // Parse SIP message inline
+
+    // The PROVISIONED_LOCATIONS should be filled with each softphone/UE's phone number
+    // so that they can be correctly reached by the SIP server. 
+    // The SIP address and port are no longer required due to the simplified registration and location server functionality. 
+    // However, the phone number must still be set to identify the user.
+    // **Note:** This needs to be done before compiling!
+    
+    ptr = message->buffer;
+    response_code = 0;
+    memset(cseq_header, 0, sizeof(cseq_header));    
+    has_sdp = false;
+
+    // 0. REGISTER
+    if (strncmp(first_line, "REGISTER ", strlen("REGISTER ")) == 0) {
+
+        // It's a REGISTER request, call handle_register
+        SIP_TRACE("Handling REGISTER request.\n");
+        int ret = handle_register(server, message);
+        if (ret == -1) {
+            SIP_TRACE("Handling REGISTER request failure.\n");
+        }
+        return;
+    }
+
+    // 0. SUBSCRIBE, reg and presence event packages
+    if (strncmp(first_line, "SUBSCRIBE ", strlen("SUBSCRIBE ")) == 0) {
+        SIP_TRACE("Handling SUBSCRIBE request.\n");
+        if (handle_subscribe(server, message) == -1) {
+            SIP_TRACE("Handling SUBSCRIBE request failure.\n");
+        }
+        return;
+    }
+
+    // 0. MESSAGE, relayed or stored for the recipient
+    if (strncmp(first_line, "MESSAGE ", strlen("MESSAGE ")) == 0) {
+        SIP_TRACE("Handling MESSAGE request.\n");
+        if (handle_message(server, message) == -1) {
+            SIP_TRACE("Handling MESSAGE request failure.\n");
+        }
+        return;
+    }
+
+    // 1. Parse Call-ID
+    // Locate "Call-ID:"
+    char *call_id_start = strstr(message->buffer, "Call-ID:");
+    if (call_id_start != NULL) {
+        // Skip "Call-ID:" and spaces
+        call_id_start += strlen("Call-ID:");
+        while (*call_id_start == ' ') {
+            call_id_start++;
+        }
+        ptr = call_id_start;
+
+        // Find the newline character, get the Call-ID
+        while (*ptr != '\r' && *ptr != '\n' && *ptr != '\0') {
+            ptr++;
+        }
+
+        if (ptr - call_id_start > 0) {
+            strncpy(call_id, call_id_start, ptr - call_id_start);
+            call_id[ptr - call_id_start] = '\0'; 
+            SIP_TRACE("  Call-ID:       [%s]\r\n", call_id);
+        } else {
+            SIP_TRACE("  Failed to parse Call-ID\r\n");
+        }
+    } else {
+        //printf("  Call-ID not found\r\n");
+    }
+
+    // 2. Parse Content-Type, only check for application/sdp
+    content_type_start = strstr(message->buffer, "Content-Type: ");
+    if (content_type_start != NULL) {
+        content_type_start += strlen("Content-Type: ");
+        ptr = content_type_start;
+        while (*ptr != '\r' && *ptr != '\n' && *ptr != '\0') {
+            ptr++;
+        }
+        if (ptr - content_type_start > 0) {
+            strncpy(content_type, content_type_start, ptr - content_type_start);
+            content_type[ptr - content_type_start] = '\0';
+            if (strstr(content_type, "application/sdp")) {
+                SIP_TRACE("  Content-Type:  [%s]\r\n", content_type);
+                has_sdp = true;
             }
-             
-            printf("\r\n===========================================================\r\n");
-            printf("Rx SIP message from Source: %s:%d\r\n", source_ip_str, ntohs(message->client_addr.sin_port));
-            printf("received SIP message:\r\n%s\r\n", message->buffer);
-            //printf("==============================================================\r\n");
-
-            // Simulate processing and response.
-            // This study case simulates minimal SIP decoding by extracting and logging the Request Method/Status Code, Call-ID, and Content-Type (if application/sdp).
-            // Only Status Codes related to INVITE, CANCEL, or BYE requests are reported to the state machine. Other Status Codes would be handled by a full SIP stack.
-            // A more complete SIP stack will manage decoding exceptions, SIP transaction processing, as well as redundant string matching and performance optimizations during SIP decoding.
-            // This SIP server operates in media bypass mode, so no media processing is performed here; media information is only recorded and forwarded to the other leg.
-            // This SIP server operates in B2BUA mode, not as a proxy. The registration server functionality is not implemented.
-
-            // The SIP_SERVER_IP_ADDRESS macro must be set to the interface address used by the SIP server
-            // so that the SIP server can correctly populate its Via: and Contact: headers. **Note:** This needs to be done before compiling!
-
-            // The location_entries should be filled with each softphone/UE's SIP port, address, and phone number
-            // so that they can be correctly reached as the called party by the SIP server. **Note:** This needs to be done before compiling!
-            // The SIP port and address are no longer required, but the phone number must still be set. 
-            // Parse SIP message inline
-
-            // The location_entries should be filled with each softphone/UE's phone number
-            // so that they can be correctly reached by the SIP server. 
-            // The SIP address and port are no longer required due to the simplified registration and location server functionality. 
-            // However, the phone number must still be set to identify the user.
-            // **Note:** This needs to be done before compiling!
-            
-            ptr = message->buffer;
-            response_code = 0;
-            memset(cseq_header, 0, sizeof(cseq_header));    
-            has_sdp = false;
-
-            // 0. REGISTER
-            if (strncmp(first_line, "REGISTER ", strlen("REGISTER ")) == 0) {
-
-                // It's a REGISTER request, call handle_register
-                printf("Handling REGISTER request.\n");
-                int ret = handle_register(message);
-                if (ret == -1) {
-                    printf("Handling REGISTER request failure.\n");
-                }
-                free(message);
-                continue; // Continue to next message
+        }
+    }
+
+    // 3. Parse Request Method (INVITE, ACK, BYE, etc.) or Status Code
+    // Find the first space
+    ptr = message->buffer; // reset ptr to the beginning of buffer
+    while (*ptr != ' ' && *ptr != '\0' && *ptr != '\r' && *ptr != '\n') {
+        ptr++;
+    }
+
+    if (*ptr == ' ') {
+        // Check if it is a response line (starts with "SIP/2.0")
+        if (strncmp(message->buffer, "SIP/2.0", 7) == 0) {
+            // If it is a response line, parse the status code
+            while (*ptr == ' ') {
+                ptr++; // Skip any leading spaces
             }
 
-            // 1. Parse Call-ID
-            // Locate "Call-ID:"
-            char *call_id_start = strstr(message->buffer, "Call-ID:");
-            if (call_id_start != NULL) {
-                // Skip "Call-ID:" and spaces
-                call_id_start += strlen("Call-ID:");
-                while (*call_id_start == ' ') {
-                    call_id_start++;
-                }
-                ptr = call_id_start;
+            const char *code_start = ptr;
+            while (isdigit(*ptr)) {
+                ptr++;  // Move ptr to the first non-digit character
+            }
 
-                // Find the newline character, get the Call-ID
-                while (*ptr != '\r' && *ptr != '\n' && *ptr != '\0') {
-                    ptr++;
-                }
+            // Check if we correctly found a number
+            if (ptr > code_start) {
+                // Copy the response code string and convert it to an integer
+                strncpy(method, code_start, ptr - code_start);
+                method[ptr - code_start] = '\0'; // Null-terminate the string
+                response_code = atoi(method); // Convert to integer
 
-                if (ptr - call_id_start > 0) {
-                    strncpy(call_id, call_id_start, ptr - call_id_start);
-                    call_id[ptr - call_id_start] = '\0'; 
-                    printf("  Call-ID:       [%s]\r\n", call_id);
-                } else {
-                    printf("  Failed to parse Call-ID\r\n");
-                }
+                // Print the parsed response code
+                SIP_TRACE("  Response Code: [%d] (parsed)\r\n", response_code);
             } else {
-                //printf("  Call-ID not found\r\n");
+                // Print the position of code_start and ptr to help debug why parsing failed
+                SIP_TRACE("  Failed to parse response code, ptr: [%p], code_start: [%p]\r\n", (void*)ptr, (void*)code_start);
+                return; // Skip processing if no response code
             }
 
-            // 2. Parse Content-Type, only check for application/sdp
-            content_type_start = strstr(message->buffer, "Content-Type: ");
-            if (content_type_start != NULL) {
-                content_type_start += strlen("Content-Type: ");
-                ptr = content_type_start;
+            // Check if the response is for an INVITE
+            const char *cseq_start = strstr(message->buffer, "CSeq:");
+            if (cseq_start != NULL) {
+                ptr = cseq_start;
                 while (*ptr != '\r' && *ptr != '\n' && *ptr != '\0') {
                     ptr++;
                 }
-                if (ptr - content_type_start > 0) {
-                    strncpy(content_type, content_type_start, ptr - content_type_start);
-                    content_type[ptr - content_type_start] = '\0';
-                    if (strstr(content_type, "application/sdp")) {
-                        printf("  Content-Type:  [%s]\r\n", content_type);
-                        has_sdp = true;
+                if (ptr - cseq_start > 0) {
+                    strncpy(cseq_header, cseq_start, ptr - cseq_start);
+                    cseq_header[ptr - cseq_start] = '\0';
+                    if (strstr(cseq_header, "INVITE") || strstr(cseq_header, "CANCEL") || strstr(cseq_header, "BYE") ||
+                        strstr(cseq_header, "UPDATE") || strstr(cseq_header, "INFO")) {
+                        // Only INVITE / CANCEL / BYE responses, and those of the relayed in-dialog requests, are handled by the state machine
+                        SIP_TRACE("  Response Code: [%d] (for %s).\r\n", response_code, cseq_header);
+                        call = find_call_by_hash(&server->store->call_map, call_id, message_call_hash(message), &leg_type);
+                        dispatch_to_call(server, call, STATUS_CODE, method, has_sdp, message, leg_type);
+                    } else if (strstr(cseq_header, "NOTIFY") && (response_code == 481 || response_code == 408)) {
+                        // The watcher no longer knows the subscription
+                        sip_subscription_notify_failed(server, call_id);
+                    } else if (strstr(cseq_header, "MESSAGE")) {
+                        if (handle_message_response(server, message) == -1) {
+                            SIP_TRACE("  Response Code: [%d] (for %s), not for a relayed MESSAGE, discarded.\r\n", response_code, cseq_header);
+                        }
+                    } else {
+                        SIP_TRACE("  Response Code: [%d] (for %s), discarded.\r\n", response_code, cseq_header);
+                        return;
                     }
+                } else {
+                    SIP_TRACE("  empty CSeq:, discard response\r\n");
+                    return;
                 }
+            } else {
+                SIP_TRACE("  No CSeq:, discard response\r\n");
+                return;
             }
 
-            // 3. Parse Request Method (INVITE, ACK, BYE, etc.) or Status Code
-            // Find the first space
-            ptr = message->buffer; // reset ptr to the beginning of buffer
-            while (*ptr != ' ' && *ptr != '\0' && *ptr != '\r' && *ptr != '\n') {
-                ptr++;
-            }
-
-            if (*ptr == ' ') {
-                // Check if it is a response line (starts with "SIP/2.0")
-                if (strncmp(message->buffer, "SIP/2.0", 7) == 0) {
-                    // If it is a response line, parse the status code
-                    while (*ptr == ' ') {
-                        ptr++; // Skip any leading spaces
-                    }
-
-                    const char *code_start = ptr;
-                    while (isdigit(*ptr)) {
-                        ptr++;  // Move ptr to the first non-digit character
-                    }
 
-                    // Check if we correctly found a number
-                    if (ptr > code_start) {
-                        // Copy the response code string and convert it to an integer
-                        strncpy(method, code_start, ptr - code_start);
-                        method[ptr - code_start] = '\0'; // Null-terminate the string
-                        response_code = atoi(method); // Convert to integer
+        } else {
+            strncpy(method, message->buffer, ptr - message->buffer);
+            method[ptr - message->buffer] = '\0'; 
+            SIP_TRACE("  Method:        [%s]\r\n", method);
+            call = find_call_by_hash(&server->store->call_map, call_id, message_call_hash(message), &leg_type);
+            dispatch_to_call(server, call, REQUEST_METHOD, method, has_sdp, message, leg_type);
+        }
+    } else {
+        SIP_TRACE("  Failed to parse Method or Response Code\r\n");
+    }
+}
 
-                        // Print the parsed response code
-                        printf("  Response Code: [%d] (parsed)\r\n", response_code);
-                    } else {
-                        // Print the position of code_start and ptr to help debug why parsing failed
-                        printf("  Failed to parse response code, ptr: [%p], code_start: [%p]\r\n", (void*)ptr, (void*)code_start);
-                        free(message); //Free the message before continue
-                        continue; // Skip processing if no response code
-                    }
+/**
+ * @brief Gives up on a call whose timer expired.
+ *
+ * A call still waiting for the B leg's final response is answered with 408 Request Timeout
+ * towards the A leg and cancelled towards the B leg. A connected call whose session timer
+ * expired without a refresh (RFC 4028) is hung up with a BYE to each leg. A call that never
+ * got its ACK, or the 200 OK of its BYE/CANCEL, is released.
+ * @param server The server handling the call.
+ * @param call The call, its lock must be held.
+ */
+static void handle_call_timeout(sip_server_t *server, call_t *call) {
+    if (!call->is_active) {
+        return;
+    }
+    switch (call->call_state) {
+        case CALL_STATE_ROUTING:
+        case CALL_STATE_RINGING: {
+            SIP_TRACE("  Call %d: no final response from B leg, sending 408 to A leg and CANCEL to B leg\r\n", call->index);
+
+            send_a_leg_response(server, call, "408 Request Timeout", "", NO_BODY, "408 Request Timeout to A-leg");
+
+            char cancel_head[BUFFER_SIZE] = {0};
+            char cancel_rest[HEADER_SIZE] = {0};
+            snprintf(cancel_head, BUFFER_SIZE, "CANCEL sip:%s@%s:%d SIP/2.0\r\n%s",
+                     call->callee, call->b_leg_ip_str, call->b_leg_port, call->b_leg_header.via);
+            snprintf(cancel_rest, HEADER_SIZE,
+                "User-Agent: TinySIP\r\n"
+                "CSeq: %d CANCEL\r\n"
+                "Max-Forwards: 70\r\n"
+                "Content-Length: 0\r\n\r\n",
+                extract_cseq_number(call->b_leg_header.cseq)
+            );
+            send_b_leg_request(server, call, cancel_head, cancel_rest, "CANCEL to B-leg");
+            break;
+        }
+        case CALL_STATE_ANSWERED:
+            SIP_TRACE("  !!! WARNING !!! Call %d: no ACK from A leg, releasing the call\r\n", call->index);
+            break;
+        case CALL_STATE_CONNECTED:
+            SIP_TRACE("  Call %d: session not refreshed within %d s, sending BYE to both legs\r\n", call->index, call->session_expires);
+            send_bye_to_a_leg(server, call);
+            send_bye_to_b_leg(server, call);
+            set_call_state(server, call, CALL_DISCONNECTING);
+            arm_call_timer(server, call, CALL_TRANSACTION_TIMEOUT_MS);
+            SIP_TRACE("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
+            return;
+        case CALL_DISCONNECTING:
+            SIP_TRACE("  !!! WARNING !!! Call %d: no 200 OK for BYE/CANCEL, releasing the call\r\n", call->index);
+            break;
+        default:
+            // The call moved on without cancelling its timer, nothing to give up on
+            return;
+    }
+    SIP_TRACE("  Call %d state transitioned to CALL_STATE_IDLE.\r\n", call->index);
+    end_call(server, call);
+}
 
-                    // Check if the response is for an INVITE
-                    const char *cseq_start = strstr(message->buffer, "CSeq:");
-                    if (cseq_start != NULL) {
-                        ptr = cseq_start;
-                        while (*ptr != '\r' && *ptr != '\n' && *ptr != '\0') {
-                            ptr++;
-                        }
-                        if (ptr - cseq_start > 0) {
-                            strncpy(cseq_header, cseq_start, ptr - cseq_start);
-                            cseq_header[ptr - cseq_start] = '\0';
-                            if (strstr(cseq_header, "INVITE") || strstr(cseq_header, "CANCEL") || strstr(cseq_header, "BYE")) { 
-                                // Only INVITE / CANCEL /BYE responses be handled by state machine for the minimal sip server
-                                printf("  Response Code: [%d] (for %s).\r\n", response_code, cseq_header);
-                                call = find_call_by_callid(&call_map, call_id, &leg_type);
-                                handle_state_machine(call, STATUS_CODE, method, has_sdp, message, message->buffer, leg_type);
-                            } else {
-                                printf("  Response Code: [%d] (for %s), discarded.\r\n", response_code, cseq_header);
-                                free(message); //Free the message before continue
-                                continue;  
-                            }
-                        } else {
-                            printf("  empty CSeq:, discard response\r\n");
-                            free(message); //Free the message before continue
-                            continue; 
-                        }
-                    } else {
-                        printf("  No CSeq:, discard response\r\n");
-                        free(message); //Free the message before continue
-                        continue; 
-                    }
+/**
+ * @brief Sends the CRLF keep-alives of one batch of NATed bindings.
+ *
+ * The bindings are spread over KEEPALIVE_SLOTS batches by their location index. The timer
+ * fires KEEPALIVE_SLOTS times per KEEPALIVE_INTERVAL_MS, each time sending one batch, so every
+ * NATed binding is refreshed once per interval without a burst of keep-alives at once. The
+ * timer stops when no NATed binding is left.
+ * @param server The server.
+ * @param now_ms The current time.
+ */
+static void handle_keepalive_timer(sip_server_t *server, uint64_t now_ms) {
+    static const sip_message_t keepalive = { .buffer = "\r\n\r\n" };
+    sip_store_t *store = server->store;
+    char destinations[MAX_LOCATIONS][INET_ADDRSTRLEN];
+    sip_outgoing_t batch[MAX_LOCATIONS];
+    size_t count = 0;
+    bool nated = false;
+
+    shm_mutex_lock(&store->location_mutex);
+    if (!sip_timer_claim(&store->timers, KEEPALIVE_TIMER_ID, now_ms)) {
+        pthread_mutex_unlock(&store->location_mutex);
+        return;
+    }
+    store->keepalive_pending = false;
+    for (int i = 0; i < store->location_size; i++) {
+        location_entry_t *user = &store->location_entries[i];
+        if (!user->registered || !user->nated) {
+            continue;
+        }
+        nated = true;
+        if (i % KEEPALIVE_SLOTS == store->keepalive_slot) {
+            memcpy(destinations[count], user->ip_str, INET_ADDRSTRLEN);
+            batch[count].message = &keepalive;
+            batch[count].destination = destinations[count];
+            batch[count].port = user->port;
+            count++;
+        }
+    }
+    store->keepalive_slot = (store->keepalive_slot + 1) % KEEPALIVE_SLOTS;
+    if (nated) {
+        arm_keepalive_timer(server);
+    }
+    pthread_mutex_unlock(&store->location_mutex);
 
+    if (count > 0) {
+        sip_server_send_batch(server, batch, count);
+        atomic_fetch_add(&store->keepalives, count);
+    }
+}
 
-                } else {
-                    strncpy(method, message->buffer, ptr - message->buffer);
-                    method[ptr - message->buffer] = '\0'; 
-                    printf("  Method:        [%s]\r\n", method);
-                    call = find_call_by_callid(&call_map, call_id, &leg_type);
-                    handle_state_machine(call, REQUEST_METHOD, method, has_sdp, message, message->buffer, leg_type);
-                }
-            } else {
-                printf("  Failed to parse Method or Response Code\r\n");
-            }
+/**
+ * @brief Handles one expired timer, under the lock of the call, location entry, subscription or mailboxes it belongs to.
+ */
+static void handle_timer(sip_server_t *server, int id, uint64_t now_ms) {
+    sip_store_t *store = server->store;
+
+    // Timers of a traced call are traced, other timers only when everything is
+    sip_trace_filter_t filter;
+    sip_server_get_trace(server, &filter);
+    sip_trace_on = filter.all;
+
+    if (id >= CALL_TIMER_ID(0) && id < CALL_TIMER_ID(MAX_CALLS)) {
+        call_t *call = &store->call_map.calls[id - CALL_TIMER_ID(0)];
+        shm_mutex_lock(&call->mutex);
+        sip_trace_on = sip_trace_on || call->traced;
+        if (sip_timer_claim(&store->timers, id, now_ms)) {
+            handle_call_timeout(server, call);
+        }
+        pthread_mutex_unlock(&call->mutex);
+    } else if (id >= LOCATION_TIMER_ID(0) && id < LOCATION_TIMER_ID(MAX_LOCATIONS)) {
+        location_entry_t *user = &store->location_entries[id - LOCATION_TIMER_ID(0)];
+        bool expired = false;
+        shm_mutex_lock(&store->location_mutex);
+        if (sip_timer_claim(&store->timers, id, now_ms) && user->registered) {
+            user->registered = false;
+            store->registration_cache[id - LOCATION_TIMER_ID(0)].valid = false;
+            sip_memory_credit(&store->memory, SIP_MEMORY_REGISTRAR, sizeof(location_entry_t));
+            expired = true;
+        }
+        pthread_mutex_unlock(&store->location_mutex);
+        if (expired) {
+            SIP_TRACE("Registration of user %s expired\r\n", user->username);
+            sip_subscriptions_changed(server, id - LOCATION_TIMER_ID(0));
+        }
+    } else if (id >= SUBSCRIPTION_TIMER_ID(0) && id <= NOTIFY_BATCH_TIMER_ID) {
+        sip_subscriptions_handle_timer(server, id, now_ms);
+    } else if (id == KEEPALIVE_TIMER_ID) {
+        handle_keepalive_timer(server, now_ms);
+    } else if (id == IM_DELIVERY_TIMER_ID) {
+        sip_im_handle_timer(server, id, now_ms);
+    }
+}
 
-            free(message);
+/**
+ * @brief Tears down a call on an operator's request, e.g. one stuck waiting for a lost response.
+ *
+ * A call still being set up is given up on like on a timeout: 408 to A and CANCEL to B. An
+ * answered or connected call is hung up with a BYE to both legs, and released once they answer
+ * or the transaction times out. Only a call already being hung up is released at once.
+ * @param index The call's index in the call table.
+ * @param call_id The A-leg Call-ID the operator picked the call by. The slot may have been
+ *        released and taken by another call since, which is then left alone.
+ * @return true if a call was dropped.
+ */
+bool sip_server_drop_call(sip_server_t *server, int index, const char *call_id) {
+    if (index < 0 || index >= MAX_CALLS) {
+        return false;
+    }
+    call_t *call = &server->store->call_map.calls[index];
+    sip_trace_filter_t filter;
+    sip_server_get_trace(server, &filter);
+
+    shm_mutex_lock(&call->mutex);
+    bool dropped = call->is_active && strcmp(call->a_leg_uuid, call_id) == 0;
+    if (dropped) {
+        sip_trace_on = filter.all || call->traced;
+        SIP_TRACE("  Call %d dropped by the operator in state %d\r\n", call->index, (int)call->call_state);
+        switch (call->call_state) {
+            case CALL_STATE_ROUTING:
+            case CALL_STATE_RINGING:
+                handle_call_timeout(server, call);
+                break;
+            case CALL_STATE_ANSWERED:
+            case CALL_STATE_CONNECTED:
+                send_bye_to_a_leg(server, call);
+                send_bye_to_b_leg(server, call);
+                set_call_state(server, call, CALL_DISCONNECTING);
+                arm_call_timer(server, call, CALL_TRANSACTION_TIMEOUT_MS);
+                SIP_TRACE("  Call %d state transitioned to CALL_DISCONNECTING.\r\n", call->index);
+                break;
+            default:
+                end_call(server, call);
+                break;
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&call->mutex);
+    return dropped;
+}
+
+/**
+ * @brief Handles the call and registration timers that expired by the server clock's current time.
+ *
+ * Called periodically by the receive loop (or by a simulation after advancing its virtual clock).
+ * Takes the same call and location locks as the workers, so it can run concurrently with them.
+ * @param server The server.
+ */
+void sip_server_run_timers(sip_server_t *server) {
+    int expired[32];
+    size_t count;
+    uint64_t now_ms = sip_server_now_ms(server);
+
+    do {
+        count = sip_timer_expire(&server->store->timers, now_ms, expired, sizeof(expired) / sizeof(expired[0]));
+        for (size_t i = 0; i < count; i++) {
+            handle_timer(server, expired[i], now_ms);
+        }
+    } while (count == sizeof(expired) / sizeof(expired[0]));
 }
 
 /**
  * @brief Destroys a call map
+ * @param call_map A pointer to the call map.
  */
-void destroy_call_map() {
-    pthread_mutex_destroy(&call_map.mutex);
+void destroy_call_map(call_map_t *call_map) {
+    for (int i = 0; i < MAX_CALLS; i++) {
+        pthread_mutex_destroy(&call_map->calls[i].mutex);
+    }
+    pthread_mutex_destroy(&call_map->mutex);
 }
 
 /**
@@ -1692,7 +3394,6 @@ void destroy_call_map() {
  * @param index The index of the call struct in the call map array.
  */
 void init_call(call_t *call, int index) {
-    pthread_mutex_init(&call->mutex, NULL);
     memset(call->a_leg_uuid, 0, sizeof(call->a_leg_uuid));
     memset(call->b_leg_uuid, 0, sizeof(call->b_leg_uuid));
     call->call_state = CALL_STATE_IDLE;
@@ -1709,17 +3410,32 @@ void init_call(call_t *call, int index) {
     memset(&call->b_leg_header, 0, sizeof(call->b_leg_header));
     memset(call->caller, 0, sizeof(call->caller));   // Initialize caller
     memset(call->callee, 0, sizeof(call->callee));   // Initialize callee
+    call->busy_aors[0] = -1;
+    call->busy_aors[1] = -1;
+    call_limit_ticket_clear(&call->limits);
+    call->session_expires = 0;
+    call->a_leg_refreshes = false;
+    call->b_leg_refreshes = false;
+    memset(call->in_dialog, 0, sizeof(call->in_dialog));
     call->is_active = false;
+    call->call_hash = 0;
+    call->traced = false;
+    const call_summary_t ended = { .active = false };
+    shm_seqlock_write(&call->summary_lock, &call->summary, &ended, sizeof(ended));
 }
 /**
  * @brief Initialize a call map.
+ * @param call_map A pointer to the call map.
+ * @param process_shared true if the call map is shared by several worker processes.
  */
-void init_call_map() {
-    call_map.size = 0;
-    pthread_mutex_init(&call_map.mutex, NULL);
+void init_call_map(call_map_t *call_map, bool process_shared) {
+    call_map->size = 0;
+    shm_mutex_init(&call_map->mutex, process_shared);
     
     for (int i = 0; i < MAX_CALLS; i++) {
-        init_call(&call_map.calls[i], i);
+        shm_mutex_init(&call_map->calls[i].mutex, process_shared);
+        shm_seqlock_init(&call_map->calls[i].summary_lock);
+        init_call(&call_map->calls[i], i);
     }
 }
 
@@ -1734,13 +3450,30 @@ void init_call_map() {
  * @However, in a commercial system, the switch and the SIP protocol stack are usually two modules, and these values are usually different with a mapping and exchange process.
  */
 call_t* find_call_by_callid(call_map_t *call_map, const char *call_id, int *leg_type) {
+    if (call_id == NULL) {
+        return NULL;
+    }
+    return find_call_by_hash(call_map, call_id, sip_hash_call_id(call_id, strlen(call_id)), leg_type);
+}
+
+/**
+ * @brief Finds a call by its A-leg or B-leg uuid, given the uuid's hash.
+ *
+ * Only the calls with that hash have their uuids compared.
+ * @param call_map A pointer to the call map.
+ * @param call_id The call_id to search for.
+ * @param call_hash sip_hash_call_id() of call_id, e.g. carried by the message with message_call_hash().
+ * @param leg_type A pointer to store the leg type where the call_id was found.
+ * @return A pointer to the call struct if found, otherwise NULL.
+ */
+call_t* find_call_by_hash(call_map_t *call_map, const char *call_id, uint64_t call_hash, int *leg_type) {
     if (call_map == NULL || call_id == NULL) {
         return NULL;
     }
 
-    pthread_mutex_lock(&call_map->mutex);
+    shm_mutex_lock(&call_map->mutex);
     for (int i = 0; i < MAX_CALLS; i++) {
-        if (call_map->calls[i].is_active) {
+        if (call_map->calls[i].is_active && call_map->calls[i].call_hash == call_hash) {
             if (strcmp(call_map->calls[i].a_leg_uuid, call_id) == 0) {
                 *leg_type = A_LEG;
                 pthread_mutex_unlock(&call_map->mutex);
@@ -1759,45 +3492,73 @@ call_t* find_call_by_callid(call_map_t *call_map, const char *call_id, int *leg_
 
 /**
  * @brief Allocates a new call from the call map.
+ * The leg uuids are set under the call map lock, so the call is never visible to
+ * find_call_by_callid() half-initialized.
  * @param call_map A pointer to the call map.
+ * @param call_id The Call-ID of the A-leg INVITE, the B-leg uuid is derived from it.
+ * @param emergency true for an emergency call, which may take the last EMERGENCY_RESERVED_CALLS entries.
  * @return A pointer to a newly allocated call struct, or NULL if the call map is full.
  */
-call_t* allocate_new_call(call_map_t *call_map) {
+call_t* allocate_new_call(call_map_t *call_map, const char *call_id, bool emergency) {
 
-    if (call_map == NULL) {
+    if (call_map == NULL || call_id == NULL) {
         return NULL;
     }
-    pthread_mutex_lock(&call_map->mutex);
-    if(call_map->size >= MAX_CALLS){
+    shm_mutex_lock(&call_map->mutex);
+    if(call_map->size >= (emergency ? MAX_CALLS : MAX_CALLS - EMERGENCY_RESERVED_CALLS)){
         pthread_mutex_unlock(&call_map->mutex);
         return NULL;
     }
     for (int i = 0; i < MAX_CALLS; i++) {
-        if (!call_map->calls[i].is_active) {
-            call_map->calls[i].is_active = true;
+        call_t *call = &call_map->calls[i];
+        if (!call->is_active) {
+            call->is_active = true;
+            strncpy(call->a_leg_uuid, call_id, MAX_UUID_LENGTH - 1);
+            strncpy(call->b_leg_uuid, call_id, MAX_UUID_LENGTH - 1);
+            if (strlen(call->b_leg_uuid) >= 5) {
+                memcpy(call->b_leg_uuid, "b-leg", 5);
+            }
+            call->call_hash = sip_hash_call_id(call->a_leg_uuid, strlen(call->a_leg_uuid));
             call_map->size++;
             pthread_mutex_unlock(&call_map->mutex);
-            return &call_map->calls[i];
+            return call;
         }
     }
     pthread_mutex_unlock(&call_map->mutex);
     return NULL;
 }
 
+/**
+ * @brief Returns a call to the call map and reinitializes it.
+ * @param call_map A pointer to the call map.
+ * @param call The call to release, must have been returned by allocate_new_call().
+ */
+void release_call(call_map_t *call_map, call_t *call) {
+    if (call_map == NULL || call == NULL) {
+        return;
+    }
+    shm_mutex_lock(&call_map->mutex);
+    if (call->is_active) {
+        call_map->size--;
+    }
+    init_call(call, call->index);
+    pthread_mutex_unlock(&call_map->mutex);
+}
+
 /**
  * @brief Find a location entry by its uri
- * @param location_map A pointer to the location map
+ * @param server The server whose location store is searched
  * @param uri The uri of the location to search for
  * @return A pointer to the location entry if found, otherwise NULL
  */
-location_entry_t* find_location_entry_by_userid(const char *uri) {
+location_entry_t* find_location_entry_by_userid(sip_server_t *server, const char *uri) {
 
     if (uri == NULL) {
         return NULL;
     }
-    for (int i = 0; i < location_size; i++) {
-        if (strcmp(location_entries[i].username, uri) == 0) {
-           return &location_entries[i];
+    for (int i = 0; i < server->store->location_size; i++) {
+        if (strcmp(server->store->location_entries[i].username, uri) == 0) {
+           return &server->store->location_entries[i];
         }
     }
     return NULL;
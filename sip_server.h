@@ -1,6 +1,10 @@
 /**
  * @file sip_server.h
  * @brief Header for SIP server functionalities, including message processing and queue management.
+ *
+ * This is the public header of libminisip. An embedding application creates a sip_server_t with
+ * sip_server_init(), giving it a transport to send messages with, and feeds received datagrams to
+ * process_sip_message(). Several servers can run in one process, each with its own state.
  */
 
 #ifndef SIP_SERVER_H
@@ -10,6 +14,18 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include <stdatomic.h>
+#include "dedup_filter.h"
+#include "sip_timer.h"
+#include "sip_memory.h"
+#include "subscription.h"
+#include "im_relay.h"
+#include "user_filter.h"
+#include "sip_trace.h"
+#include "call_limits.h"
+#include "shared_mem.h"
+#include "sip_hash.h"
+#include "cost_counters.h"
 
 // The SIP server uses SIP_SERVER_IP_ADDRESS to generate its Via: and Contact: headers.
 // *MUST* be set to your SIP server's interface address before compiling.
@@ -21,6 +37,7 @@
 #define SIP_PORT 5060
 
 #define MAX_CALLS 32                // Define max calls number
+#define MAX_LOCATIONS 64            // Define max number of provisioned users
 #define HEADER_SIZE 256             // Define the max size for header strings
 #define AUTH_HEADER_SIZE 512        // Define the max size for header strings
 #define MAX_UUID_LENGTH 128         // Define max uuid length
@@ -30,6 +47,66 @@
 #define MAX_NONCE_LENGTH 64         // Define nonce length
 #define MAX_RESPONSE_LENGTH 64      // Define nonce length
 
+// Call and registration timers, see sip_server_run_timers()
+#ifndef CALL_SETUP_TIMEOUT_MS
+#define CALL_SETUP_TIMEOUT_MS 32000         // No response from B leg to the INVITE (64*T1)
+#endif
+#ifndef CALL_RINGING_TIMEOUT_MS
+#define CALL_RINGING_TIMEOUT_MS 180000      // Timer C: no final response after a provisional one
+#endif
+#ifndef CALL_TRANSACTION_TIMEOUT_MS
+#define CALL_TRANSACTION_TIMEOUT_MS 32000   // No ACK for the 200 OK, or no 200 OK for the BYE/CANCEL (64*T1)
+#endif
+#ifndef REGISTRATION_EXPIRES
+#define REGISTRATION_EXPIRES 7200           // Expires granted to a REGISTER that asks for none, in seconds
+#endif
+#ifndef REGISTRATION_MIN_EXPIRES
+#define REGISTRATION_MIN_EXPIRES 60         // Shorter requests are answered with 423 Interval Too Brief
+#endif
+#ifndef REGISTRATION_MAX_EXPIRES
+#define REGISTRATION_MAX_EXPIRES 7200       // Longer requests are granted this
+#endif
+#ifndef REGISTRATION_JITTER_PERCENT
+#define REGISTRATION_JITTER_PERCENT 0       // Up to this share is taken off granted expiries, to spread refreshes
+#endif
+
+// Session timers (RFC 4028), see handle_call_timeout()
+#ifndef SESSION_EXPIRES
+#define SESSION_EXPIRES 1800                // Session interval offered, and the longest granted, in seconds
+#endif
+#ifndef SESSION_MIN_SE
+#define SESSION_MIN_SE 90                   // Shorter intervals are answered with 422 Session Interval Too Small
+#endif
+
+// NAT keep-alives, see handle_keepalive_timer()
+#ifndef KEEPALIVE_INTERVAL_MS
+#define KEEPALIVE_INTERVAL_MS 25000         // Each NATed binding gets a CRLF keep-alive this often, 0 for none
+#endif
+#ifndef KEEPALIVE_SLOTS
+#define KEEPALIVE_SLOTS 25                  // Batches the NATed bindings are spread over within the interval
+#endif
+
+// Emergency calls, see sip_server_is_emergency()
+#ifndef EMERGENCY_NUMBERS
+#define EMERGENCY_NUMBERS "112,911"         // Request URI users of emergency INVITEs, overridden with sip_server_set_emergency_numbers()
+#endif
+#ifndef EMERGENCY_RESERVED_CALLS
+#define EMERGENCY_RESERVED_CALLS 2          // Call table entries only emergency calls may take
+#endif
+#ifndef EMERGENCY_QUEUE_CAPACITY
+#define EMERGENCY_QUEUE_CAPACITY 4          // Emergency INVITEs queued per worker ahead of other messages
+#endif
+#define MAX_EMERGENCY_NUMBERS 8
+#define MAX_EMERGENCY_NUMBER_LENGTH 16
+
+// Timer ids in the store's timer wheel
+#define CALL_TIMER_ID(index) (index)
+#define LOCATION_TIMER_ID(index) (MAX_CALLS + (index))
+#define SUBSCRIPTION_TIMER_ID(index) (MAX_CALLS + MAX_LOCATIONS + (index))
+#define NOTIFY_BATCH_TIMER_ID SUBSCRIPTION_TIMER_ID(MAX_SUBSCRIPTIONS)
+#define KEEPALIVE_TIMER_ID (NOTIFY_BATCH_TIMER_ID + 1)
+#define IM_DELIVERY_TIMER_ID (KEEPALIVE_TIMER_ID + 1)
+
 // Define a-leg (also called O-leg) and b-leg (also called T-leg) macros
 #define A_LEG 1
 #define B_LEG 2
@@ -46,8 +123,22 @@ typedef struct {
     char buffer[BUFFER_SIZE + 1];
     struct sockaddr_in client_addr;
     socklen_t client_addr_len;
+    uint64_t dedup_hash;            // Duplicate filter key, 0 if the message is not tracked
+    uint64_t call_hash;             // sip_hash_call_id() of the Call-ID, 0 until message_call_hash() computes it
+    uint32_t pool_bytes;            // Bytes charged to the message pool, 0 if the message is not accounted
+    bool priority;                  // Emergency INVITE, queued ahead of other messages and never shed
 } sip_message_t;
 
+/**
+ * @struct sip_outgoing_t
+ * @brief One message of a batch handed to sip_server_send_batch().
+ */
+typedef struct {
+    const sip_message_t *message;
+    const char *destination;
+    int port;
+} sip_outgoing_t;
+
 /**
  * @struct message_queue_t
  * @brief Structure for a thread-safe message queue used by the SIP server.
@@ -58,10 +149,15 @@ typedef struct {
     int size;
     int front;
     int rear;
+    sip_message_t *urgent[EMERGENCY_QUEUE_CAPACITY];    // Priority messages, dequeued before the others
+    int urgent_size;
+    int urgent_front;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 } message_queue_t;
 
+struct sip_server;
+
 /**
  * @struct worker_thread_t
  * @brief Structure for worker thread and its associated message queue.
@@ -69,6 +165,7 @@ typedef struct {
 typedef struct {
     message_queue_t queue;
     pthread_t thread;
+    struct sip_server *server;      // Server the messages are processed by
 } worker_thread_t;
 
 /**
@@ -82,8 +179,23 @@ typedef struct {
     int port;                              // Port number
     char realm[MAX_REALM_LENGTH];          // realm
     bool registered;                       // Registration status
+    bool nated;                            // Registered from another address than its Contact, kept alive
 } location_entry_t;
 
+/**
+ * @struct registration_cache_t
+ * @brief The last REGISTER accepted for a binding, to answer refreshes that change nothing.
+ */
+typedef struct {
+    bool valid;
+    char source_ip[INET_ADDRSTRLEN];
+    int source_port;
+    int requested_expires;                 // Expiry the REGISTER asked for, -1 if none
+    int granted_expires;                   // Expiry granted to it
+    char dialog[3 * (HEADER_SIZE + 2)];    // Its From, To and Call-ID lines, each followed by CRLF
+    char contact[HEADER_SIZE];             // Its Contact line, without an expires parameter
+} registration_cache_t;
+
 /**
  * @struct media_state_t
  * @brief Structure to hold media status.
@@ -106,17 +218,69 @@ typedef enum {
     CALL_DISCONNECTING
 } call_state_t;
 
+#define LEG_HEADER_BLOCK_SIZE (6 * (HEADER_SIZE + 2))   // Room for the serialised lines of a leg
+
 /**
  * @struct sip_header_info_t
  * @brief Structure to hold SIP header information for each leg.
+ *
+ * block holds the lines every message the server sends on the leg repeats, serialised once
+ * with their CRLFs. On the A leg these are the Via, From, To, Call-ID, CSeq and User-Agent
+ * lines of the responses to the INVITE, built when the INVITE arrives. On the B leg these are
+ * the From, To and Call-ID lines of the ACK, CANCEL and BYE, rebuilt when B's To changes
+ * (its tag is learned). Messages are put together from it with gather_message().
  */
 typedef struct {
     char from[HEADER_SIZE];
     char via[HEADER_SIZE];
     char cseq[HEADER_SIZE];
     char to[HEADER_SIZE];
+    char block[LEG_HEADER_BLOCK_SIZE];  // Serialised lines, see above
+    size_t block_len;                   // 0 until the lines are known
 } sip_header_info_t;
 
+// In-dialog requests of connected calls, see relay_in_dialog()
+#ifndef IN_DIALOG_PENDING
+#define IN_DIALOG_PENDING 4         // Relayed requests awaiting their final response or ACK, per call
+#endif
+#define IN_DIALOG_SEGMENTS 16       // Runs of header lines passed on by a relayed message
+
+/**
+ * @struct in_dialog_request_t
+ * @brief A re-INVITE, UPDATE or INFO relayed to the other leg of a connected call.
+ *
+ * lines holds the Via, From, To, Call-ID and CSeq lines of the request as its sender sent them,
+ * with their CRLFs: the responses of the other leg go back with them in place of their own.
+ * A re-INVITE answered with 2xx stays until its ACK is relayed.
+ */
+typedef struct {
+    int cseq;                           // CSeq number of the relayed request, 0 if the slot is free
+    int origin_cseq;                    // CSeq number of the request on its sender's leg
+    int from_leg;                       // Leg the request came from, where its responses go
+    bool awaiting_ack;                  // 2xx to a re-INVITE relayed, its ACK is to follow
+    char method[8];
+    char lines[LEG_HEADER_BLOCK_SIZE];
+    size_t lines_len;
+} in_dialog_request_t;
+
+/**
+ * @struct call_summary_t
+ * @brief What the admin socket shows of a call, published by the call's worker on each state change.
+ */
+typedef struct {
+    bool active;
+    call_state_t state;
+    char call_id[MAX_UUID_LENGTH];                 // A-leg Call-ID
+    char caller[32];
+    char callee[32];
+    char a_leg_ip_str[INET_ADDRSTRLEN];
+    int a_leg_port;
+    char b_leg_ip_str[INET_ADDRSTRLEN];
+    int b_leg_port;
+    uint64_t started_ms;                           // Server time the call was routed to B
+    uint64_t state_ms;                             // Server time the call entered its state
+} call_summary_t;
+
 /**
  * @struct call_t
  * @brief Structure to hold call specific data.
@@ -124,6 +288,7 @@ typedef struct {
 typedef struct {
     char a_leg_uuid[MAX_UUID_LENGTH];              // A-leg uuid
     char b_leg_uuid[MAX_UUID_LENGTH];              // B-leg uuid
+    uint64_t call_hash;                            // sip_hash_call_id() of either uuid, compared before them
     //channel_state_t a_leg_state;                 // A-leg state, not necessary for this minimal demo 
     //channel_state_t b_leg_state;                 // B-leg state, not necessary for this minimal demo 
     call_state_t call_state;                       // Current call state
@@ -138,9 +303,18 @@ typedef struct {
     sip_header_info_t b_leg_header;                // Store b-leg SIP header
     char caller[32];                               // Caller
     char callee[32];                               // Callee
+    int busy_aors[2];                              // Location indexes of caller and callee counted busy for presence, -1 if none
+    call_limit_ticket_t limits;                    // Slots of the caller's AOR and peer the call is counted in
+    int session_expires;                           // Session interval in seconds (RFC 4028)
+    bool a_leg_refreshes;                          // A agreed to refresh the session
+    bool b_leg_refreshes;                          // B agreed to refresh the session, without either there is no session timer
+    in_dialog_request_t in_dialog[IN_DIALOG_PENDING]; // Requests relayed between the legs, see relay_in_dialog()
     char a_leg_contact[HEADER_SIZE];               // Store A-leg Contact header
     char b_leg_contact[HEADER_SIZE];               // Store B-leg Contact header    
     bool is_active;                                // Flag to mark if the call struct is active
+    bool traced;                                   // Set up by a traced message, all its messages are traced (see sip_trace.h)
+    call_summary_t summary;                        // Read by the admin socket without taking the call's lock
+    shm_seqlock_t summary_lock;
     pthread_mutex_t mutex;                         // Mutex for call, needed for multi-threaded queue processing with high concurrency, not necessary for single queue
 } call_t;
 
@@ -154,20 +328,134 @@ typedef struct {
     pthread_mutex_t mutex;
 } call_map_t;
 
-// Declare the global call map
-extern call_map_t call_map;
+/**
+ * @struct sip_store_t
+ * @brief All state shared by the workers: call table, location store, duplicate filter, CSeq counter,
+ * timers, memory accounts, subscriptions and stored instant messages.
+ *
+ * The struct holds no pointers, so it can be placed in a shared memory segment and used by
+ * several worker processes (see prefork.h). Its mutexes are then process-shared and robust.
+ */
+typedef struct {
+    call_map_t call_map;                                // Call table
+    location_entry_t location_entries[MAX_LOCATIONS];   // Location store
+    int location_size;                                  // Number of used location entries
+    registration_cache_t registration_cache[MAX_LOCATIONS]; // Per location entry, under location_mutex
+    atomic_ulong registration_cache_hits;               // Refreshes answered from registration_cache
+    pthread_mutex_t location_mutex;                     // Protects location entry updates
+    dedup_filter_t dedup_filter;                        // Duplicate datagram filter
+    user_filter_t user_filter;                          // Unknown-user rejection, rebuilt from location_entries
+    int keepalive_slot;                                 // Next batch of NATed bindings to keep alive, under location_mutex
+    bool keepalive_pending;                             // The keep-alive timer is armed, under location_mutex
+    atomic_ulong keepalives;                            // Keep-alives sent
+    atomic_int cseq_number;                             // CSeq counter for requests sent by the server
+    sip_timer_wheel_t timers;                           // Call and registration timers
+    sip_memory_t memory;                                // Memory accounts and ceilings
+    call_limits_t call_limits;                          // Concurrent calls and call rates per AOR and peer
+    cost_counters_t costs;                              // Cycles per transition, counted if built with COST_COUNTERS
+    sip_subscription_store_t subscriptions;             // reg and presence subscriptions
+    sip_im_store_t instant_messages;                    // MESSAGEs stored for offline users
+    sip_trace_filter_t trace;                           // Messages logged, under trace_lock
+    shm_seqlock_t trace_lock;                           // Lets the admin socket change the filter while workers read it
+    bool process_shared;                                // true if the store lives in a shared segment
+} sip_store_t;
+
+/**
+ * @struct sip_transport_t
+ * @brief Transport used by the server to put messages on the wire.
+ */
+typedef struct {
+    // Sends message to destination:port, user_data is passed through unchanged
+    void (*send)(void *user_data, const sip_message_t *message, const char *destination, int port);
+    // Optional, sends count messages at once (e.g. NOTIFY fan-out), NULL to send them one by one
+    void (*send_batch)(void *user_data, const sip_outgoing_t *batch, size_t count);
+    void *user_data;
+} sip_transport_t;
+
+/**
+ * @struct sip_clock_t
+ * @brief Clock the server's timers run on.
+ *
+ * sip_server_init() installs the monotonic clock. A simulation replaces it with a virtual
+ * clock (see simulation.h) and drives sip_server_run_timers() itself.
+ */
+typedef struct {
+    // Returns the current time in milliseconds, user_data is passed through unchanged
+    uint64_t (*now_ms)(void *user_data);
+    void *user_data;
+} sip_clock_t;
+
+/**
+ * @struct sip_server_t
+ * @brief Server context, all state of one server instance.
+ */
+typedef struct sip_server {
+    sip_store_t *store;             // Store in use, local_store or a shared segment (see prefork.h)
+    sip_store_t local_store;        // Process-local store
+    sip_transport_t transport;      // Transport for outgoing messages
+    sip_clock_t clock;              // Clock for timers
+    char emergency_numbers[MAX_EMERGENCY_NUMBERS][MAX_EMERGENCY_NUMBER_LENGTH];  // Set before the workers start
+    int emergency_count;
+} sip_server_t;
+
+void sip_server_init(sip_server_t *server, const sip_transport_t *transport);
+void sip_server_destroy(sip_server_t *server);
+void sip_server_send(sip_server_t *server, const sip_message_t *message, const char *destination, int port);
+void sip_server_send_batch(sip_server_t *server, const sip_outgoing_t *batch, size_t count);
+void sip_store_init(sip_store_t *store, bool process_shared);
+void sip_store_provisioning_changed(sip_store_t *store);
+int next_cseq_number(sip_server_t *server);
+uint64_t sip_server_now_ms(sip_server_t *server);
+void sip_server_run_timers(sip_server_t *server);
 
-void* process_sip_messages(void* arg);
+void* process_sip_messages(void* arg);   // A NULL message in the queue stops the worker
+const char *call_state_name(call_state_t state);
+uint64_t message_call_hash(sip_message_t *message);
+int message_worker_index(sip_message_t *message, int workers);
+void process_sip_message(sip_server_t *server, sip_message_t *message);
+void release_message(sip_server_t *server, sip_message_t *message);
+void complete_message(sip_server_t *server, sip_message_t *message);
+bool sip_server_admit_message(sip_server_t *server, sip_message_t *message);
+void sip_server_set_trace(sip_server_t *server, const sip_trace_filter_t *filter);
+void sip_server_get_trace(sip_server_t *server, sip_trace_filter_t *filter);
+bool sip_server_call_summary(sip_server_t *server, int index, call_summary_t *summary);
+bool sip_server_drop_call(sip_server_t *server, int index, const char *call_id);
+int sip_server_registrations(sip_server_t *server, location_entry_t *entries, int max);
+bool sip_server_is_emergency(const sip_server_t *server, const sip_message_t *message);
+int sip_server_set_emergency_numbers(sip_server_t *server, const char *numbers);
+void sip_server_memory_stats(sip_server_t *server, sip_memory_subsystem_t subsystem, sip_memory_stats_t *stats);
+void sip_server_send_reply(sip_server_t *server, const sip_message_t *message, const char *status,
+                           const char *via, const char *from, const char *to, const char *call_id,
+                           const char *cseq, const char *extra);
+bool sip_header_username(const char *header, char *username, size_t size);
+bool sip_header_value(const char *buffer, const char *name, char *value, size_t size);
 void initialize_message_queue(message_queue_t *queue, int capacity);
 void destroy_message_queue(message_queue_t *queue);
 int enqueue_message(message_queue_t *queue, sip_message_t *message);
 int dequeue_message(message_queue_t *queue, sip_message_t **message);
-void init_call_map(); // Declare the initialization function
-void destroy_call_map();
+void init_call_map(call_map_t *call_map, bool process_shared); // Declare the initialization function
+void destroy_call_map(call_map_t *call_map);
 call_t* find_call_by_callid(call_map_t *call_map, const char *call_id, int *leg_type);
-call_t* allocate_new_call(call_map_t *call_map);
+call_t* find_call_by_hash(call_map_t *call_map, const char *call_id, uint64_t call_hash, int *leg_type);
+call_t* allocate_new_call(call_map_t *call_map, const char *call_id, bool emergency);
+void release_call(call_map_t *call_map, call_t *call);
 void init_call(call_t *call, int index);
-void handle_state_machine(call_t *call, int message_type, const char *method_or_code, bool has_sdp, sip_message_t *message, const char *raw_sip_message, int leg_type);
-location_entry_t* find_location_entry_by_userid(const char *uri);
+int handle_register(sip_server_t *server, sip_message_t *message);
+void handle_state_machine(sip_server_t *server, call_t *call, int message_type, const char *method_or_code, bool has_sdp, sip_message_t *message, const char *raw_sip_message, int leg_type);
+location_entry_t* find_location_entry_by_userid(sip_server_t *server, const char *uri);
+
+// Subscriptions, see subscription.h
+int handle_subscribe(sip_server_t *server, sip_message_t *message);
+void sip_subscriptions_changed(sip_server_t *server, int aor);      // Registration state of a user changed
+void sip_presence_call_started(sip_server_t *server, call_t *call); // Call lock held, caller and callee set
+void sip_presence_call_ended(sip_server_t *server, call_t *call);   // Call lock held
+void sip_subscription_notify_failed(sip_server_t *server, const char *call_id);
+void sip_subscriptions_handle_timer(sip_server_t *server, int id, uint64_t now_ms);
+
+// Instant messages, see im_relay.h
+int handle_message(sip_server_t *server, sip_message_t *message);
+int handle_message_response(sip_server_t *server, sip_message_t *message);
+void sip_im_user_registered(sip_server_t *server, int aor);         // User bound, its stored messages can be delivered
+void sip_im_handle_timer(sip_server_t *server, int id, uint64_t now_ms);
 
 #endif // SIP_SERVER_H
\ No newline at end of file
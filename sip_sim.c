@@ -0,0 +1,124 @@
+/**
+ * @file sip_sim.c
+ * @brief Runs a deterministic simulation of calls and registrations (see simulation.h).
+ *
+ * Everything runs on a virtual clock, so timeouts of minutes cost nothing and a run with
+ * the same options always produces the same outcome and digest. The report goes to stdout,
+ * the server's log output is discarded unless --verbose is given.
+ */
+
+#include "simulation.h"
+#include "sip_server.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *program) {
+    sim_config_t defaults;
+    sim_config_defaults(&defaults);
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --seed N            seed of the run (default %llu)\n"
+            "  --calls N           calls to place (default %lu)\n"
+            "  --registrations N   REGISTER transactions (default %lu)\n"
+            "  --call-interval MS  time between call attempts (default %u)\n"
+            "  --hold MS           talk time of answered calls (default %u)\n"
+            "  --loss P            probability that a datagram is lost (default %.2f)\n"
+            "  --delay MIN:MAX     one-way network delay in ms (default %u:%u)\n"
+            "  --busy P            fraction of calls rejected with 486 (default %.2f)\n"
+            "  --no-answer P       fraction of calls never answered (default %.2f)\n"
+            "  --cancel P          fraction of calls cancelled while ringing (default %.2f)\n"
+            "  --verbose           keep the server's log output\n",
+            program, (unsigned long long)defaults.seed, defaults.calls, defaults.registrations,
+            defaults.call_interval_ms, defaults.hold_ms, defaults.loss, defaults.delay_min_ms, defaults.delay_max_ms,
+            defaults.busy, defaults.no_answer, defaults.cancel);
+}
+
+int main(int argc, char *argv[]) {
+    sim_config_t config;
+    bool verbose = false;
+    sim_config_defaults(&config);
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+            continue;
+        }
+        if (value == NULL) {
+            usage(argv[0]);
+            return 2;
+        }
+        if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = strtoull(value, NULL, 0);
+        } else if (strcmp(argv[i], "--calls") == 0) {
+            config.calls = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--registrations") == 0) {
+            config.registrations = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--call-interval") == 0) {
+            config.call_interval_ms = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--hold") == 0) {
+            config.hold_ms = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--loss") == 0) {
+            config.loss = atof(value);
+        } else if (strcmp(argv[i], "--delay") == 0) {
+            if (sscanf(value, "%u:%u", &config.delay_min_ms, &config.delay_max_ms) != 2) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--busy") == 0) {
+            config.busy = atof(value);
+        } else if (strcmp(argv[i], "--no-answer") == 0) {
+            config.no_answer = atof(value);
+        } else if (strcmp(argv[i], "--cancel") == 0) {
+            config.cancel = atof(value);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+
+    // The server logs every message
+    int saved_stdout = -1;
+    if (!verbose) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    sim_result_t result;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = sim_run(&config, &result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Simulation ran out of memory\n");
+        return 1;
+    }
+
+    printf("Simulated %lu calls and %lu registrations, %.1f s of virtual time in %.3f s (seed %llu)\n",
+           config.calls, config.registrations, (double)result.virtual_ms / 1000.0, elapsed,
+           (unsigned long long)config.seed);
+    printf("Datagrams: %lu sent, %lu lost, %lu retransmitted by the UAs\n",
+           result.datagrams, result.datagrams_lost, result.retransmissions);
+    printf("Calls:     %lu answered, %lu busy, %lu cancelled, %lu timed out, %lu failed, %lu unresolved\n",
+           result.calls_answered, result.calls_busy, result.calls_cancelled, result.calls_timed_out,
+           result.calls_failed, result.calls_unresolved);
+    printf("Registrations: %lu ok, %lu failed\n", result.registrations_ok, result.registrations_failed);
+    printf("Server:    %lu timers fired, %d calls left in the call table\n", result.timers_fired, result.calls_left);
+    printf("Digest:    %016llx\n", (unsigned long long)result.digest);
+    return result.calls_left == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file sip_timer.c
+ * @brief Implementation of the hashed timer wheel.
+ */
+
+#include "sip_timer.h"
+#include "shared_mem.h"
+
+#define SLOT_MASK (SIP_TIMER_WHEEL_SLOTS - 1)
+
+void sip_timer_wheel_init(sip_timer_wheel_t *wheel, bool process_shared) {
+    for (int i = 0; i < SIP_TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i] = -1;
+    }
+    for (int i = 0; i < SIP_TIMER_CAPACITY; i++) {
+        wheel->timers[i] = (sip_timer_t){ .expires_ms = 0, .next = -1, .prev = -1, .slot = 0, .linked = false };
+    }
+    // The first sip_timer_expire() call catches up with whatever clock the owner uses
+    wheel->next_tick = 0;
+    wheel->armed = 0;
+    wheel->fired = 0;
+    wheel->cancelled = 0;
+    shm_mutex_init(&wheel->mutex, process_shared);
+}
+
+void sip_timer_wheel_destroy(sip_timer_wheel_t *wheel) {
+    pthread_mutex_destroy(&wheel->mutex);
+}
+
+static void timer_link(sip_timer_wheel_t *wheel, int id) {
+    sip_timer_t *timer = &wheel->timers[id];
+    uint64_t tick = timer->expires_ms / SIP_TIMER_TICK_MS;
+    if (tick < wheel->next_tick) {
+        // Already due, goes into the first slot that will be expired
+        tick = wheel->next_tick;
+    }
+    timer->slot = (uint32_t)(tick & SLOT_MASK);
+    timer->prev = -1;
+    timer->next = wheel->slots[timer->slot];
+    if (timer->next >= 0) {
+        wheel->timers[timer->next].prev = id;
+    }
+    wheel->slots[timer->slot] = id;
+    timer->linked = true;
+    wheel->armed++;
+}
+
+static void timer_unlink(sip_timer_wheel_t *wheel, int id) {
+    sip_timer_t *timer = &wheel->timers[id];
+    if (timer->prev >= 0) {
+        wheel->timers[timer->prev].next = timer->next;
+    } else {
+        wheel->slots[timer->slot] = timer->next;
+    }
+    if (timer->next >= 0) {
+        wheel->timers[timer->next].prev = timer->prev;
+    }
+    timer->next = -1;
+    timer->prev = -1;
+    timer->linked = false;
+    wheel->armed--;
+}
+
+void sip_timer_arm(sip_timer_wheel_t *wheel, int id, uint64_t expires_ms) {
+    if (id < 0 || id >= SIP_TIMER_CAPACITY) {
+        return;
+    }
+    shm_mutex_lock(&wheel->mutex);
+    if (wheel->timers[id].linked) {
+        timer_unlink(wheel, id);
+    }
+    // 0 means "not scheduled"
+    wheel->timers[id].expires_ms = expires_ms != 0 ? expires_ms : 1;
+    timer_link(wheel, id);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+void sip_timer_cancel(sip_timer_wheel_t *wheel, int id) {
+    if (id < 0 || id >= SIP_TIMER_CAPACITY) {
+        return;
+    }
+    shm_mutex_lock(&wheel->mutex);
+    if (wheel->timers[id].linked) {
+        timer_unlink(wheel, id);
+    }
+    if (wheel->timers[id].expires_ms != 0) {
+        wheel->cancelled++;
+        wheel->timers[id].expires_ms = 0;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * @brief Moves the expired timers of one slot to expired.
+ * @return false if expired filled up before the slot was drained.
+ */
+static bool expire_slot(sip_timer_wheel_t *wheel, uint32_t slot, uint64_t now_ms, int *expired, size_t max, size_t *count) {
+    int id = wheel->slots[slot];
+    while (id >= 0) {
+        int next = wheel->timers[id].next;
+        // Timers of later revolutions share the slot and stay
+        if (wheel->timers[id].expires_ms <= now_ms) {
+            if (*count == max) {
+                return false;
+            }
+            timer_unlink(wheel, id);
+            expired[(*count)++] = id;
+            wheel->fired++;
+        }
+        id = next;
+    }
+    return true;
+}
+
+size_t sip_timer_expire(sip_timer_wheel_t *wheel, uint64_t now_ms, int *expired, size_t max) {
+    size_t count = 0;
+    // Ticks before end have fully elapsed
+    uint64_t end = now_ms / SIP_TIMER_TICK_MS;
+
+    shm_mutex_lock(&wheel->mutex);
+    if (end > wheel->next_tick && end - wheel->next_tick >= SIP_TIMER_WHEEL_SLOTS) {
+        // A full revolution or more has passed (or this is the first call): visit every slot once
+        for (uint32_t slot = 0; slot < SIP_TIMER_WHEEL_SLOTS; slot++) {
+            if (!expire_slot(wheel, slot, now_ms, expired, max, &count)) {
+                pthread_mutex_unlock(&wheel->mutex);
+                return count;
+            }
+        }
+        wheel->next_tick = end;
+    }
+    while (wheel->next_tick < end) {
+        if (!expire_slot(wheel, (uint32_t)(wheel->next_tick & SLOT_MASK), now_ms, expired, max, &count)) {
+            // Resume with this tick on the next call
+            break;
+        }
+        wheel->next_tick++;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    return count;
+}
+
+bool sip_timer_claim(sip_timer_wheel_t *wheel, int id, uint64_t now_ms) {
+    bool claimed = false;
+    if (id < 0 || id >= SIP_TIMER_CAPACITY) {
+        return false;
+    }
+    shm_mutex_lock(&wheel->mutex);
+    sip_timer_t *timer = &wheel->timers[id];
+    if (!timer->linked && timer->expires_ms != 0 && timer->expires_ms <= now_ms) {
+        timer->expires_ms = 0;
+        claimed = true;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    return claimed;
+}
+
+size_t sip_timer_armed(sip_timer_wheel_t *wheel) {
+    shm_mutex_lock(&wheel->mutex);
+    size_t armed = wheel->armed;
+    pthread_mutex_unlock(&wheel->mutex);
+    return armed;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file sip_timer.h
+ * @brief Hashed timer wheel for the server's call and registration timers.
+ *
+ * Timers are identified by a small integer id chosen by the owner (a call index, a location
+ * index, ...). They are linked into one of SIP_TIMER_WHEEL_SLOTS slot lists by their expiry
+ * tick, so arming and cancelling are O(1) and expiring only visits the slots of elapsed ticks.
+ * The wheel holds no pointers and can live in the shared store of the prefork mode.
+ *
+ * Expired timers are handed out as ids and handled outside the wheel lock. Because an owner
+ * may re-arm or cancel a timer in between, the handler confirms with sip_timer_claim()
+ * (under the owner's own lock) that the expiry is still current before acting on it.
+ */
+
+#ifndef SIP_TIMER_H
+#define SIP_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef SIP_TIMER_WHEEL_SLOTS
+#define SIP_TIMER_WHEEL_SLOTS 1024      // Slots of the wheel, must be a power of two
+#endif
+
+#ifndef SIP_TIMER_TICK_MS
+#define SIP_TIMER_TICK_MS 10            // Resolution of the wheel, timers fire up to one tick late
+#endif
+
+#ifndef SIP_TIMER_CAPACITY
+#define SIP_TIMER_CAPACITY 256          // Number of timer ids
+#endif
+
+/**
+ * @struct sip_timer_t
+ * @brief One timer of the wheel.
+ */
+typedef struct {
+    uint64_t expires_ms;    // Expiry time, 0 if the timer is not scheduled
+    int32_t next;           // Next timer in the slot list, -1 at the end
+    int32_t prev;           // Previous timer in the slot list, -1 at the head
+    uint32_t slot;          // Slot the timer is linked into
+    bool linked;            // Linked into a slot list, i.e. armed and not expired yet
+} sip_timer_t;
+
+/**
+ * @struct sip_timer_wheel_t
+ * @brief Timer wheel, one slot list head per tick modulo SIP_TIMER_WHEEL_SLOTS.
+ */
+typedef struct {
+    int32_t slots[SIP_TIMER_WHEEL_SLOTS];
+    sip_timer_t timers[SIP_TIMER_CAPACITY];
+    uint64_t next_tick;         // First tick not expired yet
+    size_t armed;               // Timers currently linked
+    unsigned long fired;        // Timers handed out by sip_timer_expire()
+    unsigned long cancelled;    // Scheduled timers cancelled before they fired
+    pthread_mutex_t mutex;
+} sip_timer_wheel_t;
+
+/**
+ * @brief Initializes an empty wheel.
+ * @param wheel The wheel to initialize.
+ * @param process_shared true if the wheel lives in a shared segment used by several processes.
+ */
+void sip_timer_wheel_init(sip_timer_wheel_t *wheel, bool process_shared);
+void sip_timer_wheel_destroy(sip_timer_wheel_t *wheel);
+
+/**
+ * @brief Schedules a timer, replacing its previous expiry if it was already scheduled.
+ * @param wheel The wheel.
+ * @param id The timer id, 0 <= id < SIP_TIMER_CAPACITY.
+ * @param expires_ms Time at which the timer expires, on the clock passed to sip_timer_expire().
+ */
+void sip_timer_arm(sip_timer_wheel_t *wheel, int id, uint64_t expires_ms);
+
+/**
+ * @brief Unschedules a timer. Cancelling a timer that isn't scheduled does nothing.
+ */
+void sip_timer_cancel(sip_timer_wheel_t *wheel, int id);
+
+/**
+ * @brief Unlinks timers that have expired by now_ms.
+ *
+ * Call repeatedly while it returns max, the remaining expired timers are handed out next time.
+ * @param wheel The wheel.
+ * @param now_ms The current time.
+ * @param expired Receives the ids of the expired timers.
+ * @param max Capacity of expired.
+ * @return The number of ids stored in expired.
+ */
+size_t sip_timer_expire(sip_timer_wheel_t *wheel, uint64_t now_ms, int *expired, size_t max);
+
+/**
+ * @brief Confirms an expiry handed out by sip_timer_expire() and marks the timer unscheduled.
+ * @return true if the timer was neither re-armed nor cancelled since it expired.
+ */
+bool sip_timer_claim(sip_timer_wheel_t *wheel, int id, uint64_t now_ms);
+
+/**
+ * @brief Returns the number of timers currently scheduled and not yet expired.
+ */
+size_t sip_timer_armed(sip_timer_wheel_t *wheel);
+
+#endif // SIP_TIMER_H
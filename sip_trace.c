@@ -0,0 +1,90 @@
+/**
+ * @file sip_trace.c
+ * @brief Implementation of the per-dialog trace filter.
+ */
+
+#define _GNU_SOURCE
+#include "sip_trace.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Thread_local bool sip_trace_on = true;
+
+void sip_trace_filter_init(sip_trace_filter_t *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->all = true;
+}
+
+int sip_trace_configure(sip_trace_filter_t *filter, const char *spec) {
+    sip_trace_filter_t parsed;
+    char copy[256];
+
+    if (spec == NULL || strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    memset(&parsed, 0, sizeof(parsed));
+    if (strcmp(spec, "all") == 0) {
+        parsed.all = true;
+        *filter = parsed;
+        return 0;
+    }
+    if (strcmp(spec, "off") == 0) {
+        *filter = parsed;
+        return 0;
+    }
+    strcpy(copy, spec);
+
+    // Parse everything first, so an invalid specification changes nothing
+    char *save;
+    for (char *setting = strtok_r(copy, ",", &save); setting != NULL; setting = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(setting, '=');
+        if (value == NULL || value[1] == '\0') {
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcmp(setting, "call-id") == 0 && strlen(value) < sizeof(parsed.call_id)) {
+            strcpy(parsed.call_id, value);
+        } else if (strcmp(setting, "user") == 0 && strlen(value) < sizeof(parsed.user)) {
+            strcpy(parsed.user, value);
+        } else if (strcmp(setting, "ip") == 0 && inet_pton(AF_INET, value, &parsed.source) == 1) {
+            parsed.has_source = true;
+        } else if (strcmp(setting, "sample") == 0) {
+            char *end;
+            unsigned long sample = strtoul(value, &end, 10);
+            if (*end != '\0' || value[0] == '-' || sample == 0 || sample > UINT32_MAX) {
+                return -1;
+            }
+            parsed.sample = (unsigned int)sample;
+        } else {
+            return -1;
+        }
+    }
+    *filter = parsed;
+    return 0;
+}
+
+bool sip_trace_match(const sip_trace_filter_t *filter, const char *call_id, size_t call_id_len, uint64_t call_hash,
+                     const char *from_user, const char *to_user, const struct in_addr *source) {
+    if (filter->all) {
+        return true;
+    }
+    if (filter->has_source && source->s_addr == filter->source.s_addr) {
+        return true;
+    }
+    if (call_id != NULL && filter->call_id[0] != '\0' && strlen(filter->call_id) == call_id_len &&
+        memcmp(filter->call_id, call_id, call_id_len) == 0) {
+        return true;
+    }
+    if (filter->sample != 0 && call_hash != 0 && call_hash % filter->sample == 0) {
+        return true;
+    }
+    if (filter->user[0] != '\0') {
+        if ((from_user != NULL && strcmp(from_user, filter->user) == 0) ||
+            (to_user != NULL && strcmp(to_user, filter->user) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file sip_trace.h
+ * @brief Per-dialog debug tracing: which messages are logged.
+ *
+ * By default every message and every step of its processing is logged. With a filter, only the
+ * messages that match it are: a Call-ID, a user (the user part of From or To), a source address,
+ * or a sample of 1 in N dialogs picked by Call-ID hash. A filter is evaluated once per received
+ * message, before the message is logged. A call set up by a traced message stays traced, so the
+ * B leg's messages of that call are logged too.
+ *
+ * Whether the current message is traced is kept in a thread-local flag, so the check made by
+ * every SIP_TRACE() is a single load. The filter itself lives in the store (sip_store_t), where the
+ * admin socket can replace it while the workers run.
+ */
+
+#ifndef SIP_TRACE_H
+#define SIP_TRACE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SIP_TRACE_CALL_ID_SIZE 128      // MAX_UUID_LENGTH
+#define SIP_TRACE_USER_SIZE 32          // MAX_USERNAME_LENGTH
+
+/**
+ * @struct sip_trace_filter_t
+ * @brief Which messages are traced. A message is traced if it matches any criterion set.
+ */
+typedef struct {
+    bool all;                               // Trace everything, the other criteria are not looked at
+    char call_id[SIP_TRACE_CALL_ID_SIZE];   // Call-ID to trace, "" for none
+    char user[SIP_TRACE_USER_SIZE];         // User in From or To to trace, "" for none
+    bool has_source;
+    struct in_addr source;                  // Source address to trace, if has_source
+    unsigned int sample;                    // Trace 1 in sample dialogs, 0 for none
+} sip_trace_filter_t;
+
+// Whether the message being processed by this thread is traced
+extern _Thread_local bool sip_trace_on;
+
+// printf() for the current message, if it is traced
+#define SIP_TRACE(...) do { if (sip_trace_on) { printf(__VA_ARGS__); } } while (0)
+
+/**
+ * @brief Initializes a filter that traces everything.
+ */
+void sip_trace_filter_init(sip_trace_filter_t *filter);
+
+/**
+ * @brief Sets a filter from a specification like "call-id=abc@host,user=1001,ip=10.0.0.1,sample=1000".
+ *
+ * "all" traces everything and "off" nothing. Otherwise the criteria given replace the filter's.
+ * @return 0 on success, -1 if the specification is invalid (the filter is not changed then).
+ */
+int sip_trace_configure(sip_trace_filter_t *filter, const char *spec);
+
+/**
+ * @brief Checks a message against a filter.
+ * @param call_id The Call-ID value, not NUL-terminated.
+ * @param call_id_len Its length.
+ * @param call_hash sip_hash_call_id() of the Call-ID, the same for both legs of a call, looked at by sample only.
+ * @param from_user The user part of From, NULL if unknown.
+ * @param to_user The user part of To, NULL if unknown.
+ * @param source The source address of the message.
+ * @return true if the message is traced.
+ */
+bool sip_trace_match(const sip_trace_filter_t *filter, const char *call_id, size_t call_id_len, uint64_t call_hash,
+                     const char *from_user, const char *to_user, const struct in_addr *source);
+
+#endif // SIP_TRACE_H
@@ -0,0 +1,528 @@
+/**
+ * @file subscription.c
+ * @brief Registration state and presence subscriptions: SUBSCRIBE handling, state change
+ * tracking and batched NOTIFYs.
+ */
+
+#include "subscription.h"
+#include "sip_server.h"
+#include "shared_mem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+_Static_assert(MAX_LOCATIONS <= SUBSCRIPTION_MAX_AORS, "subscription store too small for the location store");
+_Static_assert(SUBSCRIPTION_FIELD_SIZE == HEADER_SIZE, "subscription fields must hold a header");
+_Static_assert(SUBSCRIPTION_CALL_ID_SIZE == MAX_UUID_LENGTH, "subscription Call-ID must hold a Call-ID");
+
+/**
+ * @struct aor_state_t
+ * @brief What the watchers of a user are told, read from the location store and the busy counts.
+ */
+typedef struct {
+    char username[MAX_USERNAME_LENGTH];
+    bool registered;
+    char ip_str[INET_ADDRSTRLEN];
+    int port;
+    int busy;
+} aor_state_t;
+
+void sip_subscription_store_init(sip_subscription_store_t *store, bool process_shared) {
+    memset(store->subscriptions, 0, sizeof(store->subscriptions));
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        store->subscriptions[i].next = -1;
+    }
+    for (int i = 0; i < SUBSCRIPTION_MAX_AORS; i++) {
+        store->by_aor[i] = -1;
+        store->busy[i] = 0;
+        store->dirty[i] = false;
+    }
+    store->batch_pending = false;
+    memset(&store->stats, 0, sizeof(store->stats));
+    shm_mutex_init(&store->mutex, process_shared);
+}
+
+void sip_subscription_store_destroy(sip_subscription_store_t *store) {
+    pthread_mutex_destroy(&store->mutex);
+}
+
+void sip_subscription_stats(sip_subscription_store_t *store, sip_subscription_stats_t *stats) {
+    shm_mutex_lock(&store->mutex);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->mutex);
+}
+
+/**
+ * @brief Reads the state a user's watchers are told about.
+ * The subscription lock must be held, the location lock is taken.
+ */
+static void read_aor_state(sip_server_t *server, int aor, aor_state_t *state) {
+    sip_store_t *store = server->store;
+    location_entry_t *user = &store->location_entries[aor];
+    shm_mutex_lock(&store->location_mutex);
+    memcpy(state->username, user->username, sizeof(state->username));
+    state->registered = user->registered;
+    memcpy(state->ip_str, user->ip_str, sizeof(state->ip_str));
+    state->port = user->port;
+    pthread_mutex_unlock(&store->location_mutex);
+    state->busy = store->subscriptions.busy[aor];
+}
+
+/**
+ * @brief Sums up what a watcher of the given package sees of a state, to tell whether it changed.
+ */
+static int notified_state(sip_event_package_t event, const aor_state_t *state) {
+    if (event == SIP_EVENT_PRESENCE) {
+        return (state->registered ? 1 : 0) | (state->busy > 0 ? 2 : 0);
+    }
+    if (!state->registered) {
+        return 0;
+    }
+    // The registered contact, folded into a positive value
+    uint32_t hash = 2166136261u;
+    for (const char *p = state->ip_str; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)state->port) * 16777619u;
+    return (int)((hash & 0x7ffffffe) | 1);
+}
+
+/**
+ * @brief Renders the NOTIFY carrying a state to a watcher and records it as notified.
+ * The subscription lock must be held.
+ * @param subscription_state The Subscription-State value, NULL for "active" with the remaining time.
+ */
+static void render_notify(sip_server_t *server, sip_subscription_t *subscription, int index, const aor_state_t *state,
+                          const char *subscription_state, uint64_t now_ms, sip_message_t *out) {
+    char body[640];
+    if (subscription->event == SIP_EVENT_REG) {
+        char contact[160] = "";
+        if (state->registered) {
+            snprintf(contact, sizeof(contact),
+                "<contact id=\"c%d\" state=\"active\" event=\"registered\"><uri>sip:%s@%s:%d</uri></contact>\r\n",
+                subscription->aor, state->username, state->ip_str, state->port);
+        }
+        snprintf(body, sizeof(body),
+            "<?xml version=\"1.0\"?>\r\n"
+            "<reginfo xmlns=\"urn:ietf:params:xml:ns:reginfo\" version=\"%u\" state=\"full\">\r\n"
+            "<registration aor=\"sip:%s@%s\" id=\"r%d\" state=\"%s\">\r\n"
+            "%s"
+            "</registration>\r\n"
+            "</reginfo>\r\n",
+            subscription->version, state->username, SIP_SERVER_IP_ADDRESS, subscription->aor,
+            state->registered ? "active" : "init", contact);
+        subscription->version++;
+    } else {
+        snprintf(body, sizeof(body),
+            "<?xml version=\"1.0\"?>\r\n"
+            "<presence xmlns=\"urn:ietf:params:xml:ns:pidf\" entity=\"sip:%s@%s\">\r\n"
+            "<tuple id=\"t%d\"><status><basic>%s</basic></status></tuple>\r\n"
+            "%s"
+            "</presence>\r\n",
+            state->username, SIP_SERVER_IP_ADDRESS, subscription->aor,
+            state->registered ? "open" : "closed",
+            state->busy > 0 ? "<note>On the phone</note>\r\n" : "");
+    }
+
+    char active_state[48];
+    if (subscription_state == NULL) {
+        uint64_t remaining_ms = subscription->expires_ms > now_ms ? subscription->expires_ms - now_ms : 0;
+        snprintf(active_state, sizeof(active_state), "active;expires=%d", (int)(remaining_ms / 1000));
+        subscription_state = active_state;
+    }
+
+    subscription->cseq++;
+    memset(out, 0, sizeof(*out));
+    int len = snprintf(out->buffer, BUFFER_SIZE,
+        "NOTIFY %s SIP/2.0\r\n"
+        "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK-notify-%d-%d\r\n"
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %d NOTIFY\r\n"
+        "Max-Forwards: 70\r\n"
+        "Contact: <sip:%s:%d>\r\n"
+        "User-Agent: TinySIP\r\n"
+        "Event: %s\r\n"
+        "Subscription-State: %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n\r\n"
+        "%s",
+        subscription->target,
+        SIP_SERVER_IP_ADDRESS, SIP_PORT, index, subscription->cseq,
+        subscription->notifier,
+        subscription->watcher,
+        subscription->call_id,
+        subscription->cseq,
+        SIP_SERVER_IP_ADDRESS, SIP_PORT,
+        subscription->event == SIP_EVENT_REG ? "reg" : "presence",
+        subscription_state,
+        subscription->event == SIP_EVENT_REG ? "application/reginfo+xml" : "application/pidf+xml",
+        strlen(body), body);
+    if (len >= BUFFER_SIZE) {
+        SIP_TRACE("NOTIFY of subscription %d truncated to %d bytes\n", index, BUFFER_SIZE - 1);
+    }
+    subscription->notified_state = notified_state(subscription->event, state);
+    server->store->subscriptions.stats.notifies++;
+}
+
+/**
+ * @brief Unlinks a subscription from its user's chain and frees its entry.
+ * The subscription lock must be held.
+ */
+static void remove_subscription(sip_server_t *server, int index) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    sip_subscription_t *subscription = &store->subscriptions[index];
+    int *link = &store->by_aor[subscription->aor];
+    while (*link != -1 && *link != index) {
+        link = &store->subscriptions[*link].next;
+    }
+    if (*link == index) {
+        *link = subscription->next;
+    }
+    sip_timer_cancel(&server->store->timers, SUBSCRIPTION_TIMER_ID(index));
+    memset(subscription, 0, sizeof(*subscription));
+    subscription->next = -1;
+    store->stats.active--;
+}
+
+/**
+ * @brief Finds a subscription by the Call-ID of its dialog.
+ * The subscription lock must be held.
+ * @return Its index, -1 if there is none.
+ */
+static int find_subscription(sip_subscription_store_t *store, const char *call_id) {
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (store->subscriptions[i].active && strcmp(store->subscriptions[i].call_id, call_id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Marks a user's state changed and arms the batch timer if it isn't already.
+ * The subscription lock must be held.
+ */
+static void mark_dirty(sip_server_t *server, int aor) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    if (store->by_aor[aor] == -1) {
+        return;     // Nobody watches, nothing to notify
+    }
+    if (store->dirty[aor]) {
+        store->stats.coalesced++;
+        return;
+    }
+    store->dirty[aor] = true;
+    if (!store->batch_pending) {
+        store->batch_pending = true;
+        sip_timer_arm(&server->store->timers, NOTIFY_BATCH_TIMER_ID, sip_server_now_ms(server) + NOTIFY_BATCH_MS);
+    }
+}
+
+/**
+ * @brief Handles SIP SUBSCRIBE requests for the reg and presence event packages.
+ *
+ * A new subscription is answered with 200 OK and an immediate NOTIFY of the current state,
+ * as is a refresh. Expires: 0 ends the subscription with a final NOTIFY. Unknown users get
+ * 404 Not Found, other event packages 489 Bad Event, and a full table 503 Service Unavailable.
+ * @param server The server handling the message
+ * @param message The SUBSCRIBE
+ * @return 0 for success, -1 if message is invalid
+ */
+int handle_subscribe(sip_server_t *server, sip_message_t *message) {
+    char via[HEADER_SIZE], from[HEADER_SIZE], to[HEADER_SIZE], cseq[HEADER_SIZE];
+    char call_id[MAX_UUID_LENGTH];
+    if (!sip_header_value(message->buffer, "Via", via, sizeof(via)) ||
+        !sip_header_value(message->buffer, "From", from, sizeof(from)) ||
+        !sip_header_value(message->buffer, "To", to, sizeof(to)) ||
+        !sip_header_value(message->buffer, "Call-ID", call_id, sizeof(call_id)) ||
+        !sip_header_value(message->buffer, "CSeq", cseq, sizeof(cseq))) {
+        return -1;
+    }
+
+    char event[64] = "";
+    sip_header_value(message->buffer, "Event", event, sizeof(event));
+    size_t event_len = strcspn(event, "; ");
+    sip_event_package_t package;
+    if (event_len == strlen("reg") && strncmp(event, "reg", event_len) == 0) {
+        package = SIP_EVENT_REG;
+    } else if (event_len == strlen("presence") && strncmp(event, "presence", event_len) == 0) {
+        package = SIP_EVENT_PRESENCE;
+    } else {
+        SIP_TRACE("Unsupported event package '%s'. Sending 489 Bad Event.\n", event);
+        sip_server_send_reply(server, message, "489 Bad Event", via, from, to, call_id, cseq, "Allow-Events: reg, presence\r\n");
+        return 0;
+    }
+
+    int expires = SUBSCRIPTION_DEFAULT_EXPIRES;
+    char expires_value[16];
+    if (sip_header_value(message->buffer, "Expires", expires_value, sizeof(expires_value))) {
+        expires = atoi(expires_value);
+        if (expires < 0) {
+            expires = 0;
+        } else if (expires > SUBSCRIPTION_MAX_EXPIRES) {
+            expires = SUBSCRIPTION_MAX_EXPIRES;
+        }
+    }
+
+    char username[MAX_USERNAME_LENGTH];
+    location_entry_t *user = NULL;
+    if (sip_header_username(to, username, sizeof(username))) {
+        user = find_location_entry_by_userid(server, username);
+    }
+    if (user == NULL) {
+        SIP_TRACE("Watched user of SUBSCRIBE not found. Sending 404 Not Found.\n");
+        sip_server_send_reply(server, message, "404 Not Found", via, from, to, call_id, cseq, "");
+        return 0;
+    }
+    int aor = (int)(user - server->store->location_entries);
+
+    char source_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &message->client_addr.sin_addr, source_ip, sizeof(source_ip));
+    int source_port = ntohs(message->client_addr.sin_port);
+
+    // NOTIFYs go to the watcher's Contact, or back to where the SUBSCRIBE came from
+    char target[HEADER_SIZE];
+    char contact[HEADER_SIZE];
+    const char *uri_start;
+    size_t uri_len;
+    if (sip_header_value(message->buffer, "Contact", contact, sizeof(contact)) &&
+        (uri_start = strchr(contact, '<')) != NULL && (uri_len = strcspn(uri_start + 1, ">")) > 0) {
+        snprintf(target, sizeof(target), "%.*s", (int)uri_len, uri_start + 1);
+    } else {
+        snprintf(target, sizeof(target), "sip:%s:%d", source_ip, source_port);
+    }
+
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    uint64_t now_ms = sip_server_now_ms(server);
+    sip_message_t notify;
+
+    shm_mutex_lock(&store->mutex);
+    int index = find_subscription(store, call_id);
+    if (index == -1) {
+        // A refresh of a subscription we don't know, or an unsubscribe of one that is gone
+        if (strstr(to, "tag=") != NULL || expires == 0) {
+            pthread_mutex_unlock(&store->mutex);
+            sip_server_send_reply(server, message, "481 Subscription Does Not Exist", via, from, to, call_id, cseq, "");
+            return 0;
+        }
+        for (int i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+            if (!store->subscriptions[i].active) {
+                index = i;
+                break;
+            }
+        }
+        if (index == -1) {
+            pthread_mutex_unlock(&store->mutex);
+            SIP_TRACE("Subscription table full. Rejecting SUBSCRIBE.\n");
+            char retry_after[32];
+            snprintf(retry_after, sizeof(retry_after), "Retry-After: %d\r\n", SIP_MEMORY_RETRY_AFTER);
+            sip_server_send_reply(server, message, "503 Service Unavailable", via, from, to, call_id, cseq, retry_after);
+            return 0;
+        }
+        sip_subscription_t *subscription = &store->subscriptions[index];
+        subscription->active = true;
+        subscription->event = package;
+        subscription->aor = aor;
+        snprintf(subscription->call_id, sizeof(subscription->call_id), "%s", call_id);
+        snprintf(subscription->watcher, sizeof(subscription->watcher), "%s", from);
+        snprintf(subscription->notifier, sizeof(subscription->notifier), "%.200s;tag=sub%d-%d", to, index, next_cseq_number(server));
+        subscription->cseq = 0;
+        subscription->version = 0;
+        subscription->notified_state = -1;
+        subscription->next = store->by_aor[aor];
+        store->by_aor[aor] = index;
+        store->stats.active++;
+    }
+
+    sip_subscription_t *subscription = &store->subscriptions[index];
+    snprintf(subscription->target, sizeof(subscription->target), "%s", target);
+    snprintf(subscription->ip_str, sizeof(subscription->ip_str), "%s", source_ip);
+    subscription->port = source_port;
+    subscription->expires_ms = now_ms + (uint64_t)expires * 1000;
+    if (expires > 0) {
+        sip_timer_arm(&server->store->timers, SUBSCRIPTION_TIMER_ID(index), subscription->expires_ms);
+    }
+
+    char extra[HEADER_SIZE + 64];
+    snprintf(extra, sizeof(extra), "Contact: <sip:%s:%d>\r\nExpires: %d\r\n", SIP_SERVER_IP_ADDRESS, SIP_PORT, expires);
+    char notifier[HEADER_SIZE];
+    memcpy(notifier, subscription->notifier, sizeof(notifier));
+
+    aor_state_t state;
+    read_aor_state(server, aor, &state);
+    render_notify(server, subscription, index, &state, expires > 0 ? NULL : "terminated", now_ms, &notify);
+    char destination[INET_ADDRSTRLEN];
+    memcpy(destination, subscription->ip_str, sizeof(destination));
+    int port = subscription->port;
+    if (expires == 0) {
+        remove_subscription(server, index);
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    SIP_TRACE("Subscription %d of %s to %s of user %s, expires %d\n", index, source_ip,
+           package == SIP_EVENT_REG ? "reg" : "presence", username, expires);
+    sip_server_send_reply(server, message, "200 OK", via, from, notifier, call_id, cseq, extra);
+    SIP_TRACE("Tx SIP message NOTIFY:\r\n%s\r\n", notify.buffer);
+    sip_server_send(server, &notify, destination, port);
+    return 0;
+}
+
+void sip_subscriptions_changed(sip_server_t *server, int aor) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    shm_mutex_lock(&store->mutex);
+    mark_dirty(server, aor);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void sip_presence_call_started(sip_server_t *server, call_t *call) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    const char *parties[2] = {call->caller, call->callee};
+    int aors[2];
+    for (int i = 0; i < 2; i++) {
+        location_entry_t *user = find_location_entry_by_userid(server, parties[i]);
+        aors[i] = user != NULL ? (int)(user - server->store->location_entries) : -1;
+    }
+
+    shm_mutex_lock(&store->mutex);
+    for (int i = 0; i < 2; i++) {
+        call->busy_aors[i] = aors[i];
+        if (aors[i] != -1) {
+            store->busy[aors[i]]++;
+            mark_dirty(server, aors[i]);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void sip_presence_call_ended(sip_server_t *server, call_t *call) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    shm_mutex_lock(&store->mutex);
+    for (int i = 0; i < 2; i++) {
+        if (call->busy_aors[i] != -1) {
+            store->busy[call->busy_aors[i]]--;
+            mark_dirty(server, call->busy_aors[i]);
+            call->busy_aors[i] = -1;
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void sip_subscription_notify_failed(sip_server_t *server, const char *call_id) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    shm_mutex_lock(&store->mutex);
+    int index = find_subscription(store, call_id);
+    if (index != -1) {
+        SIP_TRACE("NOTIFY of subscription %d rejected, subscription removed\n", index);
+        remove_subscription(server, index);
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+/**
+ * @struct rendered_notifies_t
+ * @brief NOTIFYs rendered under the subscription lock, to be sent once it is released.
+ */
+typedef struct {
+    sip_message_t messages[MAX_SUBSCRIPTIONS];
+    char destinations[MAX_SUBSCRIPTIONS][INET_ADDRSTRLEN];
+    int ports[MAX_SUBSCRIPTIONS];
+    size_t count;
+} rendered_notifies_t;
+
+/**
+ * @brief Renders a NOTIFY for the watchers of every user whose state changed since the last batch.
+ * The subscription lock must be held.
+ * @return The NOTIFYs to send, to be freed, NULL if there are none.
+ */
+static rendered_notifies_t *render_pending_notifies(sip_server_t *server, uint64_t now_ms) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    rendered_notifies_t *rendered = NULL;
+
+    for (int aor = 0; aor < SUBSCRIPTION_MAX_AORS; aor++) {
+        if (!store->dirty[aor]) {
+            continue;
+        }
+        store->dirty[aor] = false;
+        aor_state_t state;
+        read_aor_state(server, aor, &state);
+        for (int i = store->by_aor[aor]; i != -1; i = store->subscriptions[i].next) {
+            sip_subscription_t *subscription = &store->subscriptions[i];
+            if (subscription->notified_state == notified_state(subscription->event, &state)) {
+                store->stats.suppressed++;
+                continue;
+            }
+            if (rendered == NULL && (rendered = calloc(1, sizeof(rendered_notifies_t))) == NULL) {
+                perror("calloc");
+                return NULL;
+            }
+            // A subscription is in one user's list only, so there is room for every one
+            size_t n = rendered->count++;
+            render_notify(server, subscription, i, &state, NULL, now_ms, &rendered->messages[n]);
+            memcpy(rendered->destinations[n], subscription->ip_str, INET_ADDRSTRLEN);
+            rendered->ports[n] = subscription->port;
+        }
+    }
+    if (rendered != NULL) {
+        store->stats.batches += (rendered->count + NOTIFY_BATCH_SIZE - 1) / NOTIFY_BATCH_SIZE;
+    }
+    return rendered;
+}
+
+/**
+ * @brief Hands rendered NOTIFYs to the transport in batches of NOTIFY_BATCH_SIZE.
+ * Called without the subscription lock.
+ */
+static void send_rendered_notifies(sip_server_t *server, const rendered_notifies_t *rendered) {
+    sip_outgoing_t batch[NOTIFY_BATCH_SIZE];
+    for (size_t sent = 0; sent < rendered->count; ) {
+        size_t count = 0;
+        for (; count < NOTIFY_BATCH_SIZE && sent < rendered->count; count++, sent++) {
+            batch[count].message = &rendered->messages[sent];
+            batch[count].destination = rendered->destinations[sent];
+            batch[count].port = rendered->ports[sent];
+        }
+        sip_server_send_batch(server, batch, count);
+    }
+}
+
+void sip_subscriptions_handle_timer(sip_server_t *server, int id, uint64_t now_ms) {
+    sip_subscription_store_t *store = &server->store->subscriptions;
+    rendered_notifies_t *rendered = NULL;
+    sip_message_t notify;
+    char destination[INET_ADDRSTRLEN];
+    int port = 0;
+
+    shm_mutex_lock(&store->mutex);
+    if (!sip_timer_claim(&server->store->timers, id, now_ms)) {
+        pthread_mutex_unlock(&store->mutex);
+        return;
+    }
+    if (id == NOTIFY_BATCH_TIMER_ID) {
+        store->batch_pending = false;
+        rendered = render_pending_notifies(server, now_ms);
+    } else {
+        int index = id - SUBSCRIPTION_TIMER_ID(0);
+        sip_subscription_t *subscription = &store->subscriptions[index];
+        if (subscription->active) {
+            aor_state_t state;
+            read_aor_state(server, subscription->aor, &state);
+            render_notify(server, subscription, index, &state, "terminated;reason=timeout", now_ms, &notify);
+            memcpy(destination, subscription->ip_str, sizeof(destination));
+            port = subscription->port;
+            SIP_TRACE("Subscription %d expired\r\n", index);
+            remove_subscription(server, index);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    // The transport is only called once the lock is released, as in handle_subscribe()
+    if (rendered != NULL) {
+        send_rendered_notifies(server, rendered);
+        free(rendered);
+    } else if (port != 0) {
+        sip_server_send(server, &notify, destination, port);
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * @file subscription.h
+ * @brief Registration state (RFC 3680) and presence subscriptions, with batched NOTIFYs.
+ *
+ * Watchers (e.g. the BLF keys of desk phones) SUBSCRIBE to the "reg" or "presence" event
+ * package of a provisioned user. Subscriptions are kept in a fixed table and chained per
+ * watched user (AOR), so a state change finds its watchers without scanning the table.
+ *
+ * A state change (a registration, its expiry, a call starting or ending) doesn't notify
+ * anyone at once: it marks the AOR dirty and arms the batch timer. When the timer fires after
+ * NOTIFY_BATCH_MS, every dirty AOR's current state is rendered once per watcher under the table's
+ * lock, and once it is released the NOTIFYs are handed to the transport as batches of
+ * NOTIFY_BATCH_SIZE (one sendmmsg() on UDP). Changes
+ * that follow each other within the window are coalesced into one NOTIFY, and a watcher whose
+ * last notified state is the current one again (a call that ended before the timer fired)
+ * gets none.
+ *
+ * The table holds no pointers, so it lives in the store and is shared by the worker processes
+ * of the prefork mode. The SIP side (handle_subscribe() and the state change hooks) is declared
+ * in sip_server.h.
+ */
+
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MAX_SUBSCRIPTIONS
+#define MAX_SUBSCRIPTIONS 128               // Subscriptions of all watchers
+#endif
+
+#ifndef SUBSCRIPTION_MAX_AORS
+#define SUBSCRIPTION_MAX_AORS 64            // Watchable users, at least MAX_LOCATIONS
+#endif
+
+#ifndef SUBSCRIPTION_DEFAULT_EXPIRES
+#define SUBSCRIPTION_DEFAULT_EXPIRES 3600   // Expires granted to a SUBSCRIBE without one, in seconds
+#endif
+
+#ifndef SUBSCRIPTION_MAX_EXPIRES
+#define SUBSCRIPTION_MAX_EXPIRES 7200       // Longest Expires granted, in seconds
+#endif
+
+#ifndef NOTIFY_BATCH_MS
+#define NOTIFY_BATCH_MS 200                 // How long state changes are collected before they are notified
+#endif
+
+#ifndef NOTIFY_BATCH_SIZE
+#define NOTIFY_BATCH_SIZE 32                // NOTIFYs handed to the transport at once
+#endif
+
+#define SUBSCRIPTION_FIELD_SIZE 256         // Size of the dialog fields, HEADER_SIZE
+#define SUBSCRIPTION_CALL_ID_SIZE 128       // Size of the Call-ID, MAX_UUID_LENGTH
+
+/**
+ * @enum sip_event_package_t
+ * @brief Event packages that can be subscribed to.
+ */
+typedef enum {
+    SIP_EVENT_REG,          // Registration state, application/reginfo+xml (RFC 3680)
+    SIP_EVENT_PRESENCE,     // Presence, application/pidf+xml (RFC 3863)
+} sip_event_package_t;
+
+/**
+ * @struct sip_subscription_t
+ * @brief One watcher's subscription to one user's state, the notifier side of its dialog.
+ */
+typedef struct {
+    bool active;
+    sip_event_package_t event;
+    int aor;                                        // Index of the watched user in the location store
+    int next;                                       // Next subscription to the same user, -1 at the end
+    char call_id[SUBSCRIPTION_CALL_ID_SIZE];
+    char watcher[SUBSCRIPTION_FIELD_SIZE];          // From of the SUBSCRIBE, with the watcher's tag
+    char notifier[SUBSCRIPTION_FIELD_SIZE];         // To of the SUBSCRIBE, with our tag
+    char target[SUBSCRIPTION_FIELD_SIZE];           // Request-URI of the NOTIFYs, the watcher's Contact
+    char ip_str[INET_ADDRSTRLEN];                   // Where the NOTIFYs go
+    int port;
+    int cseq;                                       // CSeq of the last NOTIFY
+    unsigned int version;                           // reginfo version of the last NOTIFY
+    int notified_state;                             // State of the last NOTIFY, -1 before the first
+    uint64_t expires_ms;
+} sip_subscription_t;
+
+/**
+ * @struct sip_subscription_stats_t
+ * @brief Subscription counters.
+ */
+typedef struct {
+    size_t active;
+    unsigned long notifies;         // NOTIFYs sent
+    unsigned long batches;          // Batches the NOTIFYs of state changes were sent in
+    unsigned long coalesced;        // State changes merged into a pending one
+    unsigned long suppressed;       // NOTIFYs not sent because the watcher already had the state
+} sip_subscription_stats_t;
+
+/**
+ * @struct sip_subscription_store_t
+ * @brief Subscription table, per-user watcher chains and pending state changes.
+ */
+typedef struct {
+    sip_subscription_t subscriptions[MAX_SUBSCRIPTIONS];
+    int by_aor[SUBSCRIPTION_MAX_AORS];              // First subscription to each user, -1 if none
+    int busy[SUBSCRIPTION_MAX_AORS];                // Calls each user takes part in
+    bool dirty[SUBSCRIPTION_MAX_AORS];              // State changed since the last batch
+    bool batch_pending;                             // The batch timer is armed
+    sip_subscription_stats_t stats;
+    pthread_mutex_t mutex;
+} sip_subscription_store_t;
+
+/**
+ * @brief Initializes an empty subscription store.
+ * @param process_shared true if the store is shared by several worker processes.
+ */
+void sip_subscription_store_init(sip_subscription_store_t *store, bool process_shared);
+void sip_subscription_store_destroy(sip_subscription_store_t *store);
+
+/**
+ * @brief Copies the subscription counters.
+ */
+void sip_subscription_stats(sip_subscription_store_t *store, sip_subscription_stats_t *stats);
+
+#endif // SUBSCRIPTION_H
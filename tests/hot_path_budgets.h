@@ -0,0 +1,28 @@
+#ifndef TESTS_HOT_PATH_BUDGETS_H
+#define TESTS_HOT_PATH_BUDGETS_H
+
+#include <stddef.h>
+
+/*
+ * Checked-in cost budgets of the canonical flows run by test_hot_path_budget.c,
+ * counted from the first message handed to the worker until the last one is
+ * processed. Allocating the received messages themselves is the receive loop's
+ * cost and is not counted. Lower a budget when an optimization lands, and raise
+ * one only with a reason in the commit message.
+ */
+typedef struct {
+    const char *flow;
+    size_t allocations;         // Heap allocations by the server code
+    size_t allocated_bytes;
+    size_t syscalls;            // Socket calls, see interpose.h
+    size_t bytes_sent;          // Bytes handed to sendto()
+} hot_path_budget_t;
+
+static const hot_path_budget_t hot_path_budgets[] = {
+    // flow              allocs  bytes  syscalls  bytes sent
+    {"REGISTER",         0,      0,     1,        300},
+    {"INVITE-BYE",       0,      0,     7,        2450},
+    {"INVITE-CANCEL",    0,      0,     6,        2000},
+};
+
+#endif /* TESTS_HOT_PATH_BUDGETS_H */
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "interpose.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+
+// Provided by the linker for each --wrap=symbol
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+int __real_socket(int domain, int type, int protocol);
+int __real_close(int fd);
+int __real_getsockname(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+static interpose_counters_t counters;
+
+void interpose_reset(void) {
+    interpose_counters_t zero = {0};
+    counters = zero;
+}
+
+interpose_counters_t interpose_get(void) {
+    return counters;
+}
+
+void *__wrap_malloc(size_t size) {
+    counters.allocations++;
+    counters.allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    counters.allocations++;
+    counters.allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    counters.allocations++;
+    counters.allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL) {
+        counters.frees++;
+    }
+    __real_free(ptr);
+}
+
+int __wrap_socket(int domain, int type, int protocol) {
+    counters.syscalls++;
+    return __real_socket(domain, type, protocol);
+}
+
+int __wrap_close(int fd) {
+    counters.syscalls++;
+    return __real_close(fd);
+}
+
+int __wrap_getsockname(int fd, struct sockaddr *addr, socklen_t *addr_len) {
+    counters.syscalls++;
+    return __real_getsockname(fd, addr, addr_len);
+}
+
+// Outgoing messages are counted, not put on the wire
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *dest_addr, socklen_t addr_len) {
+    (void)fd;
+    (void)buf;
+    (void)flags;
+    (void)dest_addr;
+    (void)addr_len;
+    counters.syscalls++;
+    counters.sends++;
+    counters.bytes_sent += len;
+    return (ssize_t)len;
+}
+
+// A batch is one system call, each message in it a send
+int __wrap_sendmmsg(int fd, struct mmsghdr *messages, unsigned int count, int flags) {
+    (void)fd;
+    (void)flags;
+    counters.syscalls++;
+    for (unsigned int i = 0; i < count; i++) {
+        size_t len = 0;
+        for (size_t j = 0; j < messages[i].msg_hdr.msg_iovlen; j++) {
+            len += messages[i].msg_hdr.msg_iov[j].iov_len;
+        }
+        messages[i].msg_len = (unsigned int)len;
+        counters.sends++;
+        counters.bytes_sent += len;
+    }
+    return (int)count;
+}
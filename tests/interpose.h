@@ -0,0 +1,23 @@
+#ifndef TESTS_INTERPOSE_H
+#define TESTS_INTERPOSE_H
+
+#include <stddef.h>
+
+/*
+ * Counters of heap and socket calls made by the code under test. The calls are
+ * intercepted with the linker's --wrap option (see the Makefile), so only the
+ * calls made from the server objects are counted, not those inside libc.
+ */
+typedef struct {
+    size_t allocations;         // malloc/calloc/realloc calls
+    size_t allocated_bytes;
+    size_t frees;
+    size_t syscalls;            // socket/close/getsockname/sendto/sendmmsg calls
+    size_t sends;               // Messages sent, one per sendto, each of a sendmmsg batch
+    size_t bytes_sent;
+} interpose_counters_t;
+
+void interpose_reset(void);
+interpose_counters_t interpose_get(void);
+
+#endif /* TESTS_INTERPOSE_H */
@@ -10,6 +10,7 @@
 static mock_message_t history[MOCK_HISTORY_SIZE];
 static size_t write_index = 0;
 static size_t stored = 0;
+static uint64_t virtual_now_ms = 1000;
 
 void mocks_reset(void) {
     memset(history, 0, sizeof(history));
@@ -74,3 +75,45 @@ static void record_message(const sip_message_t *message, const char *destination
 void mock_send_sip_message(const sip_message_t *message, const char *destination, int port) {
     record_message(message, destination, port);
 }
+
+void mock_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port) {
+    (void)user_data;
+    record_message(message, destination, port);
+}
+
+void mocks_server_init(sip_server_t *server) {
+    const sip_transport_t transport = { .send = mock_transport_send, .user_data = NULL };
+    sip_server_init(server, &transport);
+}
+
+static uint64_t virtual_now(void *user_data) {
+    (void)user_data;
+    return virtual_now_ms;
+}
+
+void mocks_use_virtual_clock(sip_server_t *server) {
+    server->clock = (sip_clock_t){ .now_ms = virtual_now, .user_data = NULL };
+    virtual_now_ms = 1000;
+}
+
+void mocks_setup(sip_server_t *server) {
+    mocks_reset();
+    mocks_server_init(server);
+    mocks_use_virtual_clock(server);
+}
+
+void mocks_advance(sip_server_t *server, uint64_t ms) {
+    virtual_now_ms += ms;
+    sip_server_run_timers(server);
+}
+
+void mocks_deliver(sip_server_t *server, const char *payload, const char *ip, int port) {
+    sip_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.buffer, payload, BUFFER_SIZE);
+    msg.client_addr.sin_family = AF_INET;
+    msg.client_addr_len = sizeof(msg.client_addr);
+    inet_pton(AF_INET, ip, &msg.client_addr.sin_addr);
+    msg.client_addr.sin_port = htons(port);
+    process_sip_message(server, &msg);
+}
@@ -20,5 +20,16 @@ const mock_message_t *mocks_get(size_t index);
 const mock_message_t *mocks_find_payload_substr(const char *needle);
 
 void mock_send_sip_message(const sip_message_t *message, const char *destination, int port);
+void mock_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port);
+void mocks_server_init(sip_server_t *server);
+
+// Virtual clock, at 1000 ms once installed, moved only by mocks_advance()
+void mocks_use_virtual_clock(sip_server_t *server);
+// mocks_reset(), mocks_server_init() and mocks_use_virtual_clock()
+void mocks_setup(sip_server_t *server);
+// Moves the virtual clock on and runs the timers that fall due
+void mocks_advance(sip_server_t *server, uint64_t ms);
+// Hands the server a datagram as if received from ip:port
+void mocks_deliver(sip_server_t *server, const char *payload, const char *ip, int port);
 
 #endif /* TESTS_MOCKS_H */
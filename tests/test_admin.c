@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "test_common.h"
+#include "mocks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../admin.h"
+
+static sip_server_t server;
+static char reply[4096];
+
+static void send_invite(void) {
+    mocks_deliver(&server, "INVITE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKadm\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: admin-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n0123456789", "10.0.0.1", 5060);
+}
+
+// Executes a command, its reply left in reply
+static int execute(const char *command) {
+    memset(reply, 0, sizeof(reply));
+    FILE *out = fmemopen(reply, sizeof(reply) - 1, "w");
+    int result = admin_execute(&server, command, out);
+    fclose(out);
+    return result;
+}
+
+static int test_calls_are_listed(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+
+    EXPECT_EQ_INT(execute("calls"), 0);
+    EXPECT_STRCONTAINS(reply, "total          0");
+
+    send_invite();
+    EXPECT_EQ_INT(execute("calls"), 0);
+    EXPECT_STRCONTAINS(reply, "routing        1");
+    EXPECT_STRCONTAINS(reply, "total          1");
+
+    EXPECT_EQ_INT(execute("calls list"), 0);
+    EXPECT_STRCONTAINS(reply, "0 routing admin-001@example.com 1001 -> 1002");
+
+    EXPECT_EQ_INT(execute("call admin-001@example.com"), 0);
+    EXPECT_STRCONTAINS(reply, "index:    0");
+    EXPECT_STRCONTAINS(reply, "caller:   1001 at 10.0.0.1:5060");
+    EXPECT_EQ_INT(execute("call 1"), -1);
+    EXPECT_STRCONTAINS(reply, "error: no call 1");
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_drop_ends_the_call(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    send_invite();
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+
+    mocks_reset();
+    EXPECT_EQ_INT(execute("drop 0"), 0);
+    EXPECT_STRCONTAINS(reply, "ok");
+    // A call still ringing is refused to A and cancelled towards B
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 408") != NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("CANCEL sip:") != NULL);
+    EXPECT_EQ_INT(execute("call 0"), -1);
+    EXPECT_EQ_INT(execute("drop admin-001@example.com"), -1);
+
+    // A connected call is hung up on both legs
+    send_invite();
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n9876543210", "10.0.0.2", 5070);
+    mocks_deliver(&server, "ACK sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKadm2\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: admin-001@example.com\r\n"
+                           "CSeq: 1 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    EXPECT_EQ_INT(execute("call 0"), 0);
+    EXPECT_STRCONTAINS(reply, "state:    connected");
+    mocks_reset();
+    EXPECT_EQ_INT(execute("drop 4294967296"), -1);
+    EXPECT_EQ_INT((int)mocks_count(), 0);
+    EXPECT_EQ_INT(execute("drop admin-001@example.com"), 0);
+    EXPECT_EQ_INT((int)mocks_count(), 2);
+    const mock_message_t *bye_to_b = mocks_find_payload_substr("Call-ID: b-leg-001@example.com");
+    const mock_message_t *bye_to_a = mocks_find_payload_substr("Call-ID: admin-001@example.com");
+    EXPECT_TRUE(bye_to_b != NULL && strncmp(bye_to_b->payload, "BYE sip:", 8) == 0);
+    EXPECT_TRUE(bye_to_a != NULL && strncmp(bye_to_a->payload, "BYE sip:", 8) == 0);
+    EXPECT_EQ_INT(execute("call 0"), 0);
+    EXPECT_STRCONTAINS(reply, "state:    disconnecting");
+
+    // Picked by a Call-ID the slot no longer holds, the call is left alone
+    EXPECT_TRUE(!sip_server_drop_call(&server, 0, "other-001@example.com"));
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_registrations_log_and_errors(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+
+    EXPECT_EQ_INT(execute("registrations"), 0);
+    EXPECT_STRCONTAINS(reply, "0 registered");
+    server.store->location_entries[1].registered = true;
+    EXPECT_EQ_INT(execute("registrations"), 0);
+    EXPECT_STRCONTAINS(reply, "1002 192.168.192.1:5070");
+    EXPECT_STRCONTAINS(reply, "1 registered");
+
+    sip_trace_filter_t filter;
+    EXPECT_EQ_INT(execute("log user=1001"), 0);
+    sip_server_get_trace(&server, &filter);
+    EXPECT_TRUE(!filter.all);
+    EXPECT_EQ_INT(strcmp(filter.user, "1001"), 0);
+    EXPECT_EQ_INT(execute("log colour=blue"), -1);
+    sip_server_get_trace(&server, &filter);
+    EXPECT_EQ_INT(strcmp(filter.user, "1001"), 0);
+
+    EXPECT_EQ_INT(execute("reload"), -1);
+    EXPECT_EQ_INT(execute("help"), 0);
+    EXPECT_STRCONTAINS(reply, "registrations");
+    EXPECT_EQ_INT(execute("shutdown"), -1);
+    EXPECT_STRCONTAINS(reply, "error: unknown command");
+    EXPECT_EQ_INT(execute("calls all"), -1);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int connect_client(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A client that never sends its command holds the receive loop for the I/O timeout only
+static int test_silent_client_is_dropped(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_admin_%d.sock", (int)getpid());
+    int fd = admin_socket_open(path);
+    EXPECT_TRUE(fd >= 0);
+
+    int silent = connect_client(path);
+    int client = connect_client(path);
+    EXPECT_TRUE(silent >= 0 && client >= 0);
+    const char command[] = "calls\n";
+    EXPECT_EQ_INT((int)send(client, command, strlen(command), 0), (int)strlen(command));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    admin_socket_serve(&server, fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    // Well under the second a silent client used to hold it, with room for a slow sanitizer build
+    EXPECT_TRUE(elapsed_ms < 10 * ADMIN_IO_TIMEOUT_MS);
+
+    // The silent one was closed, the other got its reply
+    char buffer[256];
+    EXPECT_EQ_INT((int)recv(silent, buffer, sizeof(buffer), 0), 0);
+    memset(reply, 0, sizeof(reply));
+    EXPECT_TRUE(recv(client, reply, sizeof(reply) - 1, MSG_WAITALL) > 0);
+    EXPECT_STRCONTAINS(reply, "total          0");
+
+    close(silent);
+    close(client);
+    admin_socket_close(fd, path);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"calls_are_listed", test_calls_are_listed},
+        {"drop_ends_the_call", test_drop_ends_the_call},
+        {"registrations_log_and_errors", test_registrations_log_and_errors},
+        {"silent_client_is_dropped", test_silent_client_is_dropped},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
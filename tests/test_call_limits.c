@@ -0,0 +1,186 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+
+static void send_invite(int n) {
+    char invite[BUFFER_SIZE];
+    snprintf(invite, sizeof(invite),
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKlim%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa%d\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: limit-%03d@example.com\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\n0123456789", n, n, n);
+    mocks_deliver(&server, invite, "10.0.0.1", 5060);
+}
+
+static int test_configure_limits(void) {
+    int failures = 0;
+    call_limits_t *limits = calloc(1, sizeof(call_limits_t));
+    call_limits_init(limits);
+    EXPECT_EQ_INT(atomic_load(&limits->max_calls[CALL_LIMIT_AOR]), CALL_LIMIT_AOR_CALLS);
+
+    EXPECT_EQ_INT(call_limits_configure(limits, "aor-calls=4,aor-cps=2,peer-calls=30,peer-cps=10"), 0);
+    EXPECT_EQ_INT(atomic_load(&limits->max_calls[CALL_LIMIT_AOR]), 4);
+    EXPECT_EQ_INT(atomic_load(&limits->max_cps[CALL_LIMIT_AOR]), 2);
+    EXPECT_EQ_INT(atomic_load(&limits->max_calls[CALL_LIMIT_PEER]), 30);
+    EXPECT_EQ_INT(atomic_load(&limits->max_cps[CALL_LIMIT_PEER]), 10);
+
+    // Invalid specifications change nothing
+    EXPECT_EQ_INT(call_limits_configure(limits, "aor-calls=1,trunk-calls=5"), -1);
+    EXPECT_EQ_INT(call_limits_configure(limits, "aor-calls=-1"), -1);
+    EXPECT_EQ_INT(call_limits_configure(limits, "peer-cps="), -1);
+    EXPECT_EQ_INT(call_limits_configure(limits, "peer=3"), -1);
+    EXPECT_EQ_INT(atomic_load(&limits->max_calls[CALL_LIMIT_AOR]), 4);
+
+    EXPECT_EQ_INT(call_limits_configure(limits, "peer-calls=0"), 0);
+    EXPECT_EQ_INT(atomic_load(&limits->max_calls[CALL_LIMIT_PEER]), 0);
+    EXPECT_EQ_INT(atomic_load(&limits->max_cps[CALL_LIMIT_PEER]), 10);
+    free(limits);
+    return failures;
+}
+
+static int test_acquire_and_release(void) {
+    int failures = 0;
+    call_limits_t *limits = calloc(1, sizeof(call_limits_t));
+    call_limits_init(limits);
+    struct in_addr peer, other_peer;
+    inet_pton(AF_INET, "10.0.0.1", &peer);
+    inet_pton(AF_INET, "10.0.0.9", &other_peer);
+    call_limit_ticket_t tickets[4];
+
+    // Concurrent calls per AOR
+    call_limits_configure(limits, "aor-calls=2");
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1001", &peer, 1000, &tickets[0]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1001", &peer, 1000, &tickets[1]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1001", &peer, 1000, &tickets[2]), CALL_LIMIT_AOR_BUSY);
+    EXPECT_EQ_INT(tickets[2].slots[CALL_LIMIT_AOR], -1);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1003", &peer, 1000, &tickets[2]), CALL_LIMIT_OK);
+    call_limits_release(limits, &tickets[0]);
+    call_limits_release(limits, &tickets[0]);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1001", &peer, 1000, &tickets[0]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "1001", &peer, 1000, &tickets[3]), CALL_LIMIT_AOR_BUSY);
+    for (int i = 0; i < 3; i++) {
+        call_limits_release(limits, &tickets[i]);
+    }
+
+    // Calls per second per peer, a refused call isn't left counted against its AOR
+    call_limits_configure(limits, "aor-calls=1,peer-cps=1");
+    EXPECT_EQ_INT(call_limits_acquire(limits, "2001", &peer, 5000, &tickets[0]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "2002", &peer, 5999, &tickets[1]), CALL_LIMIT_PEER_RATE);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "2002", &other_peer, 5999, &tickets[1]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "2003", &peer, 6000, &tickets[2]), CALL_LIMIT_OK);
+    EXPECT_EQ_INT(atomic_load(&limits->rejected[CALL_LIMIT_AOR]), 2);
+    EXPECT_EQ_INT(atomic_load(&limits->rejected[CALL_LIMIT_PEER]), 1);
+    free(limits);
+    return failures;
+}
+
+// Once every slot has had a key, the slots of keys gone quiet are taken by new ones
+static int test_idle_slots_are_reused(void) {
+    int failures = 0;
+    call_limits_t *limits = calloc(1, sizeof(call_limits_t));
+    call_limits_init(limits);
+    call_limits_configure(limits, "aor-calls=1");
+    struct in_addr peer;
+    inet_pton(AF_INET, "10.0.0.1", &peer);
+    call_limit_ticket_t held, ticket;
+
+    // One caller keeps a call, many more make one each within the same second
+    EXPECT_EQ_INT(call_limits_acquire(limits, "held", &peer, 1000, &held), CALL_LIMIT_OK);
+    char aor[32];
+    for (int i = 0; i < 8 * CALL_LIMIT_SLOTS; i++) {
+        snprintf(aor, sizeof(aor), "fill-%d", i);
+        if (call_limits_acquire(limits, aor, &peer, 1000, &ticket) == CALL_LIMIT_OK) {
+            call_limits_release(limits, &ticket);
+        }
+    }
+    EXPECT_TRUE(atomic_load(&limits->untracked) > 0);
+    int used = 0;
+    for (int i = 0; i < CALL_LIMIT_SLOTS; i++) {
+        used += atomic_load(&limits->slots[CALL_LIMIT_AOR][i].owner) != 0;
+    }
+    EXPECT_EQ_INT(used, CALL_LIMIT_SLOTS);
+
+    // A second later a new caller is limited again, and the one holding a call still is
+    EXPECT_EQ_INT(call_limits_acquire(limits, "fresh", &peer, 2500, &ticket), CALL_LIMIT_OK);
+    EXPECT_TRUE(ticket.slots[CALL_LIMIT_AOR] >= 0);
+    call_limit_ticket_t refused;
+    EXPECT_EQ_INT(call_limits_acquire(limits, "fresh", &peer, 2500, &refused), CALL_LIMIT_AOR_BUSY);
+    EXPECT_EQ_INT(call_limits_acquire(limits, "held", &peer, 2500, &refused), CALL_LIMIT_AOR_BUSY);
+    call_limits_release(limits, &ticket);
+    call_limits_release(limits, &held);
+    free(limits);
+    return failures;
+}
+
+// A caller over its limit gets 486, and a call that ends makes room for the next one
+static int test_invites_over_limit_are_refused(void) {
+    int failures = 0;
+    mocks_setup(&server);
+    EXPECT_EQ_INT(call_limits_configure(&server.store->call_limits, "aor-calls=1"), 0);
+
+    send_invite(1);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+    mocks_reset();
+    send_invite(2);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+    const mock_message_t *busy = mocks_find_payload_substr("SIP/2.0 486 Busy Here");
+    EXPECT_TRUE(busy != NULL);
+    if (busy != NULL) {
+        EXPECT_STRCONTAINS(busy->payload, "Call-ID: limit-002@example.com");
+        EXPECT_TRUE(strstr(busy->payload, "Retry-After") == NULL);
+    }
+
+    // Emergency calls are not limited
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "1002"), 0);
+    send_invite(3);
+    EXPECT_EQ_INT(server.store->call_map.size, 2);
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "112"), 0);
+
+    mocks_deliver(&server, "CANCEL sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKlim1\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa1\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: limit-001@example.com\r\n"
+                           "CSeq: 1 CANCEL\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa1\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-001@example.com\r\n"
+                           "CSeq: 2 CANCEL\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5070);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+
+    mocks_reset();
+    send_invite(4);
+    EXPECT_EQ_INT(server.store->call_map.size, 2);
+    EXPECT_TRUE(mocks_find_payload_substr("486 Busy Here") == NULL);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"configure_limits", test_configure_limits},
+        {"acquire_and_release", test_acquire_and_release},
+        {"idle_slots_are_reused", test_idle_slots_are_reused},
+        {"invites_over_limit_are_refused", test_invites_over_limit_are_refused},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
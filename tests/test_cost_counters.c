@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static char table[8192];
+
+static void dump(cost_counters_t *costs) {
+    memset(table, 0, sizeof(table));
+    FILE *out = fmemopen(table, sizeof(table) - 1, "w");
+    cost_counters_dump(costs, out);
+    fclose(out);
+}
+
+static int test_classify_events(void) {
+    int failures = 0;
+    EXPECT_EQ_INT(cost_event_classify(false, "INVITE"), COST_EVENT_INVITE);
+    EXPECT_EQ_INT(cost_event_classify(false, "ACK"), COST_EVENT_ACK);
+    EXPECT_EQ_INT(cost_event_classify(false, "BYE"), COST_EVENT_BYE);
+    EXPECT_EQ_INT(cost_event_classify(false, "CANCEL"), COST_EVENT_CANCEL);
+    EXPECT_EQ_INT(cost_event_classify(false, "OPTIONS"), COST_EVENT_OTHER_REQUEST);
+    EXPECT_EQ_INT(cost_event_classify(true, "180"), COST_EVENT_1XX);
+    EXPECT_EQ_INT(cost_event_classify(true, "200"), COST_EVENT_2XX);
+    EXPECT_EQ_INT(cost_event_classify(true, "486"), COST_EVENT_FAILURE);
+    return failures;
+}
+
+// The table lists what was counted, the most cycles first
+static int test_dump_sorts_by_cycles(void) {
+    int failures = 0;
+    cost_counters_t *costs = calloc(1, sizeof(cost_counters_t));
+    cost_counters_init(costs);
+    dump(costs);
+    EXPECT_TRUE(strstr(table, "ringing") == NULL);
+
+    cost_count_transition(costs, CALL_STATE_CONNECTED, COST_EVENT_BYE, A_LEG, false, 1000);
+    cost_count_transition(costs, CALL_STATE_RINGING, COST_EVENT_2XX, B_LEG, true, 3000);
+    cost_count_transition(costs, CALL_STATE_RINGING, COST_EVENT_2XX, B_LEG, true, 5000);
+    cost_count_register(costs, COST_REGISTER_BOUND, 2000);
+    cost_count_transition(costs, COST_STATES, COST_EVENT_BYE, A_LEG, false, 1000000);
+    EXPECT_EQ_INT((int)atomic_load(&costs->transitions[CALL_STATE_RINGING][COST_EVENT_2XX][B_LEG][1].count), 2);
+
+    dump(costs);
+    const char *ringing = strstr(table, "ringing       2xx     B   sdp");
+    const char *registered = strstr(table, "REGISTER      bound");
+    const char *connected = strstr(table, "connected     BYE     A");
+    EXPECT_TRUE(ringing != NULL && registered != NULL && connected != NULL);
+    EXPECT_TRUE(ringing < registered && registered < connected);
+    EXPECT_STRCONTAINS(table, "          2           8000       4000  72.7%");
+    free(costs);
+    return failures;
+}
+
+#ifdef COST_COUNTERS
+static sip_server_t server;
+
+// Built with COSTS=1, the state machine and the registrar count themselves
+static int test_transitions_are_counted(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+
+    sip_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.buffer, BUFFER_SIZE,
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKcost\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: cost-001@example.com\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\n0123456789");
+    msg.client_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &msg.client_addr.sin_addr);
+    msg.client_addr.sin_port = htons(5060);
+    process_sip_message(&server, &msg);
+
+    memset(msg.buffer, 0, sizeof(msg.buffer));
+    msg.call_hash = 0;
+    snprintf(msg.buffer, BUFFER_SIZE,
+             "REGISTER sip:example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.5:5062;rport;branch=z9hG4bKreg\r\n"
+             "From: <sip:1001@example.com>;tag=tag1\r\n"
+             "To: <sip:1001@example.com>\r\n"
+             "Call-ID: cost-reg@example.com\r\n"
+             "CSeq: 2 REGISTER\r\n"
+             "Contact: <sip:1001@10.0.0.5:5062>\r\n"
+             "Content-Length: 0\r\n\r\n");
+    handle_register(&server, &msg);
+
+    cost_counters_t *costs = &server.store->costs;
+    EXPECT_EQ_INT((int)atomic_load(&costs->transitions[CALL_STATE_IDLE][COST_EVENT_INVITE][0][1].count), 1);
+    EXPECT_TRUE(atomic_load(&costs->transitions[CALL_STATE_IDLE][COST_EVENT_INVITE][0][1].cycles) > 0);
+    EXPECT_EQ_INT((int)atomic_load(&costs->registers[COST_REGISTER_BOUND].count), 1);
+    sip_server_destroy(&server);
+    return failures;
+}
+#endif
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"classify_events", test_classify_events},
+        {"dump_sorts_by_cycles", test_dump_sorts_by_cycles},
+#ifdef COST_COUNTERS
+        {"transitions_are_counted", test_transitions_are_counted},
+#endif
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -0,0 +1,90 @@
+#include "test_common.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "../dedup_filter.h"
+
+static const char *register_payload =
+    "REGISTER sip:example.com SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 10.0.0.5:5062;rport;branch=z9hG4bKdup\r\n"
+    "Call-ID: dup-001@example.com\r\n"
+    "CSeq: 2 REGISTER\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+static void build_addr(struct sockaddr_in *addr, const char *ip, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &addr->sin_addr);
+    addr->sin_port = htons(port);
+}
+
+static int test_retransmission_in_flight_is_dropped(void) {
+    int failures = 0;
+    dedup_filter_t filter;
+    dedup_filter_init(&filter, false);
+
+    struct sockaddr_in addr;
+    build_addr(&addr, "10.0.0.5", 5062);
+    uint64_t hash = dedup_filter_hash(register_payload, strlen(register_payload), &addr);
+
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash, 1000));
+    EXPECT_TRUE(dedup_filter_check(&filter, hash, 1500));
+    EXPECT_TRUE(dedup_filter_check(&filter, hash, 2500));
+    EXPECT_EQ_INT(dedup_filter_duplicates(&filter), 2);
+
+    dedup_filter_destroy(&filter);
+    return failures;
+}
+
+static int test_released_message_lets_retransmission_through(void) {
+    int failures = 0;
+    dedup_filter_t filter;
+    dedup_filter_init(&filter, false);
+
+    struct sockaddr_in addr;
+    build_addr(&addr, "10.0.0.5", 5062);
+    uint64_t hash = dedup_filter_hash(register_payload, strlen(register_payload), &addr);
+
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash, 1000));
+    dedup_filter_release(&filter, hash);
+    // The first copy was answered, the UA may have lost our response
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash, 1500));
+    // Entries expire after the window even if never released
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash, 1500 + DEDUP_WINDOW_MS));
+    EXPECT_EQ_INT(dedup_filter_duplicates(&filter), 0);
+
+    dedup_filter_destroy(&filter);
+    return failures;
+}
+
+static int test_same_payload_other_source_is_not_duplicate(void) {
+    int failures = 0;
+    dedup_filter_t filter;
+    dedup_filter_init(&filter, false);
+
+    struct sockaddr_in addr_a;
+    struct sockaddr_in addr_b;
+    build_addr(&addr_a, "10.0.0.5", 5062);
+    build_addr(&addr_b, "10.0.0.5", 5064);
+    uint64_t hash_a = dedup_filter_hash(register_payload, strlen(register_payload), &addr_a);
+    uint64_t hash_b = dedup_filter_hash(register_payload, strlen(register_payload), &addr_b);
+
+    EXPECT_TRUE(hash_a != hash_b);
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash_a, 1000));
+    EXPECT_TRUE(!dedup_filter_check(&filter, hash_b, 1000));
+
+    dedup_filter_destroy(&filter);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"retransmission_in_flight_is_dropped", test_retransmission_in_flight_is_dropped},
+        {"released_message_lets_retransmission_through", test_released_message_lets_retransmission_through},
+        {"same_payload_other_source_is_not_duplicate", test_same_payload_other_source_is_not_duplicate},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
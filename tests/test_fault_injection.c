@@ -0,0 +1,251 @@
+#include "test_common.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "../fault_injection.h"
+
+static void build_addr(struct sockaddr_in *addr, const char *ip, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &addr->sin_addr);
+    addr->sin_port = htons(port);
+}
+
+typedef struct {
+    char order[64];
+    size_t count;
+} delivery_log_t;
+
+static void log_delivery(void *user_data, fault_direction_t direction, int fd,
+                         const char *data, size_t len, const struct sockaddr_in *peer) {
+    (void)direction;
+    (void)fd;
+    (void)peer;
+    delivery_log_t *log = user_data;
+    if (len > 0 && log->count < sizeof(log->order) - 1) {
+        log->order[log->count++] = data[0];
+    }
+}
+
+static int test_no_rules_passes_everything(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, NULL), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    for (int i = 0; i < 100; i++) {
+        EXPECT_TRUE(fault_injector_filter(&injector, i % 2 ? FAULT_IN : FAULT_OUT, 3, "x", 1, &peer, 1000));
+    }
+    fault_stats_t in, out;
+    fault_injector_stats(&injector, FAULT_IN, &in);
+    fault_injector_stats(&injector, FAULT_OUT, &out);
+    EXPECT_EQ_INT(in.passed, 50);
+    EXPECT_EQ_INT(out.passed, 50);
+    EXPECT_EQ_INT(fault_injector_next_due(&injector, 1000), -1);
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_invalid_specs_are_rejected(void) {
+    int failures = 0;
+    const char *invalid[] = {
+        "drop", "drop=101", "drop=x", "delay=50-10", "delay=exp:", "peer=10.0.0", "peer=10.0.0.1:0",
+        "dir=sideways", "jitter=5", "drop=5;;dup=abc",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        fault_injector_t injector;
+        EXPECT_EQ_INT(fault_injector_init(&injector, invalid[i]), -1);
+    }
+
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "peer=10.0.0.7:5070,dir=out,drop=30;drop=2,dup=1.5,delay=exp:40,reorder=5,reorder_ms=80,seed=0x2a"), 0);
+    EXPECT_EQ_INT(injector.rule_count, 2);
+    EXPECT_TRUE(!injector.rules[0].any_peer);
+    EXPECT_EQ_INT(injector.rules[0].peer_port, 5070);
+    EXPECT_EQ_INT(injector.rules[0].directions, FAULT_OUT);
+    EXPECT_EQ_INT(injector.rules[1].delay, FAULT_DELAY_EXPONENTIAL);
+    EXPECT_EQ_INT(injector.rules[1].delay_min_ms, 40);
+    EXPECT_EQ_INT(injector.rules[1].reorder_ms, 80);
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_drop_rate_is_respected(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "drop=30,seed=7"), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    int handled = 0;
+    for (int i = 0; i < 10000; i++) {
+        handled += fault_injector_filter(&injector, FAULT_IN, 3, "x", 1, &peer, 1000);
+    }
+    fault_stats_t stats;
+    fault_injector_stats(&injector, FAULT_IN, &stats);
+    EXPECT_EQ_INT(stats.passed, handled);
+    EXPECT_EQ_INT(stats.passed + stats.dropped, 10000);
+    EXPECT_TRUE(stats.dropped > 2700 && stats.dropped < 3300);
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_delayed_datagrams_are_released_when_due(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "delay=100"), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_OUT, 3, "a", 1, &peer, 1000));
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_OUT, 3, "b", 1, &peer, 1000));
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_OUT, 3, "c", 1, &peer, 1050));
+    EXPECT_EQ_INT(fault_injector_next_due(&injector, 1000), 100);
+
+    delivery_log_t log = {0};
+    EXPECT_EQ_INT(fault_injector_release(&injector, 1099, log_delivery, &log), 0);
+    EXPECT_EQ_INT(fault_injector_release(&injector, 1100, log_delivery, &log), 2);
+    EXPECT_EQ_INT(fault_injector_next_due(&injector, 1100), 50);
+    EXPECT_EQ_INT(fault_injector_release(&injector, 2000, log_delivery, &log), 1);
+    // Equal delays keep the order they came in
+    EXPECT_TRUE(strcmp(log.order, "abc") == 0);
+    EXPECT_EQ_INT(fault_injector_next_due(&injector, 2000), -1);
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_duplicates_and_reordering(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "dup=100"), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    // The original goes now, its copy comes out of the queue
+    EXPECT_TRUE(fault_injector_filter(&injector, FAULT_IN, 3, "a", 1, &peer, 1000));
+    delivery_log_t log = {0};
+    EXPECT_EQ_INT(fault_injector_release(&injector, 1000, log_delivery, &log), 1);
+    EXPECT_TRUE(strcmp(log.order, "a") == 0);
+    fault_injector_destroy(&injector);
+
+    EXPECT_EQ_INT(fault_injector_init(&injector, "delay=10,reorder=50,reorder_ms=100,seed=3"), 0);
+    const char *sent = "abcdefghijklmnopqrstuvwxyz";
+    for (int i = 0; sent[i] != '\0'; i++) {
+        fault_injector_filter(&injector, FAULT_OUT, 3, &sent[i], 1, &peer, 1000 + (uint64_t)i);
+    }
+    memset(&log, 0, sizeof(log));
+    EXPECT_EQ_INT(fault_injector_release(&injector, 5000, log_delivery, &log), 26);
+    fault_stats_t stats;
+    fault_injector_stats(&injector, FAULT_OUT, &stats);
+    EXPECT_TRUE(stats.reordered > 0 && stats.reordered < 26);
+    // Every datagram arrives once, but not in the order sent
+    EXPECT_TRUE(strcmp(log.order, sent) != 0);
+    char sorted[27];
+    memcpy(sorted, log.order, sizeof(sorted));
+    for (int i = 0; i < 26; i++) {
+        for (int j = i + 1; j < 26; j++) {
+            if (sorted[j] < sorted[i]) {
+                char c = sorted[i];
+                sorted[i] = sorted[j];
+                sorted[j] = c;
+            }
+        }
+    }
+    EXPECT_TRUE(strcmp(sorted, sent) == 0);
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_rules_match_peer_and_direction(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "peer=10.0.0.7:5070,dir=out,drop=100;peer=10.0.0.8,drop=100"), 0);
+
+    struct sockaddr_in callee, callee_other_port, other_host, caller;
+    build_addr(&callee, "10.0.0.7", 5070);
+    build_addr(&callee_other_port, "10.0.0.7", 5071);
+    build_addr(&other_host, "10.0.0.8", 6000);
+    build_addr(&caller, "10.0.0.1", 5060);
+
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_OUT, 3, "x", 1, &callee, 1000));
+    EXPECT_TRUE(fault_injector_filter(&injector, FAULT_IN, 3, "x", 1, &callee, 1000));
+    EXPECT_TRUE(fault_injector_filter(&injector, FAULT_OUT, 3, "x", 1, &callee_other_port, 1000));
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_IN, 3, "x", 1, &other_host, 1000));
+    EXPECT_TRUE(!fault_injector_filter(&injector, FAULT_OUT, 3, "x", 1, &other_host, 1000));
+    EXPECT_TRUE(fault_injector_filter(&injector, FAULT_OUT, 3, "x", 1, &caller, 1000));
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+static int test_same_seed_same_decisions(void) {
+    int failures = 0;
+    const char *spec = "drop=10,dup=10,delay=exp:30,reorder=10,seed=99";
+    fault_injector_t first, second;
+    EXPECT_EQ_INT(fault_injector_init(&first, spec), 0);
+    EXPECT_EQ_INT(fault_injector_init(&second, spec), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    int differences = 0;
+    for (int i = 0; i < 1000; i++) {
+        bool a = fault_injector_filter(&first, FAULT_IN, 3, "x", 1, &peer, (uint64_t)i);
+        bool b = fault_injector_filter(&second, FAULT_IN, 3, "x", 1, &peer, (uint64_t)i);
+        differences += a != b;
+    }
+    EXPECT_EQ_INT(differences, 0);
+
+    fault_stats_t a, b;
+    fault_injector_stats(&first, FAULT_IN, &a);
+    fault_injector_stats(&second, FAULT_IN, &b);
+    EXPECT_TRUE(memcmp(&a, &b, sizeof(a)) == 0);
+    EXPECT_TRUE(a.dropped > 0 && a.duplicated > 0 && a.delayed > 0 && a.reordered > 0);
+
+    fault_injector_destroy(&first);
+    fault_injector_destroy(&second);
+    return failures;
+}
+
+static int test_queue_overflow_drops(void) {
+    int failures = 0;
+    fault_injector_t injector;
+    EXPECT_EQ_INT(fault_injector_init(&injector, "delay=1000"), 0);
+
+    struct sockaddr_in peer;
+    build_addr(&peer, "10.0.0.1", 5060);
+    for (int i = 0; i < FAULT_MAX_HELD + 10; i++) {
+        fault_injector_filter(&injector, FAULT_OUT, 3, "x", 1, &peer, 1000);
+    }
+    fault_stats_t stats;
+    fault_injector_stats(&injector, FAULT_OUT, &stats);
+    EXPECT_EQ_INT(stats.delayed, FAULT_MAX_HELD);
+    EXPECT_EQ_INT(stats.overflowed, 10);
+
+    delivery_log_t log = {0};
+    EXPECT_EQ_INT(fault_injector_release(&injector, 2000, log_delivery, &log), FAULT_MAX_HELD);
+
+    fault_injector_destroy(&injector);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"no_rules_passes_everything", test_no_rules_passes_everything},
+        {"invalid_specs_are_rejected", test_invalid_specs_are_rejected},
+        {"drop_rate_is_respected", test_drop_rate_is_respected},
+        {"delayed_datagrams_are_released_when_due", test_delayed_datagrams_are_released_when_due},
+        {"duplicates_and_reordering", test_duplicates_and_reordering},
+        {"rules_match_peer_and_direction", test_rules_match_peer_and_direction},
+        {"same_seed_same_decisions", test_same_seed_same_decisions},
+        {"queue_overflow_drops", test_queue_overflow_drops},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
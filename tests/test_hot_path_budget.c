@@ -0,0 +1,192 @@
+#include "test_common.h"
+#include "interpose.h"
+#include "hot_path_budgets.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../sip_server.h"
+#include "../network_utils.h"
+
+#define FLOW_MAX_MESSAGES 8
+
+static sip_server_t server;
+static int udp_socket = -1;
+
+static const char *sdp_body =
+    "v=0\r\n"
+    "o=- 0 0 IN IP4 10.0.0.1\r\n"
+    "s=-\r\n"
+    "c=IN IP4 10.0.0.1\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n";
+
+static const char *a_call_id = "budget-001@example.com";
+static const char *b_call_id = "b-legt-001@example.com";
+
+static sip_message_t *new_message(const char *ip, int port) {
+    sip_message_t *msg = calloc(1, sizeof(sip_message_t));
+    msg->client_addr.sin_family = AF_INET;
+    msg->client_addr_len = sizeof(msg->client_addr);
+    inet_pton(AF_INET, ip, &msg->client_addr.sin_addr);
+    msg->client_addr.sin_port = htons(port);
+    return msg;
+}
+
+static sip_message_t *a_leg_request(const char *method, int cseq, bool sdp) {
+    sip_message_t *msg = new_message("10.0.0.1", 5060);
+    snprintf(msg->buffer, BUFFER_SIZE,
+             "%s sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bK%s%d\r\n"
+             "Max-Forwards: 70\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: %d %s\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "%s"
+             "Content-Length: %zu\r\n\r\n%s",
+             method, method, cseq, a_call_id, cseq, method,
+             sdp ? "Content-Type: application/sdp\r\n" : "",
+             sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    return msg;
+}
+
+static sip_message_t *b_leg_response(const char *status, const char *cseq, bool sdp) {
+    sip_message_t *msg = new_message("10.0.0.2", 5070);
+    snprintf(msg->buffer, BUFFER_SIZE,
+             "SIP/2.0 %s\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+             "From: <sip:1002@example.com>;tag=bbb\r\n"
+             "To: <sip:1001@example.com>;tag=ccc\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: %s\r\n"
+             "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+             "%s"
+             "Content-Length: %zu\r\n\r\n%s",
+             status, b_call_id, cseq,
+             sdp ? "Content-Type: application/sdp\r\n" : "",
+             sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    return msg;
+}
+
+static int build_flow(const char *flow, sip_message_t *messages[FLOW_MAX_MESSAGES]) {
+    int n = 0;
+    if (strcmp(flow, "REGISTER") == 0) {
+        sip_message_t *reg = new_message("10.0.0.5", 5062);
+        snprintf(reg->buffer, BUFFER_SIZE,
+                 "REGISTER sip:example.com SIP/2.0\r\n"
+                 "Via: SIP/2.0/UDP 10.0.0.5:5062;rport;branch=z9hG4bKreg\r\n"
+                 "From: <sip:1001@example.com>;tag=tag1\r\n"
+                 "To: <sip:1001@example.com>\r\n"
+                 "Call-ID: budget-reg@example.com\r\n"
+                 "CSeq: 2 REGISTER\r\n"
+                 "Contact: <sip:1001@10.0.0.5:5062>\r\n"
+                 "Content-Length: 0\r\n\r\n");
+        messages[n++] = reg;
+    } else if (strcmp(flow, "INVITE-BYE") == 0) {
+        messages[n++] = a_leg_request("INVITE", 1, true);
+        messages[n++] = b_leg_response("180 Ringing", "1 INVITE", false);
+        messages[n++] = b_leg_response("200 OK", "1 INVITE", true);
+        messages[n++] = a_leg_request("ACK", 1, false);
+        messages[n++] = a_leg_request("BYE", 2, false);
+        messages[n++] = b_leg_response("200 OK", "2 BYE", false);
+    } else if (strcmp(flow, "INVITE-CANCEL") == 0) {
+        messages[n++] = a_leg_request("INVITE", 1, true);
+        messages[n++] = b_leg_response("180 Ringing", "1 INVITE", false);
+        messages[n++] = a_leg_request("CANCEL", 1, false);
+        messages[n++] = b_leg_response("200 OK", "1 CANCEL", false);
+        messages[n++] = b_leg_response("487 Request Terminated", "1 INVITE", false);
+    }
+    return n;
+}
+
+/**
+ * @brief Runs a flow through a worker loop on this thread and returns what it cost.
+ */
+static interpose_counters_t run_flow(const char *flow, int *message_count) {
+    sip_message_t *messages[FLOW_MAX_MESSAGES];
+    worker_thread_t worker;
+    int n = build_flow(flow, messages);
+    *message_count = n;
+
+    initialize_message_queue(&worker.queue, QUEUE_CAPACITY);
+    worker.server = &server;
+    for (int i = 0; i < n; i++) {
+        enqueue_message(&worker.queue, messages[i]);
+    }
+    enqueue_message(&worker.queue, NULL);
+
+    // The handlers log every message, keep the test output readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    interpose_reset();
+    process_sip_messages(&worker);
+    interpose_counters_t cost = interpose_get();
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+
+    destroy_message_queue(&worker.queue);
+    return cost;
+}
+
+static int check_budget(const hot_path_budget_t *budget) {
+    int failures = 0;
+    int messages = 0;
+    interpose_counters_t cost = run_flow(budget->flow, &messages);
+
+    printf("\n    %-14s %d msgs: %zu allocs (%zu bytes), %zu syscalls, %zu sends (%zu bytes) ",
+           budget->flow, messages, cost.allocations, cost.allocated_bytes,
+           cost.syscalls, cost.sends, cost.bytes_sent);
+    EXPECT_TRUE(messages > 0);
+    EXPECT_TRUE(cost.allocations <= budget->allocations);
+    EXPECT_TRUE(cost.allocated_bytes <= budget->allocated_bytes);
+    EXPECT_TRUE(cost.syscalls <= budget->syscalls);
+    EXPECT_TRUE(cost.bytes_sent <= budget->bytes_sent);
+    // The worker releases every message it was handed
+    EXPECT_EQ_INT(cost.frees, messages);
+    // Every flow ends with its call slot released
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    return failures;
+}
+
+static int test_register_budget(void) {
+    return check_budget(&hot_path_budgets[0]);
+}
+
+static int test_invite_bye_budget(void) {
+    return check_budget(&hot_path_budgets[1]);
+}
+
+static int test_invite_cancel_budget(void) {
+    return check_budget(&hot_path_budgets[2]);
+}
+
+int main(void) {
+    // Messages go out through the real UDP transport, sendto() is intercepted
+    udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    const sip_transport_t transport = { .send = udp_transport_send, .user_data = &udp_socket };
+    sip_server_init(&server, &transport);
+
+    const test_case_t cases[] = {
+        {"register_budget", test_register_budget},
+        {"invite_bye_budget", test_invite_bye_budget},
+        {"invite_cancel_budget", test_invite_cancel_budget},
+    };
+
+    test_stats_t stats;
+    int result = run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+    sip_server_destroy(&server);
+    close(udp_socket);
+    return result;
+}
@@ -0,0 +1,288 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+static size_t batches_sent;
+static size_t largest_batch;
+
+static void batch_send(void *user_data, const sip_outgoing_t *batch, size_t count) {
+    batches_sent++;
+    if (count > largest_batch) {
+        largest_batch = count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        mock_transport_send(user_data, batch[i].message, batch[i].destination, batch[i].port);
+    }
+}
+
+static void setup(void) {
+    const sip_transport_t transport = { .send = mock_transport_send, .send_batch = batch_send, .user_data = NULL };
+    sip_server_init(&server, &transport);
+    mocks_use_virtual_clock(&server);
+    batches_sent = 0;
+    largest_batch = 0;
+    mocks_reset();
+}
+
+static void send_register(const char *user, const char *ip) {
+    char reg[BUFFER_SIZE];
+    snprintf(reg, sizeof(reg),
+             "REGISTER sip:example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP %s:5060;branch=z9hG4bKimreg\r\n"
+             "From: <sip:%s@example.com>;tag=tag1\r\n"
+             "To: <sip:%s@example.com>\r\n"
+             "Call-ID: im-reg-%s@example.com\r\n"
+             "CSeq: 1 REGISTER\r\n"
+             "Contact: <sip:%s@%s:5060>\r\n"
+             "Content-Length: 0\r\n\r\n", ip, user, user, user, user, ip);
+    mocks_deliver(&server, reg, ip, 5060);
+}
+
+static void send_message(const char *user, int n, const char *text) {
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message),
+             "MESSAGE sip:%s@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKim%d\r\n"
+             "Max-Forwards: 70\r\n"
+             "From: <sip:1001@example.com>;tag=im%d\r\n"
+             "To: <sip:%s@example.com>\r\n"
+             "Call-ID: im-%s-%d@example.com\r\n"
+             "CSeq: 1 MESSAGE\r\n"
+             "Content-Type: text/plain\r\n"
+             "Content-Length: %zu\r\n\r\n%s",
+             user, n, n, user, user, n, strlen(text), text);
+    mocks_deliver(&server, message, "10.0.0.1", 5060);
+}
+
+/**
+ * @brief Puts together a 200 OK to a relayed MESSAGE, with both of its Vias, or with the
+ * sender's replaced by sender_via if given.
+ */
+static void answer_relayed(const mock_message_t *relayed, const char *sender_via, char *out, size_t size) {
+    const char *our_via = relayed != NULL ? strstr(relayed->payload, "Via: ") : "Via: \r\n";
+    const char *via_end = strstr(our_via, "\r\n");
+    int our_len = (int)(via_end - our_via);
+    if (sender_via == NULL) {
+        our_len += (int)strcspn(via_end + 2, "\r") + 2;
+    }
+    snprintf(out, size,
+             "SIP/2.0 200 OK\r\n"
+             "%.*s\r\n"
+             "%s%s"
+             "From: <sip:1001@example.com>;tag=im1\r\n"
+             "To: <sip:1002@example.com>;tag=b2\r\n"
+             "Call-ID: im-1002-1@example.com\r\n"
+             "CSeq: 1 MESSAGE\r\n"
+             "Content-Length: 0\r\n\r\n", our_len, our_via,
+             sender_via != NULL ? sender_via : "", sender_via != NULL ? "\r\n" : "");
+}
+
+// A registered user gets the MESSAGE through the server's Via, and its answer goes back through it
+static int test_relay_to_registered_user(void) {
+    int failures = 0;
+    setup();
+    send_register("1002", "10.0.0.2");
+    mocks_reset();
+
+    send_message("1002", 1, "hello");
+    const mock_message_t *relayed = mocks_find_payload_substr("MESSAGE sip:1002@10.0.0.2:5060 SIP/2.0");
+    EXPECT_TRUE(relayed != NULL);
+    if (relayed != NULL) {
+        EXPECT_EQ_INT(ntohs(((const struct sockaddr_in *)&relayed->addr)->sin_port), 5060);
+        EXPECT_STRCONTAINS(relayed->payload, "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-im-");
+        EXPECT_STRCONTAINS(relayed->payload, "Via: SIP/2.0/UDP 10.0.0.1:5060;rport=5060;received=10.0.0.1;branch=z9hG4bKim1");
+        EXPECT_STRCONTAINS(relayed->payload, "Max-Forwards: 69\r\n");
+        EXPECT_STRCONTAINS(relayed->payload, "\r\n\r\nhello");
+    }
+
+    // The 200 OK of 1002 loses the server's Via and goes to where the MESSAGE came from
+    char response[BUFFER_SIZE];
+    answer_relayed(relayed, NULL, response, sizeof(response));
+    mocks_reset();
+    mocks_deliver(&server, response, "10.0.0.2", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 1);
+    const mock_message_t *ok = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(ok != NULL && strstr(ok->payload, "z9hG4bK-im-") == NULL);
+    if (ok != NULL) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)&ok->addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        EXPECT_STRCONTAINS(ip, "10.0.0.1");
+        EXPECT_EQ_INT(ntohs(addr->sin_port), 5060);
+    }
+
+    sip_im_stats_t stats;
+    sip_im_stats(&server.store->instant_messages, &stats);
+    EXPECT_EQ_INT((int)stats.relayed, 1);
+    EXPECT_EQ_INT((int)stats.responses, 1);
+    EXPECT_EQ_INT((int)stats.stored, 0);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// A response whose branch wasn't made from the Via below it is not reflected anywhere, nor one
+// to a MESSAGE whose sender named another address in its Via
+static int test_forged_response_is_dropped(void) {
+    int failures = 0;
+    setup();
+    send_register("1002", "10.0.0.2");
+    send_message("1002", 1, "hello");
+    const mock_message_t *relayed = mocks_find_payload_substr("MESSAGE sip:1002@10.0.0.2:5060 SIP/2.0");
+    EXPECT_TRUE(relayed != NULL);
+
+    // The server's Via kept, the sender's swapped for a victim's address
+    char response[BUFFER_SIZE];
+    answer_relayed(relayed, "Via: SIP/2.0/UDP 192.0.2.7:9;rport=9;received=192.0.2.7;branch=z9hG4bKim1",
+                   response, sizeof(response));
+    mocks_reset();
+    mocks_deliver(&server, response, "10.0.0.2", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 0);
+
+    // A made-up branch of ours
+    mocks_reset();
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-im-00000000deadbeef\r\n"
+                           "Via: SIP/2.0/UDP 192.0.2.7:9;branch=z9hG4bKim1\r\n"
+                           "From: <sip:1001@example.com>;tag=im1\r\n"
+                           "To: <sip:1002@example.com>;tag=b2\r\n"
+                           "Call-ID: im-1002-1@example.com\r\n"
+                           "CSeq: 1 MESSAGE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.9", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 0);
+
+    sip_im_stats_t stats;
+    sip_im_stats(&server.store->instant_messages, &stats);
+    EXPECT_EQ_INT((int)stats.responses, 0);
+
+    // A sender naming another address in its own Via gets the answer at the one it sent from
+    mocks_reset();
+    mocks_deliver(&server, "MESSAGE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 6.6.6.6:5060;received=9.9.9.9;rport=7777;branch=z9hG4bKim9\r\n"
+                           "Max-Forwards: 70\r\n"
+                           "From: <sip:1001@example.com>;tag=im9\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: im-1002-9@example.com\r\n"
+                           "CSeq: 1 MESSAGE\r\n"
+                           "Content-Length: 2\r\n\r\nhi", "10.0.0.1", 5060);
+    relayed = mocks_find_payload_substr("MESSAGE sip:1002@10.0.0.2:5060 SIP/2.0");
+    EXPECT_TRUE(relayed != NULL && strstr(relayed->payload, "9.9.9.9") == NULL &&
+                strstr(relayed->payload, "7777") == NULL);
+    if (relayed != NULL) {
+        EXPECT_STRCONTAINS(relayed->payload, "Via: SIP/2.0/UDP 6.6.6.6:5060;rport=5060;received=10.0.0.1;branch=z9hG4bKim9\r\n");
+    }
+    answer_relayed(relayed, NULL, response, sizeof(response));
+    mocks_reset();
+    mocks_deliver(&server, response, "10.0.0.2", 5060);
+    const mock_message_t *ok = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(ok != NULL);
+    if (ok != NULL) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)&ok->addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        EXPECT_STRCONTAINS(ip, "10.0.0.1");
+        EXPECT_EQ_INT(ntohs(addr->sin_port), 5060);
+    }
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// Offline users' messages wait in their mailboxes, a full mailbox refuses more
+static int test_store_for_offline_user(void) {
+    int failures = 0;
+    setup();
+    for (int i = 0; i < IM_QUEUE_DEPTH; i++) {
+        send_message("1003", i, "stored");
+    }
+    EXPECT_EQ_INT((int)mocks_count(), IM_QUEUE_DEPTH);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 202 Accepted") != NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("MESSAGE sip:") == NULL);
+
+    send_message("1003", 99, "one too many");
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 480 Temporarily Unavailable") != NULL);
+    send_message("9999", 1, "nobody");
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 404 Not Found") != NULL);
+
+    // Nothing is sent before the user registers
+    mocks_advance(&server, 10 * IM_DELIVERY_INTERVAL_MS);
+    EXPECT_TRUE(mocks_find_payload_substr("MESSAGE sip:") == NULL);
+
+    sip_im_stats_t stats;
+    sip_im_stats(&server.store->instant_messages, &stats);
+    EXPECT_EQ_INT((int)stats.stored, IM_QUEUE_DEPTH);
+    EXPECT_EQ_INT((int)stats.rejected, 1);
+    EXPECT_EQ_INT((int)stats.waiting, IM_QUEUE_DEPTH);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// Users registering at once get their stored messages in paced batches, in order
+static int test_paced_delivery_on_registration(void) {
+    int failures = 0;
+    setup();
+    const char *users[] = {"1003", "1004", "1005", "1006", "1007"};
+    const int user_count = (int)(sizeof(users) / sizeof(users[0]));
+    for (int i = 0; i < IM_QUEUE_DEPTH; i++) {
+        for (int u = 0; u < user_count; u++) {
+            send_message(users[u], i, i == 0 ? "first" : "later");
+        }
+    }
+    for (int u = 0; u < user_count; u++) {
+        send_register(users[u], "10.0.0.3");
+    }
+    mocks_reset();
+
+    mocks_advance(&server, IM_DELIVERY_INTERVAL_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT((int)batches_sent, 1);
+    EXPECT_EQ_INT((int)largest_batch, IM_DELIVERY_BATCH);
+    // One message from each user in turn, each user's oldest first
+    const mock_message_t *first = mocks_get(0);
+    EXPECT_TRUE(first != NULL && strstr(first->payload, "MESSAGE sip:1003@10.0.0.3:5060") != NULL &&
+                strstr(first->payload, "\r\n\r\nfirst") != NULL);
+    const mock_message_t *second = mocks_get(1);
+    EXPECT_TRUE(second != NULL && strstr(second->payload, "MESSAGE sip:1004@10.0.0.3:5060") != NULL);
+
+    mocks_advance(&server, IM_DELIVERY_INTERVAL_MS / 2);
+    EXPECT_EQ_INT((int)batches_sent, 1);
+    mocks_advance(&server, IM_DELIVERY_INTERVAL_MS / 2 + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT((int)batches_sent, 2);
+    EXPECT_EQ_INT((int)mocks_count(), IM_QUEUE_DEPTH * user_count);
+    mocks_advance(&server, 10 * IM_DELIVERY_INTERVAL_MS);
+    EXPECT_EQ_INT((int)batches_sent, 2);
+
+    // The responses to delivered messages end at the server
+    mocks_reset();
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-im-2-7\r\n"
+                           "From: <sip:1001@example.com>;tag=im0\r\n"
+                           "To: <sip:1003@example.com>;tag=c3\r\n"
+                           "Call-ID: im-1003-0@example.com\r\n"
+                           "CSeq: 7 MESSAGE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.3", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 0);
+
+    sip_im_stats_t stats;
+    sip_im_stats(&server.store->instant_messages, &stats);
+    EXPECT_EQ_INT((int)stats.delivered, IM_QUEUE_DEPTH * user_count);
+    EXPECT_EQ_INT((int)stats.batches, 2);
+    EXPECT_EQ_INT((int)stats.waiting, 0);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"relay_to_registered_user", test_relay_to_registered_user},
+        {"forged_response_is_dropped", test_forged_response_is_dropped},
+        {"store_for_offline_user", test_store_for_offline_user},
+        {"paced_delivery_on_registration", test_paced_delivery_on_registration},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
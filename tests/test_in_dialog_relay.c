@@ -0,0 +1,273 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+
+// Sets up a connected call from 1001 to 1002, with A refreshing its session
+static void connect_call(void) {
+    mocks_setup(&server);
+    mocks_deliver(&server, "INVITE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKdlg1\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Supported: timer\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n0123456789", "10.0.0.1", 5060);
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-legg-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n9876543210", "10.0.0.2", 5070);
+    mocks_deliver(&server, "ACK sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKdlg2\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 1 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    mocks_reset();
+}
+
+static int cseq_number(const char *payload) {
+    const char *cseq = strstr(payload, "CSeq: ");
+    return cseq != NULL ? atoi(cseq + strlen("CSeq: ")) : 0;
+}
+
+// A DTMF INFO reaches B with B's dialog and A's body, B's 200 OK reaches A with A's transaction
+static int test_info_is_relayed(void) {
+    int failures = 0;
+    connect_call();
+    mocks_deliver(&server, "INFO sip:" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKinfo\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 2 INFO\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Type: application/dtmf-relay\r\n"
+                           "Content-Length: 24\r\n\r\nSignal=5\r\nDuration=160\r\n", "10.0.0.1", 5060);
+
+    EXPECT_EQ_INT((int)mocks_count(), 1);
+    const mock_message_t *info = mocks_find_payload_substr("INFO sip:1002@");
+    EXPECT_TRUE(info != NULL);
+    if (info == NULL) {
+        sip_server_destroy(&server);
+        return failures;
+    }
+    EXPECT_STRCONTAINS(info->payload, "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-dlg-");
+    EXPECT_STRCONTAINS(info->payload, "To: <sip:1002@example.com>;tag=bbb\r\n");
+    EXPECT_STRCONTAINS(info->payload, "Call-ID: b-legg-001@example.com\r\n");
+    EXPECT_STRCONTAINS(info->payload, "Content-Type: application/dtmf-relay\r\nContent-Length: 24\r\n\r\nSignal=5\r\nDuration=160\r\n");
+    EXPECT_STRCONTAINS(info->payload, "Contact: <sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060>\r\n");
+    EXPECT_TRUE(strstr(info->payload, "10.0.0.1") == NULL && strstr(info->payload, "z9hG4bKinfo") == NULL);
+    int relayed_cseq = cseq_number(info->payload);
+
+    char ok[BUFFER_SIZE];
+    snprintf(ok, sizeof(ok),
+             "SIP/2.0 200 OK\r\n"
+             "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-dlg-%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>;tag=bbb\r\n"
+             "Call-ID: b-legg-001@example.com\r\n"
+             "CSeq: %d INFO\r\n"
+             "Content-Length: 0\r\n\r\n", relayed_cseq, relayed_cseq);
+    mocks_reset();
+    mocks_deliver(&server, ok, "10.0.0.2", 5070);
+    const mock_message_t *response = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(response != NULL);
+    if (response != NULL) {
+        EXPECT_STRCONTAINS(response->payload, "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKinfo\r\n");
+        EXPECT_STRCONTAINS(response->payload, "Call-ID: dialog-001@example.com\r\nCSeq: 2 INFO\r\n");
+    }
+
+    // A retransmitted response finds no request left
+    mocks_reset();
+    mocks_deliver(&server, ok, "10.0.0.2", 5070);
+    EXPECT_EQ_INT((int)mocks_count(), 0);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// B puts A on hold: the re-INVITE, the 200 OK and its retransmission, and the ACK cross the
+// server, a crossing re-INVITE of A's is told to wait
+static int test_reinvite_is_relayed(void) {
+    int failures = 0;
+    connect_call();
+    mocks_deliver(&server, "INVITE sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKhold\r\n"
+                           "From: <sip:1002@example.com>;tag=bbb\r\n"
+                           "To: <sip:1001@example.com>;tag=aaa\r\n"
+                           "Call-ID: b-legg-001@example.com\r\n"
+                           "CSeq: 7 INVITE\r\n"
+                           "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\na=sendonly", "10.0.0.2", 5070);
+    const mock_message_t *reinvite = mocks_find_payload_substr("INVITE sip:1001@10.0.0.1:5060 SIP/2.0");
+    EXPECT_TRUE(reinvite != NULL);
+    if (reinvite == NULL) {
+        sip_server_destroy(&server);
+        return failures;
+    }
+    EXPECT_STRCONTAINS(reinvite->payload, "From: <sip:1002@example.com>\r\nTo: <sip:1001@example.com>;tag=aaa\r\n");
+    EXPECT_STRCONTAINS(reinvite->payload, "Call-ID: dialog-001@example.com\r\n");
+    EXPECT_STRCONTAINS(reinvite->payload, "Contact: <sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060>\r\n");
+    EXPECT_STRCONTAINS(reinvite->payload, "\r\n\r\na=sendonly");
+    EXPECT_TRUE(strstr(reinvite->payload, "10.0.0.2:5070") == NULL);
+    int relayed_cseq = cseq_number(reinvite->payload);
+
+    mocks_reset();
+    mocks_deliver(&server, "INVITE sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKcross\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 3 INVITE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 1);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 491 Request Pending") != NULL);
+
+    char ok[BUFFER_SIZE];
+    snprintf(ok, sizeof(ok),
+             "SIP/2.0 200 OK\r\n"
+             "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-dlg-%d\r\n"
+             "From: <sip:1002@example.com>\r\n"
+             "To: <sip:1001@example.com>;tag=aaa\r\n"
+             "Call-ID: dialog-001@example.com\r\n"
+             "CSeq: %d INVITE\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\na=recvonly", relayed_cseq, relayed_cseq);
+    mocks_reset();
+    mocks_deliver(&server, ok, "10.0.0.1", 5060);
+    const mock_message_t *response = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(response != NULL);
+    if (response != NULL) {
+        EXPECT_STRCONTAINS(response->payload, "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKhold\r\n");
+        EXPECT_STRCONTAINS(response->payload, "CSeq: 7 INVITE\r\nContact: <sip:TinySIP@");
+        EXPECT_STRCONTAINS(response->payload, "\r\n\r\na=recvonly");
+    }
+
+    // A's 200 OK is retransmitted until B's ACK comes, in case the first one was lost
+    mocks_reset();
+    mocks_deliver(&server, ok, "10.0.0.1", 5060);
+    EXPECT_EQ_INT((int)mocks_count(), 1);
+    response = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(response != NULL && strstr(response->payload, "branch=z9hG4bKhold\r\n") != NULL);
+
+    mocks_reset();
+    mocks_deliver(&server, "ACK sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKholdack\r\n"
+                           "From: <sip:1002@example.com>;tag=bbb\r\n"
+                           "To: <sip:1001@example.com>;tag=aaa\r\n"
+                           "Call-ID: b-legg-001@example.com\r\n"
+                           "CSeq: 7 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5070);
+    const mock_message_t *ack = mocks_find_payload_substr("ACK sip:1001@10.0.0.1:5060 SIP/2.0");
+    EXPECT_TRUE(ack != NULL && cseq_number(ack->payload) == relayed_cseq);
+
+    call_t *call = find_call_by_callid(&server.store->call_map, "dialog-001@example.com", &(int){0});
+    EXPECT_TRUE(call != NULL && call->call_state == CALL_STATE_CONNECTED);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// The server ACKs a refused re-INVITE itself, and a relayed UPDATE's 2xx refreshes the session
+static int test_failure_and_session_refresh(void) {
+    int failures = 0;
+    connect_call();
+    mocks_deliver(&server, "INVITE sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKcodec\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 3 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\nm=video 0 ", "10.0.0.1", 5060);
+    const mock_message_t *reinvite = mocks_find_payload_substr("INVITE sip:1002@");
+    int relayed_cseq = reinvite != NULL ? cseq_number(reinvite->payload) : 0;
+    EXPECT_TRUE(relayed_cseq > 0);
+
+    char refusal[BUFFER_SIZE];
+    snprintf(refusal, sizeof(refusal),
+             "SIP/2.0 488 Not Acceptable Here\r\n"
+             "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-dlg-%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>;tag=bbb\r\n"
+             "Call-ID: b-legg-001@example.com\r\n"
+             "CSeq: %d INVITE\r\n"
+             "Content-Length: 0\r\n\r\n", relayed_cseq, relayed_cseq);
+    mocks_reset();
+    mocks_deliver(&server, refusal, "10.0.0.2", 5070);
+    EXPECT_EQ_INT((int)mocks_count(), 2);
+    const mock_message_t *relayed = mocks_find_payload_substr("SIP/2.0 488 Not Acceptable Here");
+    EXPECT_TRUE(relayed != NULL && strstr(relayed->payload, "CSeq: 3 INVITE\r\n") != NULL);
+    const mock_message_t *ack = mocks_find_payload_substr("ACK sip:1002@");
+    EXPECT_TRUE(ack != NULL && cseq_number(ack->payload) == relayed_cseq);
+
+    mocks_reset();
+    mocks_deliver(&server, "UPDATE sip:TinySIP@" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKupd\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: dialog-001@example.com\r\n"
+                           "CSeq: 4 UPDATE\r\n"
+                           "Session-Expires: 900;refresher=uac\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\nm=audio 0 ", "10.0.0.1", 5060);
+    const mock_message_t *update = mocks_find_payload_substr("UPDATE sip:1002@");
+    EXPECT_TRUE(update != NULL && strstr(update->payload, "Session-Expires: 900;refresher=uac\r\n") != NULL);
+    relayed_cseq = update != NULL ? cseq_number(update->payload) : 0;
+
+    char ok[BUFFER_SIZE];
+    snprintf(ok, sizeof(ok),
+             "SIP/2.0 200 OK\r\n"
+             "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-dlg-%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>;tag=bbb\r\n"
+             "Call-ID: b-legg-001@example.com\r\n"
+             "CSeq: %d UPDATE\r\n"
+             "Require: timer\r\n"
+             "Session-Expires: 900;refresher=uac\r\n"
+             "Content-Length: 0\r\n\r\n", relayed_cseq, relayed_cseq);
+    mocks_deliver(&server, ok, "10.0.0.2", 5070);
+    call_t *call = find_call_by_callid(&server.store->call_map, "dialog-001@example.com", &(int){0});
+    EXPECT_TRUE(call != NULL);
+    if (call != NULL) {
+        EXPECT_EQ_INT(call->session_expires, 900);
+        EXPECT_TRUE(call->a_leg_refreshes && !call->b_leg_refreshes);
+    }
+
+    // The session now runs 900 s from the refresh, less 32 s
+    mocks_reset();
+    mocks_advance(&server, 800 * 1000);
+    EXPECT_TRUE(mocks_find_payload_substr("BYE sip:") == NULL);
+    mocks_advance(&server, 100 * 1000);
+    EXPECT_TRUE(mocks_find_payload_substr("BYE sip:") != NULL);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"info_is_relayed", test_info_is_relayed},
+        {"reinvite_is_relayed", test_reinvite_is_relayed},
+        {"failure_and_session_refresh", test_failure_and_session_refresh},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
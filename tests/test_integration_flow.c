@@ -5,9 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
-#define UNIT_TESTING 1
-#define send_sip_message mock_send_sip_message
-#include "../sip_server.c"
+#include "../sip_server.h"
+
+static sip_server_t server;
 
 static void build_message(sip_message_t *msg, const char *payload, const char *ip, int port) {
     memset(msg, 0, sizeof(*msg));
@@ -22,7 +22,7 @@ static void build_message(sip_message_t *msg, const char *payload, const char *i
 static int active_call_count(void) {
     int count = 0;
     for (int i = 0; i < MAX_CALLS; ++i) {
-        if (call_map.calls[i].is_active) {
+        if (server.store->call_map.calls[i].is_active) {
             count++;
         }
     }
@@ -32,7 +32,7 @@ static int active_call_count(void) {
 static int test_full_call_flow(void) {
     int failures = 0;
     mocks_reset();
-    init_call_map();
+    mocks_server_init(&server);
 
     const char *call_id_a = "flow-001@example.com";
     sip_message_t invite_a;
@@ -54,13 +54,13 @@ static int test_full_call_flow(void) {
         "m=audio 4000 RTP/AVP 0\r\n"
         "a=rtpmap:0 PCMU/8000\r\n";
     build_message(&invite_a, invite_payload, "10.0.0.1", 5060);
-    handle_state_machine(NULL, REQUEST_METHOD, "INVITE", true, &invite_a, invite_a.buffer, A_LEG);
+    handle_state_machine(&server, NULL, REQUEST_METHOD, "INVITE", true, &invite_a, invite_a.buffer, A_LEG);
 
     int leg = 0;
-    call_t *call = find_call_by_callid(&call_map, call_id_a, &leg);
+    call_t *call = find_call_by_callid(&server.store->call_map, call_id_a, &leg);
     EXPECT_TRUE(call != NULL);
     if (call == NULL) {
-        destroy_call_map();
+        sip_server_destroy(&server);
         return failures;
     }
 
@@ -79,8 +79,8 @@ static int test_full_call_flow(void) {
              call_id_b);
     build_message(&ringing_b, ringing_payload, "10.0.0.2", 5070);
     leg = 0;
-    call = find_call_by_callid(&call_map, call_id_b, &leg);
-    handle_state_machine(call, STATUS_CODE, "180", false, &ringing_b, ringing_b.buffer, leg);
+    call = find_call_by_callid(&server.store->call_map, call_id_b, &leg);
+    handle_state_machine(&server, call, STATUS_CODE, "180", false, &ringing_b, ringing_b.buffer, leg);
 
     sip_message_t ok_b;
     char ok_payload[1024];
@@ -104,8 +104,8 @@ static int test_full_call_flow(void) {
              call_id_b);
     build_message(&ok_b, ok_payload, "10.0.0.2", 5070);
     leg = 0;
-    call = find_call_by_callid(&call_map, call_id_b, &leg);
-    handle_state_machine(call, STATUS_CODE, "200", true, &ok_b, ok_b.buffer, leg);
+    call = find_call_by_callid(&server.store->call_map, call_id_b, &leg);
+    handle_state_machine(&server, call, STATUS_CODE, "200", true, &ok_b, ok_b.buffer, leg);
 
     sip_message_t ack_a;
     const char *ack_payload =
@@ -118,8 +118,8 @@ static int test_full_call_flow(void) {
         "Content-Length: 0\r\n\r\n";
     build_message(&ack_a, ack_payload, "10.0.0.1", 5060);
     leg = 0;
-    call = find_call_by_callid(&call_map, call_id_a, &leg);
-    handle_state_machine(call, REQUEST_METHOD, "ACK", false, &ack_a, ack_a.buffer, leg);
+    call = find_call_by_callid(&server.store->call_map, call_id_a, &leg);
+    handle_state_machine(&server, call, REQUEST_METHOD, "ACK", false, &ack_a, ack_a.buffer, leg);
 
     sip_message_t bye_a;
     const char *bye_payload =
@@ -132,8 +132,8 @@ static int test_full_call_flow(void) {
         "Content-Length: 0\r\n\r\n";
     build_message(&bye_a, bye_payload, "10.0.0.1", 5060);
     leg = 0;
-    call = find_call_by_callid(&call_map, call_id_a, &leg);
-    handle_state_machine(call, REQUEST_METHOD, "BYE", false, &bye_a, bye_a.buffer, leg);
+    call = find_call_by_callid(&server.store->call_map, call_id_a, &leg);
+    handle_state_machine(&server, call, REQUEST_METHOD, "BYE", false, &bye_a, bye_a.buffer, leg);
 
     sip_message_t ok_bye;
     char ok_bye_payload[512];
@@ -148,8 +148,8 @@ static int test_full_call_flow(void) {
              call_id_b);
     build_message(&ok_bye, ok_bye_payload, "10.0.0.2", 5070);
     leg = 0;
-    call = find_call_by_callid(&call_map, call_id_b, &leg);
-    handle_state_machine(call, STATUS_CODE, "200", false, &ok_bye, ok_bye.buffer, leg);
+    call = find_call_by_callid(&server.store->call_map, call_id_b, &leg);
+    handle_state_machine(&server, call, STATUS_CODE, "200", false, &ok_bye, ok_bye.buffer, leg);
 
     EXPECT_EQ_INT(active_call_count(), 0);
 
@@ -183,7 +183,7 @@ static int test_full_call_flow(void) {
         EXPECT_STRCONTAINS(ok_a->payload, call_id_a);
     }
 
-    destroy_call_map();
+    sip_server_destroy(&server);
     return failures;
 }
 
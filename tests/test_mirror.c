@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include "test_common.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../mirror.h"
+
+static mirror_t mirror;
+
+static void make_message(sip_message_t *message, const char *call_id) {
+    memset(message, 0, sizeof(*message));
+    snprintf(message->buffer, sizeof(message->buffer),
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bKmir\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Content-Length: 0\r\n\r\n", call_id);
+}
+
+// A UDP socket on the loopback standing in for the shadow server
+static int open_shadow(int *port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    *port = ntohs(addr.sin_port);
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 200 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static int test_configure_mirror(void) {
+    int failures = 0;
+    mirror_init(&mirror);
+    EXPECT_EQ_INT(mirror.socket, -1);
+
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9"), -1);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9:0"), -1);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "shadow:5060"), -1);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9:5060,sample=0"), -1);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9:5060,rate=5"), -1);
+    EXPECT_EQ_INT(mirror.socket, -1);
+
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9:5060"), 0);
+    EXPECT_TRUE(mirror.socket >= 0);
+    EXPECT_EQ_INT(mirror.sample, MIRROR_SAMPLE);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "10.0.0.9:5080,sample=100"), 0);
+    EXPECT_EQ_INT(mirror.shadow_port, 5080);
+    EXPECT_EQ_INT(mirror.sample, 100);
+    mirror_close(&mirror);
+    EXPECT_EQ_INT(mirror.socket, -1);
+    return failures;
+}
+
+// Both legs of a dialog are mirrored or neither is
+static int test_dialogs_are_sampled_whole(void) {
+    int failures = 0;
+    mirror_init(&mirror);
+    EXPECT_EQ_INT(mirror_configure(&mirror, "127.0.0.1:9,sample=4"), 0);
+
+    sip_message_t a_leg, b_leg;
+    char call_id[64];
+    int sampled = 0;
+    for (int i = 0; i < 400; i++) {
+        snprintf(call_id, sizeof(call_id), "dlg%d-%d@example.com", i, i * 7);
+        make_message(&a_leg, call_id);
+        memcpy(call_id, "b-leg", 5);
+        make_message(&b_leg, call_id);
+        bool mirrored = mirror_datagram(&mirror, &a_leg, 0);
+        EXPECT_EQ_INT(mirror_datagram(&mirror, &b_leg, 0), mirrored);
+        sampled += mirrored;
+    }
+    EXPECT_TRUE(sampled > 50 && sampled < 150);
+    mirror_close(&mirror);
+    return failures;
+}
+
+// Copies wait for a batch, go out after MIRROR_FLUSH_MS, and the shadow's answers are dropped
+static int test_copies_are_batched(void) {
+    int failures = 0;
+    int port;
+    int shadow = open_shadow(&port);
+    char spec[64];
+    snprintf(spec, sizeof(spec), "127.0.0.1:%d,sample=1", port);
+    mirror_init(&mirror);
+    EXPECT_EQ_INT(mirror_configure(&mirror, spec), 0);
+
+    sip_message_t message;
+    make_message(&message, "batch-1@example.com");
+    EXPECT_TRUE(mirror_datagram(&mirror, &message, 1000));
+    make_message(&message, "batch-2@example.com");
+    EXPECT_TRUE(mirror_datagram(&mirror, &message, 1005));
+    mirror_poll(&mirror, 1000 + MIRROR_FLUSH_MS - 1);
+    EXPECT_EQ_INT(mirror.queued, 2);
+    EXPECT_EQ_INT(mirror.mirrored, 0);
+    mirror_poll(&mirror, 1000 + MIRROR_FLUSH_MS);
+    EXPECT_EQ_INT(mirror.queued, 0);
+    EXPECT_EQ_INT(mirror.mirrored, 2);
+
+    char received[BUFFER_SIZE + 1];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(shadow, received, BUFFER_SIZE, 0, (struct sockaddr *)&from, &from_len);
+    EXPECT_TRUE(n > 0);
+    received[n > 0 ? n : 0] = '\0';
+    EXPECT_STRCONTAINS(received, "Call-ID: batch-1@example.com");
+    n = recv(shadow, received, BUFFER_SIZE, 0);
+    EXPECT_TRUE(n > 0);
+    received[n > 0 ? n : 0] = '\0';
+    EXPECT_STRCONTAINS(received, "Call-ID: batch-2@example.com");
+
+    // A full batch goes out at once
+    for (int i = 0; i < MIRROR_BATCH_SIZE; i++) {
+        mirror_datagram(&mirror, &message, 2000);
+    }
+    EXPECT_EQ_INT(mirror.queued, 0);
+    EXPECT_EQ_INT(mirror.mirrored, 2 + MIRROR_BATCH_SIZE);
+
+    // What the shadow answers reaches the mirror's own socket only
+    const char response[] = "SIP/2.0 100 Trying\r\n\r\n";
+    sendto(shadow, response, sizeof(response) - 1, 0, (struct sockaddr *)&from, from_len);
+    usleep(20 * 1000);
+    mirror_poll(&mirror, 3000);
+    EXPECT_EQ_INT(mirror.discarded, 1);
+
+    mirror_close(&mirror);
+    close(shadow);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"configure_mirror", test_configure_mirror},
+        {"dialogs_are_sampled_whole", test_dialogs_are_sampled_whole},
+        {"copies_are_batched", test_copies_are_batched},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -4,9 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 
-#define UNIT_TESTING 1
-#define send_sip_message mock_send_sip_message
-#include "../sip_server.c"
+#include "../sip_server.h"
 
 static int test_parse_valid_invite(void) {
     int failures = 0;
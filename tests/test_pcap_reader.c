@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include "test_common.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../pcap_reader.h"
+
+static const char *sip_payload =
+    "REGISTER sip:example.com SIP/2.0\r\n"
+    "Call-ID: pcap-001@example.com\r\n"
+    "CSeq: 1 REGISTER\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+/**
+ * @brief Builds an IPv4 packet from 10.0.0.1:5062 to 10.0.0.2:5060.
+ * @return The packet length.
+ */
+static size_t build_ipv4(uint8_t *p, uint8_t protocol, uint16_t fragment, const char *payload) {
+    size_t payload_len = strlen(payload);
+    size_t total = 20 + 8 + payload_len;
+    memset(p, 0, 28);
+    p[0] = 0x45;
+    p[2] = (uint8_t)(total >> 8);
+    p[3] = (uint8_t)total;
+    p[6] = (uint8_t)(fragment >> 8);
+    p[7] = (uint8_t)fragment;
+    p[8] = 64;
+    p[9] = protocol;
+    uint8_t src[4] = {10, 0, 0, 1};
+    uint8_t dst[4] = {10, 0, 0, 2};
+    memcpy(p + 12, src, 4);
+    memcpy(p + 16, dst, 4);
+    uint16_t sport = htons(5062);
+    uint16_t dport = htons(5060);
+    uint16_t udp_len = htons((uint16_t)(8 + payload_len));
+    memcpy(p + 20, &sport, 2);
+    memcpy(p + 22, &dport, 2);
+    memcpy(p + 24, &udp_len, 2);
+    memcpy(p + 28, payload, payload_len);
+    return total;
+}
+
+static void write32(FILE *f, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void write16(FILE *f, uint16_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void write_pcap_record(FILE *f, uint32_t sec, uint32_t usec, const uint8_t *frame, size_t len) {
+    write32(f, sec);
+    write32(f, usec);
+    write32(f, (uint32_t)len);
+    write32(f, (uint32_t)len);
+    fwrite(frame, 1, len, f);
+}
+
+static int test_classic_pcap_ethernet(void) {
+    int failures = 0;
+    char path[] = "/tmp/test_pcap_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fdopen(fd, "wb");
+
+    write32(f, 0xa1b2c3d4);
+    write16(f, 2);
+    write16(f, 4);
+    write32(f, 0);
+    write32(f, 0);
+    write32(f, 65535);
+    write32(f, 1);              // Ethernet
+
+    uint8_t frame[1600] = {0};
+    frame[12] = 0x08;           // IPv4 ethertype
+    frame[13] = 0x00;
+    size_t len = 14 + build_ipv4(frame + 14, 6, 0, sip_payload);
+    write_pcap_record(f, 100, 1, frame, len);           // TCP, skipped
+    len = 14 + build_ipv4(frame + 14, 17, 0x2000, sip_payload);
+    write_pcap_record(f, 100, 2, frame, len);           // First fragment, skipped
+    len = 14 + build_ipv4(frame + 14, 17, 0, sip_payload);
+    write_pcap_record(f, 100, 500000, frame, len);
+    fclose(f);
+
+    pcap_reader_t *reader = malloc(sizeof(pcap_reader_t));
+    pcap_datagram_t datagram;
+    EXPECT_EQ_INT(pcap_reader_open(reader, path), 0);
+    EXPECT_EQ_INT(pcap_reader_next(reader, &datagram), 1);
+    EXPECT_EQ_INT(datagram.len, strlen(sip_payload));
+    EXPECT_TRUE(memcmp(datagram.payload, sip_payload, datagram.len) == 0);
+    EXPECT_EQ_INT(ntohs(datagram.src.sin_port), 5062);
+    EXPECT_EQ_INT(ntohs(datagram.dst.sin_port), 5060);
+    EXPECT_EQ_INT(ntohl(datagram.dst.sin_addr.s_addr), 0x0a000002);
+    EXPECT_EQ_INT(datagram.ts_ns, 100500000000ULL);
+    EXPECT_EQ_INT(pcap_reader_next(reader, &datagram), 0);
+    EXPECT_EQ_INT(reader->skipped, 2);
+    pcap_reader_close(reader);
+    free(reader);
+
+    unlink(path);
+    return failures;
+}
+
+static int test_pcapng_raw_ipv4(void) {
+    int failures = 0;
+    char path[] = "/tmp/test_pcapng_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fdopen(fd, "wb");
+
+    // Section header block
+    write32(f, 0x0a0d0d0a);
+    write32(f, 28);
+    write32(f, 0x1a2b3c4d);
+    write16(f, 1);
+    write16(f, 0);
+    write32(f, 0xffffffff);
+    write32(f, 0xffffffff);
+    write32(f, 28);
+
+    // Interface description block, raw IPv4 with nanosecond timestamps (if_tsresol = 9)
+    write32(f, 1);
+    write32(f, 32);
+    write16(f, 101);
+    write16(f, 0);
+    write32(f, 65535);
+    write16(f, 9);
+    write16(f, 1);
+    uint8_t tsresol[4] = {9, 0, 0, 0};
+    fwrite(tsresol, 1, 4, f);
+    write16(f, 0);
+    write16(f, 0);
+    write32(f, 32);
+
+    // A custom block that must be skipped
+    write32(f, 0x00000bad);
+    write32(f, 16);
+    write32(f, 0);
+    write32(f, 16);
+
+    // Enhanced packet block
+    uint8_t packet[1600] = {0};
+    size_t len = build_ipv4(packet, 17, 0, sip_payload);
+    size_t padded = (len + 3) & ~(size_t)3;
+    uint64_t ts = 2000000000123ULL;
+    write32(f, 6);
+    write32(f, (uint32_t)(32 + padded));
+    write32(f, 0);
+    write32(f, (uint32_t)(ts >> 32));
+    write32(f, (uint32_t)ts);
+    write32(f, (uint32_t)len);
+    write32(f, (uint32_t)len);
+    fwrite(packet, 1, padded, f);
+    write32(f, (uint32_t)(32 + padded));
+    fclose(f);
+
+    pcap_reader_t *reader = malloc(sizeof(pcap_reader_t));
+    pcap_datagram_t datagram;
+    EXPECT_EQ_INT(pcap_reader_open(reader, path), 0);
+    EXPECT_EQ_INT(pcap_reader_next(reader, &datagram), 1);
+    EXPECT_EQ_INT(datagram.len, strlen(sip_payload));
+    EXPECT_TRUE(memcmp(datagram.payload, sip_payload, datagram.len) == 0);
+    EXPECT_EQ_INT(ntohl(datagram.src.sin_addr.s_addr), 0x0a000001);
+    EXPECT_EQ_INT(datagram.ts_ns, ts);
+    EXPECT_EQ_INT(pcap_reader_next(reader, &datagram), 0);
+    pcap_reader_close(reader);
+    free(reader);
+
+    unlink(path);
+    return failures;
+}
+
+static int test_rejects_other_files(void) {
+    int failures = 0;
+    char path[] = "/tmp/test_notpcap_XXXXXX";
+    int fd = mkstemp(path);
+    const char *text = "not a capture file at all, just some text\n";
+    EXPECT_TRUE(write(fd, text, strlen(text)) > 0);
+    close(fd);
+
+    pcap_reader_t *reader = malloc(sizeof(pcap_reader_t));
+    EXPECT_EQ_INT(pcap_reader_open(reader, path), -1);
+    free(reader);
+
+    unlink(path);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"classic_pcap_ethernet", test_classic_pcap_ethernet},
+        {"pcapng_raw_ipv4", test_pcapng_raw_ipv4},
+        {"rejects_other_files", test_rejects_other_files},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
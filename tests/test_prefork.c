@@ -0,0 +1,185 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+#include "../prefork.h"
+#include "../shared_mem.h"
+
+static void build_message(sip_message_t *msg, const char *payload, const char *ip, int port) {
+    memset(msg, 0, sizeof(*msg));
+    strncpy(msg->buffer, payload, BUFFER_SIZE);
+    msg->buffer[BUFFER_SIZE] = '\0';
+    msg->client_addr.sin_family = AF_INET;
+    msg->client_addr_len = sizeof(msg->client_addr);
+    inet_pton(AF_INET, ip, &msg->client_addr.sin_addr);
+    msg->client_addr.sin_port = htons(port);
+}
+
+static const char *invite_payload =
+    "INVITE sip:1002@example.com SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKpf1\r\n"
+    "From: <sip:1001@example.com>;tag=aaa\r\n"
+    "To: <sip:1002@example.com>\r\n"
+    "Call-ID: prefork-001@example.com\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 10\r\n\r\n0123456789";
+
+static int test_ring_preserves_order(void) {
+    int failures = 0;
+    shm_ring_t *ring = shm_segment_create(sizeof(shm_ring_t));
+    EXPECT_TRUE(ring != NULL);
+    if (ring == NULL) {
+        return failures;
+    }
+    shm_ring_init(ring);
+
+    sip_message_t in;
+    sip_message_t out;
+    for (int i = 0; i < PREFORK_RING_CAPACITY; i++) {
+        memset(&in, 0, sizeof(in));
+        snprintf(in.buffer, BUFFER_SIZE, "message %d", i);
+        EXPECT_EQ_INT(shm_ring_push(ring, &in), 1);
+    }
+    EXPECT_EQ_INT(shm_ring_push(ring, &in), 0);
+
+    EXPECT_EQ_INT(shm_ring_pop(ring, &out), 1);
+    EXPECT_TRUE(strcmp(out.buffer, "message 0") == 0);
+    EXPECT_EQ_INT(shm_ring_pop(ring, &out), 1);
+    EXPECT_TRUE(strcmp(out.buffer, "message 1") == 0);
+
+    shm_segment_destroy(ring, sizeof(shm_ring_t));
+    return failures;
+}
+
+// A priority message overtakes the backlog, and still gets in when the regular slots are full
+static int test_priority_messages_overtake_backlog(void) {
+    int failures = 0;
+    shm_ring_t *ring = shm_segment_create(sizeof(shm_ring_t));
+    EXPECT_TRUE(ring != NULL);
+    if (ring == NULL) {
+        return failures;
+    }
+    shm_ring_init(ring);
+
+    sip_message_t in;
+    sip_message_t out;
+    for (int i = 0; i < PREFORK_RING_CAPACITY; i++) {
+        build_message(&in, "OPTIONS sip:1002@example.com SIP/2.0\r\n\r\n", "10.0.0.1", 5060);
+        EXPECT_EQ_INT(shm_ring_push(ring, &in), 1);
+    }
+    build_message(&in, "INVITE sip:112@example.com SIP/2.0\r\n\r\n", "10.0.0.1", 5060);
+    in.priority = true;
+    EXPECT_EQ_INT(shm_ring_push(ring, &in), 1);
+    EXPECT_EQ_INT(shm_ring_pop(ring, &out), 1);
+    EXPECT_TRUE(out.priority && strncmp(out.buffer, "INVITE sip:112@", 15) == 0);
+    EXPECT_EQ_INT(shm_ring_pop(ring, &out), 1);
+    EXPECT_TRUE(!out.priority);
+    shm_segment_destroy(ring, sizeof(shm_ring_t));
+
+    // The worker threads' queues do the same
+    message_queue_t queue;
+    initialize_message_queue(&queue, 2);
+    sip_message_t *messages[3];
+    for (int i = 0; i < 3; i++) {
+        messages[i] = calloc(1, sizeof(sip_message_t));
+        messages[i]->priority = i == 2;
+    }
+    EXPECT_EQ_INT(enqueue_message(&queue, messages[0]), 1);
+    EXPECT_EQ_INT(enqueue_message(&queue, messages[1]), 1);
+    EXPECT_EQ_INT(enqueue_message(&queue, messages[2]), 1);
+    sip_message_t *dequeued = NULL;
+    EXPECT_EQ_INT(dequeue_message(&queue, &dequeued), 1);
+    EXPECT_TRUE(dequeued == messages[2]);
+    free(dequeued);
+    EXPECT_EQ_INT(dequeue_message(&queue, &dequeued), 1);
+    EXPECT_TRUE(dequeued == messages[0]);
+    free(dequeued);
+    destroy_message_queue(&queue);
+    return failures;
+}
+
+static int test_both_legs_map_to_same_worker(void) {
+    int failures = 0;
+    sip_message_t a_leg;
+    sip_message_t b_leg;
+    build_message(&a_leg, "SIP/2.0 200 OK\r\nCall-ID: 12345-abcdef@example.com\r\n\r\n", "10.0.0.1", 5060);
+    build_message(&b_leg, "BYE sip:1001@10.0.0.1 SIP/2.0\r\nCall-ID: b-leg-abcdef@example.com\r\n\r\n", "10.0.0.2", 5070);
+
+    for (int workers = 1; workers <= MAX_THREADS; workers++) {
+        int index = message_worker_index(&a_leg, workers);
+        EXPECT_TRUE(index >= 0 && index < workers);
+        EXPECT_EQ_INT(index, message_worker_index(&b_leg, workers));
+    }
+
+    return failures;
+}
+
+static int test_worker_process_updates_shared_call_table(void) {
+    int failures = 0;
+    mocks_server_init(&server);
+    prefork_segment_t *segment = shm_segment_create(sizeof(prefork_segment_t));
+    EXPECT_TRUE(segment != NULL);
+    if (segment == NULL) {
+        return failures;
+    }
+    sip_store_init(&segment->store, true);
+    server.store = &segment->store;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sip_message_t invite;
+        build_message(&invite, invite_payload, "10.0.0.1", 5060);
+        process_sip_message(&server, &invite);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    int leg = 0;
+    call_t *call = find_call_by_callid(&server.store->call_map, "prefork-001@example.com", &leg);
+    EXPECT_TRUE(call != NULL);
+    if (call != NULL) {
+        EXPECT_EQ_INT(leg, A_LEG);
+        EXPECT_EQ_INT(call->call_state, CALL_STATE_ROUTING);
+    }
+
+    // A worker dying while it holds the call table lock must not stall the others
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        shm_mutex_lock(&server.store->call_map.mutex);
+        _exit(1);
+    }
+    waitpid(pid, &status, 0);
+    call = find_call_by_callid(&server.store->call_map, "prefork-001@example.com", &leg);
+    EXPECT_TRUE(call != NULL);
+
+    server.store = &server.local_store;
+    shm_segment_destroy(segment, sizeof(prefork_segment_t));
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"ring_preserves_order", test_ring_preserves_order},
+        {"priority_messages_overtake_backlog", test_priority_messages_overtake_backlog},
+        {"both_legs_map_to_same_worker", test_both_legs_map_to_same_worker},
+        {"worker_process_updates_shared_call_table", test_worker_process_updates_shared_call_table},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -5,9 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
-#define UNIT_TESTING 1
-#define send_sip_message mock_send_sip_message
-#include "../sip_server.c"
+#include "../sip_server.h"
+
+static sip_server_t server;
 
 static void build_register_message(sip_message_t *msg, const char *username,
                                    const char *contact_uri, const char *ip, int port,
@@ -38,7 +38,7 @@ static int test_register_existing_user(void) {
     mocks_reset();
 
     const char *user = "1001";
-    location_entry_t *entry = find_location_entry_by_userid(user);
+    location_entry_t *entry = find_location_entry_by_userid(&server, user);
     EXPECT_TRUE(entry != NULL);
     if (entry == NULL) {
         return failures;
@@ -52,7 +52,7 @@ static int test_register_existing_user(void) {
     sip_message_t reg;
     build_register_message(&reg, user, "sip:1001@10.0.0.5:5062", "10.0.0.5", 5062, "reg-001@example.com");
 
-    handle_register(&reg);
+    handle_register(&server, &reg);
 
     EXPECT_TRUE(entry->registered);
     EXPECT_TRUE(strcmp(entry->ip_str, "10.0.0.5") == 0);
@@ -79,7 +79,7 @@ static int test_register_unknown_user(void) {
     sip_message_t reg;
     build_register_message(&reg, "9999", "sip:9999@10.0.0.9:5090", "10.0.0.9", 5090, "reg-404@example.com");
 
-    handle_register(&reg);
+    handle_register(&server, &reg);
 
     const mock_message_t *resp = mocks_find_payload_substr("SIP/2.0 404 Not Found");
     EXPECT_TRUE(resp != NULL);
@@ -90,12 +90,217 @@ static int test_register_unknown_user(void) {
     return failures;
 }
 
+// Adds an Expires header to a REGISTER built by build_register_message()
+static void set_expires_header(sip_message_t *msg, int expires) {
+    char *tail = strstr(msg->buffer, "Content-Length: ");
+    char rest[64];
+    snprintf(rest, sizeof(rest), "%s", tail);
+    snprintf(tail, BUFFER_SIZE - (size_t)(tail - msg->buffer), "Expires: %d\r\n%s", expires, rest);
+}
+
+static int test_expiry_governance_and_cached_refresh(void) {
+    int failures = 0;
+    static sip_server_t reg_server;
+    mocks_server_init(&reg_server);
+    mocks_reset();
+    location_entry_t *entry = find_location_entry_by_userid(&reg_server, "1004");
+
+    sip_message_t reg;
+    build_register_message(&reg, "1004", "sip:1004@10.0.0.7:5060", "10.0.0.7", 5060, "reg-gov@example.com");
+    set_expires_header(&reg, REGISTRATION_MIN_EXPIRES - 1);
+    handle_register(&reg_server, &reg);
+    const mock_message_t *resp = mocks_find_payload_substr("SIP/2.0 423 Interval Too Brief");
+    EXPECT_TRUE(resp != NULL);
+    if (resp != NULL) {
+        char min_expires[32];
+        snprintf(min_expires, sizeof(min_expires), "Min-Expires: %d", REGISTRATION_MIN_EXPIRES);
+        EXPECT_STRCONTAINS(resp->payload, min_expires);
+    }
+    EXPECT_TRUE(!entry->registered);
+
+    // Too long a request is cut down
+    mocks_reset();
+    build_register_message(&reg, "1004", "sip:1004@10.0.0.7:5060", "10.0.0.7", 5060, "reg-gov@example.com");
+    set_expires_header(&reg, 100000);
+    handle_register(&reg_server, &reg);
+    EXPECT_TRUE(entry->registered);
+    char granted[96];
+    snprintf(granted, sizeof(granted), "Contact: <sip:1004@10.0.0.7:5060>;expires=%d\r\n", REGISTRATION_MAX_EXPIRES);
+    EXPECT_TRUE(mocks_find_payload_substr(granted) != NULL);
+
+    mocks_reset();
+    build_register_message(&reg, "1004", "sip:1004@10.0.0.7:5060", "10.0.0.7", 5060, "reg-gov@example.com");
+    set_expires_header(&reg, 600);
+    handle_register(&reg_server, &reg);
+    EXPECT_TRUE(mocks_find_payload_substr("Contact: <sip:1004@10.0.0.7:5060>;expires=600\r\n") != NULL);
+    EXPECT_EQ_INT(atomic_load(&reg_server.store->registration_cache_hits), 0);
+
+    // The same refresh again, with a new branch and CSeq, is answered from the cache
+    mocks_reset();
+    memcpy(strstr(reg.buffer, "CSeq: 2"), "CSeq: 3", strlen("CSeq: 3"));
+    memcpy(strstr(reg.buffer, "branch=z9hG4bKreg"), "branch=z9hG4bKrf2", strlen("branch=z9hG4bKrf2"));
+    handle_register(&reg_server, &reg);
+    EXPECT_EQ_INT(atomic_load(&reg_server.store->registration_cache_hits), 1);
+    resp = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(resp != NULL);
+    if (resp != NULL) {
+        EXPECT_STRCONTAINS(resp->payload, "branch=z9hG4bKrf2");
+        EXPECT_STRCONTAINS(resp->payload, "To: <sip:1004@example.com>\r\nCall-ID: reg-gov@example.com\r\nCSeq: 3 REGISTER\r\n");
+        EXPECT_STRCONTAINS(resp->payload, "Contact: <sip:1004@10.0.0.7:5060>;expires=600\r\n");
+    }
+
+    // A new source address takes the full path again
+    mocks_reset();
+    build_register_message(&reg, "1004", "sip:1004@10.0.0.8:5060", "10.0.0.8", 5060, "reg-gov@example.com");
+    set_expires_header(&reg, 600);
+    handle_register(&reg_server, &reg);
+    EXPECT_EQ_INT(atomic_load(&reg_server.store->registration_cache_hits), 1);
+    EXPECT_TRUE(strcmp(entry->ip_str, "10.0.0.8") == 0);
+
+    // Expires 0 removes the binding
+    mocks_reset();
+    build_register_message(&reg, "1004", "sip:1004@10.0.0.8:5060", "10.0.0.8", 5060, "reg-gov@example.com");
+    set_expires_header(&reg, 0);
+    handle_register(&reg_server, &reg);
+    EXPECT_TRUE(!entry->registered);
+    EXPECT_TRUE(mocks_find_payload_substr(";expires=0\r\n") != NULL);
+    sip_memory_stats_t stats;
+    sip_server_memory_stats(&reg_server, SIP_MEMORY_REGISTRAR, &stats);
+    EXPECT_EQ_INT(stats.objects, 0);
+
+    sip_server_destroy(&reg_server);
+    return failures;
+}
+
+static size_t count_keepalives(void) {
+    size_t found = 0;
+    for (size_t i = 0; i < mocks_count(); i++) {
+        if (strcmp(mocks_get(i)->payload, "\r\n\r\n") == 0) {
+            found++;
+        }
+    }
+    return found;
+}
+
+static int test_nated_bindings_are_kept_alive(void) {
+    int failures = 0;
+    static sip_server_t nat_server;
+    mocks_setup(&nat_server);
+
+    // 1002 registers through a NAT (its Contact is a private address), 1003 doesn't
+    sip_message_t reg;
+    build_register_message(&reg, "1002", "sip:1002@192.168.1.20:5060", "203.0.113.7", 40123, "reg-nat@example.com");
+    handle_register(&nat_server, &reg);
+    build_register_message(&reg, "1003", "sip:1003@10.0.0.6:5060", "10.0.0.6", 5060, "reg-public@example.com");
+    handle_register(&nat_server, &reg);
+    EXPECT_TRUE(find_location_entry_by_userid(&nat_server, "1002")->nated);
+    EXPECT_TRUE(!find_location_entry_by_userid(&nat_server, "1003")->nated);
+    mocks_reset();
+
+    // Once per interval, to the address the REGISTER came from
+    for (int tick = 0; tick < 2 * KEEPALIVE_SLOTS; tick++) {
+        mocks_advance(&nat_server, KEEPALIVE_INTERVAL_MS / KEEPALIVE_SLOTS + SIP_TIMER_TICK_MS);
+    }
+    EXPECT_EQ_INT(count_keepalives(), 2);
+    const mock_message_t *keepalive = mocks_get(0);
+    EXPECT_TRUE(keepalive != NULL);
+    if (keepalive != NULL) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)&keepalive->addr;
+        EXPECT_EQ_INT(ntohs(addr->sin_port), 40123);
+    }
+    EXPECT_EQ_INT(atomic_load(&nat_server.store->keepalives), 2);
+
+    sip_server_destroy(&nat_server);
+    return failures;
+}
+
+// A REGISTER or INVITE for an unknown user is rejected by the Bloom filter, or after one full
+// lookup by the negative cache, without touching the call table
+static int test_unknown_users_are_rejected_early(void) {
+    int failures = 0;
+    user_filter_t *filter = &server.store->user_filter;
+    location_entry_t *entry = &server.store->location_entries[7];
+    unsigned long bloom_rejects, negative_hits;
+    sip_message_t msg;
+
+    mocks_reset();
+    build_register_message(&msg, "9999", "sip:9999@10.0.0.9:5090", "10.0.0.9", 5090, "scan-1@example.com");
+    process_sip_message(&server, &msg);
+    const mock_message_t *resp = mocks_find_payload_substr("SIP/2.0 404 Not Found");
+    EXPECT_TRUE(resp != NULL);
+    if (resp != NULL) {
+        EXPECT_STRCONTAINS(resp->payload, "Via: SIP/2.0/UDP 10.0.0.9:5090;rport;branch=z9hG4bKreg\r\n");
+        EXPECT_STRCONTAINS(resp->payload, "Call-ID: scan-1@example.com\r\nCSeq: 2 REGISTER\r\nContent-Length: 0\r\n\r\n");
+    }
+    user_filter_stats(filter, &bloom_rejects, &negative_hits);
+    EXPECT_EQ_INT((int)bloom_rejects, 1);
+
+    mocks_reset();
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.buffer, BUFFER_SIZE,
+             "INVITE sip:5555@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.9:5090;branch=z9hG4bKinv\r\n"
+             "From: <sip:1001@example.com>;tag=a\r\n"
+             "To: <sip:5555@example.com>\r\n"
+             "Call-ID: scan-2@example.com\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Content-Length: 0\r\n\r\n");
+    msg.client_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.9", &msg.client_addr.sin_addr);
+    msg.client_addr.sin_port = htons(5090);
+    process_sip_message(&server, &msg);
+    EXPECT_EQ_INT((int)mocks_count(), 1);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 404 Not Found") != NULL);
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    user_filter_stats(filter, &bloom_rejects, &negative_hits);
+    EXPECT_EQ_INT((int)bloom_rejects, 2);
+
+    // Renaming a user without rebuilding leaves its old name in the Bloom filter, like a false positive
+    char original[MAX_USERNAME_LENGTH];
+    strncpy(original, entry->username, sizeof(original));
+    strncpy(entry->username, "7777", sizeof(entry->username));
+    for (int i = 0; i < 2; i++) {
+        mocks_reset();
+        build_register_message(&msg, original, "sip:x@10.0.0.9:5090", "10.0.0.9", 5090, "scan-3@example.com");
+        process_sip_message(&server, &msg);
+        EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 404 Not Found") != NULL);
+    }
+    user_filter_stats(filter, &bloom_rejects, &negative_hits);
+    EXPECT_EQ_INT((int)bloom_rejects, 2);
+    EXPECT_EQ_INT((int)negative_hits, 1);
+
+    // The negative cache is per source
+    mocks_reset();
+    build_register_message(&msg, original, "sip:x@10.0.0.10:5090", "10.0.0.10", 5090, "scan-4@example.com");
+    process_sip_message(&server, &msg);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 404 Not Found") != NULL);
+    user_filter_stats(filter, &bloom_rejects, &negative_hits);
+    EXPECT_EQ_INT((int)negative_hits, 1);
+
+    // Provisioning the user again empties the negative cache
+    strncpy(entry->username, original, sizeof(entry->username));
+    sip_store_provisioning_changed(server.store);
+    mocks_reset();
+    build_register_message(&msg, original, "sip:1008@10.0.0.9:5090", "10.0.0.9", 5090, "scan-5@example.com");
+    process_sip_message(&server, &msg);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 200 OK") != NULL);
+    EXPECT_TRUE(entry->registered);
+    return failures;
+}
+
 int main(void) {
+    mocks_server_init(&server);
+
     const test_case_t cases[] = {
         {"register_existing_user", test_register_existing_user},
         {"register_unknown_user", test_register_unknown_user},
+        {"nated_bindings_are_kept_alive", test_nated_bindings_are_kept_alive},
+        {"expiry_governance_and_cached_refresh", test_expiry_governance_and_cached_refresh},
+        {"unknown_users_are_rejected_early", test_unknown_users_are_rejected_early},
     };
 
     test_stats_t stats;
-    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+    int result = run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+    sip_server_destroy(&server);
+    return result;
 }
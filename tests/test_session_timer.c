@@ -0,0 +1,157 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+
+static void send_invite(const char *session_expires) {
+    char invite[BUFFER_SIZE];
+    snprintf(invite, sizeof(invite),
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKse1\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: session-001@example.com\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "Supported: timer\r\n"
+             "%s"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\n0123456789", session_expires);
+    mocks_deliver(&server, invite, "10.0.0.1", 5060);
+}
+
+// Sets up a connected call whose session A refreshes every 600 s
+static void connect_call(void) {
+    send_invite("Session-Expires: 600\r\n");
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-legon-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n9876543210", "10.0.0.2", 5070);
+    mocks_deliver(&server, "ACK sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKse2\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: session-001@example.com\r\n"
+                           "CSeq: 1 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+}
+
+static call_t *find_call(void) {
+    int leg = 0;
+    return find_call_by_callid(&server.store->call_map, "session-001@example.com", &leg);
+}
+
+// An interval below our minimum is refused with the minimum, before a call is set up
+static int test_too_small_interval_is_refused(void) {
+    int failures = 0;
+    mocks_setup(&server);
+    send_invite("Session-Expires: 30\r\n");
+
+    const mock_message_t *refusal = mocks_find_payload_substr("SIP/2.0 422 Session Interval Too Small");
+    EXPECT_TRUE(refusal != NULL);
+    if (refusal != NULL) {
+        EXPECT_STRCONTAINS(refusal->payload, "Min-SE: 90\r\n");
+        EXPECT_STRCONTAINS(refusal->payload, "Call-ID: session-001@example.com");
+    }
+    EXPECT_TRUE(mocks_find_payload_substr("INVITE sip:") == NULL);
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// B is offered A's interval with us refreshing for it, A is made the refresher in the 200 OK
+static int test_interval_is_negotiated(void) {
+    int failures = 0;
+    mocks_setup(&server);
+    connect_call();
+
+    const mock_message_t *invite = mocks_find_payload_substr("INVITE sip:1002");
+    EXPECT_TRUE(invite != NULL);
+    if (invite != NULL) {
+        EXPECT_STRCONTAINS(invite->payload, "Supported: timer\r\n");
+        EXPECT_STRCONTAINS(invite->payload, "Session-Expires: 600;refresher=uas\r\n");
+        EXPECT_STRCONTAINS(invite->payload, "Min-SE: 90\r\n");
+    }
+    const mock_message_t *ok = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(ok != NULL);
+    if (ok != NULL) {
+        EXPECT_STRCONTAINS(ok->payload, "Require: timer\r\n");
+        EXPECT_STRCONTAINS(ok->payload, "Session-Expires: 600;refresher=uac\r\n");
+    }
+
+    call_t *call = find_call();
+    EXPECT_TRUE(call != NULL);
+    if (call != NULL) {
+        EXPECT_EQ_INT(call->call_state, CALL_STATE_CONNECTED);
+        EXPECT_EQ_INT(call->session_expires, 600);
+        EXPECT_TRUE(call->a_leg_refreshes);
+        EXPECT_TRUE(!call->b_leg_refreshes);
+    }
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// A refresh keeps the call, a missed one hangs it up on both legs
+static int test_missed_refresh_ends_call(void) {
+    int failures = 0;
+    mocks_setup(&server);
+    connect_call();
+
+    mocks_advance(&server, 400 * 1000);
+    mocks_reset();
+    mocks_deliver(&server, "UPDATE sip:" SIP_SERVER_IP_ADDRESS ":5060 SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKse3\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: session-001@example.com\r\n"
+                           "CSeq: 2 UPDATE\r\n"
+                           "Session-Expires: 600;refresher=uac\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    const mock_message_t *ok = mocks_find_payload_substr("SIP/2.0 200 OK");
+    EXPECT_TRUE(ok != NULL);
+    if (ok != NULL) {
+        EXPECT_STRCONTAINS(ok->payload, "CSeq: 2 UPDATE\r\n");
+        EXPECT_STRCONTAINS(ok->payload, "Session-Expires: 600;refresher=uac\r\n");
+    }
+
+    // The session now runs 600 s from the refresh, less a third or 32 s
+    mocks_reset();
+    mocks_advance(&server, 400 * 1000);
+    EXPECT_TRUE(mocks_find_payload_substr("BYE sip:") == NULL);
+    call_t *call = find_call();
+    EXPECT_TRUE(call != NULL && call->call_state == CALL_STATE_CONNECTED);
+
+    mocks_advance(&server, 200 * 1000);
+    EXPECT_EQ_INT((int)mocks_count(), 2);
+    const mock_message_t *bye_to_b = mocks_find_payload_substr("Call-ID: b-legon-001@example.com");
+    EXPECT_TRUE(bye_to_b != NULL && strncmp(bye_to_b->payload, "BYE sip:", 8) == 0);
+    call = find_call();
+    EXPECT_TRUE(call != NULL && call->call_state == CALL_DISCONNECTING);
+
+    // Nobody answers, the call is released all the same
+    mocks_advance(&server, CALL_TRANSACTION_TIMEOUT_MS + SIP_TIMER_TICK_MS);
+    EXPECT_TRUE(find_call() == NULL);
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"too_small_interval_is_refused", test_too_small_interval_is_refused},
+        {"interval_is_negotiated", test_interval_is_negotiated},
+        {"missed_refresh_ends_call", test_missed_refresh_ends_call},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
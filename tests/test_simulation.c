@@ -0,0 +1,195 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../sip_server.h"
+#include "../simulation.h"
+
+static sip_server_t server;
+static int test_unanswered_call_times_out(void) {
+    int failures = 0;
+    mocks_setup(&server);
+
+    mocks_deliver(&server, "INVITE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKsim1\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: timer-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n0123456789", "10.0.0.1", 5060);
+    mocks_deliver(&server, "SIP/2.0 180 Ringing\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-001@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5070);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+
+    // Nothing happens before Timer C
+    mocks_advance(&server, CALL_RINGING_TIMEOUT_MS - 1000);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+    EXPECT_TRUE(mocks_find_payload_substr("408 Request Timeout") == NULL);
+
+    mocks_advance(&server, 1000 + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 408 Request Timeout") != NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("CANCEL sip:1002@") != NULL);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_answered_call_has_no_timer(void) {
+    int failures = 0;
+    mocks_setup(&server);
+
+    mocks_deliver(&server, "INVITE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKsim2\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: timer-002@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-002@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5070);
+    mocks_deliver(&server, "ACK sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKsim3\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=ccc\r\n"
+                           "Call-ID: timer-002@example.com\r\n"
+                           "CSeq: 1 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+
+    // A connected call stays up however long it lasts
+    mocks_advance(&server, 10 * CALL_RINGING_TIMEOUT_MS);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+    EXPECT_EQ_INT(sip_timer_armed(&server.store->timers), 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_registration_expires(void) {
+    int failures = 0;
+    mocks_setup(&server);
+
+    mocks_deliver(&server, "REGISTER sip:example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.5:5062;rport;branch=z9hG4bKreg\r\n"
+                           "From: <sip:1003@example.com>;tag=tag1\r\n"
+                           "To: <sip:1003@example.com>\r\n"
+                           "Call-ID: timer-reg@example.com\r\n"
+                           "CSeq: 1 REGISTER\r\n"
+                           "Contact: <sip:1003@10.0.0.5:5062>\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.5", 5062);
+    location_entry_t *user = find_location_entry_by_userid(&server, "1003");
+    EXPECT_TRUE(user != NULL);
+    if (user == NULL) {
+        sip_server_destroy(&server);
+        return failures;
+    }
+    EXPECT_TRUE(user->registered);
+
+    mocks_advance(&server, (uint64_t)REGISTRATION_EXPIRES * 1000 - 1000);
+    EXPECT_TRUE(user->registered);
+
+    mocks_advance(&server, 1000 + SIP_TIMER_TICK_MS);
+    EXPECT_TRUE(!user->registered);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+/**
+ * @brief Runs a simulation with the server's log discarded.
+ */
+static int run_quietly(const sim_config_t *config, sim_result_t *result) {
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    int ret = sim_run(config, result);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+    return ret;
+}
+
+static int test_simulation_is_deterministic(void) {
+    int failures = 0;
+    sim_config_t config;
+    sim_config_defaults(&config);
+    config.seed = 42;
+    config.calls = 2000;
+    config.registrations = 200;
+    config.loss = 0.05;
+
+    sim_result_t first, second, other;
+    EXPECT_EQ_INT(run_quietly(&config, &first), 0);
+    EXPECT_EQ_INT(run_quietly(&config, &second), 0);
+    config.seed = 43;
+    EXPECT_EQ_INT(run_quietly(&config, &other), 0);
+
+    EXPECT_TRUE(memcmp(&first, &second, sizeof(first)) == 0);
+    EXPECT_TRUE(first.digest != other.digest);
+
+    // Every call has exactly one outcome, and the server's timers clean up what the network lost
+    EXPECT_EQ_INT(first.calls_answered + first.calls_busy + first.calls_cancelled + first.calls_timed_out +
+                  first.calls_failed + first.calls_unresolved, config.calls);
+    EXPECT_EQ_INT(first.registrations_ok + first.registrations_failed, config.registrations);
+    EXPECT_TRUE(first.datagrams_lost > 0);
+    EXPECT_TRUE(first.retransmissions > 0);
+    EXPECT_TRUE(first.calls_timed_out > 0);
+    EXPECT_EQ_INT(first.calls_left, 0);
+    return failures;
+}
+
+static int test_lossless_simulation_resolves_every_call(void) {
+    int failures = 0;
+    sim_config_t config;
+    sim_config_defaults(&config);
+    config.calls = 1000;
+    config.loss = 0.0;
+
+    sim_result_t result;
+    EXPECT_EQ_INT(run_quietly(&config, &result), 0);
+    EXPECT_EQ_INT(result.datagrams_lost, 0);
+    EXPECT_EQ_INT(result.retransmissions, 0);
+    EXPECT_EQ_INT(result.calls_unresolved, 0);
+    EXPECT_EQ_INT(result.calls_failed, 0);
+    EXPECT_EQ_INT(result.registrations_ok, config.registrations);
+    EXPECT_EQ_INT(result.calls_answered + result.calls_busy + result.calls_cancelled + result.calls_timed_out, config.calls);
+    // Only the unanswered calls run into the call timer
+    EXPECT_TRUE(result.calls_timed_out > 0);
+    EXPECT_TRUE(result.calls_timed_out < config.calls / 20);
+    EXPECT_EQ_INT(result.calls_left, 0);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"unanswered_call_times_out", test_unanswered_call_times_out},
+        {"answered_call_has_no_timer", test_answered_call_has_no_timer},
+        {"registration_expires", test_registration_expires},
+        {"simulation_is_deterministic", test_simulation_is_deterministic},
+        {"lossless_simulation_resolves_every_call", test_lossless_simulation_resolves_every_call},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -0,0 +1,97 @@
+#include "test_common.h"
+
+#include <string.h>
+
+#include "../sip_server.h"
+#include "../sip_encoder.h"
+
+static const char *invite_payload =
+    "INVITE sip:1002@10.0.0.2:5070 SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 192.168.32.131:5060;branch=z9hG4bK1\r\n"
+    "From: <sip:1001@example.com>;tag=aaa\r\n"
+    "To: <sip:1002@10.0.0.2:5070;ob>\r\n"
+    "Call-ID: b-leg-001@example.com\r\n"
+    "User-Agent: TinySIP\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Max-Forwards: 69\r\n"
+    "Contact: <sip:TinySIP@192.168.32.131:5060>\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 10\r\n\r\n"
+    "User-Agent";
+
+static int test_compact_rewrites_header_names(void) {
+    int failures = 0;
+    char out[BUFFER_SIZE + 1];
+
+    size_t len = sip_encode_compact(invite_payload, strlen(invite_payload), out, sizeof(out));
+    EXPECT_TRUE(len > 0);
+    EXPECT_TRUE(len < strlen(invite_payload));
+    EXPECT_EQ_INT(len, strlen(out));
+
+    EXPECT_TRUE(strncmp(out, "INVITE sip:1002@10.0.0.2:5070 SIP/2.0\r\n", 39) == 0);
+    EXPECT_STRCONTAINS(out, "\r\nv: SIP/2.0/UDP 192.168.32.131:5060;branch=z9hG4bK1\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nf: <sip:1001@example.com>;tag=aaa\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nt: <sip:1002@10.0.0.2:5070;ob>\r\n");
+    EXPECT_STRCONTAINS(out, "\r\ni: b-leg-001@example.com\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nm: <sip:TinySIP@192.168.32.131:5060>\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nc: application/sdp\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nl: 10\r\n\r\nUser-Agent");
+    // Headers without a compact form are kept as is
+    EXPECT_STRCONTAINS(out, "\r\nCSeq: 1 INVITE\r\n");
+    EXPECT_STRCONTAINS(out, "\r\nMax-Forwards: 69\r\n");
+    // Optional headers are dropped, the body is untouched
+    EXPECT_TRUE(strstr(out, "User-Agent: TinySIP") == NULL);
+
+    return failures;
+}
+
+static int test_compact_fails_when_output_too_small(void) {
+    int failures = 0;
+    char out[32];
+
+    EXPECT_EQ_INT(sip_encode_compact(invite_payload, strlen(invite_payload), out, sizeof(out)), 0);
+
+    return failures;
+}
+
+static int test_prepare_compacts_only_over_budget(void) {
+    int failures = 0;
+    char scratch[BUFFER_SIZE + 1];
+    const char *out = NULL;
+    sip_encoder_options_t saved = sip_encoder_options;
+
+    sip_encoder_options.compact_mode = SIP_COMPACT_OVER_BUDGET;
+    sip_encoder_options.mtu_budget = 1300;
+    size_t len = sip_encoder_prepare(invite_payload, strlen(invite_payload), scratch, sizeof(scratch), &out);
+    EXPECT_TRUE(out == invite_payload);
+    EXPECT_EQ_INT(len, strlen(invite_payload));
+
+    sip_encoder_stats_t before = sip_encoder_get_stats();
+    sip_encoder_options.mtu_budget = 300;
+    len = sip_encoder_prepare(invite_payload, strlen(invite_payload), scratch, sizeof(scratch), &out);
+    EXPECT_TRUE(out == scratch);
+    EXPECT_TRUE(len < strlen(invite_payload));
+    sip_encoder_stats_t after = sip_encoder_get_stats();
+    EXPECT_EQ_INT(after.compacted, before.compacted + 1);
+    EXPECT_EQ_INT(after.over_budget, before.over_budget);
+
+    // Still too large after compaction: reported, but sent anyway
+    sip_encoder_options.mtu_budget = 100;
+    len = sip_encoder_prepare(invite_payload, strlen(invite_payload), scratch, sizeof(scratch), &out);
+    EXPECT_TRUE(out == scratch);
+    EXPECT_EQ_INT(sip_encoder_get_stats().over_budget, before.over_budget + 1);
+
+    sip_encoder_options = saved;
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"compact_rewrites_header_names", test_compact_rewrites_header_names},
+        {"compact_fails_when_output_too_small", test_compact_fails_when_output_too_small},
+        {"prepare_compacts_only_over_budget", test_prepare_compacts_only_over_budget},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -0,0 +1,81 @@
+#include "test_common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_hash.h"
+
+// Test vectors of the SipHash paper: key 00..0f, messages 00, 00 01, ...
+static int test_siphash_vectors(void) {
+    int failures = 0;
+    uint8_t key[16];
+    uint8_t message[15];
+    for (int i = 0; i < 16; i++) {
+        key[i] = (uint8_t)i;
+    }
+    for (int i = 0; i < 15; i++) {
+        message[i] = (uint8_t)i;
+    }
+    EXPECT_TRUE(sip_siphash24(key, message, 0) == 0x726fdb47dd0e0e31ULL);
+    EXPECT_TRUE(sip_siphash24(key, message, 1) == 0x74f839c593dc67fdULL);
+    EXPECT_TRUE(sip_siphash24(key, message, 8) == 0x93f5f5799a932462ULL);
+    EXPECT_TRUE(sip_siphash24(key, message, 15) == 0xa129ca6149be45e5ULL);
+    return failures;
+}
+
+static int test_keyed_hash(void) {
+    int failures = 0;
+    const char *implementation = sip_hash_implementation();
+    EXPECT_TRUE(strcmp(implementation, "aes-ni") == 0 || strcmp(implementation, "siphash") == 0);
+
+    const char data[] = "a3f1c2e4-0001@10.0.0.1 and a little more than one block";
+    uint64_t hash = sip_hash(data, sizeof(data) - 1, 0);
+    EXPECT_TRUE(hash == sip_hash(data, sizeof(data) - 1, 0));
+    EXPECT_TRUE(hash != sip_hash(data, sizeof(data) - 1, 1));
+    EXPECT_TRUE(hash != sip_hash(data, sizeof(data) - 2, 0));
+    EXPECT_TRUE(sip_hash("ab", 2, 0) != sip_hash("ab\0", 3, 0));
+
+    // The key decides the hash
+    uint8_t key[SIP_HASH_KEY_SIZE] = {0};
+    sip_hash_set_key(key);
+    uint64_t zero_key = sip_hash(data, sizeof(data) - 1, 0);
+    key[0] = 1;
+    sip_hash_set_key(key);
+    EXPECT_TRUE(zero_key != sip_hash(data, sizeof(data) - 1, 0));
+    key[0] = 0;
+    sip_hash_set_key(key);
+    EXPECT_TRUE(zero_key == sip_hash(data, sizeof(data) - 1, 0));
+    return failures;
+}
+
+// Both legs of a call hash the same, and the hashes spread over a table
+static int test_call_id_hash(void) {
+    int failures = 0;
+    EXPECT_TRUE(sip_hash_call_id("a-001@example.com", 17) != 0);
+    EXPECT_TRUE(sip_hash_call_id("", 0) != 0);
+
+    char call_id[64];
+    int buckets[16] = {0};
+    for (int i = 0; i < 1600; i++) {
+        int len = snprintf(call_id, sizeof(call_id), "call-%d@example.com", i);
+        uint64_t hash = sip_hash_call_id(call_id, (size_t)len);
+        memcpy(call_id, "b-leg", 5);
+        EXPECT_TRUE(hash == sip_hash_call_id(call_id, (size_t)len));
+        buckets[hash & 15]++;
+    }
+    for (int i = 0; i < 16; i++) {
+        EXPECT_TRUE(buckets[i] > 50 && buckets[i] < 150);
+    }
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"siphash_vectors", test_siphash_vectors},
+        {"keyed_hash", test_keyed_hash},
+        {"call_id_hash", test_call_id_hash},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -0,0 +1,328 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+
+static void send_invite(int n) {
+    char invite[BUFFER_SIZE];
+    snprintf(invite, sizeof(invite),
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKmem%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa%d\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: calls-%03d@example.com\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\n0123456789", n, n, n);
+    mocks_deliver(&server, invite, "10.0.0.1", 5060);
+}
+
+static void send_register(const char *user, int port) {
+    char reg[BUFFER_SIZE];
+    snprintf(reg, sizeof(reg),
+             "REGISTER sip:example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.5:%d;rport;branch=z9hG4bKmemreg\r\n"
+             "From: <sip:%s@example.com>;tag=tag1\r\n"
+             "To: <sip:%s@example.com>\r\n"
+             "Call-ID: memory-reg-%s@example.com\r\n"
+             "CSeq: 1 REGISTER\r\n"
+             "Contact: <sip:%s@10.0.0.5:%d>\r\n"
+             "Content-Length: 0\r\n\r\n", port, user, user, user, user, port);
+    mocks_deliver(&server, reg, "10.0.0.5", port);
+}
+
+static int test_charge_and_credit(void) {
+    int failures = 0;
+    sip_memory_t memory;
+    sip_memory_init(&memory);
+    sip_memory_set_ceiling(&memory, SIP_MEMORY_MESSAGES, 1000);
+
+    EXPECT_TRUE(sip_memory_charge(&memory, SIP_MEMORY_MESSAGES, 400));
+    EXPECT_TRUE(sip_memory_charge(&memory, SIP_MEMORY_MESSAGES, 600));
+    EXPECT_TRUE(!sip_memory_charge(&memory, SIP_MEMORY_MESSAGES, 1));
+    sip_memory_credit(&memory, SIP_MEMORY_MESSAGES, 400);
+    EXPECT_TRUE(sip_memory_charge(&memory, SIP_MEMORY_MESSAGES, 100));
+
+    sip_memory_stats_t stats;
+    sip_memory_snapshot(&memory, SIP_MEMORY_MESSAGES, &stats);
+    EXPECT_EQ_INT(stats.bytes, 700);
+    EXPECT_EQ_INT(stats.objects, 2);
+    EXPECT_EQ_INT(stats.peak_bytes, 1000);
+    EXPECT_EQ_INT(stats.ceiling_bytes, 1000);
+    EXPECT_EQ_INT(stats.shed, 1);
+
+    // No ceiling, nothing is refused
+    for (int i = 0; i < 100; i++) {
+        EXPECT_TRUE(sip_memory_charge(&memory, SIP_MEMORY_CALLS, 1 << 20));
+    }
+    return failures;
+}
+
+static int test_configure_ceilings(void) {
+    int failures = 0;
+    sip_memory_t memory;
+    sip_memory_init(&memory);
+
+    EXPECT_EQ_INT(sip_memory_configure(&memory, "messages=64k,calls=2m,registrar=1200"), 0);
+    sip_memory_stats_t stats;
+    sip_memory_snapshot(&memory, SIP_MEMORY_MESSAGES, &stats);
+    EXPECT_EQ_INT(stats.ceiling_bytes, 64 * 1024);
+    sip_memory_snapshot(&memory, SIP_MEMORY_CALLS, &stats);
+    EXPECT_EQ_INT(stats.ceiling_bytes, 2 * 1024 * 1024);
+    sip_memory_snapshot(&memory, SIP_MEMORY_REGISTRAR, &stats);
+    EXPECT_EQ_INT(stats.ceiling_bytes, 1200);
+
+    // An invalid specification leaves every ceiling alone
+    EXPECT_EQ_INT(sip_memory_configure(&memory, "calls=1k,transactions=1k"), -1);
+    EXPECT_EQ_INT(sip_memory_configure(&memory, "calls=1k,messages=lots"), -1);
+    EXPECT_EQ_INT(sip_memory_configure(&memory, "calls"), -1);
+    sip_memory_snapshot(&memory, SIP_MEMORY_CALLS, &stats);
+    EXPECT_EQ_INT(stats.ceiling_bytes, 2 * 1024 * 1024);
+    return failures;
+}
+
+static int test_call_ceiling_sheds_invites(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    sip_memory_set_ceiling(&server.store->memory, SIP_MEMORY_CALLS, 2 * sizeof(call_t));
+
+    send_invite(1);
+    send_invite(2);
+    EXPECT_EQ_INT(server.store->call_map.size, 2);
+    EXPECT_TRUE(mocks_find_payload_substr("503 Service Unavailable") == NULL);
+
+    send_invite(3);
+    EXPECT_EQ_INT(server.store->call_map.size, 2);
+    const mock_message_t *shed = mocks_find_payload_substr("SIP/2.0 503 Service Unavailable");
+    EXPECT_TRUE(shed != NULL);
+    if (shed != NULL) {
+        EXPECT_TRUE(strstr(shed->payload, "Call-ID: calls-003@example.com") != NULL);
+        EXPECT_TRUE(strstr(shed->payload, "Retry-After: ") != NULL);
+    }
+
+    sip_memory_stats_t stats;
+    sip_server_memory_stats(&server, SIP_MEMORY_CALLS, &stats);
+    EXPECT_EQ_INT(stats.objects, 2);
+    EXPECT_EQ_INT(stats.bytes, 2 * sizeof(call_t));
+    EXPECT_EQ_INT(stats.reserved_bytes, MAX_CALLS * sizeof(call_t));
+    EXPECT_EQ_INT(stats.shed, 1);
+
+    // A call that ends returns its memory and makes room for the next one
+    mocks_deliver(&server, "CANCEL sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKmem1\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa1\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: calls-001@example.com\r\n"
+                           "CSeq: 1 CANCEL\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    mocks_deliver(&server, "SIP/2.0 200 OK\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa1\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-001@example.com\r\n"
+                           "CSeq: 2 CANCEL\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5070);
+    EXPECT_EQ_INT(server.store->call_map.size, 1);
+    sip_server_memory_stats(&server, SIP_MEMORY_CALLS, &stats);
+    EXPECT_EQ_INT(stats.objects, 1);
+    EXPECT_EQ_INT(stats.bytes, sizeof(call_t));
+
+    mocks_reset();
+    send_invite(4);
+    EXPECT_EQ_INT(server.store->call_map.size, 2);
+    EXPECT_TRUE(mocks_find_payload_substr("503 Service Unavailable") == NULL);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_registrar_ceiling_sheds_new_bindings(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    sip_memory_set_ceiling(&server.store->memory, SIP_MEMORY_REGISTRAR, sizeof(location_entry_t));
+
+    send_register("1003", 5062);
+    EXPECT_TRUE(find_location_entry_by_userid(&server, "1003")->registered);
+
+    // A second binding doesn't fit, a refresh of the first still does
+    send_register("1004", 5064);
+    EXPECT_TRUE(!find_location_entry_by_userid(&server, "1004")->registered);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 503 Service Unavailable") != NULL);
+    mocks_reset();
+    send_register("1003", 5062);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 200 OK") != NULL);
+
+    sip_memory_stats_t stats;
+    sip_server_memory_stats(&server, SIP_MEMORY_REGISTRAR, &stats);
+    EXPECT_EQ_INT(stats.objects, 1);
+    EXPECT_EQ_INT(stats.shed, 1);
+
+    // An expired binding returns its memory
+    location_entry_t *entry = find_location_entry_by_userid(&server, "1003");
+    sip_timer_arm(&server.store->timers, LOCATION_TIMER_ID((int)(entry - server.store->location_entries)), 1);
+    sip_server_run_timers(&server);
+    sip_server_memory_stats(&server, SIP_MEMORY_REGISTRAR, &stats);
+    EXPECT_EQ_INT(stats.objects, 0);
+    EXPECT_EQ_INT(stats.bytes, 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_message_pool_admission(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    sip_memory_set_ceiling(&server.store->memory, SIP_MEMORY_MESSAGES, 2 * sizeof(sip_message_t));
+
+    sip_message_t *messages[3];
+    for (int i = 0; i < 3; i++) {
+        messages[i] = calloc(1, sizeof(sip_message_t));
+        snprintf(messages[i]->buffer, BUFFER_SIZE, "OPTIONS sip:%d@example.com SIP/2.0\r\n\r\n", i);
+        messages[i]->dedup_hash = dedup_filter_hash(messages[i]->buffer, strlen(messages[i]->buffer), NULL);
+        EXPECT_TRUE(!dedup_filter_check(&server.store->dedup_filter, messages[i]->dedup_hash, 1000));
+    }
+    EXPECT_TRUE(sip_server_admit_message(&server, messages[0]));
+    EXPECT_TRUE(sip_server_admit_message(&server, messages[1]));
+    EXPECT_TRUE(!sip_server_admit_message(&server, messages[2]));
+
+    sip_memory_stats_t stats;
+    sip_server_memory_stats(&server, SIP_MEMORY_MESSAGES, &stats);
+    EXPECT_EQ_INT(stats.objects, 2);
+    EXPECT_EQ_INT(stats.shed, 1);
+    sip_server_memory_stats(&server, SIP_MEMORY_TRANSACTIONS, &stats);
+    EXPECT_EQ_INT(stats.objects, 3);
+    EXPECT_EQ_INT(stats.bytes, 3 * sizeof(dedup_slot_t));
+
+    for (int i = 0; i < 3; i++) {
+        release_message(&server, messages[i]);
+    }
+    sip_server_memory_stats(&server, SIP_MEMORY_MESSAGES, &stats);
+    EXPECT_EQ_INT(stats.objects, 0);
+    EXPECT_EQ_INT(stats.bytes, 0);
+    EXPECT_EQ_INT(stats.peak_bytes, 2 * sizeof(sip_message_t));
+    sip_server_memory_stats(&server, SIP_MEMORY_TRANSACTIONS, &stats);
+    EXPECT_EQ_INT(stats.objects, 0);
+    EXPECT_EQ_INT(stats.peak_bytes, 3 * sizeof(dedup_slot_t));
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_emergency_classification(void) {
+    int failures = 0;
+    mocks_server_init(&server);
+    sip_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+
+    const char *emergency[] = {
+        "INVITE sip:112@example.com SIP/2.0\r\n",
+        "INVITE sips:911@example.com;user=phone SIP/2.0\r\n",
+        "INVITE tel:112 SIP/2.0\r\n",
+        "INVITE urn:service:sos SIP/2.0\r\n",
+        "INVITE urn:service:sos.police SIP/2.0\r\n",
+    };
+    const char *other[] = {
+        "INVITE sip:1120@example.com SIP/2.0\r\n",
+        "INVITE sip:1002@example.com SIP/2.0\r\n",
+        "INVITE urn:service:sosx SIP/2.0\r\n",
+        "OPTIONS sip:112@example.com SIP/2.0\r\n",
+        "SIP/2.0 200 OK\r\nTo: <sip:112@example.com>\r\n",
+    };
+    for (size_t i = 0; i < sizeof(emergency) / sizeof(emergency[0]); i++) {
+        strcpy(msg.buffer, emergency[i]);
+        EXPECT_TRUE(sip_server_is_emergency(&server, &msg));
+    }
+    for (size_t i = 0; i < sizeof(other) / sizeof(other[0]); i++) {
+        strcpy(msg.buffer, other[i]);
+        EXPECT_TRUE(!sip_server_is_emergency(&server, &msg));
+    }
+
+    // Invalid lists leave the numbers alone
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "999,"), -1);
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "999,,112"), -1);
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "1234567890123456"), -1);
+    EXPECT_EQ_INT(server.emergency_count, 2);
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "999,1002"), 0);
+    strcpy(msg.buffer, other[1]);
+    EXPECT_TRUE(sip_server_is_emergency(&server, &msg));
+    strcpy(msg.buffer, emergency[0]);
+    EXPECT_TRUE(!sip_server_is_emergency(&server, &msg));
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// Emergency INVITEs are admitted past the ceilings and take the reserved call table entries
+static int test_emergency_calls_bypass_shedding(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+
+    for (int n = 1; n <= MAX_CALLS - EMERGENCY_RESERVED_CALLS; n++) {
+        send_invite(n);
+    }
+    EXPECT_EQ_INT(server.store->call_map.size, MAX_CALLS - EMERGENCY_RESERVED_CALLS);
+    EXPECT_TRUE(mocks_find_payload_substr("500 Server Internal Error") == NULL);
+    send_invite(MAX_CALLS);
+    EXPECT_EQ_INT(server.store->call_map.size, MAX_CALLS - EMERGENCY_RESERVED_CALLS);
+    EXPECT_TRUE(mocks_find_payload_substr("500 Server Internal Error") != NULL);
+
+    // The call store is at its ceiling too, and the message pool is full
+    sip_memory_set_ceiling(&server.store->memory, SIP_MEMORY_CALLS,
+                           (MAX_CALLS - EMERGENCY_RESERVED_CALLS) * sizeof(call_t));
+    sip_memory_set_ceiling(&server.store->memory, SIP_MEMORY_MESSAGES, sizeof(sip_message_t));
+
+    // 1002 stands for the emergency gateway, it is the only user INVITEs can be routed to
+    EXPECT_EQ_INT(sip_server_set_emergency_numbers(&server, "1002"), 0);
+    sip_message_t *queued = calloc(1, sizeof(sip_message_t));
+    sip_message_t *urgent = calloc(1, sizeof(sip_message_t));
+    strcpy(queued->buffer, "OPTIONS sip:1002@example.com SIP/2.0\r\n\r\n");
+    strcpy(urgent->buffer, "INVITE sip:1002@example.com SIP/2.0\r\n\r\n");
+    EXPECT_TRUE(sip_server_admit_message(&server, queued));
+    EXPECT_TRUE(!queued->priority);
+    EXPECT_TRUE(sip_server_admit_message(&server, urgent));
+    EXPECT_TRUE(urgent->priority);
+    release_message(&server, queued);
+    release_message(&server, urgent);
+
+    mocks_reset();
+    for (int n = 1; n <= EMERGENCY_RESERVED_CALLS; n++) {
+        send_invite(100 + n);
+    }
+    EXPECT_EQ_INT(server.store->call_map.size, MAX_CALLS);
+    EXPECT_TRUE(mocks_find_payload_substr("503 Service Unavailable") == NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("500 Server Internal Error") == NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("INVITE sip:1002@") != NULL);
+
+    sip_memory_stats_t stats;
+    sip_server_memory_stats(&server, SIP_MEMORY_CALLS, &stats);
+    EXPECT_EQ_INT(stats.objects, MAX_CALLS);
+    EXPECT_EQ_INT(stats.shed, 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"charge_and_credit", test_charge_and_credit},
+        {"configure_ceilings", test_configure_ceilings},
+        {"call_ceiling_sheds_invites", test_call_ceiling_sheds_invites},
+        {"registrar_ceiling_sheds_new_bindings", test_registrar_ceiling_sheds_new_bindings},
+        {"message_pool_admission", test_message_pool_admission},
+        {"emergency_classification", test_emergency_classification},
+        {"emergency_calls_bypass_shedding", test_emergency_calls_bypass_shedding},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
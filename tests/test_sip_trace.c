@@ -0,0 +1,153 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+
+static int set_trace(const char *spec) {
+    sip_trace_filter_t filter;
+    sip_trace_filter_init(&filter);
+    int result = sip_trace_configure(&filter, spec);
+    if (result == 0) {
+        sip_server_set_trace(&server, &filter);
+    }
+    return result;
+}
+
+static void send_invite(const char *from, const char *call_id) {
+    char invite[BUFFER_SIZE];
+    snprintf(invite, sizeof(invite),
+             "INVITE sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKtrace\r\n"
+             "From: <sip:%s@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Contact: <sip:%s@10.0.0.1:5060>\r\n"
+             "Content-Type: application/sdp\r\n"
+             "Content-Length: 10\r\n\r\n0123456789", from, call_id, from);
+    mocks_deliver(&server, invite, "10.0.0.1", 5060);
+}
+
+static int test_configure_filter(void) {
+    int failures = 0;
+    sip_trace_filter_t filter;
+    sip_trace_filter_init(&filter);
+    EXPECT_TRUE(filter.all);
+
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "call-id=abc@host,user=1001,ip=10.0.0.7,sample=100"), 0);
+    EXPECT_TRUE(!filter.all);
+    EXPECT_EQ_INT(strcmp(filter.call_id, "abc@host"), 0);
+    EXPECT_EQ_INT(strcmp(filter.user, "1001"), 0);
+    EXPECT_TRUE(filter.has_source);
+    EXPECT_EQ_INT((int)filter.sample, 100);
+
+    // Invalid specifications leave the filter alone
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "user=1002,colour=blue"), -1);
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "ip=10.0.0"), -1);
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "sample=0"), -1);
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "user="), -1);
+    EXPECT_EQ_INT(strcmp(filter.user, "1001"), 0);
+
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "off"), 0);
+    EXPECT_TRUE(!filter.all);
+    EXPECT_EQ_INT((int)filter.sample, 0);
+    EXPECT_EQ_INT(sip_trace_configure(&filter, "all"), 0);
+    EXPECT_TRUE(filter.all);
+    return failures;
+}
+
+static int test_match_criteria(void) {
+    int failures = 0;
+    sip_trace_filter_t filter;
+    struct in_addr source, other;
+    inet_pton(AF_INET, "10.0.0.7", &source);
+    inet_pton(AF_INET, "10.0.0.8", &other);
+
+    sip_trace_configure(&filter, "off");
+    EXPECT_TRUE(!(sip_trace_match(&filter, "abc", 3, 0, "1001", "1002", &source)));
+
+    sip_trace_configure(&filter, "call-id=abc");
+    EXPECT_TRUE(sip_trace_match(&filter, "abc", 3, 0, NULL, NULL, &other));
+    EXPECT_TRUE(!(sip_trace_match(&filter, "abcd", 4, 0, NULL, NULL, &other)));
+    EXPECT_TRUE(!(sip_trace_match(&filter, NULL, 0, 0, NULL, NULL, &other)));
+
+    sip_trace_configure(&filter, "user=1002,ip=10.0.0.7");
+    EXPECT_TRUE(sip_trace_match(&filter, "x", 1, 0, "1001", "1002", &other));
+    EXPECT_TRUE(sip_trace_match(&filter, "x", 1, 0, "1001", "1003", &source));
+    EXPECT_TRUE(!(sip_trace_match(&filter, "x", 1, 0, "1001", "1003", &other)));
+
+    // A sample of 1 in 1 takes every dialog, 1 in N takes about 1/N of them
+    sip_trace_configure(&filter, "sample=1");
+    EXPECT_TRUE(sip_trace_match(&filter, "x", 1, sip_hash_call_id("x", 1), NULL, NULL, &other));
+    sip_trace_configure(&filter, "sample=10");
+    int sampled = 0;
+    for (int i = 0; i < 1000; i++) {
+        char call_id[32];
+        int len = snprintf(call_id, sizeof(call_id), "call-%d@example.com", i);
+        sampled += sip_trace_match(&filter, call_id, (size_t)len, sip_hash_call_id(call_id, (size_t)len), NULL, NULL, &other);
+    }
+    EXPECT_TRUE(sampled > 50 && sampled < 150);
+    return failures;
+}
+
+// A call set up by a traced INVITE keeps its B leg traced, other calls stay quiet
+static int test_traced_dialog_is_sticky(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+    EXPECT_EQ_INT(set_trace("user=1003"), 0);
+
+    send_invite("1001", "quiet-1@example.com");
+    EXPECT_TRUE(!sip_trace_on);
+    send_invite("1003", "loud-1@example.com");
+    EXPECT_TRUE(sip_trace_on);
+
+    int leg = 0;
+    call_t *quiet = find_call_by_callid(&server.store->call_map, "quiet-1@example.com", &leg);
+    call_t *loud = find_call_by_callid(&server.store->call_map, "loud-1@example.com", &leg);
+    EXPECT_TRUE(quiet != NULL && !quiet->traced);
+    EXPECT_TRUE(loud != NULL && loud->traced);
+    if (quiet == NULL || loud == NULL) {
+        sip_server_destroy(&server);
+        return failures;
+    }
+
+    // B's 180 doesn't name the traced user, it is traced through its call
+    const char *b_legs[] = {quiet->b_leg_uuid, loud->b_leg_uuid};
+    const bool traced[] = {false, true};
+    for (int i = 0; i < 2; i++) {
+        char ringing[BUFFER_SIZE];
+        snprintf(ringing, sizeof(ringing),
+                 "SIP/2.0 180 Ringing\r\n"
+                 "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKring\r\n"
+                 "From: <sip:caller@example.com>;tag=aaa\r\n"
+                 "To: <sip:1002@example.com>;tag=bbb\r\n"
+                 "Call-ID: %s\r\n"
+                 "CSeq: 1 INVITE\r\n"
+                 "Content-Length: 0\r\n\r\n", b_legs[i]);
+        mocks_deliver(&server, ringing, "10.0.0.2", 5070);
+        EXPECT_TRUE(sip_trace_on == traced[i]);
+    }
+
+    set_trace("all");
+    sip_server_destroy(&server);
+    sip_trace_on = true;
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"configure_filter", test_configure_filter},
+        {"match_criteria", test_match_criteria},
+        {"traced_dialog_is_sticky", test_traced_dialog_is_sticky},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
@@ -5,9 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
-#define UNIT_TESTING 1
-#define send_sip_message mock_send_sip_message
-#include "../sip_server.c"
+#include "../sip_server.h"
+
+static sip_server_t server;
 
 static void build_message(sip_message_t *msg, const char *payload, const char *ip, int port) {
     memset(msg, 0, sizeof(*msg));
@@ -22,7 +22,7 @@ static void build_message(sip_message_t *msg, const char *payload, const char *i
 static int test_initial_invite_allocates_call(void) {
     int failures = 0;
     mocks_reset();
-    init_call_map();
+    mocks_server_init(&server);
 
     const char *call_id = "call-001@example.com";
     sip_message_t invite;
@@ -38,10 +38,10 @@ static int test_initial_invite_allocates_call(void) {
         "Content-Length: 10\r\n\r\n0123456789";
     build_message(&invite, payload, "10.0.0.1", 5060);
 
-    handle_state_machine(NULL, REQUEST_METHOD, "INVITE", true, &invite, invite.buffer, A_LEG);
+    handle_state_machine(&server, NULL, REQUEST_METHOD, "INVITE", true, &invite, invite.buffer, A_LEG);
 
     int leg = 0;
-    call_t *call = find_call_by_callid(&call_map, call_id, &leg);
+    call_t *call = find_call_by_callid(&server.store->call_map, call_id, &leg);
     EXPECT_TRUE(call != NULL);
     if (call != NULL) {
         EXPECT_EQ_INT(leg, A_LEG);
@@ -50,14 +50,14 @@ static int test_initial_invite_allocates_call(void) {
         EXPECT_TRUE(call->is_active);
     }
 
-    destroy_call_map();
+    sip_server_destroy(&server);
     return failures;
 }
 
 static int test_b_leg_180_generates_response(void) {
     int failures = 0;
     mocks_reset();
-    init_call_map();
+    mocks_server_init(&server);
 
     const char *call_id = "call-002@example.com";
     sip_message_t invite;
@@ -72,13 +72,13 @@ static int test_b_leg_180_generates_response(void) {
         "Content-Type: application/sdp\r\n"
         "Content-Length: 8\r\n\r\nABCDEFGH";
     build_message(&invite, invite_payload, "10.0.0.1", 5060);
-    handle_state_machine(NULL, REQUEST_METHOD, "INVITE", true, &invite, invite.buffer, A_LEG);
+    handle_state_machine(&server, NULL, REQUEST_METHOD, "INVITE", true, &invite, invite.buffer, A_LEG);
 
     int leg = 0;
-    call_t *call = find_call_by_callid(&call_map, call_id, &leg);
+    call_t *call = find_call_by_callid(&server.store->call_map, call_id, &leg);
     EXPECT_TRUE(call != NULL);
     if (call == NULL) {
-        destroy_call_map();
+        sip_server_destroy(&server);
         return failures;
     }
 
@@ -99,10 +99,10 @@ static int test_b_leg_180_generates_response(void) {
     build_message(&ringing, ringing_payload, "10.0.0.2", 5070);
 
     leg = 0;
-    call = find_call_by_callid(&call_map, b_leg_uuid, &leg);
+    call = find_call_by_callid(&server.store->call_map, b_leg_uuid, &leg);
     EXPECT_TRUE(call != NULL);
     EXPECT_EQ_INT(leg, B_LEG);
-    handle_state_machine(call, STATUS_CODE, "180", false, &ringing, ringing.buffer, leg);
+    handle_state_machine(&server, call, STATUS_CODE, "180", false, &ringing, ringing.buffer, leg);
 
     EXPECT_EQ_INT(call->call_state, CALL_STATE_RINGING);
 
@@ -117,14 +117,14 @@ static int test_b_leg_180_generates_response(void) {
         EXPECT_STRCONTAINS(response->payload, "Content-Length: ");
     }
 
-    destroy_call_map();
+    sip_server_destroy(&server);
     return failures;
 }
 
 static int test_b_leg_failure_releases_call(void) {
     int failures = 0;
     mocks_reset();
-    init_call_map();
+    mocks_server_init(&server);
 
     const char *call_id = "call-003@example.com";
     sip_message_t invite;
@@ -139,13 +139,13 @@ static int test_b_leg_failure_releases_call(void) {
         "Content-Type: application/sdp\r\n"
         "Content-Length: 20\r\n\r\n01234567890123456789";
     build_message(&invite, invite_payload, "10.0.0.1", 5060);
-    handle_state_machine(NULL, REQUEST_METHOD, "INVITE", false, &invite, invite.buffer, A_LEG);
+    handle_state_machine(&server, NULL, REQUEST_METHOD, "INVITE", false, &invite, invite.buffer, A_LEG);
 
     int leg = 0;
-    call_t *call = find_call_by_callid(&call_map, call_id, &leg);
+    call_t *call = find_call_by_callid(&server.store->call_map, call_id, &leg);
     EXPECT_TRUE(call != NULL);
     if (call == NULL) {
-        destroy_call_map();
+        sip_server_destroy(&server);
         return failures;
     }
 
@@ -166,10 +166,10 @@ static int test_b_leg_failure_releases_call(void) {
     build_message(&failure, failure_payload, "10.0.0.2", 5070);
 
     leg = 0;
-    call = find_call_by_callid(&call_map, b_leg_uuid, &leg);
+    call = find_call_by_callid(&server.store->call_map, b_leg_uuid, &leg);
     EXPECT_TRUE(call != NULL);
     EXPECT_EQ_INT(leg, B_LEG);
-    handle_state_machine(call, STATUS_CODE, "486", false, &failure, failure.buffer, leg);
+    handle_state_machine(&server, call, STATUS_CODE, "486", false, &failure, failure.buffer, leg);
 
     const mock_message_t *ack = mocks_find_payload_substr("ACK ");
     EXPECT_TRUE(ack != NULL);
@@ -184,10 +184,92 @@ static int test_b_leg_failure_releases_call(void) {
         EXPECT_STRCONTAINS(err->payload, "Call-ID: call-003@example.com");
     }
 
-    call = find_call_by_callid(&call_map, call_id, &leg);
+    call = find_call_by_callid(&server.store->call_map, call_id, &leg);
     EXPECT_TRUE(call == NULL);
 
-    destroy_call_map();
+    sip_server_destroy(&server);
+    return failures;
+}
+
+// Responses to A and requests to B are put together from each leg's serialised lines, and
+// the B leg lines pick up B's To tag
+static int test_leg_header_blocks_are_reused(void) {
+    int failures = 0;
+    mocks_reset();
+    mocks_server_init(&server);
+
+    sip_message_t msg;
+    build_message(&msg,
+        "INVITE sip:1002@example.com SIP/2.0\r\n"
+        "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK666\r\n"
+        "From: <sip:1001@example.com>;tag=hhh\r\n"
+        "To: <sip:1002@example.com>\r\n"
+        "Call-ID: call-004@example.com\r\n"
+        "CSeq: 7 INVITE\r\n"
+        "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+        "Content-Type: application/sdp\r\n"
+        "Content-Length: 4\r\n\r\nv=0\n", "10.0.0.1", 5060);
+    handle_state_machine(&server, NULL, REQUEST_METHOD, "INVITE", true, &msg, msg.buffer, A_LEG);
+    int leg = 0;
+    call_t *call = find_call_by_callid(&server.store->call_map, "call-004@example.com", &leg);
+    EXPECT_TRUE(call != NULL);
+    if (call == NULL) {
+        sip_server_destroy(&server);
+        return failures;
+    }
+    const char *a_leg_lines =
+        "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK666;received=10.0.0.1\r\n"
+        "From: <sip:1001@example.com>;tag=hhh\r\n"
+        "To: <sip:1002@example.com>\r\n"
+        "Call-ID: call-004@example.com\r\n"
+        "CSeq: 7 INVITE\r\n"
+        "User-Agent: TinySIP\r\n";
+    char expected[BUFFER_SIZE];
+    snprintf(expected, sizeof(expected), "SIP/2.0 100 Trying\r\n%sContent-Length: 0\r\n\r\n", a_leg_lines);
+    const mock_message_t *trying = mocks_find_payload_substr("SIP/2.0 100 Trying");
+    EXPECT_TRUE(trying != NULL && strcmp(trying->payload, expected) == 0);
+
+    char payload[512];
+    snprintf(payload, sizeof(payload),
+             "SIP/2.0 180 Ringing\r\n"
+             "Via: %s"
+             "From: <sip:1001@example.com>;tag=hhh\r\n"
+             "To: <sip:1002@10.0.0.2:5070;ob>;tag=iii\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: 1 INVITE\r\n"
+             "Content-Length: 0\r\n\r\n",
+             call->b_leg_header.via + strlen("Via: "), call->b_leg_uuid);
+    build_message(&msg, payload, "10.0.0.2", 5070);
+    mocks_reset();
+    handle_state_machine(&server, call, STATUS_CODE, "180", false, &msg, msg.buffer, B_LEG);
+    snprintf(expected, sizeof(expected), "SIP/2.0 180 Ringing\r\n%sContact: <sip:TinySIP@%s:%d>\r\nContent-Length: 0\r\n\r\n",
+             a_leg_lines, SIP_SERVER_IP_ADDRESS, SIP_PORT);
+    const mock_message_t *ringing = mocks_find_payload_substr("SIP/2.0 180 Ringing");
+    EXPECT_TRUE(ringing != NULL && strcmp(ringing->payload, expected) == 0);
+
+    build_message(&msg,
+        "CANCEL sip:1002@example.com SIP/2.0\r\n"
+        "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK666\r\n"
+        "From: <sip:1001@example.com>;tag=hhh\r\n"
+        "To: <sip:1002@example.com>\r\n"
+        "Call-ID: call-004@example.com\r\n"
+        "CSeq: 7 CANCEL\r\n"
+        "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+    mocks_reset();
+    handle_state_machine(&server, call, REQUEST_METHOD, "CANCEL", false, &msg, msg.buffer, A_LEG);
+    snprintf(expected, sizeof(expected), "SIP/2.0 487 Request Terminated\r\n%sContent-Length: 0\r\n\r\n", a_leg_lines);
+    const mock_message_t *terminated = mocks_find_payload_substr("SIP/2.0 487");
+    EXPECT_TRUE(terminated != NULL && strcmp(terminated->payload, expected) == 0);
+    const mock_message_t *cancel = mocks_find_payload_substr("CANCEL sip:1002@");
+    EXPECT_TRUE(cancel != NULL);
+    if (cancel != NULL) {
+        EXPECT_STRCONTAINS(cancel->payload, "\r\nFrom: <sip:1001@example.com>;tag=hhh\r\n"
+                                            "To: <sip:1002@10.0.0.2:5070;ob>;tag=iii\r\n"
+                                            "Call-ID: b-leg004@example.com\r\n"
+                                            "User-Agent: TinySIP\r\n");
+    }
+
+    sip_server_destroy(&server);
     return failures;
 }
 
@@ -196,6 +278,7 @@ int main(void) {
         {"initial_invite_allocates_call", test_initial_invite_allocates_call},
         {"b_leg_180_generates_response", test_b_leg_180_generates_response},
         {"b_leg_failure_releases_call", test_b_leg_failure_releases_call},
+        {"leg_header_blocks_are_reused", test_leg_header_blocks_are_reused},
     };
 
     test_stats_t stats;
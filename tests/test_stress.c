@@ -0,0 +1,368 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../sip_server.h"
+
+// Run under ThreadSanitizer with `make tsan`
+#ifndef STRESS_DIALOGS
+#define STRESS_DIALOGS 2000         // Synthetic dialogs driven through the workers
+#endif
+#define STRESS_PRODUCERS 2          // Threads feeding the worker queues
+#define STRESS_WINDOW 8             // Dialogs interleaved by each producer
+#define STRESS_MAX_STEPS 10         // Messages in the longest dialog script
+
+static sip_server_t server;
+
+// What the server sent, counted by the transport (called from the worker threads)
+static atomic_int invites_to_b;
+static atomic_int answered;         // 200 OK to the A-leg INVITE
+static atomic_int terminated;       // 487 after CANCEL
+static atomic_int busy;             // 486 forwarded from the B-leg
+static atomic_int overloaded;       // 500, no free call slot
+static atomic_int registered;       // 200 OK to REGISTER
+
+static const char *sdp_body =
+    "v=0\r\n"
+    "o=- 0 0 IN IP4 10.0.0.1\r\n"
+    "s=-\r\n"
+    "c=IN IP4 10.0.0.1\r\n"
+    "t=0 0\r\n"
+    "m=audio 4000 RTP/AVP 0\r\n";
+
+static void counting_transport_send(void *user_data, const sip_message_t *message, const char *destination, int port) {
+    (void)user_data;
+    (void)destination;
+    (void)port;
+    const char *payload = message->buffer;
+    if (strncmp(payload, "INVITE ", 7) == 0) {
+        atomic_fetch_add(&invites_to_b, 1);
+    } else if (strncmp(payload, "SIP/2.0 200", 11) == 0 && strstr(payload, "CSeq: 1 INVITE") != NULL) {
+        atomic_fetch_add(&answered, 1);
+    } else if (strncmp(payload, "SIP/2.0 200", 11) == 0 && strstr(payload, "REGISTER") != NULL) {
+        atomic_fetch_add(&registered, 1);
+    } else if (strncmp(payload, "SIP/2.0 487", 11) == 0) {
+        atomic_fetch_add(&terminated, 1);
+    } else if (strncmp(payload, "SIP/2.0 486", 11) == 0) {
+        atomic_fetch_add(&busy, 1);
+    } else if (strncmp(payload, "SIP/2.0 500", 11) == 0) {
+        atomic_fetch_add(&overloaded, 1);
+    }
+}
+
+static sip_message_t *new_message(const char *ip, int port) {
+    sip_message_t *msg = calloc(1, sizeof(sip_message_t));
+    msg->client_addr.sin_family = AF_INET;
+    msg->client_addr_len = sizeof(msg->client_addr);
+    inet_pton(AF_INET, ip, &msg->client_addr.sin_addr);
+    msg->client_addr.sin_port = htons(port);
+    return msg;
+}
+
+static sip_message_t *a_leg_request(const char *method, int cseq, const char *call_id, bool sdp) {
+    sip_message_t *msg = new_message("10.0.0.1", 5060);
+    snprintf(msg->buffer, BUFFER_SIZE,
+             "%s sip:1002@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bK%s%d\r\n"
+             "From: <sip:1001@example.com>;tag=aaa\r\n"
+             "To: <sip:1002@example.com>\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: %d %s\r\n"
+             "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+             "%s"
+             "Content-Length: %zu\r\n\r\n%s",
+             method, method, cseq, call_id, cseq, method,
+             sdp ? "Content-Type: application/sdp\r\n" : "",
+             sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    return msg;
+}
+
+static sip_message_t *b_leg_response(const char *status, const char *cseq, const char *call_id, bool sdp) {
+    sip_message_t *msg = new_message("10.0.0.2", 5070);
+    snprintf(msg->buffer, BUFFER_SIZE,
+             "SIP/2.0 %s\r\n"
+             "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKb\r\n"
+             "From: <sip:1002@example.com>;tag=bbb\r\n"
+             "To: <sip:1001@example.com>;tag=ccc\r\n"
+             "Call-ID: %s\r\n"
+             "CSeq: %s\r\n"
+             "Contact: <sip:1002@10.0.0.2:5070>\r\n"
+             "%s"
+             "Content-Length: %zu\r\n\r\n%s",
+             status, call_id, cseq,
+             sdp ? "Content-Type: application/sdp\r\n" : "",
+             sdp ? strlen(sdp_body) : 0, sdp ? sdp_body : "");
+    return msg;
+}
+
+static sip_message_t *register_request(int user, int port, int seq) {
+    sip_message_t *msg = new_message("10.0.1.1", port);
+    snprintf(msg->buffer, BUFFER_SIZE,
+             "REGISTER sip:example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.1.1:%d;rport;branch=z9hG4bKreg%d\r\n"
+             "From: <sip:%d@example.com>;tag=r%d\r\n"
+             "To: <sip:%d@example.com>\r\n"
+             "Call-ID: stress-reg-%d@example.com\r\n"
+             "CSeq: %d REGISTER\r\n"
+             "Contact: <sip:%d@10.0.1.1:%d>\r\n"
+             "Content-Length: 0\r\n\r\n",
+             port, seq, user, seq, user, seq, seq, user, port);
+    return msg;
+}
+
+/**
+ * @brief Builds the script of one dialog, the scenario depends on the dialog number.
+ * Retransmissions of responses and requests are mixed in; a REGISTER goes with every dialog.
+ * @return The number of messages.
+ */
+static int build_dialog(int dialog, sip_message_t *steps[STRESS_MAX_STEPS]) {
+    char a_id[MAX_UUID_LENGTH];
+    char b_id[MAX_UUID_LENGTH];
+    snprintf(a_id, sizeof(a_id), "call-%d@stress.example.com", dialog);
+    snprintf(b_id, sizeof(b_id), "b-leg%s", a_id + 5);
+    int n = 0;
+
+    steps[n++] = a_leg_request("INVITE", 1, a_id, true);
+    steps[n++] = register_request(1001 + dialog % 8, 20000 + dialog % 1000, dialog);
+    steps[n++] = b_leg_response("180 Ringing", "1 INVITE", b_id, false);
+    switch (dialog % 4) {
+        case 0:  // Answered, hung up by the caller
+            steps[n++] = b_leg_response("200 OK", "1 INVITE", b_id, true);
+            steps[n++] = b_leg_response("200 OK", "1 INVITE", b_id, true);
+            steps[n++] = a_leg_request("ACK", 1, a_id, false);
+            steps[n++] = a_leg_request("BYE", 2, a_id, false);
+            steps[n++] = a_leg_request("BYE", 2, a_id, false);
+            steps[n++] = b_leg_response("200 OK", "2 BYE", b_id, false);
+            break;
+        case 1:  // Cancelled while ringing
+            steps[n++] = a_leg_request("CANCEL", 1, a_id, false);
+            steps[n++] = b_leg_response("200 OK", "1 CANCEL", b_id, false);
+            steps[n++] = b_leg_response("487 Request Terminated", "1 INVITE", b_id, false);
+            break;
+        case 2:  // Rejected by the callee
+            steps[n++] = b_leg_response("180 Ringing", "1 INVITE", b_id, false);
+            steps[n++] = b_leg_response("486 Busy Here", "1 INVITE", b_id, false);
+            break;
+        default: // Answered, hung up by the callee
+            steps[n++] = b_leg_response("200 OK", "1 INVITE", b_id, true);
+            steps[n++] = a_leg_request("ACK", 1, a_id, false);
+            steps[n++] = a_leg_request("ACK", 1, a_id, false);
+            {
+                sip_message_t *bye = new_message("10.0.0.2", 5070);
+                snprintf(bye->buffer, BUFFER_SIZE,
+                         "BYE sip:1001@10.0.0.1:5060 SIP/2.0\r\n"
+                         "Via: SIP/2.0/UDP 10.0.0.2:5070;branch=z9hG4bKbye\r\n"
+                         "From: <sip:1002@example.com>;tag=ccc\r\n"
+                         "To: <sip:1001@example.com>;tag=aaa\r\n"
+                         "Call-ID: %s\r\n"
+                         "CSeq: 2 BYE\r\n"
+                         "Content-Length: 0\r\n\r\n",
+                         b_id);
+                steps[n++] = bye;
+            }
+            {
+                sip_message_t *ok = new_message("10.0.0.1", 5060);
+                snprintf(ok->buffer, BUFFER_SIZE,
+                         "SIP/2.0 200 OK\r\n"
+                         "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bKa\r\n"
+                         "From: <sip:1002@example.com>;tag=ccc\r\n"
+                         "To: <sip:1001@example.com>;tag=aaa\r\n"
+                         "Call-ID: %s\r\n"
+                         "CSeq: 2 BYE\r\n"
+                         "Content-Length: 0\r\n\r\n",
+                         a_id);
+                steps[n++] = ok;
+            }
+            break;
+    }
+    return n;
+}
+
+static worker_thread_t workers[MAX_THREADS];
+
+static void dispatch(sip_message_t *message) {
+    message_queue_t *queue = &workers[message_worker_index(message, MAX_THREADS)].queue;
+    while (!enqueue_message(queue, message)) {
+        sched_yield();
+    }
+}
+
+typedef struct {
+    int first;
+    int registers;
+} producer_t;
+
+/**
+ * @brief Feeds the dialogs first, first + STRESS_PRODUCERS, ... one message at a time,
+ * round-robin over a window of dialogs in progress.
+ */
+static void *producer_main(void *arg) {
+    producer_t *producer = arg;
+    sip_message_t *steps[STRESS_WINDOW][STRESS_MAX_STEPS];
+    int count[STRESS_WINDOW] = {0};
+    int next[STRESS_WINDOW] = {0};
+    int dialog = producer->first;
+    int busy_slots;
+
+    do {
+        busy_slots = 0;
+        for (int w = 0; w < STRESS_WINDOW; w++) {
+            if (next[w] == count[w] && dialog < STRESS_DIALOGS) {
+                count[w] = build_dialog(dialog, steps[w]);
+                next[w] = 0;
+                producer->registers++;
+                dialog += STRESS_PRODUCERS;
+            }
+            if (next[w] < count[w]) {
+                dispatch(steps[w][next[w]++]);
+                busy_slots++;
+            }
+        }
+    } while (busy_slots > 0);
+    return NULL;
+}
+
+static int active_call_count(void) {
+    int count = 0;
+    for (int i = 0; i < MAX_CALLS; ++i) {
+        if (server.store->call_map.calls[i].is_active) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int test_concurrent_dialogs_terminate(void) {
+    int failures = 0;
+    const sip_transport_t transport = { .send = counting_transport_send, .user_data = NULL };
+    sip_server_init(&server, &transport);
+
+    // The handlers log every message, keep the test output readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        initialize_message_queue(&workers[i].queue, QUEUE_CAPACITY);
+        workers[i].server = &server;
+        pthread_create(&workers[i].thread, NULL, process_sip_messages, &workers[i]);
+    }
+
+    pthread_t producers[STRESS_PRODUCERS];
+    producer_t state[STRESS_PRODUCERS];
+    for (int i = 0; i < STRESS_PRODUCERS; i++) {
+        state[i].first = i;
+        state[i].registers = 0;
+        pthread_create(&producers[i], NULL, producer_main, &state[i]);
+    }
+    int registers = 0;
+    for (int i = 0; i < STRESS_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+        registers += state[i].registers;
+    }
+
+    // A NULL message stops a worker once its queue is drained
+    for (int i = 0; i < MAX_THREADS; i++) {
+        while (!enqueue_message(&workers[i].queue, NULL)) {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < MAX_THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        destroy_message_queue(&workers[i].queue);
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+
+    // Every dialog was either admitted or refused for lack of call slots...
+    EXPECT_EQ_INT(atomic_load(&invites_to_b) + atomic_load(&overloaded), STRESS_DIALOGS);
+    // ...every admitted dialog got exactly one final response...
+    EXPECT_EQ_INT(atomic_load(&answered) + atomic_load(&terminated) + atomic_load(&busy), atomic_load(&invites_to_b));
+    EXPECT_TRUE(atomic_load(&invites_to_b) > 0);
+    // ...and released its call slot
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    EXPECT_EQ_INT(active_call_count(), 0);
+    EXPECT_EQ_INT(atomic_load(&registered), registers);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+#define REGISTRAR_THREADS 4
+#define REGISTRAR_ROUNDS 500
+
+static void *registrar_main(void *arg) {
+    int thread = *(int *)arg;
+    for (int i = 0; i < REGISTRAR_ROUNDS; i++) {
+        sip_message_t *reg = register_request(1001 + i % 8, 30000 + thread, thread * REGISTRAR_ROUNDS + i);
+        process_sip_message(&server, reg);
+        release_message(&server, reg);
+    }
+    return NULL;
+}
+
+static int test_registrar_under_contention(void) {
+    int failures = 0;
+    const sip_transport_t transport = { .send = counting_transport_send, .user_data = NULL };
+    sip_server_init(&server, &transport);
+    atomic_store(&registered, 0);
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    pthread_t threads[REGISTRAR_THREADS];
+    int ids[REGISTRAR_THREADS];
+    for (int i = 0; i < REGISTRAR_THREADS; i++) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, registrar_main, &ids[i]);
+    }
+    for (int i = 0; i < REGISTRAR_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+
+    EXPECT_EQ_INT(atomic_load(&registered), REGISTRAR_THREADS * REGISTRAR_ROUNDS);
+    // Each binding holds the address of one of the registering threads, never a torn mix
+    for (int user = 1001; user <= 1008; user++) {
+        char username[MAX_USERNAME_LENGTH];
+        snprintf(username, sizeof(username), "%d", user);
+        location_entry_t *entry = find_location_entry_by_userid(&server, username);
+        EXPECT_TRUE(entry != NULL);
+        if (entry != NULL) {
+            EXPECT_TRUE(entry->registered);
+            EXPECT_TRUE(strcmp(entry->ip_str, "10.0.1.1") == 0);
+            EXPECT_TRUE(entry->port >= 30000 && entry->port < 30000 + REGISTRAR_THREADS);
+        }
+    }
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"concurrent_dialogs_terminate", test_concurrent_dialogs_terminate},
+        {"registrar_under_contention", test_registrar_under_contention},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
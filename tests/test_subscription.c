@@ -0,0 +1,288 @@
+#include "test_common.h"
+#include "mocks.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../sip_server.h"
+
+static sip_server_t server;
+static size_t batches_sent;
+static size_t largest_batch;
+
+static void batch_send(void *user_data, const sip_outgoing_t *batch, size_t count) {
+    batches_sent++;
+    if (count > largest_batch) {
+        largest_batch = count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        mock_transport_send(user_data, batch[i].message, batch[i].destination, batch[i].port);
+    }
+}
+
+static void setup(void) {
+    const sip_transport_t transport = { .send = mock_transport_send, .send_batch = batch_send, .user_data = NULL };
+    sip_server_init(&server, &transport);
+    mocks_use_virtual_clock(&server);
+    batches_sent = 0;
+    largest_batch = 0;
+    mocks_reset();
+}
+
+static void send_subscribe(int watcher, const char *user, const char *event, int expires) {
+    char subscribe[BUFFER_SIZE];
+    snprintf(subscribe, sizeof(subscribe),
+             "SUBSCRIBE sip:%s@example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP 10.0.1.%d:5060;branch=z9hG4bKsub%d\r\n"
+             "From: <sip:watcher%d@example.com>;tag=w%d\r\n"
+             "To: <sip:%s@example.com>\r\n"
+             "Call-ID: sub-%s-%s-%d@example.com\r\n"
+             "CSeq: 1 SUBSCRIBE\r\n"
+             "Contact: <sip:watcher%d@10.0.1.%d:5060>\r\n"
+             "Event: %s\r\n"
+             "Expires: %d\r\n"
+             "Content-Length: 0\r\n\r\n",
+             user, watcher, watcher, watcher, watcher, user, user, event, watcher, watcher, watcher, event, expires);
+    char ip[INET_ADDRSTRLEN];
+    snprintf(ip, sizeof(ip), "10.0.1.%d", watcher);
+    mocks_deliver(&server, subscribe, ip, 5060);
+}
+
+static void send_register(const char *user, const char *ip) {
+    char reg[BUFFER_SIZE];
+    snprintf(reg, sizeof(reg),
+             "REGISTER sip:example.com SIP/2.0\r\n"
+             "Via: SIP/2.0/UDP %s:5060;branch=z9hG4bKsubreg\r\n"
+             "From: <sip:%s@example.com>;tag=tag1\r\n"
+             "To: <sip:%s@example.com>\r\n"
+             "Call-ID: sub-reg-%s@example.com\r\n"
+             "CSeq: 1 REGISTER\r\n"
+             "Contact: <sip:%s@%s:5060>\r\n"
+             "Content-Length: 0\r\n\r\n", ip, user, user, user, user, ip);
+    mocks_deliver(&server, reg, ip, 5060);
+}
+
+static void send_invite(void) {
+    mocks_deliver(&server, "INVITE sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKsubinv\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>\r\n"
+                           "Call-ID: calls-sub@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Contact: <sip:1001@10.0.0.1:5060>\r\n"
+                           "Content-Type: application/sdp\r\n"
+                           "Content-Length: 10\r\n\r\n0123456789", "10.0.0.1", 5060);
+}
+
+static void reject_call(void) {
+    mocks_deliver(&server, "SIP/2.0 486 Busy Here\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bKsubinv\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: b-leg-sub@example.com\r\n"
+                           "CSeq: 1 INVITE\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.2", 5060);
+    mocks_deliver(&server, "ACK sip:1002@example.com SIP/2.0\r\n"
+                           "Via: SIP/2.0/UDP 10.0.0.1:5060;rport;branch=z9hG4bKsubinv\r\n"
+                           "From: <sip:1001@example.com>;tag=aaa\r\n"
+                           "To: <sip:1002@example.com>;tag=bbb\r\n"
+                           "Call-ID: calls-sub@example.com\r\n"
+                           "CSeq: 1 ACK\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.0.1", 5060);
+}
+
+static size_t count_sent(const char *needle) {
+    size_t found = 0;
+    for (size_t i = 0; i < mocks_count(); i++) {
+        if (strstr(mocks_get(i)->payload, needle) != NULL) {
+            found++;
+        }
+    }
+    return found;
+}
+
+static int test_subscribe_is_answered_with_current_state(void) {
+    int failures = 0;
+    setup();
+
+    send_subscribe(1, "1002", "reg", 600);
+    EXPECT_EQ_INT(mocks_count(), 2);
+    const mock_message_t *ok = mocks_get(0);
+    EXPECT_STRCONTAINS(ok->payload, "SIP/2.0 200 OK");
+    EXPECT_STRCONTAINS(ok->payload, "To: <sip:1002@example.com>;tag=sub");
+    EXPECT_STRCONTAINS(ok->payload, "Expires: 600");
+    const mock_message_t *notify = mocks_get(1);
+    EXPECT_STRCONTAINS(notify->payload, "NOTIFY sip:watcher1@10.0.1.1:5060 SIP/2.0");
+    EXPECT_STRCONTAINS(notify->payload, "Event: reg");
+    EXPECT_STRCONTAINS(notify->payload, "Subscription-State: active;expires=600");
+    EXPECT_STRCONTAINS(notify->payload, "To: <sip:watcher1@example.com>;tag=w1");
+    EXPECT_STRCONTAINS(notify->payload, "state=\"init\"");
+
+    sip_subscription_stats_t stats;
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    EXPECT_EQ_INT(stats.active, 1);
+    EXPECT_EQ_INT(stats.notifies, 1);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_rejected_subscriptions(void) {
+    int failures = 0;
+    setup();
+
+    send_subscribe(1, "1002", "dialog", 600);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 489 Bad Event") != NULL);
+    EXPECT_TRUE(mocks_find_payload_substr("Allow-Events: reg, presence") != NULL);
+    send_subscribe(1, "9999", "presence", 600);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 404 Not Found") != NULL);
+    send_subscribe(1, "1002", "presence", 0);
+    EXPECT_TRUE(mocks_find_payload_substr("SIP/2.0 481") != NULL);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_registration_changes_are_coalesced(void) {
+    int failures = 0;
+    setup();
+    send_subscribe(1, "1002", "reg", 600);
+    mocks_reset();
+
+    // Nothing goes out until the batch timer fires, then the last state once
+    send_register("1002", "10.0.0.2");
+    send_register("1002", "10.0.0.3");
+    send_register("1002", "10.0.0.4");
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 0);
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 1);
+    const mock_message_t *notify = mocks_find_payload_substr("NOTIFY ");
+    EXPECT_TRUE(notify != NULL);
+    if (notify != NULL) {
+        EXPECT_STRCONTAINS(notify->payload, "<uri>sip:1002@10.0.0.4:5060</uri>");
+        EXPECT_STRCONTAINS(notify->payload, "version=\"1\"");
+        EXPECT_STRCONTAINS(notify->payload, "CSeq: 2 NOTIFY");
+    }
+
+    // An unchanged refresh is answered from the registrar's cache and doesn't touch the watchers
+    mocks_reset();
+    send_register("1002", "10.0.0.4");
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 0);
+
+    sip_subscription_stats_t stats;
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    EXPECT_EQ_INT(stats.coalesced, 2);
+    EXPECT_EQ_INT(stats.suppressed, 0);
+    EXPECT_EQ_INT(stats.batches, 1);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_presence_follows_calls(void) {
+    int failures = 0;
+    setup();
+    send_register("1001", "10.0.0.1");
+    send_register("1002", "10.0.0.2");
+    send_subscribe(1, "1002", "presence", 600);
+    EXPECT_TRUE(mocks_find_payload_substr("<basic>open</basic>") != NULL);
+    mocks_reset();
+
+    send_invite();
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 1);
+    EXPECT_TRUE(mocks_find_payload_substr("<note>On the phone</note>") != NULL);
+
+    // The callee rejects the call: idle again
+    mocks_reset();
+    reject_call();
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 1);
+    EXPECT_TRUE(mocks_find_payload_substr("<note>On the phone</note>") == NULL);
+
+    // A call that ends within the batch window isn't notified at all
+    mocks_reset();
+    send_invite();
+    reject_call();
+    EXPECT_EQ_INT(server.store->call_map.size, 0);
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(count_sent("NOTIFY "), 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_fan_out_is_batched(void) {
+    int failures = 0;
+    setup();
+    const int watchers = NOTIFY_BATCH_SIZE + 8;
+    for (int i = 1; i <= watchers; i++) {
+        send_subscribe(i, "1003", i % 2 ? "reg" : "presence", 600);
+    }
+    mocks_reset();
+
+    send_register("1003", "10.0.0.3");
+    mocks_advance(&server, NOTIFY_BATCH_MS + SIP_TIMER_TICK_MS);
+    EXPECT_EQ_INT(batches_sent, 2);
+    EXPECT_EQ_INT(largest_batch, NOTIFY_BATCH_SIZE);
+
+    sip_subscription_stats_t stats;
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    EXPECT_EQ_INT(stats.active, watchers);
+    EXPECT_EQ_INT(stats.notifies, 2 * watchers);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+static int test_unsubscribe_and_expiry(void) {
+    int failures = 0;
+    setup();
+    send_subscribe(1, "1004", "reg", 600);
+    send_subscribe(2, "1004", "presence", 60);
+    mocks_reset();
+
+    send_subscribe(1, "1004", "reg", 0);
+    EXPECT_TRUE(mocks_find_payload_substr("Subscription-State: terminated\r\n") != NULL);
+
+    mocks_reset();
+    mocks_advance(&server, 60 * 1000 + SIP_TIMER_TICK_MS);
+    EXPECT_TRUE(mocks_find_payload_substr("Subscription-State: terminated;reason=timeout") != NULL);
+
+    sip_subscription_stats_t stats;
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    EXPECT_EQ_INT(stats.active, 0);
+    EXPECT_EQ_INT(server.store->subscriptions.by_aor[3], -1);
+
+    // A 481 to a NOTIFY removes the subscription
+    send_subscribe(3, "1004", "reg", 600);
+    mocks_deliver(&server, "SIP/2.0 481 Subscription Does Not Exist\r\n"
+                           "Via: SIP/2.0/UDP " SIP_SERVER_IP_ADDRESS ":5060;branch=z9hG4bK-notify\r\n"
+                           "From: <sip:1004@example.com>;tag=x\r\n"
+                           "To: <sip:watcher3@example.com>;tag=w3\r\n"
+                           "Call-ID: sub-1004-reg-3@example.com\r\n"
+                           "CSeq: 1 NOTIFY\r\n"
+                           "Content-Length: 0\r\n\r\n", "10.0.1.3", 5060);
+    sip_subscription_stats(&server.store->subscriptions, &stats);
+    EXPECT_EQ_INT(stats.active, 0);
+
+    sip_server_destroy(&server);
+    return failures;
+}
+
+int main(void) {
+    const test_case_t cases[] = {
+        {"subscribe_is_answered_with_current_state", test_subscribe_is_answered_with_current_state},
+        {"rejected_subscriptions", test_rejected_subscriptions},
+        {"registration_changes_are_coalesced", test_registration_changes_are_coalesced},
+        {"presence_follows_calls", test_presence_follows_calls},
+        {"fan_out_is_batched", test_fan_out_is_batched},
+        {"unsubscribe_and_expiry", test_unsubscribe_and_expiry},
+    };
+
+    test_stats_t stats;
+    return run_tests(cases, sizeof(cases) / sizeof(cases[0]), &stats);
+}
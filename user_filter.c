@@ -0,0 +1,132 @@
+/**
+ * @file user_filter.c
+ * @brief Implementation of the unknown-user Bloom filter and negative cache.
+ */
+
+#include "user_filter.h"
+#include "shared_mem.h"
+#include "sip_hash.h"
+#include <string.h>
+
+_Static_assert((USER_FILTER_BLOOM_BITS & (USER_FILTER_BLOOM_BITS - 1)) == 0 && USER_FILTER_BLOOM_BITS >= 64,
+               "USER_FILTER_BLOOM_BITS must be a power of two");
+_Static_assert((USER_FILTER_NEGATIVE_SLOTS & (USER_FILTER_NEGATIVE_SLOTS - 1)) == 0,
+               "USER_FILTER_NEGATIVE_SLOTS must be a power of two");
+
+/**
+ * @brief Keyed hash of a username.
+ */
+static uint64_t username_hash(const char *username) {
+    return sip_hash(username, strlen(username), 0);
+}
+
+/**
+ * @brief Returns the i-th Bloom bit of a username hash (double hashing).
+ */
+static uint32_t bloom_bit(uint64_t hash, int i) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return (h1 + (uint32_t)i * h2) & (USER_FILTER_BLOOM_BITS - 1);
+}
+
+/**
+ * @brief Negative cache key of a username and source address, never 0.
+ */
+static uint64_t negative_key(const char *username, const struct in_addr *source) {
+    uint64_t hash = sip_hash(username, strlen(username), source->s_addr);
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Empties the negative cache. The mutex must be held, or the filter not yet in use.
+ */
+static void clear_negative(user_filter_t *filter) {
+    for (int i = 0; i < USER_FILTER_NEGATIVE_SLOTS; i++) {
+        atomic_store_explicit(&filter->negative[i].key, 0, memory_order_relaxed);
+        atomic_store_explicit(&filter->negative[i].expires_ms, 0, memory_order_relaxed);
+    }
+}
+
+void user_filter_init(user_filter_t *filter, bool process_shared) {
+    memset(filter->bloom, 0, sizeof(filter->bloom));
+    shm_seqlock_init(&filter->bloom_lock);
+    clear_negative(filter);
+    atomic_init(&filter->bloom_rejects, 0);
+    atomic_init(&filter->negative_hits, 0);
+    shm_mutex_init(&filter->mutex, process_shared);
+}
+
+void user_filter_destroy(user_filter_t *filter) {
+    pthread_mutex_destroy(&filter->mutex);
+}
+
+void user_filter_rebuild(user_filter_t *filter, const void *usernames, size_t count, size_t stride) {
+    uint64_t bloom[USER_FILTER_BLOOM_BITS / 64] = {0};
+    for (size_t n = 0; n < count; n++) {
+        uint64_t hash = username_hash((const char *)usernames + n * stride);
+        for (int i = 0; i < USER_FILTER_BLOOM_HASHES; i++) {
+            uint32_t bit = bloom_bit(hash, i);
+            bloom[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    shm_mutex_lock(&filter->mutex);
+    shm_seqlock_write(&filter->bloom_lock, filter->bloom, bloom, sizeof(bloom));
+    // A user rejected before may have just been provisioned
+    clear_negative(filter);
+    pthread_mutex_unlock(&filter->mutex);
+}
+
+/**
+ * @brief Tells whether all the Bloom bits of a username hash are set, reading only their words.
+ */
+static bool bloom_contains(user_filter_t *filter, uint64_t hash) {
+    bool contains;
+    unsigned int start;
+    do {
+        start = shm_seqlock_read_begin(&filter->bloom_lock);
+        contains = true;
+        for (int i = 0; i < USER_FILTER_BLOOM_HASHES && contains; i++) {
+            uint32_t bit = bloom_bit(hash, i);
+            contains = (filter->bloom[bit / 64] & (1ULL << (bit % 64))) != 0;
+        }
+    } while (shm_seqlock_read_retry(&filter->bloom_lock, start));
+    return contains;
+}
+
+user_filter_verdict_t user_filter_check(user_filter_t *filter, const char *username,
+                                        const struct in_addr *source, uint64_t now_ms) {
+    if (!bloom_contains(filter, username_hash(username))) {
+        atomic_fetch_add_explicit(&filter->bloom_rejects, 1, memory_order_relaxed);
+        return USER_FILTER_UNKNOWN;
+    }
+
+    // Read without the lock: at worst a racing write pairs the key with the other entry's expiry,
+    // and both entries are of usernames a full lookup found unknown
+    uint64_t key = negative_key(username, source);
+    user_filter_slot_t *slot = &filter->negative[key & (USER_FILTER_NEGATIVE_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->key, memory_order_acquire) == key &&
+        now_ms < atomic_load_explicit(&slot->expires_ms, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&filter->negative_hits, 1, memory_order_relaxed);
+        return USER_FILTER_RECENTLY_REJECTED;
+    }
+    return USER_FILTER_MAYBE_KNOWN;
+}
+
+void user_filter_remember_rejection(user_filter_t *filter, const char *username,
+                                    const struct in_addr *source, uint64_t now_ms) {
+    uint64_t key = negative_key(username, source);
+    user_filter_slot_t *slot = &filter->negative[key & (USER_FILTER_NEGATIVE_SLOTS - 1)];
+
+    shm_mutex_lock(&filter->mutex);
+    // The key last, so a check that matches it reads the new expiry
+    atomic_store_explicit(&slot->key, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->expires_ms, now_ms + USER_FILTER_NEGATIVE_MS, memory_order_relaxed);
+    atomic_store_explicit(&slot->key, key, memory_order_release);
+    pthread_mutex_unlock(&filter->mutex);
+}
+
+void user_filter_stats(user_filter_t *filter, unsigned long *bloom_rejects, unsigned long *negative_hits) {
+    *bloom_rejects = atomic_load_explicit(&filter->bloom_rejects, memory_order_relaxed);
+    *negative_hits = atomic_load_explicit(&filter->negative_hits, memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file user_filter.h
+ * @brief Fast rejection of requests for users that aren't provisioned.
+ *
+ * Scanners and misconfigured devices send REGISTERs and INVITEs for users that don't exist.
+ * A Bloom filter over the provisioned usernames answers "certainly not provisioned" for almost
+ * all of them with a few hash probes, without walking the location store. The few unknown
+ * users the Bloom filter lets through (false positives) are rejected by the full lookup, which
+ * then remembers the username and source address in a short-lived negative cache, so the
+ * retries of the same device are rejected after a hash check as well.
+ *
+ * Every REGISTER and INVITE is checked, so checking takes no lock: the Bloom filter is read
+ * under a seqlock, replaced only when the users are reloaded, and the negative cache entries
+ * are atomics. The mutex only serialises the writers. The filter holds no pointers, so it
+ * lives in the store and is shared by the worker processes of the prefork mode.
+ */
+
+#ifndef USER_FILTER_H
+#define USER_FILTER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "shared_mem.h"
+
+#ifndef USER_FILTER_BLOOM_BITS
+#define USER_FILTER_BLOOM_BITS 4096         // Bloom filter size, a power of two
+#endif
+
+#ifndef USER_FILTER_BLOOM_HASHES
+#define USER_FILTER_BLOOM_HASHES 4          // Bits set per username
+#endif
+
+#ifndef USER_FILTER_NEGATIVE_SLOTS
+#define USER_FILTER_NEGATIVE_SLOTS 256      // Negative cache entries, a power of two
+#endif
+
+#ifndef USER_FILTER_NEGATIVE_MS
+#define USER_FILTER_NEGATIVE_MS 30000       // How long a rejected username and source stay cached
+#endif
+
+/**
+ * @enum user_filter_verdict_t
+ * @brief Result of checking a username against the filter.
+ */
+typedef enum {
+    USER_FILTER_MAYBE_KNOWN,        // Possibly provisioned, the location store must be searched
+    USER_FILTER_UNKNOWN,            // Certainly not provisioned (Bloom filter)
+    USER_FILTER_RECENTLY_REJECTED,  // Rejected by a full lookup for the same source not long ago
+} user_filter_verdict_t;
+
+/**
+ * @struct user_filter_slot_t
+ * @brief One negative cache entry.
+ */
+typedef struct {
+    atomic_uint_fast64_t key;           // Hash of the username and the source address, 0 if unused
+    atomic_uint_fast64_t expires_ms;    // Server time after which the entry is stale
+} user_filter_slot_t;
+
+/**
+ * @struct user_filter_t
+ * @brief Bloom filter over the provisioned usernames and the negative cache.
+ */
+typedef struct {
+    uint64_t bloom[USER_FILTER_BLOOM_BITS / 64];
+    shm_seqlock_t bloom_lock;           // Lets the Bloom filter be rebuilt while requests are checked
+    user_filter_slot_t negative[USER_FILTER_NEGATIVE_SLOTS];
+    atomic_ulong bloom_rejects;         // Requests rejected by the Bloom filter
+    atomic_ulong negative_hits;         // Requests rejected by the negative cache
+    pthread_mutex_t mutex;              // Serialises rebuilds and negative cache writes
+} user_filter_t;
+
+/**
+ * @brief Initializes an empty filter, which knows no user.
+ * @param process_shared true if the filter lives in a shared segment used by several processes.
+ */
+void user_filter_init(user_filter_t *filter, bool process_shared);
+void user_filter_destroy(user_filter_t *filter);
+
+/**
+ * @brief Replaces the provisioned usernames and empties the negative cache.
+ * @param usernames The usernames, the first field of each element.
+ * @param count Number of elements.
+ * @param stride Size of an element, e.g. sizeof(location_entry_t).
+ */
+void user_filter_rebuild(user_filter_t *filter, const void *usernames, size_t count, size_t stride);
+
+/**
+ * @brief Checks whether a request from source for username can be rejected without a lookup.
+ * @param now_ms Current server time in milliseconds.
+ */
+user_filter_verdict_t user_filter_check(user_filter_t *filter, const char *username,
+                                        const struct in_addr *source, uint64_t now_ms);
+
+/**
+ * @brief Remembers that a full lookup found no user, for USER_FILTER_NEGATIVE_MS.
+ */
+void user_filter_remember_rejection(user_filter_t *filter, const char *username,
+                                    const struct in_addr *source, uint64_t now_ms);
+
+/**
+ * @brief Copies the number of requests rejected by the Bloom filter and by the negative cache.
+ */
+void user_filter_stats(user_filter_t *filter, unsigned long *bloom_rejects, unsigned long *negative_hits);
+
+#endif // USER_FILTER_H